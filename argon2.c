@@ -0,0 +1,375 @@
+// argon2.c
+// Argon2id, see argon2.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "crypto.h"
+
+#define ARGON2_BLOCK_SIZE 1024
+#define ARGON2_QWORDS (ARGON2_BLOCK_SIZE / 8)
+#define ARGON2_SYNC_POINTS 4
+#define ARGON2_ADDRESSES_IN_BLOCK 128
+#define ARGON2_TYPE_ID 2                // Argon2id
+#define ARGON2_PREHASH_LEN 64
+
+struct block {
+    uint64_t v[ARGON2_QWORDS];
+};
+
+struct instance {
+    struct block *memory;
+    uint32_t passes;
+    uint32_t memory_blocks;
+    uint32_t segment_length;
+    uint32_t lane_length;
+    uint32_t lanes;
+};
+
+static void store32_le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint64_t load64_le(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static void store64_le(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void blake2b_update_u32(struct blake2b_ctx *ctx, uint32_t v) {
+    uint8_t buf[4];
+    store32_le(buf, v);
+    blake2b_update(ctx, buf, sizeof(buf));
+}
+
+// H', the variable-length hash built from BLAKE2b
+static void blake2b_long(uint8_t *out, size_t out_len, const void *in, size_t in_len) {
+    struct blake2b_ctx ctx;
+
+    if (out_len <= BLAKE2B_OUT_LEN) {
+        blake2b_init(&ctx, out_len, NULL, 0);
+        blake2b_update_u32(&ctx, (uint32_t)out_len);
+        blake2b_update(&ctx, in, in_len);
+        blake2b_final(&ctx, out);
+        return;
+    }
+
+    uint8_t v[BLAKE2B_OUT_LEN];
+    blake2b_init(&ctx, BLAKE2B_OUT_LEN, NULL, 0);
+    blake2b_update_u32(&ctx, (uint32_t)out_len);
+    blake2b_update(&ctx, in, in_len);
+    blake2b_final(&ctx, v);
+
+    // Emit the first half of each intermediate hash, then the last in full
+    while (out_len > BLAKE2B_OUT_LEN) {
+        memcpy(out, v, BLAKE2B_OUT_LEN / 2);
+        out += BLAKE2B_OUT_LEN / 2;
+        out_len -= BLAKE2B_OUT_LEN / 2;
+        if (out_len > BLAKE2B_OUT_LEN) blake2b(v, BLAKE2B_OUT_LEN, v, BLAKE2B_OUT_LEN, NULL, 0);
+    }
+    blake2b(out, out_len, v, BLAKE2B_OUT_LEN, NULL, 0);
+    crypto_wipe(v, sizeof(v));
+}
+
+static inline uint64_t rotr64(uint64_t v, int n) {
+    return (v >> n) | (v << (64 - n));
+}
+
+// BLAKE2b round function with the multiplication hardening of BlaMka
+static inline uint64_t fblamka(uint64_t x, uint64_t y) {
+    return x + y + 2 * (uint64_t)(uint32_t)x * (uint32_t)y;
+}
+
+#define GB(a, b, c, d)                                  \
+    a = fblamka(a, b); d = rotr64(d ^ a, 32);           \
+    c = fblamka(c, d); b = rotr64(b ^ c, 24);           \
+    a = fblamka(a, b); d = rotr64(d ^ a, 16);           \
+    c = fblamka(c, d); b = rotr64(b ^ c, 63);
+
+#define BLAKE2_ROUND_NOMSG(v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15) \
+    GB(v0, v4, v8, v12); GB(v1, v5, v9, v13); GB(v2, v6, v10, v14); GB(v3, v7, v11, v15);       \
+    GB(v0, v5, v10, v15); GB(v1, v6, v11, v12); GB(v2, v7, v8, v13); GB(v3, v4, v9, v14);
+
+// The compression function G: next = P(ref ^ prev) ^ ref ^ prev, XORed
+// into next instead of overwriting it on passes after the first
+static void fill_block(const struct block *prev, const struct block *ref, struct block *next, int with_xor) {
+    struct block r, tmp;
+
+    for (int i = 0; i < ARGON2_QWORDS; i++) r.v[i] = ref->v[i] ^ prev->v[i];
+    tmp = r;
+    if (with_xor) {
+        for (int i = 0; i < ARGON2_QWORDS; i++) tmp.v[i] ^= next->v[i];
+    }
+
+    uint64_t *v = r.v;
+    for (int i = 0; i < 8; i++) {
+        uint64_t *q = v + 16 * i;
+        BLAKE2_ROUND_NOMSG(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7],
+                           q[8], q[9], q[10], q[11], q[12], q[13], q[14], q[15]);
+    }
+    for (int i = 0; i < 8; i++) {
+        uint64_t *q = v + 2 * i;
+        BLAKE2_ROUND_NOMSG(q[0], q[1], q[16], q[17], q[32], q[33], q[48], q[49],
+                           q[64], q[65], q[80], q[81], q[96], q[97], q[112], q[113]);
+    }
+
+    for (int i = 0; i < ARGON2_QWORDS; i++) next->v[i] = tmp.v[i] ^ r.v[i];
+}
+
+static void next_addresses(struct block *address, struct block *input, const struct block *zero) {
+    input->v[6]++;
+    fill_block(zero, input, address, 0);
+    fill_block(zero, address, address, 0);
+}
+
+// Map a pseudo-random value onto a block this position may reference
+static uint32_t index_alpha(const struct instance *in, uint32_t pass, uint32_t slice, uint32_t index,
+                            uint32_t pseudo_rand, int same_lane) {
+    uint32_t area;
+
+    if (pass == 0) {
+        if (slice == 0) area = index - 1;
+        else if (same_lane) area = slice * in->segment_length + index - 1;
+        else area = slice * in->segment_length + (index == 0 ? -1 : 0);
+    } else {
+        if (same_lane) area = in->lane_length - in->segment_length + index - 1;
+        else area = in->lane_length - in->segment_length + (index == 0 ? -1 : 0);
+    }
+
+    uint64_t rel = pseudo_rand;
+    rel = (rel * rel) >> 32;
+    rel = area - 1 - ((area * rel) >> 32);
+
+    uint32_t start = 0;
+    if (pass != 0 && slice != ARGON2_SYNC_POINTS - 1) start = (slice + 1) * in->segment_length;
+    return (uint32_t)((start + rel) % in->lane_length);
+}
+
+static void fill_segment(const struct instance *in, uint32_t pass, uint32_t lane, uint32_t slice) {
+    struct block address, input, zero;
+    // Argon2id: data-independent addressing for the first half of pass one
+    int independent = pass == 0 && slice < ARGON2_SYNC_POINTS / 2;
+    uint32_t start_index = 0;
+
+    if (independent) {
+        memset(&zero, 0, sizeof(zero));
+        memset(&input, 0, sizeof(input));
+        input.v[0] = pass;
+        input.v[1] = lane;
+        input.v[2] = slice;
+        input.v[3] = in->memory_blocks;
+        input.v[4] = in->passes;
+        input.v[5] = ARGON2_TYPE_ID;
+    }
+
+    if (pass == 0 && slice == 0) {
+        start_index = 2;
+        if (independent) next_addresses(&address, &input, &zero);
+    }
+
+    uint32_t curr = lane * in->lane_length + slice * in->segment_length + start_index;
+    uint32_t prev = curr % in->lane_length == 0 ? curr + in->lane_length - 1 : curr - 1;
+
+    for (uint32_t i = start_index; i < in->segment_length; i++, curr++, prev++) {
+        uint64_t pseudo_rand;
+
+        if (curr % in->lane_length == 1) prev = curr - 1;
+
+        if (independent) {
+            if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) next_addresses(&address, &input, &zero);
+            pseudo_rand = address.v[i % ARGON2_ADDRESSES_IN_BLOCK];
+        } else {
+            pseudo_rand = in->memory[prev].v[0];
+        }
+
+        uint32_t ref_lane = (uint32_t)((pseudo_rand >> 32) % in->lanes);
+        if (pass == 0 && slice == 0) ref_lane = lane;
+
+        uint32_t ref_index = index_alpha(in, pass, slice, i, (uint32_t)pseudo_rand, ref_lane == lane);
+        const struct block *ref = &in->memory[(size_t)in->lane_length * ref_lane + ref_index];
+
+        fill_block(&in->memory[prev], ref, &in->memory[curr], pass != 0);
+    }
+}
+
+int argon2id_hash(uint8_t *out, size_t out_len, const void *pwd, size_t pwd_len,
+                  const void *salt, size_t salt_len, uint32_t t_cost, uint32_t m_cost, uint32_t lanes) {
+    struct instance in;
+    struct blake2b_ctx ctx;
+    uint8_t h0[ARGON2_PREHASH_LEN + 8];
+    uint8_t block_bytes[ARGON2_BLOCK_SIZE];
+
+    if (out_len < 4 || t_cost < 1 || lanes < 1 || lanes > 0xffffff ||
+        m_cost < 8 * lanes || m_cost > ARGON2_MAX_M || salt_len < 8) {
+        return -1;
+    }
+
+    in.passes = t_cost;
+    in.lanes = lanes;
+    in.segment_length = m_cost / (lanes * ARGON2_SYNC_POINTS);
+    in.lane_length = in.segment_length * ARGON2_SYNC_POINTS;
+    in.memory_blocks = in.lane_length * lanes;
+    in.memory = malloc((size_t)in.memory_blocks * sizeof(struct block));
+    if (!in.memory) return -1;
+
+    // H0 binds every parameter and input
+    blake2b_init(&ctx, ARGON2_PREHASH_LEN, NULL, 0);
+    blake2b_update_u32(&ctx, lanes);
+    blake2b_update_u32(&ctx, (uint32_t)out_len);
+    blake2b_update_u32(&ctx, m_cost);
+    blake2b_update_u32(&ctx, t_cost);
+    blake2b_update_u32(&ctx, ARGON2_VERSION);
+    blake2b_update_u32(&ctx, ARGON2_TYPE_ID);
+    blake2b_update_u32(&ctx, (uint32_t)pwd_len);
+    blake2b_update(&ctx, pwd, pwd_len);
+    blake2b_update_u32(&ctx, (uint32_t)salt_len);
+    blake2b_update(&ctx, salt, salt_len);
+    blake2b_update_u32(&ctx, 0);    // No secret
+    blake2b_update_u32(&ctx, 0);    // No associated data
+    blake2b_final(&ctx, h0);
+
+    // The first two blocks of each lane come straight from H0
+    for (uint32_t l = 0; l < lanes; l++) {
+        for (uint32_t j = 0; j < 2; j++) {
+            store32_le(h0 + ARGON2_PREHASH_LEN, j);
+            store32_le(h0 + ARGON2_PREHASH_LEN + 4, l);
+            blake2b_long(block_bytes, ARGON2_BLOCK_SIZE, h0, sizeof(h0));
+            struct block *b = &in.memory[(size_t)l * in.lane_length + j];
+            for (int i = 0; i < ARGON2_QWORDS; i++) b->v[i] = load64_le(block_bytes + 8 * i);
+        }
+    }
+
+    // Lanes are filled one after another; the result is the same as the
+    // parallel schedule since lanes only synchronize at slice boundaries
+    for (uint32_t pass = 0; pass < t_cost; pass++) {
+        for (uint32_t slice = 0; slice < ARGON2_SYNC_POINTS; slice++) {
+            for (uint32_t l = 0; l < lanes; l++) fill_segment(&in, pass, l, slice);
+        }
+    }
+
+    // XOR the last block of every lane into the final tag
+    struct block final = in.memory[in.lane_length - 1];
+    for (uint32_t l = 1; l < lanes; l++) {
+        const struct block *b = &in.memory[(size_t)l * in.lane_length + in.lane_length - 1];
+        for (int i = 0; i < ARGON2_QWORDS; i++) final.v[i] ^= b->v[i];
+    }
+    for (int i = 0; i < ARGON2_QWORDS; i++) store64_le(block_bytes + 8 * i, final.v[i]);
+    blake2b_long(out, out_len, block_bytes, ARGON2_BLOCK_SIZE);
+
+    crypto_wipe(in.memory, (size_t)in.memory_blocks * sizeof(struct block));
+    free(in.memory);
+    crypto_wipe(h0, sizeof(h0));
+    crypto_wipe(block_bytes, sizeof(block_bytes));
+    crypto_wipe(&final, sizeof(final));
+    return 0;
+}
+
+// Unpadded standard base64, as PHC strings use
+static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t b64_encode(char *out, const uint8_t *in, size_t len) {
+    size_t o = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        acc = (acc << 8) | in[i];
+        bits += 8;
+        while (bits >= 6) {
+            bits -= 6;
+            out[o++] = b64_chars[(acc >> bits) & 63];
+        }
+    }
+    if (bits > 0) out[o++] = b64_chars[(acc << (6 - bits)) & 63];
+    out[o] = 0;
+    return o;
+}
+
+// Decode up to the next '$' or the end. Returns the byte count or -1.
+static int b64_decode(uint8_t *out, size_t cap, const char *in, const char **end) {
+    size_t o = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for (; *in && *in != '$'; in++) {
+        const char *p = strchr(b64_chars, *in);
+        if (!p) return -1;
+        acc = (acc << 6) | (uint32_t)(p - b64_chars);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (o == cap) return -1;
+            out[o++] = (uint8_t)(acc >> bits);
+        }
+    }
+    *end = in;
+    return (int)o;
+}
+
+int argon2id_hash_encoded(char *out, size_t cap, const void *pwd, size_t pwd_len) {
+    struct argon2_params p = {
+        .t_cost = ARGON2_DEFAULT_T,
+        .m_cost = ARGON2_DEFAULT_M,
+        .lanes = ARGON2_DEFAULT_P,
+        .salt_len = ARGON2_SALT_LEN,
+        .hash_len = ARGON2_HASH_LEN,
+    };
+    char salt[ARGON2_MAX_LEN * 2], hash[ARGON2_MAX_LEN * 2];
+
+    if (random_bytes(p.salt, p.salt_len) < 0) return -1;
+    if (argon2id_hash(p.hash, p.hash_len, pwd, pwd_len, p.salt, p.salt_len, p.t_cost, p.m_cost, p.lanes) < 0) {
+        return -1;
+    }
+
+    b64_encode(salt, p.salt, p.salt_len);
+    b64_encode(hash, p.hash, p.hash_len);
+    int n = snprintf(out, cap, "$argon2id$v=%d$m=%u,t=%u,p=%u$%s$%s",
+                     ARGON2_VERSION, p.m_cost, p.t_cost, p.lanes, salt, hash);
+    crypto_wipe(&p, sizeof(p));
+    return n > 0 && (size_t)n < cap ? 0 : -1;
+}
+
+int argon2id_decode(struct argon2_params *p, const char *s) {
+    unsigned int version, m, t, lanes;
+    int used = 0;
+    const char *end;
+
+    memset(p, 0, sizeof(*p));
+    if (sscanf(s, "$argon2id$v=%u$m=%u,t=%u,p=%u$%n", &version, &m, &t, &lanes, &used) != 4 || used == 0) {
+        return -1;
+    }
+    if (version != ARGON2_VERSION || t < 1 || lanes < 1 || m < 8 * lanes || m > ARGON2_MAX_M) return -1;
+
+    int n = b64_decode(p->salt, sizeof(p->salt), s + used, &end);
+    if (n < 8 || *end != '$') return -1;
+    p->salt_len = n;
+
+    n = b64_decode(p->hash, sizeof(p->hash), end + 1, &end);
+    if (n < 4 || *end != 0) return -1;
+    p->hash_len = n;
+
+    p->t_cost = t;
+    p->m_cost = m;
+    p->lanes = lanes;
+    return 0;
+}
+
+int argon2id_verify(const struct argon2_params *p, const void *pwd, size_t pwd_len) {
+    uint8_t out[ARGON2_MAX_LEN];
+
+    if (argon2id_hash(out, p->hash_len, pwd, pwd_len, p->salt, p->salt_len, p->t_cost, p->m_cost, p->lanes) < 0) {
+        return -1;
+    }
+    int ok = crypto_memeq(out, p->hash, p->hash_len);
+    crypto_wipe(out, sizeof(out));
+    return ok;
+}
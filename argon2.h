@@ -0,0 +1,50 @@
+// argon2.h
+// Argon2id password hashing (RFC 9106) and PHC string encoding
+//
+// Hashes are stored in the usual PHC format, so they can be produced or
+// checked with any other Argon2 implementation:
+//
+//   $argon2id$v=19$m=19456,t=2,p=1$<salt, base64>$<hash, base64>
+
+#ifndef ARGON2_H
+#define ARGON2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARGON2_VERSION 0x13
+#define ARGON2_SALT_LEN 16            // Salt for new hashes
+#define ARGON2_HASH_LEN 32            // Tag length for new hashes
+#define ARGON2_MAX_LEN 64             // Longest salt or tag accepted when decoding
+#define ARGON2_DEFAULT_T 2            // Passes for new hashes
+#define ARGON2_DEFAULT_M 19456        // KiB of memory for new hashes
+#define ARGON2_DEFAULT_P 1            // Lanes for new hashes
+#define ARGON2_MAX_M (1024 * 1024)    // Refuse hashes asking for more than 1 GiB
+#define ARGON2_ENCODED_LEN 256        // Room for any encoded hash we accept
+
+struct argon2_params {
+    uint32_t t_cost;
+    uint32_t m_cost;                  // KiB
+    uint32_t lanes;
+    uint8_t salt[ARGON2_MAX_LEN];
+    size_t salt_len;
+    uint8_t hash[ARGON2_MAX_LEN];
+    size_t hash_len;
+};
+
+// Raw Argon2id. Returns -1 if the parameters are out of range or the
+// memory cannot be allocated.
+int argon2id_hash(uint8_t *out, size_t out_len, const void *pwd, size_t pwd_len,
+                  const void *salt, size_t salt_len, uint32_t t_cost, uint32_t m_cost, uint32_t lanes);
+
+// Hash a new password with a random salt and the default cost into a PHC
+// string. Returns -1 on failure.
+int argon2id_hash_encoded(char *out, size_t cap, const void *pwd, size_t pwd_len);
+
+// Parse a PHC string. Returns -1 if it is not a supported Argon2id hash.
+int argon2id_decode(struct argon2_params *p, const char *encoded);
+
+// Returns 1 if the password matches, 0 if not, -1 if it could not be checked
+int argon2id_verify(const struct argon2_params *p, const void *pwd, size_t pwd_len);
+
+#endif
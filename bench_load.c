@@ -0,0 +1,1085 @@
+// bench_load.c
+// build: gcc -Wall -O2 -pthread -o bench_load bench_load.c socks5.c frame.c pool.c crypto.c chacha_simd.c noise.c compress.c
+// run: ./bench_load [-c clients] [-m messages] [-i idle] [-R rooms] [-r rate] [-s bytes] [-l latency-ms] [-j jitter-ms] [-u user:password] [-a] [-U socket] [-f flooders] [-n port|socket] [-Z] [port]
+//
+// Load and latency test for a running server. A built-in SOCKS5 proxy
+// stands in for Tor's 127.0.0.1:9050 and holds back everything it forwards
+// by a one-way latency plus random jitter, in order, as a circuit would.
+// Each synthetic client connects through it with the real client's
+// socks5_connect_domain(), pipelining the first handshake message, finishes
+// the key exchange and logs in. Once every client is in they all chat at a
+// fixed rate; each message carries its send time, so every delivery to
+// every other client is one end-to-end latency sample. With -i some of the
+// clients only listen, for a few busy connections among many idle ones.
+// With -R the clients are dealt out over that many rooms and chat only in
+// their own, so each message reaches its room rather than everyone.
+//
+// With -U the proxy dials the server's Unix socket (server -s) instead of
+// 127.0.0.1:port, as Tor does for HiddenServicePort ... unix:<socket>, so
+// the two transports can be compared under the same load.
+//
+// The proxy also counts the Tor relay cells each read would take, a read
+// being what Tor packages at a time, in both directions. The clients add
+// up what their frames would cost if each had travelled alone, so the
+// report shows how many cells the server's batching (server -W, -P) saves
+// per message delivered, or what padding costs.
+//
+// With -f that many more clients log in and, while the others chat, send
+// the largest messages the server takes as fast as it takes them, into a
+// room of their own so what the others receive is unchanged. Latency is
+// still measured over the others only: with fair scheduling and rate
+// limits on the server (server -q, -Q) it should not move. The per-user
+// limit (-Q) only keeps the flooders apart from the others when -u names
+// an account per client, as in -u bench%d:password; with one account for
+// all it throttles everyone together.
+//
+// With -n the clients are split between two federated nodes (server -F),
+// odd-numbered ones connecting to the second, and the report adds the
+// latency and rate of deliveries between clients on the same node and
+// between clients on different ones, so what the link between the nodes
+// costs can be read off directly.
+//
+// The clients offer compression in the handshake as the client does, -Z
+// turning it off, and fill out their messages with words drawn at random
+// from a short list, which compresses about as well as chat does. The
+// report gives the ratio, in each direction, over frames that could be
+// compressed, and the time the clients took per frame to compress and
+// decompress; the server's own time per frame is in its metrics.
+//
+// Progress goes to stderr. The results are one JSON object on stdout.
+// The account (bench:bench unless -u says otherwise) must exist on the
+// server: printf 'bench\n' | ./server -u bench. For -u bench%d:bench,
+// create bench0, bench1 and so on up to the number of clients, flooders
+// included.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "compress.h"
+#include "frame.h"
+#include "noise.h"
+#include "socks5.h"
+
+#define SERVER_HOST "localhost"      // Name sent in the CONNECT request; the proxy always dials 127.0.0.1
+#define SECOND_HOST "node2"          // ...and the name that makes it dial the second node (-n) instead
+#define DEFAULT_PORT 1234
+#define DEFAULT_CLIENTS 50
+#define DEFAULT_MESSAGES 100         // Messages sent by each client
+#define DEFAULT_RATE 10              // Messages per second from each client
+#define DEFAULT_SIZE 64              // Bytes of chat text per message
+#define DEFAULT_LOGIN "bench:bench"
+#define RELAY_CHUNK 16384            // Bytes the proxy reads and forwards at a time
+#define SETUP_TIMEOUT_S 60           // Give up on a client whose connect or login stalls
+#define DRAIN_TIMEOUT_MS 2000        // Stop waiting for deliveries after this long without one
+#define BENCH_TAG "bench "           // Marks benchmark chat among anything else relayed
+#define BENCH_ROOM "bench%d"         // Name of room N with -R
+#define FLOOD_ROOM "flood"           // Where flooders (-f) post
+#define THREAD_STACK_SIZE (512 * 1024)  // Two threads per client; the default stacks are mostly unused
+
+static int clients = DEFAULT_CLIENTS;
+static int messages = DEFAULT_MESSAGES;
+static int idle;                     // Clients that log in and listen but never send
+static int rooms;                    // Rooms the clients are spread over, 0 for the lobby (-R)
+static int rate = DEFAULT_RATE;
+static int msg_size = DEFAULT_SIZE;
+static int latency_ms;
+static int jitter_ms;
+static int isolate;                  // Give each client its own SOCKS credentials
+static int server_port = DEFAULT_PORT;
+static const char *server_socket;    // Unix socket the proxy dials instead of the port (-U)
+static const char *second_node;      // Port or Unix socket of a second node for odd clients (-n)
+static const char *login = DEFAULT_LOGIN;
+static int flooders;                 // Extra clients that send as fast as they can (-f)
+static int flood_stop;               // Set once the other clients are done, atomic
+static uint8_t offered = FRAME_FEATURE_COMPRESS;   // Handshake features (-Z drops compression)
+
+static int proxy_listen_fd;
+static int proxy_port;
+static pthread_attr_t proxy_attr;    // Detached, with small stacks
+
+static pthread_barrier_t start_barrier;
+static int logged_in;                // Clients that made it to the chat, atomic
+static int logged_in_busy;           // Those of them that send, atomic
+static int *room_busy;               // Logged-in clients that send, per room, atomic
+static uint64_t cells_down;          // Relay cells carried from the server, atomic
+static uint64_t cells_up;            // ...and to it
+
+// Filler for the chat text
+static const char *const words[] = {
+    "the", "and", "you", "that", "was", "for", "are", "with", "they", "this", "have", "from", "one", "had",
+    "but", "not", "what", "all", "were", "when", "your", "can", "said", "there", "each", "which", "how",
+    "their", "will", "other", "about", "out", "many", "then", "them", "some", "would", "like", "into",
+    "time", "look", "more", "see", "way", "could", "people", "than", "first", "been", "who", "now", "long",
+    "down", "day", "get", "come", "made", "part", "server", "relay", "think", "know", "really", "good",
+    "just", "going", "yeah", "lol", "ok", "later", "tonight", "message", "room", "maybe", "sure",
+};
+
+// Frames of the kinds that may be compressed, in one direction
+struct zstats {
+    uint64_t frames;
+    uint64_t compressed;             // ...of them sent compressed
+    uint64_t raw_bytes;              // Payload bytes
+    uint64_t wire_bytes;             // ...as sent, inner type included when compressed
+    uint64_t ns;                     // Time compressing or decompressing them
+};
+
+struct bench_client {
+    int id;
+    pthread_t thread;
+    int ok;                          // Logged in and took part in the chat
+    int busy;                        // Sends messages, rather than only listening
+    int room;                        // Room it chats in with -R
+    char room_name[16];
+    uint32_t connect_us;             // Proxy connect until the session was encrypted
+    uint32_t auth_us;                // Login sent until the server accepted it
+    uint64_t sent;
+    uint64_t sent_bytes;
+    uint64_t received;
+    uint64_t chat_start_ns;
+    uint64_t last_rx_ns;
+    uint64_t frame_cells;            // Cells its frames would take one read each, padding aside
+    uint32_t *lat_us;                // End-to-end latency of each delivery
+    size_t lat_count, lat_cap;
+    uint32_t *cross_us;              // ...of those from a client on the other node, with -n
+    size_t cross_count, cross_cap;
+    int compressing;                 // The server agreed to compression
+    struct compress_stream *zsend;
+    struct compress_stream *zrecv;
+    struct zstats zup;               // Sent and received frames that could be compressed
+    struct zstats zdown;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int recv_exact(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// --- SOCKS5 stand-in ---------------------------------------------------
+
+// Data on its way through the proxy, released once due
+struct chunk {
+    struct chunk *next;
+    uint64_t due_ns;
+    size_t len;
+    unsigned char data[];
+};
+
+// One direction of a proxied connection
+struct relay {
+    int from, to;
+    int eof;                         // from is done; shut down `to` once drained
+    uint64_t *cells;                 // Counter for the cells this direction carries
+    struct chunk *head, *tail;
+    uint64_t last_due_ns;            // Later chunks never overtake earlier ones
+};
+
+// One-way delay for the next chunk: the latency plus up to jitter_ms more
+static uint64_t proxy_delay_ns(unsigned int *seed) {
+    uint64_t d = (uint64_t)latency_ms * 1000000;
+    if (jitter_ms > 0) d += (uint64_t)(rand_r(seed) % (jitter_ms * 1000 + 1)) * 1000;
+    return d;
+}
+
+static void relay_read(struct relay *r, unsigned int *seed) {
+    unsigned char buf[RELAY_CHUNK];
+
+    ssize_t n = recv(r->from, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) return;
+    struct chunk *c = n > 0 ? malloc(sizeof(*c) + n) : NULL;
+    if (!c) {
+        r->eof = 1;
+        return;
+    }
+
+    __atomic_add_fetch(r->cells, (n + FRAME_CELL_DATA - 1) / FRAME_CELL_DATA, __ATOMIC_RELAXED);
+
+    uint64_t due = now_ns() + proxy_delay_ns(seed);
+    if (due < r->last_due_ns) due = r->last_due_ns;
+    r->last_due_ns = due;
+
+    c->next = NULL;
+    c->due_ns = due;
+    c->len = n;
+    memcpy(c->data, buf, n);
+    if (r->tail) r->tail->next = c;
+    else r->head = c;
+    r->tail = c;
+}
+
+// Forward every chunk that is due. Returns -1 if the far side is gone.
+static int relay_flush(struct relay *r, uint64_t now) {
+    while (r->head && r->head->due_ns <= now) {
+        struct chunk *c = r->head;
+        if (send_all(r->to, c->data, c->len) < 0) return -1;
+        r->head = c->next;
+        if (!r->head) r->tail = NULL;
+        free(c);
+    }
+    return 0;
+}
+
+static void relay_free(struct relay *r) {
+    while (r->head) {
+        struct chunk *c = r->head;
+        r->head = c->next;
+        free(c);
+    }
+}
+
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+// Answer the SOCKS5 greeting, optional RFC 1929 login and CONNECT request
+// the way Tor does, then dial the server on 127.0.0.1 (or its Unix socket)
+// whatever name was asked for, unless it is SECOND_HOST. Returns the
+// upstream socket, or -1.
+static int proxy_accept_request(int fd, unsigned int *seed) {
+    unsigned char buf[600];
+    unsigned char reply[10] = { 0x05, 0x00, 0x00, 0x01 };
+
+    if (recv_exact(fd, buf, 2) < 0 || buf[0] != 0x05 || recv_exact(fd, buf + 2, buf[1]) < 0) return -1;
+    unsigned char method = memchr(buf + 2, 0x02, buf[1]) ? 0x02 : 0x00;
+    unsigned char greet[2] = { 0x05, method };
+    if (send_all(fd, greet, 2) < 0) return -1;
+
+    // Like Tor, take any user name and password
+    if (method == 0x02) {
+        unsigned char ok[2] = { 0x01, 0x00 };
+        if (recv_exact(fd, buf, 2) < 0 || recv_exact(fd, buf + 2, buf[1] + 1) < 0 ||
+            recv_exact(fd, buf + 3 + buf[1], buf[2 + buf[1]]) < 0 || send_all(fd, ok, 2) < 0) return -1;
+    }
+
+    if (recv_exact(fd, buf, 4) < 0 || buf[0] != 0x05 || buf[1] != 0x01) return -1;
+    size_t addr_len;
+    switch (buf[3]) {
+        case 0x01: addr_len = 4; break;
+        case 0x04: addr_len = 16; break;
+        case 0x03:
+            if (recv_exact(fd, buf, 1) < 0) return -1;
+            addr_len = buf[0];
+            break;
+        default: return -1;
+    }
+    if (recv_exact(fd, buf, addr_len + 2) < 0) return -1;
+    int port = (buf[addr_len] << 8) | buf[addr_len + 1];
+    int second = second_node && addr_len == strlen(SECOND_HOST) && memcmp(buf, SECOND_HOST, addr_len) == 0;
+
+    // Tor answers once the circuit to the service is built; charge one
+    // round trip for it
+    sleep_ns(2 * proxy_delay_ns(seed));
+
+    int up;
+    if (second) up = strchr(second_node, '/') ? connect_unix(second_node) : connect_local(atoi(second_node));
+    else up = server_socket ? connect_unix(server_socket) : connect_local(port);
+    reply[1] = up < 0 ? 0x05 : 0x00;
+    if (send_all(fd, reply, sizeof(reply)) < 0 && up >= 0) {
+        close(up);
+        return -1;
+    }
+    return up;
+}
+
+// Shuttle data both ways, each chunk held back until it is due. Ends once
+// both sides have closed or either fails.
+static void proxy_relay(struct relay *dirs[2], unsigned int *seed) {
+    int shut[2] = { 0, 0 };
+
+    while (1) {
+        struct pollfd pfd[2];
+        int which[2], n = 0, busy = 0;
+        uint64_t now = now_ns(), next = UINT64_MAX;
+
+        for (int i = 0; i < 2; i++) {
+            struct relay *r = dirs[i];
+            if (relay_flush(r, now) < 0) return;
+            if (r->head) {
+                if (r->head->due_ns < next) next = r->head->due_ns;
+                busy = 1;
+            } else if (r->eof && !shut[i]) {
+                shutdown(r->to, SHUT_WR);
+                shut[i] = 1;
+            }
+            if (!r->eof) {
+                pfd[n].fd = r->from;
+                pfd[n].events = POLLIN;
+                which[n++] = i;
+                busy = 1;
+            }
+        }
+        if (!busy) return;
+
+        struct timespec ts, *timeout = NULL;
+        if (next != UINT64_MAX) {
+            ts.tv_sec = (next - now) / 1000000000ull;
+            ts.tv_nsec = (next - now) % 1000000000ull;
+            timeout = &ts;
+        }
+        if (ppoll(pfd, n, timeout, NULL) < 0 && errno != EINTR) return;
+        for (int i = 0; i < n; i++) {
+            if (pfd[i].revents) relay_read(dirs[which[i]], seed);
+        }
+    }
+}
+
+static void *proxy_conn(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned int seed = (unsigned int)now_ns() ^ (unsigned int)fd;
+
+    int up = proxy_accept_request(fd, &seed);
+    if (up >= 0) {
+        struct relay to_server = { .from = fd, .to = up, .cells = &cells_up };
+        struct relay to_client = { .from = up, .to = fd, .cells = &cells_down };
+        struct relay *dirs[2] = { &to_server, &to_client };
+        proxy_relay(dirs, &seed);
+        relay_free(&to_server);
+        relay_free(&to_client);
+        close(up);
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *proxy_main(void *arg) {
+    while (1) {
+        int fd = accept(proxy_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("bench: proxy accept");
+            sleep_ns(10000000);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t t;
+        if (pthread_create(&t, &proxy_attr, proxy_conn, (void *)(intptr_t)fd) != 0) {
+            perror("bench: proxy thread");
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+// Listen on an ephemeral loopback port, so a real Tor on 9050 is left alone
+static int proxy_start() {
+    struct sockaddr_in sa = {0};
+    socklen_t sa_len = sizeof(sa);
+    pthread_t t;
+
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    proxy_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (proxy_listen_fd < 0 ||
+        bind(proxy_listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(proxy_listen_fd, 1024) < 0 ||
+        getsockname(proxy_listen_fd, (struct sockaddr *)&sa, &sa_len) < 0) {
+        perror("bench: proxy socket");
+        return -1;
+    }
+    proxy_port = ntohs(sa.sin_port);
+
+    pthread_attr_init(&proxy_attr);
+    pthread_attr_setstacksize(&proxy_attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&proxy_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t, &proxy_attr, proxy_main, NULL) != 0) {
+        perror("bench: proxy thread");
+        return -1;
+    }
+    return 0;
+}
+
+// --- Synthetic clients -------------------------------------------------
+
+#define LOGIN_MAX 512                // "user\0password", client number filled in
+
+// The login for client id, "user\0password", with a %d in the user name
+// of -u replaced by the number so that each client has its own account.
+// Returns the payload length.
+static size_t login_for(int id, unsigned char *out) {
+    const char *colon = strchr(login, ':');
+    const char *num = strstr(login, "%d");
+    int n;
+
+    if (num && num < colon) {
+        n = snprintf((char *)out, LOGIN_MAX, "%.*s%d", (int)(num - login), login, id);
+        n += snprintf((char *)out + n, LOGIN_MAX - n, "%.*s", (int)(colon - num - 2), num + 2);
+    } else {
+        n = snprintf((char *)out, LOGIN_MAX, "%.*s", (int)(colon - login), login);
+    }
+    n++;
+    n += snprintf((char *)out + n, LOGIN_MAX - n, "%s", colon + 1);
+    return (size_t)n;
+}
+
+static int send_sealed(int fd, struct noise_cipher *tx, uint8_t type, const void *payload, size_t len) {
+    unsigned char out[FRAME_HDR_LEN + FRAME_MAX_PAYLOAD];
+    size_t n = noise_seal_frame(tx, out, type, payload, len);
+    return send_all(fd, out, n);
+}
+
+// Send a frame that may be compressed, compressed if the server agreed to
+// that and it shrinks
+static int send_chat(struct bench_client *bc, int fd, struct noise_cipher *tx, uint8_t type, const void *payload,
+                     size_t len) {
+    unsigned char inner[FRAME_MAX_PLAINTEXT];
+    struct zstats *z = &bc->zup;
+
+    if (!compress_eligible(type, len)) return send_sealed(fd, tx, type, payload, len);
+
+    z->frames++;
+    z->raw_bytes += len;
+    if (bc->zsend) {
+        uint64_t start = now_ns();
+        size_t n = compress_payload(bc->zsend, type, inner + 1, payload, len);
+        z->ns += now_ns() - start;
+        if (n > 0) {
+            inner[0] = type;
+            z->compressed++;
+            z->wire_bytes += n + 1;
+            return send_sealed(fd, tx, FRAME_COMPRESSED, inner, n + 1);
+        }
+    }
+    z->wire_bytes += len;
+    return send_sealed(fd, tx, type, payload, len);
+}
+
+// Turn a FRAME_COMPRESSED just opened into the frame it carries, whose
+// payload is then only good until the next one. Returns -1 if it does not
+// decompress.
+static int inflate_frame(struct bench_client *bc, struct frame *f) {
+    struct zstats *z = &bc->zdown;
+
+    if (f->type != FRAME_COMPRESSED) {
+        if (compress_eligible(f->type, f->len)) {
+            z->frames++;
+            z->raw_bytes += f->len;
+            z->wire_bytes += f->len;
+        }
+        return 0;
+    }
+    if (!bc->zrecv || f->len < 2) return -1;
+
+    size_t len;
+    uint64_t start = now_ns();
+    const unsigned char *payload = decompress_payload(bc->zrecv, f->payload[0], f->payload + 1, f->len - 1, &len);
+    z->ns += now_ns() - start;
+    if (!payload) return -1;
+
+    z->frames++;
+    z->compressed++;
+    z->raw_bytes += len;
+    z->wire_bytes += f->len;
+    f->type = f->payload[0];
+    f->payload = payload;
+    f->len = (uint32_t)len;
+    return 0;
+}
+
+// Cells a frame of len payload bytes takes when it travels alone
+static uint64_t frame_cells(uint32_t len) {
+    return (FRAME_HDR_LEN + len + FRAME_CELL_DATA - 1) / FRAME_CELL_DATA;
+}
+
+// Block for the next frame, opened with cs unless that is NULL. Returns
+// 0 on a closed connection, a timeout or a bad frame.
+static int read_frame(struct bench_client *bc, int fd, struct frame_reader *rx, struct noise_cipher *cs, struct frame *f) {
+    while (1) {
+        int r = frame_next(rx, f);
+        if (r < 0) return 0;
+        if (r > 0) {
+            uint64_t cells = frame_cells(f->len);
+            if (cs && (f->type != FRAME_SEALED || noise_open_frame(cs, f) < 0 || inflate_frame(bc, f) < 0)) return 0;
+            if (f->type == FRAME_PADDING) continue;
+            bc->frame_cells += cells;
+            return 1;
+        }
+        if (frame_reader_fill(rx, fd) <= 0) return 0;
+    }
+}
+
+// Connect through the proxy, finish the key exchange and log in the way
+// the client does. Returns 1 once the server has accepted the login.
+static int client_login(struct bench_client *bc, int fd, struct frame_reader *rx,
+                        struct noise_cipher *tx, struct noise_cipher *rxc) {
+    unsigned char hello[FRAME_HDR_LEN + NOISE_MSG1_MAX];
+    uint8_t server_key[NOISE_KEY_LEN];
+    uint8_t features;
+    struct noise_handshake hs;
+    struct frame f;
+    char auth[32];
+    unsigned char cred[LOGIN_MAX];
+    int prompts = 0;
+
+    uint64_t start = now_ns();
+    int len = noise_initiator_start(&hs, hello + FRAME_HDR_LEN, offered);
+    if (len < 0) return 0;
+    frame_encode_header(hello, FRAME_HANDSHAKE, (uint32_t)len);
+    snprintf(auth, sizeof(auth), "bench:%d", bc->id);
+    const char *host = second_node && (bc->id & 1) ? SECOND_HOST : SERVER_HOST;
+    if (socks5_connect_domain(fd, host, server_port, isolate ? auth : NULL, hello, FRAME_HDR_LEN + len, 1) < 0) {
+        return 0;
+    }
+
+    if (!read_frame(bc, fd, rx, NULL, &f) || f.type != FRAME_HANDSHAKE ||
+        noise_initiator_finish(&hs, f.payload, f.len, server_key, tx, rxc, &features) < 0) {
+        fprintf(stderr, "bench: client %d: key exchange failed\n", bc->id);
+        return 0;
+    }
+    bc->connect_us = (now_ns() - start) / 1000;
+    if (features & FRAME_FEATURE_COMPRESS) {
+        bc->compressing = 1;
+        bc->zsend = compress_stream_new();
+        bc->zrecv = compress_stream_new();
+        if (!bc->zsend || !bc->zrecv) return 0;
+    }
+
+    // The login goes out at once; the prompt already on its way is ignored
+    start = now_ns();
+    if (send_sealed(fd, tx, FRAME_AUTH, cred, login_for(bc->id, cred)) < 0) return 0;
+    while (read_frame(bc, fd, rx, rxc, &f)) {
+        if (f.type == FRAME_AUTH_OK) {
+            bc->auth_us = (now_ns() - start) / 1000;
+            return 1;
+        }
+        if (f.type == FRAME_AUTH_FAIL || (f.type == FRAME_AUTH_PROMPT && ++prompts > 1)) break;
+    }
+    fprintf(stderr, "bench: client %d: login failed\n", bc->id);
+    return 0;
+}
+
+static void record_latency(struct bench_client *bc, uint32_t us, int cross) {
+    uint32_t **v = cross ? &bc->cross_us : &bc->lat_us;
+    size_t *count = cross ? &bc->cross_count : &bc->lat_count;
+    size_t *cap = cross ? &bc->cross_cap : &bc->lat_cap;
+
+    if (*count == *cap) {
+        size_t n = *cap ? *cap * 2 : 1024;
+        uint32_t *p = realloc(*v, n * sizeof(*p));
+        if (!p) return;
+        *v = p;
+        *cap = n;
+    }
+    (*v)[(*count)++] = us;
+}
+
+// Take every complete frame in rx, timing benchmark chat and answering
+// the server's pings unless tx is NULL. Returns -1 if the server broke the protocol or the
+// connection failed.
+static int client_receive(struct bench_client *bc, int fd, struct frame_reader *rx,
+                          struct noise_cipher *tx, struct noise_cipher *rxc) {
+    struct frame f;
+    int r;
+
+    while ((r = frame_next(rx, &f)) > 0) {
+        uint64_t cells = frame_cells(f.len);
+        if (f.type != FRAME_SEALED || noise_open_frame(rxc, &f) < 0 || inflate_frame(bc, &f) < 0) return -1;
+        if (f.type == FRAME_PADDING) continue;
+        bc->frame_cells += cells;
+        if (f.type == FRAME_PING) {
+            if (tx && send_sealed(fd, tx, FRAME_PONG, f.payload, f.len) < 0) return -1;
+            continue;
+        }
+        const char *text;
+        size_t len;
+        if (f.type == FRAME_CHAT && f.len > FRAME_CHAT_HDR_LEN) {
+            text = (const char *)f.payload + FRAME_CHAT_HDR_LEN;
+            len = f.len - FRAME_CHAT_HDR_LEN;
+        } else if (f.type == FRAME_ROOM && memchr(f.payload, 0, f.len)) {
+            // "room\0user: text"
+            size_t skip = strlen((const char *)f.payload) + 1;
+            text = (const char *)f.payload + skip;
+            len = f.len - skip;
+        } else {
+            continue;
+        }
+        const char *tag = memmem(text, len, BENCH_TAG, strlen(BENCH_TAG));
+        if (!tag) continue;
+
+        char stamp[64];
+        size_t n = text + len - tag;
+        if (n >= sizeof(stamp)) n = sizeof(stamp) - 1;
+        memcpy(stamp, tag, n);
+        stamp[n] = 0;
+
+        int from;
+        unsigned long long sent;
+        if (sscanf(stamp, BENCH_TAG "%d %llu", &from, &sent) != 2) continue;
+
+        uint64_t now = now_ns();
+        // Clients alternate between the nodes with -n
+        record_latency(bc, (uint32_t)((now - sent) / 1000), second_node && ((from ^ bc->id) & 1));
+        bc->received++;
+        bc->last_rx_ns = now;
+    }
+    return r;
+}
+
+// Send `messages` chat messages at `rate` per second while taking in
+// everyone else's, until all expected deliveries arrived or they stop
+static void client_chat(struct bench_client *bc, int fd, struct frame_reader *rx,
+                        struct noise_cipher *tx, struct noise_cipher *rxc, uint64_t expected) {
+    char buf[MAX_MESSAGE_LEN + sizeof(bc->room_name)];
+    unsigned int seed = (unsigned int)bc->id;
+    uint64_t interval = 1000000000ull / rate;
+    uint64_t drain = DRAIN_TIMEOUT_MS * 1000000ull;
+    uint64_t to_send = bc->busy ? messages : 0;
+    uint64_t now = now_ns();
+
+    // Spread the clients over the first interval rather than all at once
+    uint64_t next_send = now + (uint64_t)rand_r(&seed) % interval;
+    bc->chat_start_ns = bc->last_rx_ns = now;
+
+    while (1) {
+        now = now_ns();
+        if (bc->sent < to_send && now >= next_send) {
+            // Room messages are addressed with the room's name up front
+            size_t head = rooms ? strlen(bc->room_name) + 1 : 0;
+            memcpy(buf, bc->room_name, head);
+            char *text = buf + head;
+            int len = snprintf(text, MAX_MESSAGE_LEN, BENCH_TAG "%d %llu", bc->id, (unsigned long long)now);
+            while (len < msg_size) {
+                const char *w = words[rand_r(&seed) % (sizeof(words) / sizeof(words[0]))];
+                int n = snprintf(text + len, msg_size - len + 1, " %s", w);
+                len += n < msg_size - len ? n : msg_size - len;
+            }
+            if (send_chat(bc, fd, tx, rooms ? FRAME_ROOM : FRAME_CHAT, buf, head + len) < 0) break;
+            bc->sent++;
+            next_send += interval;
+            continue;
+        }
+
+        uint64_t wait;
+        if (bc->sent < to_send) {
+            wait = next_send - now;
+        } else if (bc->received >= expected || now - bc->last_rx_ns >= drain) {
+            break;
+        } else {
+            wait = drain - (now - bc->last_rx_ns);
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        struct timespec ts = { .tv_sec = wait / 1000000000ull, .tv_nsec = wait % 1000000000ull };
+        int r = ppoll(&pfd, 1, &ts, NULL);
+        if (r < 0 && errno != EINTR) break;
+        if (r > 0 && (frame_reader_fill(rx, fd) <= 0 || client_receive(bc, fd, rx, tx, rxc) < 0)) break;
+    }
+}
+
+// Join the client's room and wait until the server confirms it, so no
+// message to the room can overtake the join. Returns 1 once in.
+static int client_join(struct bench_client *bc, int fd, struct frame_reader *rx,
+                       struct noise_cipher *tx, struct noise_cipher *rxc) {
+    struct frame f;
+
+    if (send_sealed(fd, tx, FRAME_JOIN, bc->room_name, strlen(bc->room_name)) < 0) return 0;
+    while (read_frame(bc, fd, rx, rxc, &f)) {
+        if (f.type == FRAME_NOTICE && f.len > 7 && memcmp(f.payload, "Joined ", 7) == 0) return 1;
+    }
+    fprintf(stderr, "bench: client %d: could not join %s\n", bc->id, bc->room_name);
+    return 0;
+}
+
+// Post maximum-size messages as fast as the socket takes them until told
+// to stop, reading and discarding whatever comes back meanwhile
+static void client_flood(struct bench_client *bc, int fd, struct frame_reader *rx,
+                         struct noise_cipher *tx, struct noise_cipher *rxc) {
+    unsigned char *out = malloc(FRAME_HDR_LEN + FRAME_MAX_PAYLOAD);
+    char buf[MAX_MESSAGE_LEN];
+    size_t head = strlen(FLOOD_ROOM) + 1;
+    size_t len = 0, off = 0;
+
+    memcpy(buf, FLOOD_ROOM, head);
+    memset(buf + head, 'f', sizeof(buf) - head);
+
+    while (!__atomic_load_n(&flood_stop, __ATOMIC_RELAXED)) {
+        if (off == len) {
+            len = noise_seal_frame(tx, out, FRAME_ROOM, buf, sizeof(buf));
+            off = 0;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLOUT };
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) break;
+        if (pfd.revents & POLLIN) {
+            // No pongs: one would cut into the frame being sent, and a
+            // flooder is never silent long enough to be pinged anyway
+            if (frame_reader_fill(rx, fd) <= 0 || client_receive(bc, fd, rx, NULL, rxc) < 0) break;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(fd, out + off, len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (n > 0) off += n;
+            if (n > 0 && off == len) {
+                bc->sent++;
+                bc->sent_bytes += len;
+            }
+        }
+    }
+    free(out);
+}
+
+static void *client_main(void *arg) {
+    struct bench_client *bc = arg;
+    struct noise_cipher tx, rxc;
+    struct frame_reader rx;
+    int ok = 0;
+
+    frame_reader_init(&rx);
+    int fd = connect_local(proxy_port);
+    if (fd < 0) {
+        perror("bench: connect to proxy");
+    } else {
+        // Setup reads block; a stuck server must not hang the run
+        struct timeval tv = { .tv_sec = SETUP_TIMEOUT_S };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ok = client_login(bc, fd, &rx, &tx, &rxc) && (!rooms || bc->id >= clients || client_join(bc, fd, &rx, &tx, &rxc));
+    }
+    if (ok) __atomic_add_fetch(&logged_in, 1, __ATOMIC_RELAXED);
+    if (ok && bc->id >= clients) {
+        snprintf(bc->room_name, sizeof(bc->room_name), FLOOD_ROOM);
+        ok = client_join(bc, fd, &rx, &tx, &rxc);
+    } else if (ok && bc->busy) {
+        __atomic_add_fetch(&logged_in_busy, 1, __ATOMIC_RELAXED);
+        if (rooms) __atomic_add_fetch(&room_busy[bc->room], 1, __ATOMIC_RELAXED);
+    }
+
+    // Nobody chats until everyone has connected or given up
+    pthread_barrier_wait(&start_barrier);
+
+    if (ok && bc->id >= clients) {
+        bc->ok = 1;
+        client_flood(bc, fd, &rx, &tx, &rxc);
+    } else if (ok) {
+        int *busy = rooms ? &room_busy[bc->room] : &logged_in_busy;
+        int peers = __atomic_load_n(busy, __ATOMIC_RELAXED) - bc->busy;
+        bc->ok = 1;
+        client_chat(bc, fd, &rx, &tx, &rxc, (uint64_t)peers * messages);
+    }
+    if (fd >= 0) close(fd);
+    frame_reader_free(&rx);
+    compress_stream_free(bc->zrecv);
+    compress_stream_free(bc->zsend);
+    return NULL;
+}
+
+// --- Results -----------------------------------------------------------
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted microsecond samples, in milliseconds
+static double percentile_ms(const uint32_t *v, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t rank = (size_t)(p * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return v[rank - 1] / 1000.0;
+}
+
+static void print_dist(const char *name, uint32_t *v, size_t n, int tail) {
+    qsort(v, n, sizeof(*v), cmp_u32);
+    printf("\"%s\":{\"p50\":%.3f,\"p99\":%.3f,", name, percentile_ms(v, n, 0.50), percentile_ms(v, n, 0.99));
+    if (tail) printf("\"p999\":%.3f,", percentile_ms(v, n, 0.999));
+    printf("\"max\":%.3f}", n ? v[n - 1] / 1000.0 : 0);
+}
+
+static void add_zstats(struct zstats *sum, const struct zstats *z) {
+    sum->frames += z->frames;
+    sum->compressed += z->compressed;
+    sum->raw_bytes += z->raw_bytes;
+    sum->wire_bytes += z->wire_bytes;
+    sum->ns += z->ns;
+}
+
+static void print_zstats(const char *name, const struct zstats *z) {
+    printf("\"%s\":{\"frames\":%llu,\"compressed\":%llu,\"raw_bytes\":%llu,\"wire_bytes\":%llu,\"ratio\":%.3f,"
+           "\"ns_per_frame\":%.0f}",
+           name, (unsigned long long)z->frames, (unsigned long long)z->compressed, (unsigned long long)z->raw_bytes,
+           (unsigned long long)z->wire_bytes, z->wire_bytes ? (double)z->raw_bytes / z->wire_bytes : 1.0,
+           z->frames ? (double)z->ns / z->frames : 0);
+}
+
+static void report(struct bench_client *bc, double elapsed_s) {
+    uint32_t *connect_us = malloc(clients * sizeof(uint32_t));
+    uint32_t *auth_us = malloc(clients * sizeof(uint32_t));
+    size_t ok = 0, lat_total = 0, cross_total = 0;
+    uint64_t sent = 0, received = 0, first = UINT64_MAX, last = 0, alone = 0;
+
+    for (int i = 0; i < clients; i++) {
+        if (!bc[i].ok) continue;
+        connect_us[ok] = bc[i].connect_us;
+        auth_us[ok++] = bc[i].auth_us;
+        sent += bc[i].sent;
+        received += bc[i].received;
+        lat_total += bc[i].lat_count;
+        cross_total += bc[i].cross_count;
+        if (bc[i].chat_start_ns < first) first = bc[i].chat_start_ns;
+        if (bc[i].received && bc[i].last_rx_ns > last) last = bc[i].last_rx_ns;
+    }
+
+    // Same-node samples first, then cross-node ones, so each kind can be
+    // sorted on its own before the whole is
+    uint32_t *lat = malloc((lat_total + cross_total ? lat_total + cross_total : 1) * sizeof(uint32_t));
+    size_t off = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(lat + off, bc[i].lat_us, bc[i].lat_count * sizeof(uint32_t));
+        off += bc[i].lat_count;
+    }
+    for (int i = 0; i < clients; i++) {
+        if (bc[i].cross_count) memcpy(lat + off, bc[i].cross_us, bc[i].cross_count * sizeof(uint32_t));
+        off += bc[i].cross_count;
+    }
+
+    // Each message goes to every client but its sender, or with -R to
+    // every other client in the sender's room
+    uint64_t expected = 0;
+    for (int r = 0; r < (rooms ? rooms : 1); r++) {
+        uint64_t in_room = 0, busy_in_room = 0;
+        for (int i = 0; i < clients; i++) {
+            if (!bc[i].ok || (rooms && bc[i].room != r)) continue;
+            in_room++;
+            busy_in_room += bc[i].busy;
+        }
+        if (busy_in_room) expected += busy_in_room * (in_room - 1) * messages;
+    }
+    double chat_s = last > first ? (last - first) / 1e9 : 0;
+
+    printf("{\"clients\":%d,\"idle\":%d,\"rooms\":%d,\"logged_in\":%zu,\"messages_per_client\":%d,\"rate_per_client\":%d,"
+           "\"message_bytes\":%d,\"transport\":\"%s\",\"proxy_latency_ms\":%d,\"proxy_jitter_ms\":%d,",
+           clients, idle, rooms, ok, messages, rate, msg_size, server_socket ? "unix" : "tcp", latency_ms, jitter_ms);
+    print_dist("connect_ms", connect_us, ok, 0);
+    printf(",");
+    print_dist("auth_ms", auth_us, ok, 0);
+    printf(",\"sent\":%llu,\"delivered\":%llu,\"expected\":%llu,\"chat_s\":%.3f,"
+           "\"sent_per_s\":%.1f,\"delivered_per_s\":%.1f,",
+           (unsigned long long)sent, (unsigned long long)received, (unsigned long long)expected, chat_s,
+           chat_s > 0 ? sent / chat_s : 0, chat_s > 0 ? received / chat_s : 0);
+    if (second_node) {
+        printf("\"nodes\":2,\"same_node_delivered\":%zu,\"same_node_per_s\":%.1f,",
+               lat_total, chat_s > 0 ? lat_total / chat_s : 0);
+        print_dist("same_node_latency_ms", lat, lat_total, 1);
+        printf(",\"cross_node_delivered\":%zu,\"cross_node_per_s\":%.1f,",
+               cross_total, chat_s > 0 ? cross_total / chat_s : 0);
+        print_dist("cross_node_latency_ms", lat + lat_total, cross_total, 1);
+        printf(",");
+    }
+    print_dist("latency_ms", lat, lat_total + cross_total, 1);
+
+    // Cells as carried against one frame per read, over the whole run
+    // since the proxy cannot tell login from chat
+    uint64_t down = __atomic_load_n(&cells_down, __ATOMIC_RELAXED);
+    uint64_t up = __atomic_load_n(&cells_up, __ATOMIC_RELAXED);
+    for (int i = 0; i < clients; i++) alone += bc[i].frame_cells;
+    printf(",\"cells\":{\"cell_bytes\":%d,\"down\":%llu,\"up\":%llu,\"down_unbatched\":%llu,\"saved_per_message\":%.3f}",
+           FRAME_CELL_DATA, (unsigned long long)down, (unsigned long long)up, (unsigned long long)alone,
+           received ? ((double)alone - (double)down) / received : 0);
+
+    uint64_t flood_sent = 0, flood_bytes = 0;
+    for (int i = clients; i < clients + flooders; i++) {
+        flood_sent += bc[i].sent;
+        flood_bytes += bc[i].sent_bytes;
+    }
+    // Sent by the clients and delivered to them, flooders aside
+    struct zstats zup = {0}, zdown = {0};
+    size_t negotiated = 0;
+    for (int i = 0; i < clients; i++) {
+        negotiated += bc[i].compressing;
+        add_zstats(&zup, &bc[i].zup);
+        add_zstats(&zdown, &bc[i].zdown);
+    }
+    printf(",\"compression\":{\"negotiated\":%zu,", negotiated);
+    print_zstats("up", &zup);
+    printf(",");
+    print_zstats("down", &zdown);
+    printf("}");
+
+    printf(",\"flood\":{\"flooders\":%d,\"sent\":%llu,\"bytes\":%llu,\"bytes_per_s\":%.0f}", flooders,
+           (unsigned long long)flood_sent, (unsigned long long)flood_bytes, chat_s > 0 ? flood_bytes / chat_s : 0);
+    printf(",\"elapsed_s\":%.3f}\n", elapsed_s);
+
+    free(connect_us);
+    free(auth_us);
+    free(lat);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c clients] [-m messages] [-i idle] [-R rooms] [-r rate] [-s bytes] [-l latency-ms] [-j jitter-ms] [-u user:password] [-a] [-U socket] [-f flooders] [-n port|socket] [-Z] [port]\n", prog);
+    fprintf(stderr, "  -c clients      Synthetic clients (default %d)\n", DEFAULT_CLIENTS);
+    fprintf(stderr, "  -m messages     Messages each client sends (default %d)\n", DEFAULT_MESSAGES);
+    fprintf(stderr, "  -i idle         How many of the clients only listen (default 0)\n");
+    fprintf(stderr, "  -R rooms        Spread the clients over this many rooms instead of the lobby\n");
+    fprintf(stderr, "  -r rate         Messages per second per client (default %d)\n", DEFAULT_RATE);
+    fprintf(stderr, "  -s bytes        Chat text per message (default %d)\n", DEFAULT_SIZE);
+    fprintf(stderr, "  -l latency-ms   One-way delay the proxy adds (default 0)\n");
+    fprintf(stderr, "  -j jitter-ms    Up to this much more delay, at random (default 0)\n");
+    fprintf(stderr, "  -u user:pass    Account every client logs in with (default %s); a %%d in the user\n"
+                    "                  name becomes the client's number, 0 on, flooders last, so each has\n"
+                    "                  its own. With one account for all, run the server with -Q 0\n", DEFAULT_LOGIN);
+    fprintf(stderr, "  -a              Give each client its own SOCKS credentials, as client -a does\n");
+    fprintf(stderr, "  -U socket       Reach the server through its Unix socket (server -s) instead of the port\n");
+    fprintf(stderr, "  -f flooders     Also run this many clients that send as fast as the server reads\n");
+    fprintf(stderr, "  -n port|socket  Connect every other client to this second, federated node and time\n"
+                    "                  deliveries within and across the nodes\n");
+    fprintf(stderr, "  -Z              Do not offer compression in the handshake\n");
+    fprintf(stderr, "  port            Server port on 127.0.0.1 (default %d)\n", DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_attr_t attr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:m:i:R:r:s:l:j:u:aU:f:n:Z")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 'm': messages = atoi(optarg); break;
+            case 'i': idle = atoi(optarg); break;
+            case 'R': rooms = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 's': msg_size = atoi(optarg); break;
+            case 'l': latency_ms = atoi(optarg); break;
+            case 'j': jitter_ms = atoi(optarg); break;
+            case 'u': login = optarg; break;
+            case 'a': isolate = 1; break;
+            case 'U': server_socket = optarg; break;
+            case 'f': flooders = atoi(optarg); break;
+            case 'n': second_node = optarg; break;
+            case 'Z': offered &= ~FRAME_FEATURE_COMPRESS; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind < argc) server_port = atoi(argv[optind]);
+
+    const char *colon = strchr(login, ':');
+    if (clients < 1 || messages < 0 || idle < 0 || idle >= clients || flooders < 0 || rooms < 0 || rate < 1 || msg_size < 1 || msg_size > MAX_MESSAGE_LEN ||
+        latency_ms < 0 || jitter_ms < 0 || server_port < 1 || server_port > 65535 ||
+        (second_node && !strchr(second_node, '/') && (atoi(second_node) < 1 || atoi(second_node) > 65535)) ||
+        !colon || strlen(login) + 16 >= LOGIN_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *num = strstr(login, "%d");
+    if (flooders > 0 && !(num && num < colon)) {
+        fprintf(stderr, "bench: the flooders share the clients' account and so its rate limit; "
+                        "give -u a %%d user name, or start the server with -Q 0\n");
+    }
+
+    if (proxy_start() < 0) return 1;
+
+    // Flooders come after the clients proper, which are all the report counts
+    struct bench_client *bc = calloc(clients + flooders, sizeof(*bc));
+    room_busy = calloc(rooms ? rooms : 1, sizeof(*room_busy));
+    if (!bc || !room_busy) return 1;
+    pthread_barrier_init(&start_barrier, NULL, clients + flooders + 1);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    char target[128];
+    if (server_socket) snprintf(target, sizeof(target), "%s", server_socket);
+    else snprintf(target, sizeof(target), "port %d", server_port);
+    if (second_node) snprintf(target + strlen(target), sizeof(target) - strlen(target), " and %s", second_node);
+    fprintf(stderr, "Connecting %d clients to %s through a SOCKS5 stand-in (latency %d ms, jitter %d ms)...\n",
+            clients, target, latency_ms, jitter_ms);
+    uint64_t start = now_ns();
+    for (int i = 0; i < clients + flooders; i++) {
+        bc[i].id = i;
+        bc[i].busy = i < clients - idle;
+        bc[i].room = rooms ? i % rooms : 0;
+        snprintf(bc[i].room_name, sizeof(bc[i].room_name), BENCH_ROOM, bc[i].room);
+        if (pthread_create(&bc[i].thread, &attr, client_main, &bc[i]) != 0) {
+            perror("bench: client thread");
+            return 1;
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    fprintf(stderr, "%d of %d clients logged in, %d sending %d messages each at %d/s%s...\n",
+            logged_in, clients + flooders, logged_in_busy, messages, rate, flooders ? ", the rest flooding" : "");
+
+    for (int i = 0; i < clients; i++) pthread_join(bc[i].thread, NULL);
+    __atomic_store_n(&flood_stop, 1, __ATOMIC_RELAXED);
+    for (int i = clients; i < clients + flooders; i++) pthread_join(bc[i].thread, NULL);
+    report(bc, (now_ns() - start) / 1e9);
+
+    for (int i = 0; i < clients + flooders; i++) {
+        free(bc[i].lat_us);
+        free(bc[i].cross_us);
+    }
+    free(bc);
+    free(room_busy);
+    return logged_in == clients + flooders ? 0 : 1;
+}
@@ -1,6 +1,6 @@
 // client.c
-// build: gcc -Wall -O2 -o client client.c
-// run: ./client <onion-hostname> <port>
+// build: gcc -Wall -O2 -pthread -o client client.c socks5.c frame.c pool.c crypto.c chacha_simd.c noise.c files.c compress.c
+// run: ./client [-k server-key] [-a socks-user:password] [-s] [-P] [-C ms] [-Z] <onion-hostname> <port>
 // example: ./client abcdefghijklmnopqrstuvwxyz.onion 12345
 
 #include <stdio.h>
@@ -8,14 +8,42 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "compress.h"
+#include "crypto.h"
+#include "files.h"
+#include "frame.h"
+#include "noise.h"
+#include "socks5.h"
 
 #define PROXY_HOST "127.0.0.1"
 #define PROXY_PORT 9050
 #define BUF_SIZE 4096
+#define KNOWN_HOSTS_FILE ".torchat_known_hosts"  // In $HOME, server keys seen before
+#define HISTORY_ON_JOIN 20     // Past messages shown after logging in
+#define HISTORY_DEFAULT 50     // Messages fetched by a bare /history
+#define MAX_TICKET_LEN 256     // Largest resumption ticket kept
+#define RECONNECT_MIN_MS 500   // First reconnect delay, doubled after every failure
+#define RECONNECT_MAX_MS 60000
+#define RECONNECT_ATTEMPTS 12  // Give up after this many failed reconnects in a row
+#define MISSED_REPLAY_MAX 1000 // Messages fetched after logging back in with a password
+#define REPLY_TIMEOUT_S 60     // Give up on a proxy or server that stops answering
+#define MAX_ROOMS 16           // Rooms kept joined, as many as the server allows
+#define ROOM_NAME_MAX 32
+#define UPLOAD_WINDOW 8        // File chunks sent ahead of the server's acknowledgement
+#define OUT_BUF_SIZE (2 * (FRAME_HDR_LEN + FRAME_MAX_PAYLOAD))  // Sealed frames gathered into one write
+#define COVER_MIN_MS 10
+#define HEARTBEAT_MS 5000      // Ping the server after hearing nothing from it for this long
+#define HEARTBEAT_TIMEOUT_MS 5000  // Give the circuit up for dead if the ping goes unanswered this long
 
 // Color codes for better UI
 #define COLOR_RED     "\x1b[31m"
@@ -26,6 +54,73 @@
 #define COLOR_CYAN    "\x1b[36m"
 #define COLOR_RESET   "\x1b[0m"
 
+// Session keys, set once the handshake with the server is done
+static struct noise_cipher send_cipher;
+static struct noise_cipher recv_cipher;
+static int session_ready;
+
+// Features offered in the handshake (-Z drops compression), those the
+// server agreed to, and the compression contexts, made on first use
+static uint8_t offered = FRAME_FEATURE_COMPRESS;
+static uint8_t features;
+static struct compress_stream *zsend;
+static struct compress_stream *zrecv;
+
+// Sealed frames wait here until the client next blocks, then go out in a
+// single write, optionally padded to whole Tor cells (-P). With -C a quiet
+// connection sends a cell of padding every cover_ms.
+static unsigned char out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+static int pad_cells;
+static int cover_ms;
+static uint64_t last_write_ms;
+
+// Heartbeat: when the server was last heard from, and when a ping went
+// out that nothing has come back for since (0 if none)
+static uint64_t last_rx_ms;
+static uint64_t ping_sent_ms;
+
+// Live messages in [replayed_from, replayed_to) were already shown by the
+// last history replay
+static uint64_t replayed_from, replayed_to;
+
+// What a reconnect needs to pick up where the session left off: the
+// server's latest resumption ticket and the newest message shown
+static unsigned char ticket[MAX_TICKET_LEN];
+static size_t ticket_len;
+static uint64_t last_seq;
+
+// Rooms joined, rejoined after a reconnect, and the one typed lines go to
+// (empty for the lobby)
+static char rooms[MAX_ROOMS][ROOM_NAME_MAX + 1];
+static char current_room[ROOM_NAME_MAX + 1];
+
+// A file on its way up or down; one of each may run at a time. Both
+// survive a reconnect: an upload is offered again and the server says
+// which chunks it still lacks, a download is asked for again from the
+// first chunk not yet written.
+struct transfer {
+    int fd;                        // -1 while idle
+    struct file_manifest *m;       // NULL for a download until the server sends it
+    uint8_t id[FILE_ID_LEN];
+    uint32_t next;                 // Next chunk to send, or to receive
+    uint32_t acked;                // Upload: chunks the server holds
+    char to[ROOM_NAME_MAX + 2];    // Upload: "", "#room" or a user
+    char path[BUF_SIZE];           // Download: the partial file
+};
+
+static struct transfer upload = { .fd = -1 };
+static struct transfer download = { .fd = -1 };
+
+// Where and how to reach the server, kept for reconnecting
+struct server_target {
+    const char *host;
+    int port;
+    const char *socks_auth;
+    int pipelined;
+    const uint8_t *pinned;
+};
+
 static int connect_tcp(const char *host, int port) {
     struct sockaddr_in sa = {0};
     sa.sin_family = AF_INET;
@@ -41,6 +136,15 @@ static int connect_tcp(const char *host, int port) {
         perror("socket");
         return -1;
     }
+
+    // Every frame is small and latency-bound; never hold one back
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Setup reads block waiting for a reply; a stuck proxy must not hang a
+    // reconnect forever. The chat loop only reads once select() says so.
+    struct timeval tv = { .tv_sec = REPLY_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     
     printf(COLOR_YELLOW "Connecting to Tor proxy at %s:%d..." COLOR_RESET "\n", host, port);
     if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
@@ -53,189 +157,921 @@ static int connect_tcp(const char *host, int port) {
     return fd;
 }
 
-static int socks5_connect_domain(int proxy_fd, const char *domain, int port) {
-    unsigned char buf[512];
-    
-    printf(COLOR_YELLOW "Establishing SOCKS5 connection to %s:%d..." COLOR_RESET "\n", domain, port);
-    
-    // 1) greeting: no auth
-    buf[0] = 0x05; buf[1] = 0x01; buf[2] = 0x00;
-    if (send(proxy_fd, buf, 3, 0) != 3) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Failed to send greeting\n" COLOR_RESET);
+void print_banner() {
+    printf("\n");
+    printf(COLOR_CYAN "╔══════════════════════════════════════════════════════════╗\n");
+    printf("║" COLOR_MAGENTA "               SECURE TOR CHAT CLIENT                     " COLOR_CYAN "║\n");
+    printf("║" COLOR_GREEN "                 Connection Established                   " COLOR_CYAN "║\n");
+    printf("║" COLOR_YELLOW "           All communications are encrypted               " COLOR_CYAN "║\n");
+    printf("║" COLOR_BLUE "      Commands: /quit (exit), /help (show commands)       " COLOR_CYAN "║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n" COLOR_RESET);
+    printf("\n");
+}
+
+void print_help() {
+    printf(COLOR_YELLOW "\nAvailable commands:\n" COLOR_RESET);
+    printf("  " COLOR_CYAN "/quit" COLOR_RESET " - Exit the chat\n");
+    printf("  " COLOR_CYAN "/help" COLOR_RESET " - Show this help message\n");
+    printf("  " COLOR_CYAN "/clear" COLOR_RESET " - Clear the screen\n");
+    printf("  " COLOR_CYAN "/history [n]" COLOR_RESET " - Show the last n messages (default %d)\n", HISTORY_DEFAULT);
+    printf("  " COLOR_CYAN "/join room" COLOR_RESET " - Join a room and talk there\n");
+    printf("  " COLOR_CYAN "/leave [room]" COLOR_RESET " - Leave a room (default the current one)\n");
+    printf("  " COLOR_CYAN "/lobby" COLOR_RESET " - Talk in the lobby again, staying in your rooms\n");
+    printf("  " COLOR_CYAN "/msg user text" COLOR_RESET " - Send a direct message\n");
+    printf("  " COLOR_CYAN "/send file [#room|user]" COLOR_RESET " - Share a file (default where you are talking)\n");
+    printf("  " COLOR_CYAN "/get id" COLOR_RESET " - Download a shared file into the current directory\n");
+    printf("  Just type and press Enter to send a message\n\n");
+}
+
+// Decrypt a frame in place once the session is up. Returns -1 if the
+// frame was not sealed with the session key.
+static int open_frame(struct frame *f) {
+    if (!session_ready) return 0;
+    if (noise_open_frame(&recv_cipher, f) < 0) {
+        printf(COLOR_RED "\nServer sent a frame that failed decryption\n" COLOR_RESET);
         return -1;
     }
-    
-    if (recv(proxy_fd, buf, 2, 0) != 2) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Failed to receive greeting response\n" COLOR_RESET);
-        return -1;
+    if (f->type != FRAME_COMPRESSED) return 0;
+
+    // Compressed: the payload is then only good until the next frame
+    const unsigned char *payload = NULL;
+    size_t len = 0;
+    if ((features & FRAME_FEATURE_COMPRESS) && f->len > 1 && (zrecv || (zrecv = compress_stream_new()) != NULL)) {
+        payload = decompress_payload(zrecv, f->payload[0], f->payload + 1, f->len - 1, &len);
     }
-    
-    if (buf[0] != 0x05 || buf[1] != 0x00) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Authentication not supported by proxy\n" COLOR_RESET);
+    if (!payload || !compress_eligible(f->payload[0], len)) {
+        printf(COLOR_RED "\nServer sent a frame that failed decompression\n" COLOR_RESET);
         return -1;
     }
+    f->type = f->payload[0];
+    f->payload = payload;
+    f->len = (uint32_t)len;
+    return 0;
+}
 
-    // 2) CONNECT request with domain name
-    size_t dlen = strlen(domain);
-    if (dlen > 255) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Domain name too long\n" COLOR_RESET);
-        return -1;
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Seal a FRAME_PADDING frame of n bytes on the wire into the output buffer
+static void queue_padding(size_t n) {
+    static const unsigned char zeros[FRAME_CELL_DATA];
+    out_len += noise_seal_frame(&send_cipher, out_buf + out_len, FRAME_PADDING, zeros, n - FRAME_PADDING_MIN);
+}
+
+// Write out every frame sealed since the last flush. Returns -1 if the
+// connection failed.
+static int flush_output(int sockfd) {
+    if (out_len == 0) return 0;
+    if (pad_cells) {
+        size_t pad = frame_padding_len(out_len);
+        if (pad > 0) queue_padding(pad);
     }
-    
+
     size_t off = 0;
-    buf[off++] = 0x05; // version
-    buf[off++] = 0x01; // CONNECT
-    buf[off++] = 0x00; // RSV
-    buf[off++] = 0x03; // ATYP = DOMAINNAME
-    buf[off++] = (unsigned char)dlen;
-    memcpy(buf + off, domain, dlen); off += dlen;
-    buf[off++] = (unsigned char)((port >> 8) & 0xff);
-    buf[off++] = (unsigned char)(port & 0xff);
-
-    if (send(proxy_fd, buf, off, 0) != (ssize_t)off) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Failed to send connection request\n" COLOR_RESET);
-        return -1;
+    while (off < out_len) {
+        ssize_t n = send(sockfd, out_buf + off, out_len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            out_len = 0;
+            return -1;
+        }
+        off += n;
     }
+    out_len = 0;
+    last_write_ms = now_ms();
+    return 0;
+}
 
-    // 3) read reply
-    ssize_t r = recv(proxy_fd, buf, 4, 0);
-    if (r != 4) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Failed to receive connection response\n" COLOR_RESET);
+// Send one frame, sealed once the session is up, and compressed if the
+// server takes that and it shrinks. Sealed frames are only gathered here;
+// they go out at the next flush_output().
+static int send_frame(int sockfd, uint8_t type, const void *payload, size_t len) {
+    if (!session_ready) return frame_send(sockfd, type, payload, len);
+    if (len > FRAME_MAX_PLAINTEXT) {
+        errno = EMSGSIZE;
         return -1;
     }
-    
-    if (buf[0] != 0x05) {
-        fprintf(stderr, COLOR_RED "SOCKS5: Invalid version in response\n" COLOR_RESET);
-        return -1;
+
+    // Leave room for the padding a flush may add
+    size_t need = FRAME_HDR_LEN + FRAME_SEAL_OVERHEAD + len + FRAME_CELL_DATA + FRAME_PADDING_MIN;
+    if (out_len + need > sizeof(out_buf) && flush_output(sockfd) < 0) return -1;
+
+    if ((features & FRAME_FEATURE_COMPRESS) && compress_eligible(type, len) &&
+        (zsend || (zsend = compress_stream_new()) != NULL)) {
+        // Built where noise_seal_frame() would move it to anyway
+        unsigned char *inner = out_buf + out_len + FRAME_HDR_LEN + 1;
+        size_t n = compress_payload(zsend, type, inner + 1, payload, len);
+        if (n > 0) {
+            inner[0] = type;
+            out_len += noise_seal_frame(&send_cipher, out_buf + out_len, FRAME_COMPRESSED, inner, n + 1);
+            return 0;
+        }
     }
-    
-    if (buf[1] != 0x00) {
-        const char *error_msg = "Unknown error";
-        switch(buf[1]) {
-            case 0x01: error_msg = "General failure"; break;
-            case 0x02: error_msg = "Connection not allowed"; break;
-            case 0x03: error_msg = "Network unreachable"; break;
-            case 0x04: error_msg = "Host unreachable"; break;
-            case 0x05: error_msg = "Connection refused"; break;
-            case 0x06: error_msg = "TTL expired"; break;
-            case 0x07: error_msg = "Command not supported"; break;
-            case 0x08: error_msg = "Address type not supported"; break;
+    out_len += noise_seal_frame(&send_cipher, out_buf + out_len, type, payload, len);
+    return 0;
+}
+
+// Ask the server to replay past messages: those from sequence `since` on,
+// but at most the last `max` of them
+static int request_history(int sockfd, uint64_t since, uint32_t max) {
+    unsigned char req[12];
+    frame_put_u64(req, since);
+    frame_put_u32(req + 8, max);
+    replayed_from = replayed_to = 0;
+    return send_frame(sockfd, FRAME_HISTORY, req, sizeof(req));
+}
+
+// Show a relayed chat message with the time the server logged it
+static void show_chat(const struct frame *f) {
+    if (f->len < FRAME_CHAT_HDR_LEN) return;
+
+    uint64_t seq = frame_get_u64(f->payload);
+    if (seq > last_seq) last_seq = seq;
+    if (seq >= replayed_from && seq < replayed_to) return;
+
+    time_t when = frame_get_u64(f->payload + 8) / 1000;
+    struct tm t;
+    localtime_r(&when, &t);
+    printf(COLOR_YELLOW "[%02d:%02d] " COLOR_RESET COLOR_BLUE "%.*s\n" COLOR_RESET, t.tm_hour, t.tm_min,
+           (int)(f->len - FRAME_CHAT_HDR_LEN), (const char *)f->payload + FRAME_CHAT_HDR_LEN);
+}
+
+// Show a room message, "room\0user: text"
+static void show_room(const struct frame *f) {
+    const char *room = (const char *)f->payload;
+    const char *sep = memchr(room, 0, f->len);
+    if (!sep) return;
+    printf(COLOR_MAGENTA "[#%s] %.*s\n" COLOR_RESET, room, (int)(f->len - (sep + 1 - room)), sep + 1);
+}
+
+// Show a direct message, "sender\0recipient\0text"
+static void show_direct(const struct frame *f) {
+    const char *from = (const char *)f->payload;
+    const char *sep = memchr(from, 0, f->len);
+    const char *to = sep ? sep + 1 : NULL;
+    const char *end = to ? memchr(to, 0, f->len - (to - from)) : NULL;
+    if (!end) return;
+    printf(COLOR_GREEN "[%s -> you] %.*s\n" COLOR_RESET, from, (int)(f->len - (end + 1 - from)), end + 1);
+}
+
+static const char *format_size(char *buf, size_t cap, uint64_t n) {
+    if (n < 1024) snprintf(buf, cap, "%llu B", (unsigned long long)n);
+    else if (n < 1024 * 1024) snprintf(buf, cap, "%.1f KiB", n / 1024.0);
+    else snprintf(buf, cap, "%.1f MiB", n / (1024.0 * 1024.0));
+    return buf;
+}
+
+static void end_transfer(struct transfer *t) {
+    if (t->fd >= 0) close(t->fd);
+    free(t->m);
+    t->fd = -1;
+    t->m = NULL;
+}
+
+// Offer the upload's manifest, prefixed by its target
+static int offer_upload(int sockfd) {
+    static unsigned char buf[FRAME_MAX_PLAINTEXT];
+    size_t to_len = strlen(upload.to);
+    memcpy(buf, upload.to, to_len + 1);
+    size_t len = to_len + 1 + file_manifest_encode(upload.m, buf + to_len + 1);
+    upload.next = upload.acked = 0;
+    return send_frame(sockfd, FRAME_FILE_OFFER, buf, len);
+}
+
+// Hash the file chunk by chunk into a manifest and offer it
+static int start_upload(int sockfd, const char *path, const char *to) {
+    static unsigned char chunk[FILE_CHUNK_SIZE];
+    struct stat st;
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    if (upload.fd >= 0) {
+        printf(COLOR_RED "Still sending %s; wait for it to finish\n" COLOR_RESET, upload.m->name);
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf(COLOR_RED "Cannot open %s: %s\n" COLOR_RESET, path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t)st.st_size > FILE_MAX_SIZE) {
+        printf(COLOR_RED "Only files of 1 byte to %llu MiB can be shared\n" COLOR_RESET,
+               (unsigned long long)(FILE_MAX_SIZE >> 20));
+        close(fd);
+        return 0;
+    }
+
+    struct file_manifest *m = calloc(1, sizeof(*m));
+    if (!m) {
+        close(fd);
+        return 0;
+    }
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->size = st.st_size;
+    file_manifest_seal(m);
+    for (uint32_t i = 0; i < m->chunks; i++) {
+        size_t len = file_chunk_len(m, i);
+        if (pread(fd, chunk, len, (off_t)i * FILE_CHUNK_SIZE) != (ssize_t)len) {
+            printf(COLOR_RED "Cannot read %s\n" COLOR_RESET, path);
+            free(m);
+            close(fd);
+            return 0;
         }
-        fprintf(stderr, COLOR_RED "SOCKS5: Connection failed - %s\n" COLOR_RESET, error_msg);
-        return -1;
+        file_hash_chunk(m->hashes[i], chunk, len);
     }
+    file_manifest_seal(m);
 
-    // Read the rest of the response based on address type
-    unsigned char atyp = buf[3];
-    if (atyp == 0x01) { // IPv4
-        if (recv(proxy_fd, buf, 4 + 2, 0) != 6) return -1;
-    } else if (atyp == 0x03) { // domain
-        if (recv(proxy_fd, buf, 1, 0) != 1) return -1;
-        int len = buf[0];
-        if (recv(proxy_fd, buf, len + 2, 0) != len + 2) return -1;
-    } else if (atyp == 0x04) { // IPv6
-        if (recv(proxy_fd, buf, 16 + 2, 0) != 18) return -1;
+    upload.fd = fd;
+    upload.m = m;
+    memcpy(upload.id, m->id, FILE_ID_LEN);
+    snprintf(upload.to, sizeof(upload.to), "%s", to);
+
+    char size[32];
+    printf(COLOR_YELLOW "Sending %s (%s)...\n" COLOR_RESET, m->name, format_size(size, sizeof(size), m->size));
+    return offer_upload(sockfd);
+}
+
+// Keep up to UPLOAD_WINDOW chunks beyond the acknowledged ones in flight
+static int pump_upload(int sockfd) {
+    static unsigned char buf[FILE_CHUNK_HDR_LEN + FILE_CHUNK_SIZE];
+    struct file_manifest *m = upload.m;
+
+    while (upload.next < m->chunks && upload.next < upload.acked + UPLOAD_WINDOW) {
+        size_t len = file_chunk_len(m, upload.next);
+        memcpy(buf, m->id, FILE_ID_LEN);
+        frame_put_u32(buf + FILE_ID_LEN, upload.next);
+        if (pread(upload.fd, buf + FILE_CHUNK_HDR_LEN, len, (off_t)upload.next * FILE_CHUNK_SIZE) != (ssize_t)len) {
+            printf(COLOR_RED "Cannot read %s any more; upload stopped\n" COLOR_RESET, m->name);
+            end_transfer(&upload);
+            return 0;
+        }
+        if (send_frame(sockfd, FRAME_FILE_CHUNK, buf, FILE_CHUNK_HDR_LEN + len) < 0) return -1;
+        upload.next++;
+    }
+    return 0;
+}
+
+static int upload_acked(int sockfd, const struct frame *f) {
+    if (upload.fd < 0 || f->len != FILE_CHUNK_HDR_LEN || memcmp(f->payload, upload.id, FILE_ID_LEN) != 0) return 0;
+
+    uint32_t acked = frame_get_u32(f->payload + FILE_ID_LEN);
+    if (acked == FILE_REFUSED) {
+        end_transfer(&upload);
+        return 0;
+    }
+    if (acked < upload.acked || acked > upload.m->chunks) return 0;
+    upload.acked = acked;
+    if (upload.next < acked) upload.next = acked;
+
+    if (acked == upload.m->chunks) {
+        char id[2 * FILE_ID_LEN + 1], size[32];
+        file_id_format(id, upload.id);
+        printf("\r\033[K");
+        printf(COLOR_GREEN "Shared %s (%s), fetch it with /get %s\n" COLOR_RESET, upload.m->name,
+               format_size(size, sizeof(size), upload.m->size), id);
+        end_transfer(&upload);
+        return 1;
+    }
+    return pump_upload(sockfd);
+}
+
+// Ask for the download from the first chunk not yet written
+static int request_download(int sockfd) {
+    unsigned char req[FILE_CHUNK_HDR_LEN];
+    memcpy(req, download.id, FILE_ID_LEN);
+    frame_put_u32(req + FILE_ID_LEN, download.next);
+    return send_frame(sockfd, FRAME_FILE_GET, req, sizeof(req));
+}
+
+// Chunks already in a partial file from an earlier attempt are kept once
+// the manifest confirms them
+static int start_download(int sockfd, const char *hex) {
+    struct stat st;
+
+    if (download.fd >= 0) {
+        printf(COLOR_RED "Still downloading; wait for it to finish\n" COLOR_RESET);
+        return 0;
+    }
+    if (file_id_parse(hex, download.id) < 0) {
+        printf(COLOR_RED "Usage: /get id, the %d hex digits from the announcement\n" COLOR_RESET, 2 * FILE_ID_LEN);
+        return 0;
+    }
+    snprintf(download.path, sizeof(download.path), "%s.part", hex);
+    download.fd = open(download.path, O_RDWR | O_CREAT, 0600);
+    if (download.fd < 0 || fstat(download.fd, &st) < 0) {
+        printf(COLOR_RED "Cannot write %s: %s\n" COLOR_RESET, download.path, strerror(errno));
+        end_transfer(&download);
+        return 0;
+    }
+    download.next = (uint32_t)(st.st_size / FILE_CHUNK_SIZE);
+    return request_download(sockfd);
+}
+
+// The partial file is complete: give it its name, unless that is taken
+static void finish_download() {
+    struct file_manifest *m = download.m;
+    char path[BUF_SIZE], size[32];
+
+    if (ftruncate(download.fd, m->size) < 0 || access(m->name, F_OK) == 0 ||
+        rename(download.path, m->name) < 0) {
+        snprintf(path, sizeof(path), "%s", download.path);
     } else {
-        fprintf(stderr, COLOR_RED "SOCKS5: Unsupported address type\n" COLOR_RESET);
+        snprintf(path, sizeof(path), "%s", m->name);
+    }
+    printf("\r\033[K");
+    printf(COLOR_GREEN "Downloaded %s (%s) to %s\n" COLOR_RESET, m->name, format_size(size, sizeof(size), m->size), path);
+    end_transfer(&download);
+}
+
+// The manifest must hash to the ID asked for, so the server cannot swap
+// the file; every chunk is then checked against it
+static int download_offer(int sockfd, const struct frame *f) {
+    static unsigned char chunk[FILE_CHUNK_SIZE];
+    char size[32];
+
+    if (download.fd < 0 || download.m) return 0;
+    struct file_manifest *m = malloc(sizeof(*m));
+    if (!m) return 0;
+    if (file_manifest_decode(m, f->payload, f->len) < 0 || memcmp(m->id, download.id, FILE_ID_LEN) != 0) {
+        printf("\r\033[K");
+        printf(COLOR_RED "Server sent the wrong file; download stopped\n" COLOR_RESET);
+        free(m);
+        end_transfer(&download);
+        return 1;
+    }
+    download.m = m;
+
+    // Keep the chunks from an earlier attempt that check out
+    uint32_t kept = 0;
+    if (download.next > m->chunks) download.next = m->chunks;
+    while (kept < download.next) {
+        size_t len = file_chunk_len(m, kept);
+        uint8_t hash[FILE_HASH_LEN];
+        if (pread(download.fd, chunk, len, (off_t)kept * FILE_CHUNK_SIZE) != (ssize_t)len) break;
+        file_hash_chunk(hash, chunk, len);
+        if (!crypto_memeq(hash, m->hashes[kept], FILE_HASH_LEN)) break;
+        kept++;
+    }
+
+    printf("\r\033[K");
+    printf(COLOR_YELLOW "Downloading %s (%s)" COLOR_RESET, m->name, format_size(size, sizeof(size), m->size));
+    if (kept > 0) printf(COLOR_YELLOW ", resuming at chunk %u of %u" COLOR_RESET, kept + 1, m->chunks);
+    printf("\n");
+
+    if (kept == m->chunks) {
+        finish_download();
+    } else if (kept < download.next) {
+        // The server is already sending from download.next; start over from
+        // the first bad chunk, ignoring the rest until it arrives
+        download.next = kept;
+        if (ftruncate(download.fd, (off_t)kept * FILE_CHUNK_SIZE) < 0 || request_download(sockfd) < 0) return -1;
+    }
+    return 1;
+}
+
+static int download_chunk(const struct frame *f) {
+    struct file_manifest *m = download.m;
+    uint8_t hash[FILE_HASH_LEN];
+
+    if (!m || f->len < FILE_CHUNK_HDR_LEN || memcmp(f->payload, download.id, FILE_ID_LEN) != 0) return 0;
+    if (frame_get_u32(f->payload + FILE_ID_LEN) != download.next) return 0;
+
+    const unsigned char *data = f->payload + FILE_CHUNK_HDR_LEN;
+    size_t len = f->len - FILE_CHUNK_HDR_LEN;
+    if (len == file_chunk_len(m, download.next)) file_hash_chunk(hash, data, len);
+    if (len != file_chunk_len(m, download.next) || !crypto_memeq(hash, m->hashes[download.next], FILE_HASH_LEN)) {
+        printf("\r\033[K");
+        printf(COLOR_RED "Chunk %u of %s is corrupt; download stopped\n" COLOR_RESET, download.next, m->name);
+        end_transfer(&download);
+        return 1;
+    }
+    if (pwrite(download.fd, data, len, (off_t)download.next * FILE_CHUNK_SIZE) != (ssize_t)len) {
+        printf("\r\033[K");
+        printf(COLOR_RED "Cannot write %s: %s\n" COLOR_RESET, download.path, strerror(errno));
+        end_transfer(&download);
+        return 1;
+    }
+    if (++download.next < m->chunks) return 0;
+    finish_download();
+    return 1;
+}
+
+// A new connection knows nothing of the transfers; pick both up again
+static int resume_transfers(int sockfd) {
+    if (upload.fd >= 0 && offer_upload(sockfd) < 0) return -1;
+    if (download.fd >= 0) {
+        // The manifest is sent again and checked again
+        free(download.m);
+        download.m = NULL;
+        if (request_download(sockfd) < 0) return -1;
+    }
+    return 0;
+}
+
+// Read frames until one is available. Returns 1 with the frame in f,
+// or 0 if the server disconnected or broke the protocol.
+static int read_frame(int sockfd, struct frame_reader *rx, struct frame *f) {
+    while (1) {
+        int r = frame_next(rx, f);
+        if (r > 0) {
+            if (open_frame(f) < 0) return 0;
+            if (f->type != FRAME_PADDING) return 1;
+            continue;
+        }
+        if (r < 0) {
+            printf(COLOR_RED "Server sent an oversized frame\n" COLOR_RESET);
+            return 0;
+        }
+        if (flush_output(sockfd) < 0 || frame_reader_fill(rx, sockfd) <= 0) return 0;
+    }
+}
+
+// Display every complete frame in the receive buffer and move file
+// transfers along. Returns -1 if the server broke the protocol, otherwise
+// whether anything was printed.
+static int show_frames(int sockfd, struct frame_reader *rx) {
+    struct frame f;
+    int r, shown = 0;
+
+    while ((r = frame_next(rx, &f)) > 0) {
+        if (open_frame(&f) < 0) return -1;
+        if (f.type == FRAME_PADDING || f.type == FRAME_PONG) continue;
+        if (f.type == FRAME_PING) {
+            if (f.len <= FRAME_PING_MAX) send_frame(sockfd, FRAME_PONG, f.payload, f.len);
+            continue;
+        }
+
+        if (f.type == FRAME_TICKET) {
+            if (f.len <= sizeof(ticket)) {
+                memcpy(ticket, f.payload, f.len);
+                ticket_len = f.len;
+            }
+            continue;
+        }
+
+        // Transfers move along quietly; only their start and end are shown.
+        // If the connection failed the next read sees it and reconnects.
+        if (f.type == FRAME_FILE_ACK || f.type == FRAME_FILE_OFFER || f.type == FRAME_FILE_CHUNK) {
+            int printed = f.type == FRAME_FILE_ACK ? upload_acked(sockfd, &f)
+                        : f.type == FRAME_FILE_OFFER ? download_offer(sockfd, &f) : download_chunk(&f);
+            if (printed < 0) {
+                perror("send");
+                shutdown(sockfd, SHUT_RDWR);
+            }
+            shown |= printed > 0;
+            continue;
+        }
+        shown = 1;
+
+        // Clear the current "You: " line and show server message
+        printf("\r\033[K"); // Move to beginning of line and clear
+        if (f.type == FRAME_CHAT) {
+            show_chat(&f);
+        } else if (f.type == FRAME_ROOM) {
+            show_room(&f);
+        } else if (f.type == FRAME_DIRECT) {
+            show_direct(&f);
+        } else if (f.type == FRAME_HISTORY_END) {
+            if (f.len != 16) continue;
+            replayed_from = frame_get_u64(f.payload);
+            replayed_to = frame_get_u64(f.payload + 8);
+            printf(COLOR_YELLOW "--- %s ---\n" COLOR_RESET, replayed_to > replayed_from ? "end of history" : "no earlier messages");
+        } else {
+            printf(COLOR_BLUE "Server: %.*s\n" COLOR_RESET, (int)f.len, (const char *)f.payload);
+        }
+    }
+    if (r < 0) {
+        printf(COLOR_RED "\nServer sent an oversized frame\n" COLOR_RESET);
         return -1;
     }
+    return shown;
+}
 
-    printf(COLOR_GREEN "✓ SOCKS5 connection established\n" COLOR_RESET);
+static int parse_key(const char *hex, uint8_t key[NOISE_KEY_LEN]) {
+    if (strlen(hex) != 2 * NOISE_KEY_LEN) return -1;
+    for (int i = 0; i < NOISE_KEY_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return -1;
+        key[i] = (uint8_t)byte;
+    }
     return 0;
 }
 
-void print_banner() {
-    printf("\n");
-    printf(COLOR_CYAN "╔══════════════════════════════════════════════════════════╗\n");
-    printf("║" COLOR_MAGENTA "               SECURE TOR CHAT CLIENT                     " COLOR_CYAN "║\n");
-    printf("║" COLOR_GREEN "                 Connection Established                   " COLOR_CYAN "║\n");
-    printf("║" COLOR_YELLOW "           All communications are encrypted               " COLOR_CYAN "║\n");
-    printf("║" COLOR_BLUE "      Commands: /quit (exit), /help (show commands)       " COLOR_CYAN "║\n");
-    printf("╚══════════════════════════════════════════════════════════╝\n" COLOR_RESET);
-    printf("\n");
+static void format_key(char hex[2 * NOISE_KEY_LEN + 1], const uint8_t key[NOISE_KEY_LEN]) {
+    for (int i = 0; i < NOISE_KEY_LEN; i++) sprintf(hex + 2 * i, "%02x", key[i]);
 }
 
-void print_help() {
-    printf(COLOR_YELLOW "\nAvailable commands:\n" COLOR_RESET);
-    printf("  " COLOR_CYAN "/quit" COLOR_RESET " - Exit the chat\n");
-    printf("  " COLOR_CYAN "/help" COLOR_RESET " - Show this help message\n");
-    printf("  " COLOR_CYAN "/clear" COLOR_RESET " - Clear the screen\n");
-    printf("  Just type and press Enter to send a message\n\n");
+// Check the server's static key against the pinned key if one was given,
+// otherwise against the key remembered for this host on first use.
+// Returns 0 if the key is trusted.
+static int verify_server_key(const uint8_t key[NOISE_KEY_LEN], const uint8_t *pinned, const char *host, int port) {
+    char hex[2 * NOISE_KEY_LEN + 1];
+    char path[BUF_SIZE];
+    char line[BUF_SIZE];
+    char id[BUF_SIZE];
+
+    format_key(hex, key);
+
+    if (pinned) {
+        if (!crypto_memeq(key, pinned, NOISE_KEY_LEN)) {
+            fprintf(stderr, COLOR_RED "Server key %s does not match the pinned key!\n" COLOR_RESET, hex);
+            return -1;
+        }
+        printf(COLOR_GREEN "✓ Server key matches the pinned key\n" COLOR_RESET);
+        return 0;
+    }
+
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/%s", home ? home : ".", KNOWN_HOSTS_FILE);
+    snprintf(id, sizeof(id), "%s:%d", host, port);
+
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            char known_id[BUF_SIZE], known_hex[BUF_SIZE];
+            if (sscanf(line, "%s %s", known_id, known_hex) != 2 || strcmp(known_id, id) != 0) continue;
+            fclose(fp);
+            if (strcmp(known_hex, hex) != 0) {
+                fprintf(stderr, COLOR_RED "WARNING: the key for %s has changed!\n" COLOR_RESET, id);
+                fprintf(stderr, COLOR_RED "  remembered %s\n  received   %s\n" COLOR_RESET, known_hex, hex);
+                fprintf(stderr, COLOR_RED "Someone may be impersonating the server. Remove the entry from %s if the change is expected.\n" COLOR_RESET, path);
+                return -1;
+            }
+            printf(COLOR_GREEN "✓ Server key matches the one remembered for %s\n" COLOR_RESET, id);
+            return 0;
+        }
+        fclose(fp);
+    }
+
+    // First contact: trust and remember the key
+    printf(COLOR_YELLOW "First connection to %s, server key %s\n" COLOR_RESET, id, hex);
+    printf(COLOR_YELLOW "Compare it with the key printed by the server, or use -k to pin it\n" COLOR_RESET);
+    fp = fopen(path, "a");
+    if (fp) {
+        fprintf(fp, "%s %s\n", id, hex);
+        fclose(fp);
+    }
+    return 0;
+}
+
+// Finish the Noise NX key exchange started by the message sent through
+// the tunnel: after this every frame in both directions is encrypted and
+// the server has proven it holds the expected static key
+static int handshake_with_server(int sockfd, struct frame_reader *rx, struct noise_handshake *hs,
+                                 const uint8_t *pinned, const char *host, int port) {
+    uint8_t server_key[NOISE_KEY_LEN];
+    struct frame f;
+
+    printf(COLOR_YELLOW "Exchanging keys with the server..." COLOR_RESET "\n");
+
+    if (!read_frame(sockfd, rx, &f)) {
+        printf(COLOR_RED "Server disconnected during the key exchange\n" COLOR_RESET);
+        return 0;
+    }
+    if (f.type != FRAME_HANDSHAKE) {
+        printf(COLOR_RED "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
+        return 0;
+    }
+    if (noise_initiator_finish(hs, f.payload, f.len, server_key, &send_cipher, &recv_cipher, &features) < 0) {
+        printf(COLOR_RED "Key exchange failed: the server's reply did not authenticate\n" COLOR_RESET);
+        return 0;
+    }
+    if (verify_server_key(server_key, pinned, host, port) < 0) return 0;
+
+    session_ready = 1;
+    printf(COLOR_GREEN "✓ Session encrypted with ChaCha20-Poly1305 (%s)\n" COLOR_RESET,
+           chacha20_impl_name(chacha20_current()));
+    if (features & FRAME_FEATURE_COMPRESS) printf(COLOR_GREEN "✓ Messages compressed\n" COLOR_RESET);
+    return 1;
 }
 
-int authenticate_with_server(int sockfd) {
+// Connect through Tor and run the key exchange, the first handshake
+// message travelling with the SOCKS request. Returns the socket, or -1.
+static int open_session(const struct server_target *t, struct frame_reader *rx) {
+    struct noise_handshake hs;
+    unsigned char hello[FRAME_HDR_LEN + NOISE_MSG1_MAX];
+
+    // Nothing from an earlier connection carries over
+    session_ready = 0;
+    features = 0;
+    compress_stream_free(zsend);
+    compress_stream_free(zrecv);
+    zsend = zrecv = NULL;
+    out_len = 0;
+    last_rx_ms = now_ms();
+    ping_sent_ms = 0;
+    frame_reader_free(rx);
+
+    int fd = connect_tcp(PROXY_HOST, PROXY_PORT);
+    if (fd < 0) {
+        fprintf(stderr, COLOR_RED "Failed to connect to Tor proxy\n" COLOR_RESET);
+        return -1;
+    }
+
+    int len = noise_initiator_start(&hs, hello + FRAME_HDR_LEN, offered);
+    if (len < 0) {
+        perror("handshake");
+        close(fd);
+        return -1;
+    }
+    frame_encode_header(hello, FRAME_HANDSHAKE, (uint32_t)len);
+
+    printf(COLOR_YELLOW "Establishing SOCKS5 connection to %s:%d..." COLOR_RESET "\n", t->host, t->port);
+    if (socks5_connect_domain(fd, t->host, t->port, t->socks_auth, hello, FRAME_HDR_LEN + len, t->pipelined) < 0) {
+        fprintf(stderr, COLOR_RED "SOCKS5 handshake failed\n" COLOR_RESET);
+        close(fd);
+        return -1;
+    }
+    printf(COLOR_GREEN "✓ SOCKS5 connection established\n" COLOR_RESET);
+    printf(COLOR_GREEN "✓ Connected to %s:%d via Tor\n" COLOR_RESET, t->host, t->port);
+
+    int ok = handshake_with_server(fd, rx, &hs, t->pinned, t->host, t->port);
+    crypto_wipe(&hs, sizeof(hs));
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int read_line(const char *prompt, char *buf, size_t cap) {
+    printf(COLOR_YELLOW "%s" COLOR_RESET, prompt);
+    fflush(stdout);
+    if (!fgets(buf, cap, stdin)) return -1;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+// Send "user\0password" sealed, then wipe the password
+static int send_login(int sockfd, const char *user, char *password) {
     char buffer[BUF_SIZE];
-    int auth_complete = 0;
-    int attempts = 0;
+    size_t user_len = strlen(user);
+    size_t len = user_len + 1 + strlen(password);
+
+    if (len > sizeof(buffer)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buffer, user, user_len + 1);
+    memcpy(buffer + user_len + 1, password, len - user_len - 1);
+    int sent = send_frame(sockfd, FRAME_AUTH, buffer, len);
+    crypto_wipe(buffer, sizeof(buffer));
+    crypto_wipe(password, strlen(password));
+    return sent;
+}
+
+// The login was read before connecting and goes out as soon as the server
+// key checks out, without waiting for the server's prompt. If that prompt
+// is still on its way (prompt_pending) it is already answered; later ones
+// follow a failed attempt.
+int authenticate_with_server(int sockfd, struct frame_reader *rx, const char *user, char *password, int prompt_pending) {
+    char retry[BUF_SIZE];
+    struct frame f;
+    int attempts = 1;
+    int prompt_answered = prompt_pending;
     const int max_attempts = 3;
+
+    printf(COLOR_YELLOW "Logging in as %s..." COLOR_RESET "\n", user);
+    if (send_login(sockfd, user, password) < 0) {
+        perror("send");
+        return 0;
+    }
     
-    printf(COLOR_YELLOW "Starting authentication..." COLOR_RESET "\n");
-    
-    while (!auth_complete && attempts < max_attempts) {
-        // Wait for server prompt
-        int n = recv(sockfd, buffer, BUF_SIZE - 1, 0);
-        if (n <= 0) {
+    while (attempts <= max_attempts) {
+        if (!read_frame(sockfd, rx, &f)) {
             printf(COLOR_RED "Server disconnected during authentication\n" COLOR_RESET);
             return 0;
         }
-        buffer[n] = 0;
-        
-        // Remove any trailing newlines for display
-        char *clean_msg = buffer;
-        while (*clean_msg && (clean_msg[strlen(clean_msg)-1] == '\n' || clean_msg[strlen(clean_msg)-1] == '\r')) {
-            clean_msg[strlen(clean_msg)-1] = 0;
-        }
-        
-        printf(COLOR_BLUE "Server: %s" COLOR_RESET "\n", clean_msg);
-        
-        // Check if authentication was successful
-        if (strstr(buffer, "Authentication successful") != NULL) {
+
+        switch (f.type) {
+        case FRAME_AUTH_OK:
+            printf(COLOR_BLUE "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
             return 1;
-        }
-        
-        // Check if authentication failed completely
-        if (strstr(buffer, "Maximum authentication attempts") != NULL) {
+
+        case FRAME_AUTH_FAIL:
+            printf(COLOR_RED "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
             return 0;
-        }
-        
-        // If we see password prompt, send the password
-        if (strstr(buffer, "password") != NULL || strstr(buffer, "Password") != NULL) {
-            attempts++;
-            printf(COLOR_YELLOW "Enter password (attempt %d/%d): " COLOR_RESET, attempts, max_attempts);
-            fflush(stdout);
-            
-            // Read password securely (no echo)
-            if (!fgets(buffer, BUF_SIZE - 1, stdin)) {
-                return 0;
+
+        case FRAME_AUTH_PROMPT:
+            if (prompt_answered) {
+                prompt_answered = 0;
+                break;
             }
-            // Remove newline
-            buffer[strcspn(buffer, "\n")] = 0;
-            
-            // Send password to server
-            if (send(sockfd, buffer, strlen(buffer), 0) < 0) {
+            attempts++;
+            if (attempts > max_attempts) break;
+
+            snprintf(retry, sizeof(retry), "Enter password (attempt %d/%d): ", attempts, max_attempts);
+            if (read_line(retry, retry, sizeof(retry)) < 0) return 0;
+            if (send_login(sockfd, user, retry) < 0) {
                 perror("send");
                 return 0;
             }
             printf("\n");
+            break;
+
+        default:
+            printf(COLOR_BLUE "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
+            break;
         }
     }
     
-    if (attempts >= max_attempts) {
-        printf(COLOR_RED "Too many authentication attempts\n" COLOR_RESET);
+    printf(COLOR_RED "Too many authentication attempts\n" COLOR_RESET);
+    return 0;
+}
+
+// Log back in with the ticket from the last session; the server replays
+// whatever arrived after last_seq straight away. Returns 1 once resumed,
+// 0 if the ticket was refused and the server wants a password instead, or
+// -1 if the connection failed.
+static int resume_session(int sockfd, struct frame_reader *rx) {
+    unsigned char req[8 + MAX_TICKET_LEN];
+    struct frame f;
+    int prompts = 0;
+
+    frame_put_u64(req, last_seq);
+    memcpy(req + 8, ticket, ticket_len);
+    replayed_from = replayed_to = 0;
+    if (send_frame(sockfd, FRAME_RESUME, req, 8 + ticket_len) < 0) return -1;
+
+    while (1) {
+        if (!read_frame(sockfd, rx, &f)) return -1;
+
+        switch (f.type) {
+        case FRAME_AUTH_OK:
+            printf(COLOR_BLUE "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
+            return 1;
+
+        case FRAME_AUTH_FAIL:
+            printf(COLOR_RED "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
+            return -1;
+
+        case FRAME_AUTH_PROMPT:
+            // The first prompt was sent before the ticket arrived; a second
+            // one means it was refused
+            if (++prompts == 2) return 0;
+            break;
+
+        default:
+            printf(COLOR_BLUE "Server: %.*s" COLOR_RESET "\n", (int)f.len, (const char *)f.payload);
+            break;
+        }
     }
-    
+}
+
+// The connection dropped: reconnect with exponential backoff and resume the
+// session, falling back to the password if the ticket is refused. Returns
+// the new socket, or -1 to give up.
+static int reconnect(const struct server_target *t, struct frame_reader *rx, const char *user) {
+    char password[BUF_SIZE];
+    unsigned int delay = RECONNECT_MIN_MS;
+
+    for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++) {
+        // Up to half as long again at random, so clients dropped together
+        // do not all come back at the same moment
+        unsigned int wait = delay + (unsigned int)(rand() % (delay / 2 + 1));
+        printf(COLOR_YELLOW "Reconnecting in %.1f s (attempt %d/%d)...\n" COLOR_RESET, wait / 1000.0, attempt, RECONNECT_ATTEMPTS);
+        fflush(stdout);
+        usleep(wait * 1000);
+        delay = delay * 2 < RECONNECT_MAX_MS ? delay * 2 : RECONNECT_MAX_MS;
+
+        uint64_t started = now_ms();
+        int fd = open_session(t, rx);
+        if (fd < 0) continue;
+
+        int r = ticket_len > 0 ? resume_session(fd, rx) : 0;
+        if (r > 0) {
+            printf(COLOR_GREEN "✓ Session resumed in %llu ms\n" COLOR_RESET, (unsigned long long)(now_ms() - started));
+            return fd;
+        }
+        if (r == 0) {
+            // Without a usable ticket the user has to log in again, and
+            // the missed messages are fetched explicitly
+            printf(COLOR_YELLOW "Please log in again\n" COLOR_RESET);
+            int prompt_pending = ticket_len == 0;
+            ticket_len = 0;
+            if (read_line("Enter password: ", password, sizeof(password)) < 0 ||
+                !authenticate_with_server(fd, rx, user, password, prompt_pending)) {
+                close(fd);
+                return -1;
+            }
+            if (request_history(fd, last_seq + 1, MISSED_REPLAY_MAX) == 0) return fd;
+        }
+        close(fd);
+    }
+
+    printf(COLOR_RED "Could not reconnect, giving up\n" COLOR_RESET);
+    return -1;
+}
+
+// Send a frame made of a name, a NUL byte and text, as room and direct
+// messages are
+static int send_addressed(int sockfd, uint8_t type, const char *name, const char *text, size_t len) {
+    static char buf[FRAME_MAX_PLAINTEXT];
+    size_t name_len = strlen(name);
+    if (name_len + 1 + len > sizeof(buf)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, name, name_len + 1);
+    memcpy(buf + name_len + 1, text, len);
+    return send_frame(sockfd, type, buf, name_len + 1 + len);
+}
+
+// Remember a room as joined. Returns -1 if MAX_ROOMS are joined already.
+static int add_room(const char *name) {
+    int free_slot = -1;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (strcmp(rooms[i], name) == 0) return 0;
+        if (!rooms[i][0] && free_slot < 0) free_slot = i;
+    }
+    if (free_slot < 0) return -1;
+    snprintf(rooms[free_slot], sizeof(rooms[free_slot]), "%s", name);
     return 0;
 }
 
+static void forget_room(const char *name) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (strcmp(rooms[i], name) == 0) rooms[i][0] = 0;
+    }
+    if (strcmp(current_room, name) == 0) current_room[0] = 0;
+}
+
+// A new connection starts in the lobby only; join the rooms again
+static int rejoin_rooms(int sockfd) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rooms[i][0] && send_frame(sockfd, FRAME_JOIN, rooms[i], strlen(rooms[i])) < 0) return -1;
+    }
+    return 0;
+}
+
+// "/join #room" and "/join room" name the same room
+static const char *room_arg(const char *arg) {
+    arg += strspn(arg, " ");
+    return *arg == '#' ? arg + 1 : arg;
+}
+
+static void usage(const char *prog) {
+    printf(COLOR_RED "Usage: %s [-k server-key] [-a socks-user:password] [-s] [-P] [-C ms] [-Z] <onion-hostname> <port>\n" COLOR_RESET, prog);
+    printf(COLOR_YELLOW "Example: %s abcdefghijklmnop.onion 12345\n" COLOR_RESET, prog);
+    printf("  -k server-key   Require this server key (printed by the server at startup)\n");
+    printf("  -a user:pass    SOCKS credentials; Tor gives each distinct pair its own circuit\n");
+    printf("  -s              Wait for each SOCKS reply instead of pipelining, for proxies that need it\n");
+    printf("  -P              Pad what is sent to whole Tor cells of %d bytes\n", FRAME_CELL_DATA);
+    printf("  -C ms           Send a cell of padding whenever nothing else went out for this long\n");
+    printf("  -Z              Do not ask the server to compress messages\n");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) { 
-        printf(COLOR_RED "Usage: %s <onion-hostname> <port>\n" COLOR_RESET, argv[0]); 
-        printf(COLOR_YELLOW "Example: %s abcdefghijklmnop.onion 12345\n" COLOR_RESET, argv[0]);
+    uint8_t pinned_key[NOISE_KEY_LEN];
+    const uint8_t *pinned = NULL;
+    const char *socks_auth = NULL;
+    int pipelined = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:a:sPC:Z")) != -1) {
+        switch (opt) {
+        case 'k':
+            if (parse_key(optarg, pinned_key) < 0) {
+                fprintf(stderr, COLOR_RED "Error: the server key must be %d hex digits\n" COLOR_RESET, 2 * NOISE_KEY_LEN);
+                return 1;
+            }
+            pinned = pinned_key;
+            break;
+        case 'a':
+            socks_auth = optarg;
+            break;
+        case 's':
+            pipelined = 0;
+            break;
+        case 'P':
+            pad_cells = 1;
+            break;
+        case 'C':
+            cover_ms = atoi(optarg);
+            if (cover_ms < COVER_MIN_MS) {
+                fprintf(stderr, COLOR_RED "Error: padding interval must be at least %d ms\n" COLOR_RESET, COVER_MIN_MS);
+                return 1;
+            }
+            break;
+        case 'Z':
+            offered &= ~FRAME_FEATURE_COMPRESS;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) { 
+        usage(argv[0]);
         return 1; 
     }
 
-    char *hostname = argv[1];
-    int port = atoi(argv[2]);
+    char *hostname = argv[optind];
+    int port = atoi(argv[optind + 1]);
 
     if (port <= 0 || port > 65535) {
         fprintf(stderr, COLOR_RED "Error: Invalid port number\n" COLOR_RESET);
@@ -246,29 +1082,40 @@ int main(int argc, char *argv[]) {
     printf(COLOR_YELLOW "Make sure Tor is running on %s:%d\n" COLOR_RESET, PROXY_HOST, PROXY_PORT);
 
     int sockfd;
-    char buffer[BUF_SIZE];
+    char *line = NULL;
+    size_t line_cap = 0;
+    struct frame_reader rx;
+    char user[256];
+    char password[BUF_SIZE];
+    struct server_target target = {
+        .host = hostname, .port = port, .socks_auth = socks_auth, .pipelined = pipelined, .pinned = pinned,
+    };
 
-    // Connect to Tor proxy
-    sockfd = connect_tcp(PROXY_HOST, PROXY_PORT);
-    if (sockfd < 0) { 
-        fprintf(stderr, COLOR_RED "Failed to connect to Tor proxy\n" COLOR_RESET);
-        exit(1); 
-    }
+    frame_reader_init(&rx);
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
 
-    if (socks5_connect_domain(sockfd, hostname, port) < 0) {
-        fprintf(stderr, COLOR_RED "SOCKS5 handshake failed\n" COLOR_RESET);
-        close(sockfd);
+    // Ask for the login first so nothing waits on the keyboard once the
+    // circuit is up
+    if (read_line("Enter user name: ", user, sizeof(user)) < 0 ||
+        read_line("Enter password: ", password, sizeof(password)) < 0) {
         exit(1);
     }
 
-    printf(COLOR_GREEN "✓ Connected to %s:%d via Tor\n" COLOR_RESET, hostname, port);
+    // Connect to the server through Tor
+    uint64_t started = now_ms();
+    sockfd = open_session(&target, &rx);
+    if (sockfd < 0) {
+        crypto_wipe(password, sizeof(password));
+        exit(1);
+    }
 
     // Authenticate with server
-    if (!authenticate_with_server(sockfd)) {
+    if (!authenticate_with_server(sockfd, &rx, user, password, 1)) {
         fprintf(stderr, COLOR_RED "Authentication failed\n" COLOR_RESET);
         close(sockfd);
         exit(1);
     }
+    printf(COLOR_GREEN "✓ Logged in %llu ms after connecting\n" COLOR_RESET, (unsigned long long)(now_ms() - started));
 
     // Print banner after successful authentication
     print_banner();
@@ -280,71 +1127,220 @@ int main(int argc, char *argv[]) {
 
     printf(COLOR_GREEN "You are now connected! Start chatting...\n\n" COLOR_RESET);
 
+    // Frames that arrived together with the authentication reply
+    if (show_frames(sockfd, &rx) < 0) {
+        close(sockfd);
+        exit(1);
+    }
+
+    if (request_history(sockfd, 0, HISTORY_ON_JOIN) < 0) {
+        perror("send");
+        close(sockfd);
+        exit(1);
+    }
+
+    // The prompt is printed again only after something else was, so a
+    // transfer waking the loop for every chunk leaves it alone
+    int prompted = 0;
     while (1) {
-        printf(COLOR_CYAN "You: " COLOR_RESET);
-        fflush(stdout);
+        if (!prompted) {
+            if (current_room[0]) printf(COLOR_CYAN "You #%s: " COLOR_RESET, current_room);
+            else printf(COLOR_CYAN "You: " COLOR_RESET);
+            fflush(stdout);
+            prompted = 1;
+        }
+
+        // Everything this pass queued goes out together before waiting
+        if (flush_output(sockfd) < 0) {
+            perror("send");
+            shutdown(sockfd, SHUT_RDWR);
+        }
 
         FD_ZERO(&readfds);
         FD_SET(sockfd, &readfds);
         FD_SET(STDIN_FILENO, &readfds);
 
-        if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
+        // Wake for the next heartbeat step, or padding with -C
+        uint64_t now = now_ms();
+        uint64_t due = ping_sent_ms ? ping_sent_ms + HEARTBEAT_TIMEOUT_MS : last_rx_ms + HEARTBEAT_MS;
+        if (cover_ms > 0 && last_write_ms + cover_ms < due) due = last_write_ms + cover_ms;
+        uint64_t wait = due > now ? due - now : 0;
+        struct timeval tv = { .tv_sec = wait / 1000, .tv_usec = wait % 1000 * 1000 };
+
+        int ready = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+        if (ready < 0) {
             perror("select");
             break;
         }
+        if (ready == 0) {
+            now = now_ms();
+            if (ping_sent_ms && now - ping_sent_ms >= HEARTBEAT_TIMEOUT_MS) {
+                // Tor may not notice a dead circuit for a long time; drop
+                // it, and the read below reconnects
+                printf(COLOR_RED "\nNo reply from the server in %llu s\n" COLOR_RESET,
+                       (unsigned long long)(now - last_rx_ms) / 1000);
+                shutdown(sockfd, SHUT_RDWR);
+                prompted = 0;
+            } else if (!ping_sent_ms && now - last_rx_ms >= HEARTBEAT_MS) {
+                send_frame(sockfd, FRAME_PING, NULL, 0);
+                ping_sent_ms = now;
+            } else if (cover_ms > 0 && now - last_write_ms >= (uint64_t)cover_ms) {
+                // Quiet for cover_ms: one cell of padding, flushed next pass
+                queue_padding(FRAME_CELL_DATA);
+            }
+            continue;
+        }
 
         // Check for incoming data from server
         if (FD_ISSET(sockfd, &readfds)) {
-            int n = recv(sockfd, buffer, BUF_SIZE - 1, 0);
-            if (n <= 0) {
+            if (frame_reader_fill(&rx, sockfd) > 0) {
+                last_rx_ms = now_ms();
+                ping_sent_ms = 0;
+            } else {
                 printf(COLOR_RED "\nServer disconnected\n" COLOR_RESET);
-                break;
-            }
-            buffer[n] = 0;
-            
-            // Clean the message for display
-            char *msg = buffer;
-            while (*msg && (msg[strlen(msg)-1] == '\n' || msg[strlen(msg)-1] == '\r')) {
-                msg[strlen(msg)-1] = 0;
+                close(sockfd);
+                sockfd = reconnect(&target, &rx, user);
+                if (sockfd < 0) break;
+                maxfd = (sockfd > STDIN_FILENO) ? sockfd : STDIN_FILENO;
+                if (rejoin_rooms(sockfd) < 0 || resume_transfers(sockfd) < 0) {
+                    perror("send");
+                    shutdown(sockfd, SHUT_RDWR);
+                }
+                prompted = 0;
             }
-            
-            // Clear the current "You: " line and show server message
-            printf("\r\033[K"); // Move to beginning of line and clear
-            printf(COLOR_BLUE "Server: %s\n" COLOR_RESET, msg);
+            int shown = show_frames(sockfd, &rx);
+            if (shown < 0) break;
+            if (shown) prompted = 0;
         }
 
         // Check for user input
         if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (!fgets(buffer, BUF_SIZE - 1, stdin)) break;
-            buffer[strcspn(buffer, "\n")] = 0;
+            ssize_t len = getline(&line, &line_cap, stdin);
+            if (len < 0) break;
+            prompted = 0;
+            line[strcspn(line, "\n")] = 0;
+            len = strlen(line);
             
-            if (strlen(buffer) > 0) {
+            if (len > 0) {
                 // Handle commands
-                if (strcmp(buffer, "/quit") == 0 || strcmp(buffer, "/exit") == 0) {
+                if (strcmp(line, "/quit") == 0 || strcmp(line, "/exit") == 0) {
                     printf(COLOR_YELLOW "Disconnecting...\n" COLOR_RESET);
                     break;
-                } else if (strcmp(buffer, "/help") == 0) {
+                } else if (strcmp(line, "/help") == 0) {
                     print_help();
                     continue;
-                } else if (strcmp(buffer, "/clear") == 0) {
+                } else if (strcmp(line, "/clear") == 0) {
                     printf("\033[2J\033[H"); // Clear screen
                     print_banner();
                     continue;
+                } else if (strncmp(line, "/history", 8) == 0 && (line[8] == 0 || line[8] == ' ')) {
+                    int n = line[8] ? atoi(line + 9) : HISTORY_DEFAULT;
+                    if (n <= 0) {
+                        printf(COLOR_RED "Usage: /history [number of messages]\n" COLOR_RESET);
+                    } else if (request_history(sockfd, 0, n) < 0) {
+                        perror("send");
+                        shutdown(sockfd, SHUT_RDWR);
+                    }
+                    continue;
+                } else if (strncmp(line, "/join ", 6) == 0) {
+                    const char *room = room_arg(line + 6);
+                    if (*room == 0 || strlen(room) > ROOM_NAME_MAX) {
+                        printf(COLOR_RED "Usage: /join room\n" COLOR_RESET);
+                    } else if (add_room(room) < 0) {
+                        printf(COLOR_RED "You are in %d rooms already; /leave one first\n" COLOR_RESET, MAX_ROOMS);
+                    } else {
+                        snprintf(current_room, sizeof(current_room), "%s", room);
+                        if (send_frame(sockfd, FRAME_JOIN, room, strlen(room)) < 0) {
+                            perror("send");
+                            shutdown(sockfd, SHUT_RDWR);
+                        }
+                    }
+                    continue;
+                } else if (strcmp(line, "/leave") == 0 || strncmp(line, "/leave ", 7) == 0) {
+                    char room[ROOM_NAME_MAX + 1];
+                    snprintf(room, sizeof(room), "%s", line[6] ? room_arg(line + 7) : current_room);
+                    if (!room[0]) {
+                        printf(COLOR_RED "You are in the lobby; /leave which room?\n" COLOR_RESET);
+                        continue;
+                    }
+                    forget_room(room);
+                    if (send_frame(sockfd, FRAME_LEAVE, room, strlen(room)) < 0) {
+                        perror("send");
+                        shutdown(sockfd, SHUT_RDWR);
+                    }
+                    continue;
+                } else if (strcmp(line, "/lobby") == 0) {
+                    current_room[0] = 0;
+                    continue;
+                } else if (strncmp(line, "/send ", 6) == 0) {
+                    char *path = line + 6 + strspn(line + 6, " ");
+                    char *to = strchr(path, ' ');
+                    char target[ROOM_NAME_MAX + 2];
+                    if (to) {
+                        *to++ = 0;
+                        to += strspn(to, " ");
+                    }
+                    if (!*path || (to && strlen(to) > ROOM_NAME_MAX + 1)) {
+                        printf(COLOR_RED "Usage: /send file [#room|user]\n" COLOR_RESET);
+                        continue;
+                    }
+                    if (to && *to) snprintf(target, sizeof(target), "%s", to);
+                    else if (current_room[0]) snprintf(target, sizeof(target), "#%s", current_room);
+                    else target[0] = 0;
+                    if (start_upload(sockfd, path, target) < 0) {
+                        perror("send");
+                        shutdown(sockfd, SHUT_RDWR);
+                    }
+                    continue;
+                } else if (strncmp(line, "/get ", 5) == 0) {
+                    if (start_download(sockfd, line + 5 + strspn(line + 5, " ")) < 0) {
+                        perror("send");
+                        shutdown(sockfd, SHUT_RDWR);
+                    }
+                    continue;
+                } else if (strncmp(line, "/msg ", 5) == 0) {
+                    char *to = line + 5 + strspn(line + 5, " ");
+                    char *text = strchr(to, ' ');
+                    if (!text || text - to > ROOM_NAME_MAX) {
+                        printf(COLOR_RED "Usage: /msg user text\n" COLOR_RESET);
+                        continue;
+                    }
+                    *text++ = 0;
+                    printf("\r\033[K");
+                    printf(COLOR_GREEN "[you -> %s] %s\n" COLOR_RESET, to, text);
+                    if (send_addressed(sockfd, FRAME_DIRECT, to, text, strlen(text)) < 0) {
+                        perror("send");
+                        shutdown(sockfd, SHUT_RDWR);
+                    }
+                    continue;
+                }
+
+                if (len > MAX_MESSAGE_LEN) {
+                    printf(COLOR_RED "Message too long (%zd bytes, max %d)\n" COLOR_RESET, len, MAX_MESSAGE_LEN);
+                    continue;
                 }
                 
                 // Clear the "You: " line and show what we sent
                 printf("\r\033[K"); // Move to beginning of line and clear
-                printf(COLOR_CYAN "You: %s\n" COLOR_RESET, buffer);
+                if (current_room[0]) printf(COLOR_CYAN "You #%s: %s\n" COLOR_RESET, current_room, line);
+                else printf(COLOR_CYAN "You: %s\n" COLOR_RESET, line);
                 
-                // Send message to server
-                if (send(sockfd, buffer, strlen(buffer), 0) < 0) {
+                // Send message to server. If the connection is gone, the
+                // next read sees it closed and reconnects.
+                int sent = current_room[0] ? send_addressed(sockfd, FRAME_ROOM, current_room, line, len)
+                                           : send_frame(sockfd, FRAME_CHAT, line, len);
+                if (sent < 0) {
                     perror("send");
-                    break;
+                    shutdown(sockfd, SHUT_RDWR);
                 }
             }
         }
     }
 
+    end_transfer(&upload);
+    end_transfer(&download);
+    free(line);
+    frame_reader_free(&rx);
     close(sockfd);
     printf(COLOR_GREEN "Connection closed.\n" COLOR_RESET);
     return 0;
@@ -0,0 +1,273 @@
+// compress.c
+// Dictionary LZ compression of frame payloads, see compress.h
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+// The shared dictionary. Matches are found at the last place a sequence
+// occurs, so the likeliest text goes at the end. Changing a byte of this
+// breaks compatibility with every binary built before: add a feature bit
+// for a new dictionary instead.
+static const char dictionary[] =
+    "file upload download link image photo picture screenshot video audio the document page "
+    "server client network connection relay circuit onion address key password account "
+    "bridge guard exit node hidden service tor browser update version release build bug fix "
+    "error problem issue crash works working broken restart reboot install config settings "
+    "Monday Tuesday Wednesday Thursday Friday Saturday Sunday morning afternoon evening night "
+    "tomorrow yesterday today tonight weekend minute minutes hour hours later soon again "
+    "really actually probably maybe definitely exactly totally pretty much just kind of "
+    "something anything everything nothing someone anyone everyone nobody somewhere "
+    "because before after about above again against between through during without "
+    "people person friend friends group room channel message messages chat talk talking "
+    "question answer think thought know knew want need like love hate feel feeling "
+    "interesting important different possible impossible available anyway already always "
+    "never sometimes usually though although however otherwise whatever whenever "
+    ", and the , but the , so the . The . I think . It is . That is "
+    " would be  could be  should be  might be  will be  has been  have been  had been "
+    " going to  want to  need to  have to  trying to  able to  used to  supposed to "
+    " in the  on the  at the  to the  for the  of the  from the  with the  and the  is the "
+    " I don't know  I'm not sure  I think so  I guess  I mean  you know  let me know "
+    " what do you think?  how are you?  what's up?  are you there?  is anyone here? "
+    " thank you  thanks!  no problem  sounds good  see you  good night  good morning "
+    " hello everyone  hi all  hey there  welcome back  lol  haha  yeah  okay  ok  sure "
+    "Authentication failed. Please try again. "
+    "Room names are 1 to 32 letters, digits, '.', '-' or '_'. "
+    "Could not join the room, try again later. "
+    "You are not in that room; /join it first. "
+    "Direct messages need a user name. "
+    "That file cannot be shared. The server lost part of that file. There is no such file. "
+    "You are sending too fast; your messages will be delayed. "
+    "Server is shutting down. Goodbye! "
+    " is offline and their mailbox is full. "
+    " is offline; the message will be delivered when they log in. "
+    " is not online. "
+    " messages arrived while you were away, the first at "
+    "Welcome to the secure chat server! Type your messages. "
+    "You are already in  rooms; leave one first. Joined #Left #";
+
+#define DICT_LEN (sizeof(dictionary) - 1)
+
+static uint16_t dict_table[1 << COMPRESS_DICT_HASH_BITS];   // Dictionary position + 1, or 0
+static pthread_once_t dict_once = PTHREAD_ONCE_INIT;
+static __thread unsigned char *scratch[2];                   // [history][payload], to compress and decompress
+static __thread struct compress_stream *blank;               // Stands in for the stream of a payload kept out of it
+
+#define SCRATCH_LEN (COMPRESS_HISTORY + FRAME_MAX_PLAINTEXT)
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash(uint32_t seq, int bits) {
+    return (seq * 2654435761u) >> (32 - bits);
+}
+
+static void dict_init(void) {
+    const unsigned char *d = (const unsigned char *)dictionary;
+    for (size_t i = 0; i + COMPRESS_MIN_MATCH <= DICT_LEN; i++) {
+        dict_table[hash(read32(d + i), COMPRESS_DICT_HASH_BITS)] = (uint16_t)(i + 1);
+    }
+}
+
+static unsigned char *get_scratch(int which) {
+    if (!scratch[which]) scratch[which] = malloc(SCRATCH_LEN);
+    return scratch[which];
+}
+
+// The stream a payload of this type is coded in: s itself for lobby chat,
+// otherwise an empty one, so that it reaches only the dictionary and
+// itself. Returns NULL if out of memory.
+static struct compress_stream *stream_for(struct compress_stream *s, uint8_t type) {
+    if (type == FRAME_CHAT) return s;
+    if (!blank && (blank = malloc(sizeof(*blank))) == NULL) return NULL;
+    blank->pos = 0;
+    blank->hist_len = 0;
+    memset(blank->table, 0, sizeof(blank->table));
+    return blank;
+}
+
+struct compress_stream *compress_stream_new(void) {
+    struct compress_stream *s = malloc(sizeof(*s));
+    if (!s) return NULL;
+
+    pthread_once(&dict_once, dict_init);
+    s->pos = 0;
+    s->hist_len = 0;
+    memset(s->table, 0, sizeof(s->table));
+    return s;
+}
+
+void compress_stream_free(struct compress_stream *s) {
+    free(s);
+}
+
+// Keep the last COMPRESS_HISTORY bytes of buf[0..end), which holds the old
+// history followed by the payload just added
+static void remember(struct compress_stream *s, const unsigned char *buf, size_t end, size_t added) {
+    size_t keep = end < COMPRESS_HISTORY ? end : COMPRESS_HISTORY;
+    memcpy(s->hist, buf + end - keep, keep);
+    s->hist_len = (uint32_t)keep;
+    s->pos += (uint32_t)added;
+}
+
+// Bytes equal at a and b, at most max
+static size_t common_len(const unsigned char *a, const unsigned char *b, size_t max) {
+    size_t n = 0;
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+// Length continuation bytes for a nibble of 15
+static unsigned char *put_length(unsigned char *op, size_t v) {
+    for (v -= 15; v >= 255; v -= 255) *op++ = 255;
+    *op++ = (unsigned char)v;
+    return op;
+}
+
+// Write one sequence: literals, then a match unless match_len is 0.
+// Returns NULL if it would reach end.
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end, const unsigned char *lit,
+                                   size_t lit_len, size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    size_t need = 1 + lit_len + (lit_len >= 15 ? lit_len / 255 + 1 : 0) +
+                  (match_len ? 2 + (ml >= 15 ? ml / 255 + 1 : 0) : 0);
+    if (need >= (size_t)(end - op)) return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) return op;
+
+    *token |= (unsigned char)(ml < 15 ? ml : 15);
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    if (ml >= 15) op = put_length(op, ml);
+    return op;
+}
+
+size_t compress_payload(struct compress_stream *s, uint8_t type, unsigned char *out, const unsigned char *in,
+                        size_t len) {
+    const unsigned char *dict = (const unsigned char *)dictionary;
+    unsigned char *buf = get_scratch(0);
+
+    s = stream_for(s, type);
+    if (!s || !buf || len < COMPRESS_MIN_LEN || len > FRAME_MAX_PLAINTEXT) return 0;
+
+    // The match finder works on the history and the payload as one buffer
+    size_t start = s->hist_len, end = start + len;
+    memcpy(buf, s->hist, start);
+    memcpy(buf + start, in, len);
+    uint16_t base = (uint16_t)(s->pos - start);     // Stream position of buf[0], low bits
+
+    unsigned char *op = out, *oend = out + len;
+    size_t anchor = start, i = start;
+    while (i + COMPRESS_MIN_MATCH <= end) {
+        uint32_t seq = read32(buf + i);
+        size_t best = 0, offset = 0;
+
+        // Earlier in the stream. A slot may be stale, even from a payload
+        // that went raw, but a match is checked against the buffer both
+        // sides share, so it only ever costs a miss.
+        unsigned int slot = hash(seq, COMPRESS_HASH_BITS);
+        size_t dist = (uint16_t)(base + i - s->table[slot]);
+        s->table[slot] = (uint16_t)(base + i);
+        if (dist > 0 && dist <= i && read32(buf + i - dist) == seq) {
+            best = COMPRESS_MIN_MATCH + common_len(buf + i - dist + COMPRESS_MIN_MATCH, buf + i + COMPRESS_MIN_MATCH,
+                                                   end - i - COMPRESS_MIN_MATCH);
+            offset = dist;
+        }
+
+        // In the dictionary, which lies before the stream
+        size_t d = dict_table[hash(seq, COMPRESS_DICT_HASH_BITS)];
+        if (d-- && d + COMPRESS_MIN_MATCH <= DICT_LEN && read32(dict + d) == seq && i + DICT_LEN - d <= UINT16_MAX) {
+            size_t max = DICT_LEN - d < end - i ? DICT_LEN - d : end - i;
+            size_t n = COMPRESS_MIN_MATCH + common_len(dict + d + COMPRESS_MIN_MATCH, buf + i + COMPRESS_MIN_MATCH,
+                                                       max - COMPRESS_MIN_MATCH);
+            if (n > best) {
+                best = n;
+                offset = i + DICT_LEN - d;
+            }
+        }
+
+        if (!best) {
+            i++;
+            continue;
+        }
+        op = put_sequence(op, oend, buf + anchor, i - anchor, offset, best);
+        if (!op) return 0;
+        for (size_t k = i + 1; k < i + best && k + COMPRESS_MIN_MATCH <= end; k++) {
+            s->table[hash(read32(buf + k), COMPRESS_HASH_BITS)] = (uint16_t)(base + k);
+        }
+        i += best;
+        anchor = i;
+    }
+    if (anchor < end) {
+        op = put_sequence(op, oend, buf + anchor, end - anchor, 0, 0);
+        if (!op) return 0;
+    }
+
+    remember(s, buf, end, len);
+    return (size_t)(op - out);
+}
+
+// A length nibble of 15 continued. Returns -1 if the input runs out.
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *v) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *v += b;
+    } while (b == 255 && *v <= FRAME_MAX_PLAINTEXT);
+    return 0;
+}
+
+const unsigned char *decompress_payload(struct compress_stream *s, uint8_t type, const unsigned char *in, size_t len,
+                                        size_t *out_len) {
+    const unsigned char *dict = (const unsigned char *)dictionary;
+    const unsigned char *ip = in, *iend = in + len;
+    unsigned char *buf = get_scratch(1);
+
+    s = stream_for(s, type);
+    if (!s || !buf || len == 0) return NULL;
+
+    size_t start = s->hist_len, op = start, cap = start + FRAME_MAX_PLAINTEXT;
+    memcpy(buf, s->hist, start);
+
+    for (;;) {
+        unsigned char token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) < 0) return NULL;
+        if (lit_len > (size_t)(iend - ip) || lit_len > cap - op) return NULL;
+        memcpy(buf + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return NULL;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) < 0) return NULL;
+        match_len += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > op + DICT_LEN || match_len > cap - op) return NULL;
+
+        // Bytes before the start of the buffer come from the dictionary;
+        // the rest may overlap what is being written, so go byte by byte
+        size_t from = op + DICT_LEN - offset;
+        for (; match_len > 0 && from < DICT_LEN; match_len--) buf[op++] = dict[from++];
+        for (from -= DICT_LEN; match_len > 0; match_len--) buf[op++] = buf[from++];
+        if (ip == iend) break;
+    }
+
+    remember(s, buf, op, op - start);
+    *out_len = op - start;
+    return buf + start;
+}
@@ -0,0 +1,87 @@
+// compress.h
+// Frame compression against a built-in dictionary, for a session where
+// every byte crosses Tor
+//
+// Chat lines are short, and a general-purpose compressor starting from
+// nothing finds little to work with in eighty bytes. These are compressed
+// instead with a small LZ77 coder whose matches can reach into two places
+// the receiver also has: a dictionary of chat words, phrases and server
+// notices built into every binary, and, for lobby chat, the last
+// COMPRESS_HISTORY bytes of lobby chat sent compressed in the same
+// direction of the same session. A greeting that was typed before, a user
+// name that keeps recurring or a notice the server sends every time
+// shrinks to a few bytes.
+//
+// Each direction of a session has its own compress_stream, one on the
+// sending side and one on the receiving side, which must see the same
+// payloads in the same order. Only lobby chat that actually went out as
+// FRAME_COMPRESSED is added to it, so the sender may still send any frame
+// raw. The encoding is LZ4's sequence format: a token whose high nibble is
+// the literal count and low nibble the match length less
+// COMPRESS_MIN_MATCH, 15 in either continuing in further bytes of 255 and
+// a final smaller one, then the literals, then the match offset as two
+// little-endian bytes. Offsets count back through the output, then the
+// history, then the dictionary, as if they were one buffer. The last
+// sequence has literals only.
+//
+// Compressing text alongside anything secret would let someone who can
+// both inject text and watch frame sizes guess the secret a byte at a
+// time, so only frames that carry chat and notices are eligible, and only
+// lobby chat, which every user sees anyway, shares the stream. Room and
+// direct messages come from many senders down one connection, and a
+// notice may say what the user did: each of those is coded against the
+// dictionary and itself alone, so what one sender writes never shortens
+// another's. Logins, tickets and files are never compressed.
+//
+// A stream belongs to one thread at a time. The scratch buffer the coder
+// works in is per thread.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#define COMPRESS_HISTORY 4096        // Earlier payload bytes matches may refer back to
+#define COMPRESS_HASH_BITS 10        // Stream match finder: 1024 slots
+#define COMPRESS_DICT_HASH_BITS 12   // Dictionary match finder: 4096 slots
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MIN_LEN 32          // Payloads shorter than this always go raw
+
+struct compress_stream {
+    uint32_t pos;                                  // Payload bytes added so far, modulo 2^32
+    uint32_t hist_len;
+    uint16_t table[1 << COMPRESS_HASH_BITS];       // Low 16 bits of pos at recent 4-byte sequences
+    unsigned char hist[COMPRESS_HISTORY];
+};
+
+// Returns NULL if out of memory
+struct compress_stream *compress_stream_new(void);
+void compress_stream_free(struct compress_stream *s);
+
+// Whether a frame of this type and payload length is worth compressing
+static inline int compress_eligible(uint8_t type, size_t len) {
+    if (len < COMPRESS_MIN_LEN || len >= FRAME_MAX_PLAINTEXT) return 0;
+    return type == FRAME_CHAT || type == FRAME_NOTICE || type == FRAME_ROOM || type == FRAME_DIRECT;
+}
+
+// Compress len bytes of in, the payload of a frame of this type, into
+// out, which needs room for len bytes, and add lobby chat to the stream.
+// Returns the compressed length, or 0 if it would not come out shorter;
+// the frame should then go raw. The stream's history is then unchanged,
+// though its match finder may point at the discarded payload, which costs
+// the next payload no more than a missed match.
+size_t compress_payload(struct compress_stream *s, uint8_t type, unsigned char *out, const unsigned char *in,
+                        size_t len);
+
+// Decompress len bytes of in, the payload of a frame of this type, and add
+// lobby chat to the stream. Returns the payload, in a per-thread buffer
+// valid until the next call on this thread, with its length in *out_len,
+// or NULL if the input is malformed or would decompress past
+// FRAME_MAX_PLAINTEXT bytes.
+const unsigned char *decompress_payload(struct compress_stream *s, uint8_t type, const unsigned char *in, size_t len,
+                                        size_t *out_len);
+
+#endif
@@ -0,0 +1,166 @@
+// creds.c
+// Credential file and lookup table, see creds.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crypto.h"
+#include "creds.h"
+
+int creds_valid_user(const char *user, size_t len) {
+    if (len == 0 || len > CREDS_MAX_USER) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char ch = user[i];
+        int ok = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+                 ch == '.' || ch == '-' || ch == '_';
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+// FNV-1a
+static uint64_t hash_user(const char *user, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)user[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Linear probing; the table is at most half full so a free slot always ends
+// the probe
+static struct cred *find_slot(const struct cred_table *t, const char *user, size_t len) {
+    unsigned int i = (unsigned int)hash_user(user, len) & t->mask;
+
+    while (t->slots[i].user[0]) {
+        if (strlen(t->slots[i].user) == len && memcmp(t->slots[i].user, user, len) == 0) break;
+        i = (i + 1) & t->mask;
+    }
+    return &t->slots[i];
+}
+
+const struct cred *creds_lookup(const struct cred_table *t, const char *user, size_t len) {
+    if (!t || !creds_valid_user(user, len)) return NULL;
+    const struct cred *c = find_slot(t, user, len);
+    return c->user[0] ? c : NULL;
+}
+
+void creds_free(struct cred_table *t) {
+    if (!t) return;
+    crypto_wipe(t->slots, (t->mask + 1) * sizeof(*t->slots));
+    free(t->slots);
+    free(t);
+}
+
+// Split "user:hash" in place. Returns -1 for a malformed line.
+static int parse_line(char *line, char **user, char **hash) {
+    line[strcspn(line, "\r\n")] = 0;
+    char *colon = strchr(line, ':');
+    if (!colon) return -1;
+    *colon = 0;
+    *user = line;
+    *hash = colon + 1;
+    return creds_valid_user(*user, strlen(*user)) ? 0 : -1;
+}
+
+static int is_blank(const char *line) {
+    line += strspn(line, " \t\r\n");
+    return *line == 0 || *line == '#';
+}
+
+struct cred_table *creds_load(const char *path) {
+    char line[CREDS_LINE_MAX];
+    unsigned int lines = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    while (fgets(line, sizeof(line), fp)) lines++;
+
+    struct cred_table *t = calloc(1, sizeof(*t));
+    unsigned int cap = 16;
+    while (cap < lines * 2) cap *= 2;
+    if (t) t->slots = calloc(cap, sizeof(*t->slots));
+    if (!t || !t->slots) {
+        free(t);
+        fclose(fp);
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->mask = cap - 1;
+
+    rewind(fp);
+    for (int lineno = 1; fgets(line, sizeof(line), fp); lineno++) {
+        char *user, *hash;
+        struct argon2_params params;
+
+        if (is_blank(line)) continue;
+        if (parse_line(line, &user, &hash) < 0 || argon2id_decode(&params, hash) < 0) {
+            fprintf(stderr, "%s:%d: not a valid user:argon2id entry, skipped\n", path, lineno);
+            continue;
+        }
+
+        struct cred *c = find_slot(t, user, strlen(user));
+        if (c->user[0]) {
+            fprintf(stderr, "%s:%d: duplicate user %s, later entry wins\n", path, lineno, user);
+        } else {
+            t->count++;
+        }
+        snprintf(c->user, sizeof(c->user), "%s", user);
+        c->params = params;
+    }
+
+    crypto_wipe(line, sizeof(line));
+    fclose(fp);
+    return t;
+}
+
+int creds_set(const char *path, const char *user, const char *password) {
+    char encoded[ARGON2_ENCODED_LEN];
+    char tmp_path[4096];
+    char line[CREDS_LINE_MAX];
+    int replaced = 0;
+
+    if (!creds_valid_user(user, strlen(user))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (argon2id_hash_encoded(encoded, sizeof(encoded), password, strlen(password)) < 0) return -1;
+
+    // Rewrite into a temporary file and rename it over the original, so a
+    // server reloading concurrently never reads a half-written file
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    mode_t old_mask = umask(077);
+    FILE *out = fopen(tmp_path, "w");
+    umask(old_mask);
+    if (!out) return -1;
+
+    FILE *in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            char copy[CREDS_LINE_MAX];
+            char *name, *hash;
+
+            memcpy(copy, line, sizeof(copy));
+            if (!is_blank(line) && parse_line(copy, &name, &hash) == 0 && strcmp(name, user) == 0) {
+                if (!replaced) fprintf(out, "%s:%s\n", user, encoded);
+                replaced = 1;
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    if (!replaced) fprintf(out, "%s:%s\n", user, encoded);
+
+    if (fclose(out) != 0 || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+// creds.h
+// User accounts: Argon2id hashes loaded from a text file into an
+// open-addressing hash table
+//
+// The file holds one account per line, blank lines and # comments aside:
+//
+//   alice:$argon2id$v=19$m=19456,t=2,p=1$<salt>$<hash>
+//
+// A loaded table is immutable, so a reload builds a new one and swaps it
+// in; lookups only ever see a complete table.
+
+#ifndef CREDS_H
+#define CREDS_H
+
+#include <stddef.h>
+
+#include "argon2.h"
+
+#define CREDS_MAX_USER 32             // Longest user name
+#define CREDS_LINE_MAX 512
+
+struct cred {
+    char user[CREDS_MAX_USER + 1];    // Empty for a free slot
+    struct argon2_params params;
+};
+
+struct cred_table {
+    struct cred *slots;
+    unsigned int mask;                // Slot count minus one, a power of two
+    unsigned int count;
+};
+
+// Names are 1 to CREDS_MAX_USER letters, digits, '.', '-' or '_'
+int creds_valid_user(const char *user, size_t len);
+
+// Load every valid account from path, warning about lines that are not.
+// Returns NULL if the file cannot be read.
+struct cred_table *creds_load(const char *path);
+void creds_free(struct cred_table *t);
+
+const struct cred *creds_lookup(const struct cred_table *t, const char *user, size_t len);
+
+// Add an account, or change its password if it exists, by rewriting the
+// file. Returns -1 on failure.
+int creds_set(const char *path, const char *user, const char *password);
+
+#endif
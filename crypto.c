@@ -0,0 +1,722 @@
+// crypto.c
+// ChaCha20-Poly1305, X25519 and BLAKE2b, see crypto.h
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#include "crypto.h"
+
+static inline uint32_t load32_le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint64_t load64_le(const uint8_t *p) {
+    return (uint64_t)load32_le(p) | ((uint64_t)load32_le(p + 4) << 32);
+}
+
+static inline void store64_le(uint8_t *p, uint64_t v) {
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+// ---------------------------------------------------------------------------
+// ChaCha20
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                      \
+    a += b; d ^= a; d = ROTL32(d, 16);                \
+    c += d; b ^= c; b = ROTL32(b, 12);                \
+    a += b; d ^= a; d = ROTL32(d, 8);                 \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_block(const uint32_t state[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        store32_le(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+static size_t chacha20_blocks_portable(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks) {
+    uint8_t ks[64];
+
+    for (size_t b = 0; b < nblocks; b++) {
+        chacha20_block(state, ks);
+        for (int i = 0; i < 64; i++) out[i] = in[i] ^ ks[i];
+        state[12]++;
+        in += 64;
+        out += 64;
+    }
+    crypto_wipe(ks, sizeof(ks));
+    return nblocks;
+}
+
+static size_t (*chacha20_blocks)(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks) = chacha20_blocks_portable;
+static enum chacha20_impl chacha20_active = CHACHA20_PORTABLE;
+
+int chacha20_select(enum chacha20_impl impl) {
+    __builtin_cpu_init();
+
+    switch (impl) {
+    case CHACHA20_AVX2:
+        if (!__builtin_cpu_supports("avx2")) return 0;
+        chacha20_blocks = chacha20_blocks_avx2;
+        break;
+    case CHACHA20_SSE2:
+        if (!__builtin_cpu_supports("sse2")) return 0;
+        chacha20_blocks = chacha20_blocks_sse2;
+        break;
+    default:
+        chacha20_blocks = chacha20_blocks_portable;
+        break;
+    }
+    chacha20_active = impl;
+    return 1;
+}
+
+enum chacha20_impl chacha20_current(void) {
+    return chacha20_active;
+}
+
+const char *chacha20_impl_name(enum chacha20_impl impl) {
+    switch (impl) {
+    case CHACHA20_AVX2: return "avx2";
+    case CHACHA20_SSE2: return "sse2";
+    default: return "portable";
+    }
+}
+
+// Pick the widest kernel the CPU supports before any thread starts
+__attribute__((constructor))
+static void chacha20_dispatch_init(void) {
+    if (!chacha20_select(CHACHA20_AVX2) && !chacha20_select(CHACHA20_SSE2)) {
+        chacha20_select(CHACHA20_PORTABLE);
+    }
+}
+
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len,
+                  const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN],
+                  uint32_t counter) {
+    uint32_t state[16];
+
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) state[4 + i] = load32_le(key + 4 * i);
+    state[12] = counter;
+    state[13] = load32_le(nonce);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
+
+    size_t nblocks = len / 64;
+    size_t done = chacha20_blocks(state, out, in, nblocks);
+    // Kernels only take whole vectors of blocks; an AVX2 remainder of four
+    // or more still fills an SSE2 vector, the rest is finished here
+    if (chacha20_active == CHACHA20_AVX2) {
+        done += chacha20_blocks_sse2(state, out + 64 * done, in + 64 * done, nblocks - done);
+    }
+    chacha20_blocks_portable(state, out + 64 * done, in + 64 * done, nblocks - done);
+
+    size_t tail = len % 64;
+    if (tail) {
+        uint8_t ks[64];
+        size_t off = len - tail;
+        chacha20_block(state, ks);
+        for (size_t i = 0; i < tail; i++) out[off + i] = in[off + i] ^ ks[i];
+        crypto_wipe(ks, sizeof(ks));
+    }
+    crypto_wipe(state, sizeof(state));
+}
+
+// ---------------------------------------------------------------------------
+// Poly1305, 44/44/42-bit limbs with 128-bit products
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+typedef unsigned __int128 u128;
+
+void poly1305_init(struct poly1305_ctx *ctx, const uint8_t key[32]) {
+    uint64_t t0 = load64_le(key);
+    uint64_t t1 = load64_le(key + 8);
+
+    // Clamp r as the spec requires
+    ctx->r[0] = t0 & 0xffc0fffffffULL;
+    ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+    ctx->pad[0] = load64_le(key + 16);
+    ctx->pad[1] = load64_le(key + 24);
+    ctx->leftover = 0;
+    ctx->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305_ctx *ctx, const uint8_t *m, size_t len) {
+    const uint64_t hibit = ctx->final ? 0 : (1ULL << 40);
+    uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    uint64_t s1 = r1 * (5 << 2);
+    uint64_t s2 = r2 * (5 << 2);
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+
+    while (len >= 16) {
+        uint64_t t0 = load64_le(m);
+        uint64_t t1 = load64_le(m + 8);
+
+        h0 += t0 & MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+        h2 += ((t1 >> 24) & MASK42) | hibit;
+
+        u128 d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+        u128 d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+        u128 d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & MASK44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & MASK44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= MASK44;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+}
+
+void poly1305_update(struct poly1305_ctx *ctx, const uint8_t *m, size_t len) {
+    if (ctx->leftover) {
+        size_t want = 16 - ctx->leftover;
+        if (want > len) want = len;
+        memcpy(ctx->buffer + ctx->leftover, m, want);
+        ctx->leftover += want;
+        m += want;
+        len -= want;
+        if (ctx->leftover < 16) return;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+        ctx->leftover = 0;
+    }
+
+    size_t whole = len & ~(size_t)15;
+    if (whole) {
+        poly1305_blocks(ctx, m, whole);
+        m += whole;
+        len -= whole;
+    }
+
+    if (len) {
+        memcpy(ctx->buffer, m, len);
+        ctx->leftover = len;
+    }
+}
+
+void poly1305_final(struct poly1305_ctx *ctx, uint8_t mac[POLY1305_TAG_LEN]) {
+    if (ctx->leftover) {
+        size_t i = ctx->leftover;
+        ctx->buffer[i++] = 1;
+        memset(ctx->buffer + i, 0, 16 - i);
+        ctx->final = 1;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+    }
+
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint64_t c;
+
+    // Fully carry h
+    c = h1 >> 44; h1 &= MASK44;
+    h2 += c; c = h2 >> 42; h2 &= MASK42;
+    h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+    h1 += c; c = h1 >> 44; h1 &= MASK44;
+    h2 += c; c = h2 >> 42; h2 &= MASK42;
+    h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+    h1 += c;
+
+    // g = h + -p
+    uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= MASK44;
+    uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= MASK44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+
+    // Select h if h < p, otherwise g
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    // h = (h + pad) mod 2^128
+    uint64_t t0 = ctx->pad[0];
+    uint64_t t1 = ctx->pad[1];
+    h0 += t0 & MASK44; c = h0 >> 44; h0 &= MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c; c = h1 >> 44; h1 &= MASK44;
+    h2 += ((t1 >> 24) & MASK42) + c; h2 &= MASK42;
+
+    store64_le(mac, h0 | (h1 << 44));
+    store64_le(mac + 8, (h1 >> 20) | (h2 << 24));
+
+    crypto_wipe(ctx, sizeof(*ctx));
+}
+
+// ---------------------------------------------------------------------------
+// ChaCha20-Poly1305 AEAD
+
+static const uint8_t zero_pad[16];
+
+static void aead_mac(uint8_t tag[POLY1305_TAG_LEN], const uint8_t *ct, size_t len,
+                     const uint8_t *ad, size_t ad_len,
+                     const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN]) {
+    uint8_t block0[64] = {0};
+    uint8_t lens[16];
+    struct poly1305_ctx ctx;
+
+    // The one-time Poly1305 key is the first half of keystream block 0
+    chacha20_xor(block0, block0, sizeof(block0), key, nonce, 0);
+    poly1305_init(&ctx, block0);
+
+    poly1305_update(&ctx, ad, ad_len);
+    poly1305_update(&ctx, zero_pad, (16 - ad_len % 16) % 16);
+    poly1305_update(&ctx, ct, len);
+    poly1305_update(&ctx, zero_pad, (16 - len % 16) % 16);
+    store64_le(lens, ad_len);
+    store64_le(lens + 8, len);
+    poly1305_update(&ctx, lens, sizeof(lens));
+    poly1305_final(&ctx, tag);
+
+    crypto_wipe(block0, sizeof(block0));
+}
+
+void aead_seal(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *ad, size_t ad_len,
+               const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN]) {
+    chacha20_xor(out, in, len, key, nonce, 1);
+    aead_mac(out + len, out, len, ad, ad_len, key, nonce);
+}
+
+int aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *ad, size_t ad_len,
+              const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN]) {
+    uint8_t tag[POLY1305_TAG_LEN];
+
+    aead_mac(tag, in, len, ad, ad_len, key, nonce);
+    if (!crypto_memeq(tag, in + len, POLY1305_TAG_LEN)) return -1;
+
+    chacha20_xor(out, in, len, key, nonce, 1);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// X25519, radix 2^51 field arithmetic
+
+#define MASK51 0x7ffffffffffffULL
+
+typedef uint64_t fe[5];
+
+static void fe_copy(fe out, const fe a) {
+    memcpy(out, a, sizeof(fe));
+}
+
+static void fe_add(fe out, const fe a, const fe b) {
+    for (int i = 0; i < 5; i++) out[i] = a[i] + b[i];
+}
+
+// a - b, biased by 2p so limbs never go negative
+static void fe_sub(fe out, const fe a, const fe b) {
+    out[0] = a[0] + 0xfffffffffffdaULL - b[0];
+    out[1] = a[1] + 0xffffffffffffeULL - b[1];
+    out[2] = a[2] + 0xffffffffffffeULL - b[2];
+    out[3] = a[3] + 0xffffffffffffeULL - b[3];
+    out[4] = a[4] + 0xffffffffffffeULL - b[4];
+}
+
+static void fe_carry(fe out, u128 t[5]) {
+    uint64_t c;
+    out[0] = (uint64_t)t[0] & MASK51; c = (uint64_t)(t[0] >> 51);
+    t[1] += c; out[1] = (uint64_t)t[1] & MASK51; c = (uint64_t)(t[1] >> 51);
+    t[2] += c; out[2] = (uint64_t)t[2] & MASK51; c = (uint64_t)(t[2] >> 51);
+    t[3] += c; out[3] = (uint64_t)t[3] & MASK51; c = (uint64_t)(t[3] >> 51);
+    t[4] += c; out[4] = (uint64_t)t[4] & MASK51; c = (uint64_t)(t[4] >> 51);
+    out[0] += c * 19;
+    out[1] += out[0] >> 51;
+    out[0] &= MASK51;
+}
+
+static void fe_mul(fe out, const fe a, const fe b) {
+    uint64_t a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3], a4 = a[4];
+    uint64_t b0 = b[0], b1 = b[1], b2 = b[2], b3 = b[3], b4 = b[4];
+    uint64_t b1_19 = b1 * 19, b2_19 = b2 * 19, b3_19 = b3 * 19, b4_19 = b4 * 19;
+    u128 t[5];
+
+    t[0] = (u128)a0 * b0 + (u128)a1 * b4_19 + (u128)a2 * b3_19 + (u128)a3 * b2_19 + (u128)a4 * b1_19;
+    t[1] = (u128)a0 * b1 + (u128)a1 * b0 + (u128)a2 * b4_19 + (u128)a3 * b3_19 + (u128)a4 * b2_19;
+    t[2] = (u128)a0 * b2 + (u128)a1 * b1 + (u128)a2 * b0 + (u128)a3 * b4_19 + (u128)a4 * b3_19;
+    t[3] = (u128)a0 * b3 + (u128)a1 * b2 + (u128)a2 * b1 + (u128)a3 * b0 + (u128)a4 * b4_19;
+    t[4] = (u128)a0 * b4 + (u128)a1 * b3 + (u128)a2 * b2 + (u128)a3 * b1 + (u128)a4 * b0;
+    fe_carry(out, t);
+}
+
+static void fe_sq(fe out, const fe a) {
+    fe_mul(out, a, a);
+}
+
+static void fe_sq_n(fe out, const fe a, int n) {
+    fe_sq(out, a);
+    for (int i = 1; i < n; i++) fe_sq(out, out);
+}
+
+static void fe_mul_small(fe out, const fe a, uint64_t k) {
+    u128 t[5];
+    for (int i = 0; i < 5; i++) t[i] = (u128)a[i] * k;
+    fe_carry(out, t);
+}
+
+// z^(p-2)
+static void fe_invert(fe out, const fe z) {
+    fe z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+
+    fe_sq(z2, z);
+    fe_sq_n(t, z2, 2);
+    fe_mul(z9, t, z);
+    fe_mul(z11, z9, z2);
+    fe_sq(t, z11);
+    fe_mul(z2_5_0, t, z9);
+    fe_sq_n(t, z2_5_0, 5);
+    fe_mul(z2_10_0, t, z2_5_0);
+    fe_sq_n(t, z2_10_0, 10);
+    fe_mul(z2_20_0, t, z2_10_0);
+    fe_sq_n(t, z2_20_0, 20);
+    fe_mul(t, t, z2_20_0);
+    fe_sq_n(t, t, 10);
+    fe_mul(z2_50_0, t, z2_10_0);
+    fe_sq_n(t, z2_50_0, 50);
+    fe_mul(z2_100_0, t, z2_50_0);
+    fe_sq_n(t, z2_100_0, 100);
+    fe_mul(t, t, z2_100_0);
+    fe_sq_n(t, t, 50);
+    fe_mul(t, t, z2_50_0);
+    fe_sq_n(t, t, 5);
+    fe_mul(out, t, z11);
+}
+
+static void fe_cswap(fe a, fe b, uint64_t swap) {
+    uint64_t mask = 0 - swap;
+    for (int i = 0; i < 5; i++) {
+        uint64_t x = mask & (a[i] ^ b[i]);
+        a[i] ^= x;
+        b[i] ^= x;
+    }
+}
+
+static void fe_frombytes(fe out, const uint8_t in[32]) {
+    out[0] = load64_le(in) & MASK51;
+    out[1] = (load64_le(in + 6) >> 3) & MASK51;
+    out[2] = (load64_le(in + 12) >> 6) & MASK51;
+    out[3] = (load64_le(in + 19) >> 1) & MASK51;
+    out[4] = (load64_le(in + 24) >> 12) & MASK51;
+}
+
+static void fe_tobytes(uint8_t out[32], const fe a) {
+    uint64_t t[5];
+    fe_copy(t, a);
+
+    // Two full carry passes leave 0 <= t < 2^255
+    for (int pass = 0; pass < 2; pass++) {
+        t[1] += t[0] >> 51; t[0] &= MASK51;
+        t[2] += t[1] >> 51; t[1] &= MASK51;
+        t[3] += t[2] >> 51; t[2] &= MASK51;
+        t[4] += t[3] >> 51; t[3] &= MASK51;
+        t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;
+    }
+
+    // Offset by 19 so values in [p, 2^255) wrap, then subtract it back
+    t[0] += 19;
+    t[1] += t[0] >> 51; t[0] &= MASK51;
+    t[2] += t[1] >> 51; t[1] &= MASK51;
+    t[3] += t[2] >> 51; t[2] &= MASK51;
+    t[4] += t[3] >> 51; t[3] &= MASK51;
+    t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;
+
+    t[0] += 0x8000000000000ULL - 19;
+    t[1] += 0x8000000000000ULL - 1;
+    t[2] += 0x8000000000000ULL - 1;
+    t[3] += 0x8000000000000ULL - 1;
+    t[4] += 0x8000000000000ULL - 1;
+
+    t[1] += t[0] >> 51; t[0] &= MASK51;
+    t[2] += t[1] >> 51; t[1] &= MASK51;
+    t[3] += t[2] >> 51; t[2] &= MASK51;
+    t[4] += t[3] >> 51; t[3] &= MASK51;
+    t[4] &= MASK51;
+
+    store64_le(out, t[0] | (t[1] << 51));
+    store64_le(out + 8, (t[1] >> 13) | (t[2] << 38));
+    store64_le(out + 16, (t[2] >> 26) | (t[3] << 25));
+    store64_le(out + 24, (t[3] >> 39) | (t[4] << 12));
+}
+
+void x25519(uint8_t out[X25519_LEN], const uint8_t scalar[X25519_LEN], const uint8_t point[X25519_LEN]) {
+    uint8_t k[32];
+    fe x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb, t;
+    uint64_t swap = 0;
+
+    memcpy(k, scalar, 32);
+    k[0] &= 248;
+    k[31] &= 127;
+    k[31] |= 64;
+
+    fe_frombytes(x1, point);
+    memset(x2, 0, sizeof(fe)); x2[0] = 1;
+    memset(z2, 0, sizeof(fe));
+    fe_copy(x3, x1);
+    memset(z3, 0, sizeof(fe)); z3[0] = 1;
+
+    // Montgomery ladder, RFC 7748 section 5
+    for (int pos = 254; pos >= 0; pos--) {
+        uint64_t bit = (k[pos / 8] >> (pos & 7)) & 1;
+        swap ^= bit;
+        fe_cswap(x2, x3, swap);
+        fe_cswap(z2, z3, swap);
+        swap = bit;
+
+        fe_add(a, x2, z2);
+        fe_sq(aa, a);
+        fe_sub(b, x2, z2);
+        fe_sq(bb, b);
+        fe_sub(e, aa, bb);
+        fe_add(c, x3, z3);
+        fe_sub(d, x3, z3);
+        fe_mul(da, d, a);
+        fe_mul(cb, c, b);
+
+        fe_add(t, da, cb);
+        fe_sq(x3, t);
+        fe_sub(t, da, cb);
+        fe_sq(t, t);
+        fe_mul(z3, x1, t);
+
+        fe_mul(x2, aa, bb);
+        fe_mul_small(t, e, 121665);
+        fe_add(t, aa, t);
+        fe_mul(z2, e, t);
+    }
+    fe_cswap(x2, x3, swap);
+    fe_cswap(z2, z3, swap);
+
+    fe_invert(z2, z2);
+    fe_mul(x2, x2, z2);
+    fe_tobytes(out, x2);
+
+    crypto_wipe(k, sizeof(k));
+}
+
+void x25519_public(uint8_t pub[X25519_LEN], const uint8_t priv[X25519_LEN]) {
+    static const uint8_t base[32] = { 9 };
+    x25519(pub, priv, base);
+}
+
+// ---------------------------------------------------------------------------
+// BLAKE2b
+
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define ROTR64(v, n) (((v) >> (n)) | ((v) << (64 - (n))))
+
+#define B2B_G(a, b, c, d, x, y)                       \
+    v[a] = v[a] + v[b] + (x); v[d] = ROTR64(v[d] ^ v[a], 32); \
+    v[c] = v[c] + v[d];       v[b] = ROTR64(v[b] ^ v[c], 24); \
+    v[a] = v[a] + v[b] + (y); v[d] = ROTR64(v[d] ^ v[a], 16); \
+    v[c] = v[c] + v[d];       v[b] = ROTR64(v[b] ^ v[c], 63);
+
+static void blake2b_compress(struct blake2b_ctx *ctx, int last) {
+    uint64_t v[16], m[16];
+
+    for (int i = 0; i < 8; i++) {
+        v[i] = ctx->h[i];
+        v[i + 8] = blake2b_iv[i];
+    }
+    v[12] ^= ctx->t[0];
+    v[13] ^= ctx->t[1];
+    if (last) v[14] = ~v[14];
+
+    for (int i = 0; i < 16; i++) m[i] = load64_le(ctx->buf + 8 * i);
+
+    for (int r = 0; r < 12; r++) {
+        const uint8_t *s = blake2b_sigma[r];
+        B2B_G(0, 4,  8, 12, m[s[0]],  m[s[1]]);
+        B2B_G(1, 5,  9, 13, m[s[2]],  m[s[3]]);
+        B2B_G(2, 6, 10, 14, m[s[4]],  m[s[5]]);
+        B2B_G(3, 7, 11, 15, m[s[6]],  m[s[7]]);
+        B2B_G(0, 5, 10, 15, m[s[8]],  m[s[9]]);
+        B2B_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        B2B_G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+        B2B_G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) ctx->h[i] ^= v[i] ^ v[i + 8];
+}
+
+void blake2b_init(struct blake2b_ctx *ctx, size_t out_len, const void *key, size_t key_len) {
+    memset(ctx, 0, sizeof(*ctx));
+    for (int i = 0; i < 8; i++) ctx->h[i] = blake2b_iv[i];
+    ctx->h[0] ^= 0x01010000 ^ (key_len << 8) ^ out_len;
+    ctx->out_len = out_len;
+
+    if (key_len > 0) {
+        blake2b_update(ctx, key, key_len);
+        ctx->buf_len = BLAKE2B_BLOCK_LEN;
+    }
+}
+
+void blake2b_update(struct blake2b_ctx *ctx, const void *in, size_t len) {
+    const uint8_t *p = in;
+
+    while (len > 0) {
+        // Compress only once more input is known to follow, since the
+        // final block needs the last-block flag
+        if (ctx->buf_len == BLAKE2B_BLOCK_LEN) {
+            ctx->t[0] += BLAKE2B_BLOCK_LEN;
+            if (ctx->t[0] < BLAKE2B_BLOCK_LEN) ctx->t[1]++;
+            blake2b_compress(ctx, 0);
+            ctx->buf_len = 0;
+        }
+
+        size_t take = BLAKE2B_BLOCK_LEN - ctx->buf_len;
+        if (take > len) take = len;
+        memcpy(ctx->buf + ctx->buf_len, p, take);
+        ctx->buf_len += take;
+        p += take;
+        len -= take;
+    }
+}
+
+void blake2b_final(struct blake2b_ctx *ctx, uint8_t *out) {
+    uint8_t full[BLAKE2B_OUT_LEN];
+
+    ctx->t[0] += ctx->buf_len;
+    if (ctx->t[0] < ctx->buf_len) ctx->t[1]++;
+    memset(ctx->buf + ctx->buf_len, 0, BLAKE2B_BLOCK_LEN - ctx->buf_len);
+    blake2b_compress(ctx, 1);
+
+    for (int i = 0; i < 8; i++) store64_le(full + 8 * i, ctx->h[i]);
+    memcpy(out, full, ctx->out_len);
+
+    crypto_wipe(full, sizeof(full));
+    crypto_wipe(ctx, sizeof(*ctx));
+}
+
+void blake2b(uint8_t *out, size_t out_len, const void *in, size_t len, const void *key, size_t key_len) {
+    struct blake2b_ctx ctx;
+    blake2b_init(&ctx, out_len, key, key_len);
+    blake2b_update(&ctx, in, len);
+    blake2b_final(&ctx, out);
+}
+
+void hmac_blake2b(uint8_t out[BLAKE2B_OUT_LEN], const void *key, size_t key_len, const void *data, size_t len) {
+    uint8_t k[BLAKE2B_BLOCK_LEN] = {0};
+    uint8_t pad[BLAKE2B_BLOCK_LEN];
+    uint8_t inner[BLAKE2B_OUT_LEN];
+    struct blake2b_ctx ctx;
+
+    if (key_len > BLAKE2B_BLOCK_LEN) {
+        blake2b(k, BLAKE2B_OUT_LEN, key, key_len, NULL, 0);
+    } else {
+        memcpy(k, key, key_len);
+    }
+
+    for (int i = 0; i < BLAKE2B_BLOCK_LEN; i++) pad[i] = k[i] ^ 0x36;
+    blake2b_init(&ctx, BLAKE2B_OUT_LEN, NULL, 0);
+    blake2b_update(&ctx, pad, sizeof(pad));
+    blake2b_update(&ctx, data, len);
+    blake2b_final(&ctx, inner);
+
+    for (int i = 0; i < BLAKE2B_BLOCK_LEN; i++) pad[i] = k[i] ^ 0x5c;
+    blake2b_init(&ctx, BLAKE2B_OUT_LEN, NULL, 0);
+    blake2b_update(&ctx, pad, sizeof(pad));
+    blake2b_update(&ctx, inner, sizeof(inner));
+    blake2b_final(&ctx, out);
+
+    crypto_wipe(k, sizeof(k));
+    crypto_wipe(pad, sizeof(pad));
+    crypto_wipe(inner, sizeof(inner));
+}
+
+// ---------------------------------------------------------------------------
+// Helpers
+
+int random_bytes(void *buf, size_t len) {
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = getrandom(p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int crypto_memeq(const void *a, const void *b, size_t len) {
+    const volatile uint8_t *x = a;
+    const volatile uint8_t *y = b;
+    uint8_t diff = 0;
+
+    for (size_t i = 0; i < len; i++) diff |= x[i] ^ y[i];
+    return diff == 0;
+}
+
+void crypto_wipe(void *p, size_t len) {
+    volatile uint8_t *v = p;
+    while (len--) *v++ = 0;
+}
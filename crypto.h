@@ -0,0 +1,88 @@
+// crypto.h
+// Self-contained primitives for the encrypted session layer
+//
+//   ChaCha20-Poly1305 AEAD (RFC 8439), with AVX2/SSE2 ChaCha20 kernels
+//   chosen at startup from the CPU's features and a portable fallback
+//   X25519 key agreement (RFC 7748)
+//   BLAKE2b (RFC 7693) and HMAC-BLAKE2b for the Noise handshake
+//
+// Everything here is constant-time with respect to secret data.
+
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_LEN 32
+#define CHACHA20_NONCE_LEN 12
+#define POLY1305_TAG_LEN 16
+#define X25519_LEN 32
+#define BLAKE2B_OUT_LEN 64
+#define BLAKE2B_BLOCK_LEN 128
+
+enum chacha20_impl {
+    CHACHA20_PORTABLE,
+    CHACHA20_SSE2,        // 4 blocks per iteration
+    CHACHA20_AVX2         // 8 blocks per iteration
+};
+
+// XOR len bytes of keystream starting at block `counter` into out
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len,
+                  const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN],
+                  uint32_t counter);
+
+// The fastest supported kernel is picked automatically; these let a
+// benchmark compare them. chacha20_select() returns 0 if the CPU lacks it.
+int chacha20_select(enum chacha20_impl impl);
+enum chacha20_impl chacha20_current(void);
+const char *chacha20_impl_name(enum chacha20_impl impl);
+
+struct poly1305_ctx {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    size_t leftover;
+    uint8_t buffer[16];
+    int final;
+};
+
+void poly1305_init(struct poly1305_ctx *ctx, const uint8_t key[32]);
+void poly1305_update(struct poly1305_ctx *ctx, const uint8_t *m, size_t len);
+void poly1305_final(struct poly1305_ctx *ctx, uint8_t mac[POLY1305_TAG_LEN]);
+
+// ChaCha20-Poly1305. seal writes len bytes of ciphertext followed by the
+// tag; open reads the same layout and returns -1 if the tag is wrong, in
+// which case out holds no plaintext. out may equal in.
+void aead_seal(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *ad, size_t ad_len,
+               const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN]);
+int aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *ad, size_t ad_len,
+              const uint8_t key[CHACHA20_KEY_LEN], const uint8_t nonce[CHACHA20_NONCE_LEN]);
+
+void x25519(uint8_t out[X25519_LEN], const uint8_t scalar[X25519_LEN], const uint8_t point[X25519_LEN]);
+void x25519_public(uint8_t pub[X25519_LEN], const uint8_t priv[X25519_LEN]);
+
+struct blake2b_ctx {
+    uint64_t h[8];
+    uint64_t t[2];
+    uint8_t buf[BLAKE2B_BLOCK_LEN];
+    size_t buf_len;
+    size_t out_len;
+};
+
+void blake2b_init(struct blake2b_ctx *ctx, size_t out_len, const void *key, size_t key_len);
+void blake2b_update(struct blake2b_ctx *ctx, const void *in, size_t len);
+void blake2b_final(struct blake2b_ctx *ctx, uint8_t *out);
+void blake2b(uint8_t *out, size_t out_len, const void *in, size_t len, const void *key, size_t key_len);
+void hmac_blake2b(uint8_t out[BLAKE2B_OUT_LEN], const void *key, size_t key_len, const void *data, size_t len);
+
+int random_bytes(void *buf, size_t len);
+int crypto_memeq(const void *a, const void *b, size_t len);
+void crypto_wipe(void *p, size_t len);
+
+// Vectorized kernels from chacha_simd.c. Each XORs whole 64-byte blocks,
+// advances state[12] and returns how many blocks it handled.
+size_t chacha20_blocks_sse2(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks);
+size_t chacha20_blocks_avx2(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks);
+
+#endif
@@ -0,0 +1,907 @@
+// federation.c
+// Relay links between server nodes, see federation.h
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "crypto.h"
+#include "federation.h"
+#include "frame.h"
+#include "groups.h"
+#include "log.h"
+#include "socks5.h"
+
+#define PROOF_LABEL "torchat federation 1"
+#define NAME_SET_MIN 64                    // Initial buckets of a name set, a power of two
+#define BATCH_MSGS 256                     // Messages taken off a link queue at a time
+
+// Names a node has: rooms and users, each keyed by its fed_kind byte
+// followed by the name, with a count of shards or announcements
+struct name_entry {
+    struct name_entry *next;
+    unsigned int count;
+    size_t len;
+    char key[];
+};
+
+struct name_set {
+    struct name_entry **buckets;
+    unsigned int mask;
+    unsigned int count;
+};
+
+struct fed_node {
+    struct fed_node *next;
+    uint8_t key[NOISE_KEY_LEN];        // Its static key, as in the handshake
+    uint64_t origin;                   // Incarnation its messages come from
+    uint64_t last_seq;                 // Last sequence taken from that origin
+    uint64_t gen;                      // Generation of its current link to us, 0 for none
+    struct name_set interest;          // What it announced over that link
+};
+
+struct fed_entry {
+    uint64_t seq;
+    struct msgbuf *m;
+};
+
+// An interest change waiting to go out on a link
+struct fed_op {
+    struct fed_op *next;
+    size_t len;
+    unsigned char payload[];
+};
+
+struct fed_link {
+    char addr[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_t thread;
+    pthread_cond_t wake;
+    int fd;                            // While connected, so fed_stop() can cut it short
+    int up;
+    int failing;                       // Dialing has failed since it was last up
+    struct fed_node *node;             // Far end, once it has answered
+    struct fed_entry queue[FED_QUEUE_MAX];  // Ring, oldest at head
+    unsigned int head;
+    unsigned int count;
+    unsigned int unsent;               // Entries from head + unsent on have never been written
+    unsigned int resend;               // Entries before unsent to count as resent
+    size_t bytes;                      // Frame bytes the queue references
+    struct fed_op *ops, *ops_tail;     // Interest changes, kept only while up
+};
+
+// One connection of a link, owned by its thread
+struct link_session {
+    int fd;
+    struct noise_cipher tx;
+    struct noise_cipher rx;
+    struct frame_reader r;
+    uint64_t last_rx;                  // Monotonic ms a frame last arrived
+    int pinged;                        // A ping is out since then
+    unsigned char *out;                // Sealed frames waiting to be written
+    size_t used;
+    unsigned char *plain;              // One frame being assembled for sealing
+};
+
+static pthread_mutex_t fed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled;
+static int fed_stopping;
+static uint8_t secret[FED_SECRET_LEN];
+static uint8_t node_key[NOISE_KEY_LEN];
+static uint64_t origin;
+static uint64_t next_seq;
+static uint64_t next_gen;
+static struct fed_node *nodes;
+static struct fed_link *links[FED_MAX_PEERS];
+static int num_links;
+static struct name_set local;          // Rooms counted over shards, and users, of this node
+static struct fed_stats stats;         // Counters only; the rest is filled in by fed_get_stats()
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// --- Name sets -----------------------------------------------------------
+
+static uint32_t name_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+static int set_init(struct name_set *s) {
+    s->buckets = calloc(NAME_SET_MIN, sizeof(*s->buckets));
+    s->mask = NAME_SET_MIN - 1;
+    s->count = 0;
+    return s->buckets ? 0 : -1;
+}
+
+// The link pointing at key's entry, or at the NULL ending its chain
+static struct name_entry **set_find(struct name_set *s, const char *key, size_t len) {
+    struct name_entry **p = &s->buckets[name_hash(key, len) & s->mask];
+    while (*p && ((*p)->len != len || memcmp((*p)->key, key, len) != 0)) p = &(*p)->next;
+    return p;
+}
+
+static unsigned int set_count(struct name_set *s, const char *key, size_t len) {
+    struct name_entry *e = *set_find(s, key, len);
+    return e ? e->count : 0;
+}
+
+// Twice the buckets once chains average two entries; failing to grow only
+// makes them longer
+static void set_grow(struct name_set *s) {
+    unsigned int size = (s->mask + 1) * 2;
+    struct name_entry **b = calloc(size, sizeof(*b));
+    if (!b) return;
+
+    for (unsigned int i = 0; i <= s->mask; i++) {
+        struct name_entry *e = s->buckets[i];
+        while (e) {
+            struct name_entry *next = e->next;
+            struct name_entry **p = &b[name_hash(e->key, e->len) & (size - 1)];
+            e->next = *p;
+            *p = e;
+            e = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = b;
+    s->mask = size - 1;
+}
+
+// Add delta to key's count, dropping the entry at 0. Returns the new
+// count, or -1 if out of memory.
+static int set_adjust(struct name_set *s, const char *key, size_t len, int delta) {
+    struct name_entry **p = set_find(s, key, len);
+    struct name_entry *e = *p;
+
+    if (!e) {
+        if (delta <= 0) return 0;
+        e = malloc(sizeof(*e) + len);
+        if (!e) return -1;
+        e->next = NULL;
+        e->count = 0;
+        e->len = len;
+        memcpy(e->key, key, len);
+        *p = e;
+        if (++s->count > 2 * (s->mask + 1)) set_grow(s);
+    }
+    e->count += delta;
+    if (e->count > 0) return (int)e->count;
+
+    *set_find(s, key, len) = e->next;
+    free(e);
+    s->count--;
+    return 0;
+}
+
+static void set_clear(struct name_set *s) {
+    for (unsigned int i = 0; i <= s->mask; i++) {
+        while (s->buckets[i]) {
+            struct name_entry *e = s->buckets[i];
+            s->buckets[i] = e->next;
+            free(e);
+        }
+    }
+    s->count = 0;
+}
+
+// kind followed by the name, the key of a name set. Returns its length, or
+// 0 if the name is too long.
+static size_t make_key(char key[GROUP_NAME_MAX + 1], enum fed_kind kind, const char *name, size_t len) {
+    if (len == 0 || len > GROUP_NAME_MAX) return 0;
+    key[0] = (char)kind;
+    memcpy(key + 1, name, len);
+    return len + 1;
+}
+
+// --- Nodes and links -----------------------------------------------------
+
+// The record of the node with this key, created on first sight. Called
+// with fed_lock held.
+static struct fed_node *node_get(const uint8_t key[NOISE_KEY_LEN]) {
+    for (struct fed_node *n = nodes; n; n = n->next) {
+        if (memcmp(n->key, key, NOISE_KEY_LEN) == 0) return n;
+    }
+
+    struct fed_node *n = calloc(1, sizeof(*n));
+    if (!n) return NULL;
+    if (set_init(&n->interest) < 0) {
+        free(n);
+        return NULL;
+    }
+    memcpy(n->key, key, NOISE_KEY_LEN);
+    n->next = nodes;
+    nodes = n;
+    return n;
+}
+
+// Keyed BLAKE2b of the secret over the role, the session's
+// initiator-to-responder key, the sender's node key and 8 more bytes: the
+// initiator's origin, or the sequence the responder answers with. Binding
+// the session key means a proof seen on one connection is worthless on
+// any other.
+static void make_proof(uint8_t out[FED_PROOF_LEN], char role, const uint8_t binding[CHACHA20_KEY_LEN],
+                       const uint8_t key[NOISE_KEY_LEN], const unsigned char extra[8]) {
+    struct blake2b_ctx ctx;
+
+    blake2b_init(&ctx, FED_PROOF_LEN, secret, sizeof(secret));
+    blake2b_update(&ctx, PROOF_LABEL, sizeof(PROOF_LABEL));
+    blake2b_update(&ctx, &role, 1);
+    blake2b_update(&ctx, binding, CHACHA20_KEY_LEN);
+    blake2b_update(&ctx, key, NOISE_KEY_LEN);
+    blake2b_update(&ctx, extra, 8);
+    blake2b_final(&ctx, out);
+}
+
+// Queue an interest change on every link that is up. Called with fed_lock held.
+static void announce(const char *key, size_t len, int add) {
+    for (int i = 0; i < num_links; i++) {
+        struct fed_link *l = links[i];
+        if (!l->up) continue;
+
+        struct fed_op *op = malloc(sizeof(*op) + len + 1);
+        if (!op) continue;
+        op->next = NULL;
+        op->len = len + 1;
+        op->payload[0] = key[0];
+        op->payload[1] = add ? 1 : 0;
+        memcpy(op->payload + 2, key + 1, len - 1);
+        if (l->ops_tail) l->ops_tail->next = op;
+        else l->ops = op;
+        l->ops_tail = op;
+        pthread_cond_signal(&l->wake);
+    }
+}
+
+static void free_ops(struct fed_link *l) {
+    while (l->ops) {
+        struct fed_op *op = l->ops;
+        l->ops = op->next;
+        free(op);
+    }
+    l->ops_tail = NULL;
+}
+
+// Drop the oldest queued message. Called with fed_lock held.
+static void queue_evict(struct fed_link *l) {
+    struct fed_entry *e = &l->queue[l->head];
+
+    if (l->unsent == 0) stats.dropped++;
+    else l->unsent--;
+    if (l->resend > 0) l->resend--;
+    l->bytes -= e->m->len;
+    msgbuf_unref(e->m);
+    l->head = (l->head + 1) % FED_QUEUE_MAX;
+    l->count--;
+}
+
+static void queue_push(struct fed_link *l, uint64_t seq, struct msgbuf *m) {
+    while (l->count > 0 && (l->count == FED_QUEUE_MAX || l->bytes + m->len > FED_QUEUE_BYTES)) queue_evict(l);
+
+    struct fed_entry *e = &l->queue[(l->head + l->count) % FED_QUEUE_MAX];
+    e->seq = seq;
+    e->m = msgbuf_ref(m);
+    l->bytes += m->len;
+    l->count++;
+    pthread_cond_signal(&l->wake);
+}
+
+// --- Dialing -------------------------------------------------------------
+
+// Connect to addr and send `early`, the first handshake frame, ahead of
+// anything else. Returns the socket, or -1.
+static int link_dial(const char *addr, const void *early, size_t early_len) {
+    struct timeval tv = { .tv_sec = FED_SETUP_TIMEOUT_S };
+    int fd = -1;
+
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) goto fail;
+    } else {
+        char host[256];
+        const char *colon = strrchr(addr, ':');
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        int port = atoi(colon + 1);
+        size_t host_len = strlen(host);
+        int onion = host_len > 6 && strcmp(host + host_len - 6, ".onion") == 0;
+
+        // Onion addresses only resolve inside Tor
+        char service[16];
+        snprintf(service, sizeof(service), "%d", onion ? FED_SOCKS_PORT : port);
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+        if (getaddrinfo(onion ? "127.0.0.1" : host, service, &hints, &res) != 0) return -1;
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) return -1;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (onion) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (socks5_connect_domain(fd, host, port, NULL, early, early_len, 1) < 0) goto fail;
+            return fd;
+        }
+    }
+
+    for (size_t off = 0; off < early_len; ) {
+        ssize_t n = send(fd, (const char *)early + off, early_len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto fail;
+        off += n;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static int send_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Seal one frame onto the session's output, writing it out first if the
+// batch is full. Returns -1 if the link failed.
+static int session_put(struct link_session *s, uint8_t type, const void *payload, size_t len) {
+    if (s->used >= FED_BATCH_BYTES) {
+        if (send_all(s->fd, s->out, s->used) < 0) return -1;
+        s->used = 0;
+    }
+    s->used += noise_seal_frame(&s->tx, s->out + s->used, type, payload, len);
+    return 0;
+}
+
+static int session_flush(struct link_session *s) {
+    int r = s->used > 0 ? send_all(s->fd, s->out, s->used) : 0;
+    s->used = 0;
+    return r;
+}
+
+// Block for the next frame, opened unless it is the handshake. Returns 0
+// on a closed connection, a timeout or a bad frame.
+static int session_read(struct link_session *s, struct frame *f, int sealed) {
+    while (1) {
+        int r = frame_next(&s->r, f);
+        if (r < 0) return 0;
+        if (r > 0) {
+            if (sealed && (f->type != FRAME_SEALED || noise_open_frame(&s->rx, f) < 0)) return 0;
+            if (f->type == FRAME_PADDING) continue;
+            s->last_rx = now_ms();
+            return 1;
+        }
+        if (frame_reader_fill(&s->r, s->fd) <= 0) return 0;
+    }
+}
+
+// Dial the link's peer, run the key exchange and prove ourselves to each
+// other, then pick up where the last connection left off. Returns a
+// reason on failure, NULL once the link is up.
+static const char *link_connect(struct fed_link *l, struct link_session *s) {
+    unsigned char hello[FRAME_HDR_LEN + NOISE_MSG1_MAX];
+    unsigned char msg[FED_HELLO_LEN], proof[FED_PROOF_LEN];
+    uint8_t peer_key[NOISE_KEY_LEN];
+    struct noise_handshake hs;
+    struct frame f;
+    uint8_t features;
+
+    s->fd = -1;
+
+    // Links offer no features: what they carry is relayed as it came
+    int len = noise_initiator_start(&hs, hello + FRAME_HDR_LEN, 0);
+    if (len < 0) return "no randomness";
+    frame_encode_header(hello, FRAME_HANDSHAKE, (uint32_t)len);
+    s->fd = link_dial(l->addr, hello, FRAME_HDR_LEN + len);
+    if (s->fd < 0) return strerror(errno ? errno : ECONNREFUSED);
+
+    struct timeval tv = { .tv_sec = FED_SETUP_TIMEOUT_S };
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = FED_SEND_TIMEOUT_S;
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (!session_read(s, &f, 0) || f.type != FRAME_HANDSHAKE ||
+        noise_initiator_finish(&hs, f.payload, f.len, peer_key, &s->tx, &s->rx, &features) < 0) {
+        return "key exchange failed";
+    }
+    crypto_wipe(&hs, sizeof(hs));
+
+    memcpy(msg, node_key, NOISE_KEY_LEN);
+    frame_put_u64(msg + NOISE_KEY_LEN, origin);
+    make_proof(msg + NOISE_KEY_LEN + 8, 'I', s->tx.key, node_key, msg + NOISE_KEY_LEN);
+    if (session_put(s, FRAME_PEER_HELLO, msg, sizeof(msg)) < 0 || session_flush(s) < 0) return "connection lost";
+
+    // The login prompt sent before the hello arrived is skipped
+    while (1) {
+        if (!session_read(s, &f, 1)) return "connection lost";
+        if (f.type == FRAME_PEER_WELCOME) break;
+        if (f.type == FRAME_AUTH_FAIL) return "refused";
+    }
+    if (f.len != FED_WELCOME_LEN) return "bad welcome";
+    make_proof(proof, 'R', s->tx.key, peer_key, f.payload);
+    if (!crypto_memeq(proof, f.payload + 8, FED_PROOF_LEN)) return "proof failed; is federation.key the same on both nodes?";
+    uint64_t last = frame_get_u64(f.payload);
+
+    tv.tv_sec = 0;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    pthread_mutex_lock(&fed_lock);
+    l->node = node_get(peer_key);
+    l->fd = s->fd;
+    l->up = 1;
+    stats.connects++;
+
+    // Whatever the far end has not seen from this origin goes again. One
+    // that knows nothing of it has restarted, and gets only what was
+    // never written at all.
+    unsigned int from = l->unsent;
+    if (last > 0) {
+        from = 0;
+        while (from < l->unsent && l->queue[(l->head + from) % FED_QUEUE_MAX].seq <= last) from++;
+    }
+    l->resend = l->unsent - from;
+    l->unsent = from;
+
+    // A snapshot of what this node has, which replaces any change queued
+    free_ops(l);
+    for (unsigned int i = 0; i <= local.mask; i++) {
+        for (struct name_entry *e = local.buckets[i]; e; e = e->next) {
+            struct fed_op *op = malloc(sizeof(*op) + e->len + 1);
+            if (!op) continue;
+            op->next = NULL;
+            op->len = e->len + 1;
+            op->payload[0] = e->key[0];
+            op->payload[1] = 1;
+            memcpy(op->payload + 2, e->key + 1, e->len - 1);
+            if (l->ops_tail) l->ops_tail->next = op;
+            else l->ops = op;
+            l->ops_tail = op;
+        }
+    }
+    unsigned int resend = l->resend;
+    pthread_mutex_unlock(&fed_lock);
+
+    log_event(LOG_INFO, "federation", NULL, 0, NULL, "Linked to node %s%s", l->addr,
+              resend ? ", resending what it missed" : "");
+    if (resend) {
+        log_event(LOG_DEBUG, "federation", NULL, 0, NULL, "Resending %u message%s to %s", resend,
+                  resend == 1 ? "" : "s", l->addr);
+    }
+    return NULL;
+}
+
+// Answer the far end's pings and notice it going away. Returns -1 once
+// the link should be redialed.
+static int link_poll_input(struct fed_link *l, struct link_session *s) {
+    struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+    struct frame f;
+
+    while (poll(&pfd, 1, 0) > 0) {
+        if (frame_reader_fill(&s->r, s->fd) <= 0) {
+            if (!__atomic_load_n(&fed_stopping, __ATOMIC_RELAXED)) {
+                log_event(LOG_WARN, "federation", NULL, 0, NULL, "Link to %s closed by the far end", l->addr);
+            }
+            return -1;
+        }
+        int r;
+        while ((r = frame_next(&s->r, &f)) > 0) {
+            if (f.type != FRAME_SEALED || noise_open_frame(&s->rx, &f) < 0) return -1;
+            s->last_rx = now_ms();
+            s->pinged = 0;
+            if (f.type == FRAME_PING && f.len <= FRAME_PING_MAX && session_put(s, FRAME_PONG, f.payload, f.len) < 0) return -1;
+        }
+        if (r < 0) return -1;
+    }
+
+    uint64_t quiet = now_ms() - s->last_rx;
+    if (quiet >= FED_DEAD_MS) {
+        log_event(LOG_WARN, "federation", NULL, 0, NULL, "Link to %s silent for %llu s, redialing", l->addr,
+                  (unsigned long long)(quiet / 1000));
+        return -1;
+    }
+    if (quiet >= FED_PING_MS && !s->pinged) {
+        s->pinged = 1;
+        if (session_put(s, FRAME_PING, NULL, 0) < 0) return -1;
+    }
+    return session_flush(s);
+}
+
+// Send queued interest changes and messages until the link fails or the
+// server stops
+static void link_run(struct fed_link *l, struct link_session *s) {
+    struct fed_entry batch[BATCH_MSGS];
+    unsigned int n = 0, resent = 0;
+
+    pthread_mutex_lock(&fed_lock);
+    while (!fed_stopping) {
+        stats.sent += n;
+        stats.resent += resent;
+        if (!l->ops && l->unsent == l->count) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += FED_WAIT_MS / 1000;
+            ts.tv_nsec += (FED_WAIT_MS % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&l->wake, &fed_lock, &ts);
+        }
+
+        struct fed_op *ops = l->ops;
+        l->ops = l->ops_tail = NULL;
+        size_t bytes = 0;
+        unsigned int next = l->unsent;
+        n = resent = 0;
+        while (next < l->count && n < BATCH_MSGS && bytes < FED_BATCH_BYTES) {
+            struct fed_entry *e = &l->queue[(l->head + next++) % FED_QUEUE_MAX];
+            batch[n].seq = e->seq;
+            batch[n++].m = msgbuf_ref(e->m);
+            bytes += e->m->len;
+        }
+        pthread_mutex_unlock(&fed_lock);
+
+        // Unsent messages stay queued, so a failure here loses none of them
+        int failed = 0;
+        while (ops) {
+            struct fed_op *op = ops;
+            ops = op->next;
+            if (!failed && session_put(s, FRAME_PEER_INTEREST, op->payload, op->len) < 0) failed = 1;
+            free(op);
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            struct msgbuf *m = batch[i].m;
+            size_t len = m->len - FRAME_HDR_LEN;
+            if (!failed) {
+                frame_put_u64(s->plain, origin);
+                frame_put_u64(s->plain + 8, batch[i].seq);
+                s->plain[16] = m->data[FRAME_HDR_LEN - 1];
+                memcpy(s->plain + FED_MSG_HDR, msgbuf_payload(m), len);
+                if (session_put(s, FRAME_PEER_MSG, s->plain, FED_MSG_HDR + len) < 0) failed = 1;
+            }
+            msgbuf_unref(m);
+        }
+        if (failed || session_flush(s) < 0) {
+            pthread_mutex_lock(&fed_lock);
+            if (!fed_stopping) log_event(LOG_WARN, "federation", NULL, 0, NULL, "Link to %s failed: %s", l->addr, strerror(errno));
+            break;
+        }
+
+        // The batch is out. Entries evicted meanwhile took their place in
+        // unsent with them, so go by sequence number.
+        pthread_mutex_lock(&fed_lock);
+        while (n > 0 && l->unsent < l->count &&
+               l->queue[(l->head + l->unsent) % FED_QUEUE_MAX].seq <= batch[n - 1].seq) {
+            l->unsent++;
+            if (l->resend > 0) {
+                l->resend--;
+                resent++;
+            }
+        }
+        pthread_mutex_unlock(&fed_lock);
+
+        if (link_poll_input(l, s) < 0) {
+            pthread_mutex_lock(&fed_lock);
+            break;
+        }
+        pthread_mutex_lock(&fed_lock);
+    }
+    l->up = 0;
+    l->fd = -1;
+    free_ops(l);
+    pthread_mutex_unlock(&fed_lock);
+}
+
+static void *link_main(void *arg) {
+    struct fed_link *l = arg;
+    unsigned int delay = FED_RETRY_MIN_MS;
+    struct link_session s = {0};
+
+    s.out = malloc(FED_BATCH_BYTES + FRAME_HDR_LEN + FRAME_MAX_PAYLOAD);
+    s.plain = malloc(FRAME_MAX_PLAINTEXT);
+    if (!s.out || !s.plain) {
+        log_event(LOG_ERROR, "federation", NULL, 0, NULL, "Out of memory, not linking to %s", l->addr);
+        free(s.out);
+        free(s.plain);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&fed_lock);
+    while (!fed_stopping) {
+        pthread_mutex_unlock(&fed_lock);
+
+        frame_reader_init(&s.r);
+        s.used = 0;
+        s.pinged = 0;
+        errno = 0;
+        const char *why = link_connect(l, &s);
+        if (!why) {
+            l->failing = 0;
+            delay = FED_RETRY_MIN_MS;
+            link_run(l, &s);
+        } else if (!l->failing) {
+            // Said once; a peer that is down would otherwise fill the log
+            log_event(LOG_WARN, "federation", NULL, 0, NULL, "Cannot link to node %s: %s; retrying", l->addr, why);
+            l->failing = 1;
+        }
+        if (s.fd >= 0) close(s.fd);
+        frame_reader_free(&s.r);
+        crypto_wipe(&s.tx, sizeof(s.tx));
+        crypto_wipe(&s.rx, sizeof(s.rx));
+
+        pthread_mutex_lock(&fed_lock);
+        if (fed_stopping) break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += delay / 1000;
+        ts.tv_nsec += (delay % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&l->wake, &fed_lock, &ts);
+        if (!why) delay = FED_RETRY_MIN_MS;
+        else if ((delay *= 2) > FED_RETRY_MAX_MS) delay = FED_RETRY_MAX_MS;
+    }
+    pthread_mutex_unlock(&fed_lock);
+
+    free(s.out);
+    free(s.plain);
+    return NULL;
+}
+
+// --- Public interface ----------------------------------------------------
+
+int fed_init(const uint8_t key[FED_SECRET_LEN], const uint8_t pub[NOISE_KEY_LEN]) {
+    if (set_init(&local) < 0) return -1;
+    while (origin == 0) {
+        if (random_bytes(&origin, sizeof(origin)) < 0) return -1;
+    }
+    memcpy(secret, key, FED_SECRET_LEN);
+    memcpy(node_key, pub, NOISE_KEY_LEN);
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int fed_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+int fed_add_peer(const char *addr) {
+    struct fed_link *l;
+
+    if (num_links == FED_MAX_PEERS || strlen(addr) >= sizeof(l->addr)) return -1;
+    if (!strchr(addr, '/')) {
+        const char *colon = strrchr(addr, ':');
+        if (!colon || colon == addr || atoi(colon + 1) < 1 || atoi(colon + 1) > 65535) return -1;
+    }
+
+    l = calloc(1, sizeof(*l));
+    if (!l) return -1;
+    snprintf(l->addr, sizeof(l->addr), "%s", addr);
+    l->fd = -1;
+    pthread_cond_init(&l->wake, NULL);
+    links[num_links++] = l;
+    return 0;
+}
+
+int fed_start(void) {
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    for (int i = 0; i < num_links; i++) {
+        if (pthread_create(&links[i]->thread, &attr, link_main, links[i]) != 0) {
+            perror("pthread_create");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+void fed_stop(void) {
+    pthread_mutex_lock(&fed_lock);
+    fed_stopping = 1;
+    for (int i = 0; i < num_links; i++) {
+        pthread_cond_signal(&links[i]->wake);
+        if (links[i]->fd >= 0) shutdown(links[i]->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&fed_lock);
+
+    for (int i = 0; i < num_links; i++) {
+        struct fed_link *l = links[i];
+        pthread_join(l->thread, NULL);
+        while (l->count > 0) {
+            l->unsent = l->count;
+            queue_evict(l);
+        }
+        free_ops(l);
+        free(l);
+        links[i] = NULL;
+    }
+    num_links = 0;
+
+    while (nodes) {
+        struct fed_node *n = nodes;
+        nodes = n->next;
+        set_clear(&n->interest);
+        free(n->interest.buckets);
+        free(n);
+    }
+    if (local.buckets) {
+        set_clear(&local);
+        free(local.buckets);
+        local.buckets = NULL;
+    }
+    crypto_wipe(secret, sizeof(secret));
+}
+
+struct fed_node *fed_hello(const uint8_t binding[CHACHA20_KEY_LEN], const unsigned char *hello, size_t len,
+                           unsigned char welcome[FED_WELCOME_LEN], uint64_t *gen) {
+    uint8_t proof[FED_PROOF_LEN];
+
+    if (!fed_enabled() || len != FED_HELLO_LEN) return NULL;
+    make_proof(proof, 'I', binding, hello, hello + NOISE_KEY_LEN);
+    if (!crypto_memeq(proof, hello + NOISE_KEY_LEN + 8, FED_PROOF_LEN)) return NULL;
+
+    // A node listed among its own peers would only talk to itself
+    if (memcmp(hello, node_key, NOISE_KEY_LEN) == 0) return NULL;
+
+    uint64_t from = frame_get_u64(hello + NOISE_KEY_LEN);
+    pthread_mutex_lock(&fed_lock);
+    struct fed_node *n = node_get(hello);
+    if (n) {
+        if (n->origin != from) {
+            n->origin = from;
+            n->last_seq = 0;
+        }
+        n->gen = ++next_gen;
+        set_clear(&n->interest);
+        *gen = n->gen;
+        frame_put_u64(welcome, n->last_seq);
+    }
+    pthread_mutex_unlock(&fed_lock);
+    if (!n) return NULL;
+
+    make_proof(welcome + 8, 'R', binding, node_key, welcome);
+    return n;
+}
+
+void fed_link_closed(struct fed_node *n, uint64_t gen) {
+    pthread_mutex_lock(&fed_lock);
+    if (n->gen == gen) {
+        n->gen = 0;
+        set_clear(&n->interest);
+    }
+    pthread_mutex_unlock(&fed_lock);
+}
+
+int fed_accept(struct fed_node *n, const unsigned char *payload, size_t len) {
+    if (len < FED_MSG_HDR) return -1;
+    uint64_t from = frame_get_u64(payload);
+    uint64_t seq = frame_get_u64(payload + 8);
+
+    pthread_mutex_lock(&fed_lock);
+    int fresh = from == n->origin && seq > n->last_seq;
+    if (fresh) {
+        n->last_seq = seq;
+        stats.received++;
+    } else {
+        stats.duplicates++;
+    }
+    pthread_mutex_unlock(&fed_lock);
+    return fresh;
+}
+
+void fed_remote_interest(struct fed_node *n, uint64_t gen, const unsigned char *payload, size_t len) {
+    char key[GROUP_NAME_MAX + 1];
+
+    if (len < 3 || (payload[0] != FED_ROOM && payload[0] != FED_USER)) return;
+    size_t key_len = make_key(key, payload[0], (const char *)payload + 2, len - 2);
+    if (key_len == 0) return;
+
+    pthread_mutex_lock(&fed_lock);
+    if (n->gen == gen) {
+        int has = set_count(&n->interest, key, key_len) > 0;
+        if (payload[1] && !has) set_adjust(&n->interest, key, key_len, 1);
+        else if (!payload[1] && has) set_adjust(&n->interest, key, key_len, -1);
+    }
+    pthread_mutex_unlock(&fed_lock);
+}
+
+void fed_interest(enum fed_kind kind, const char *name, size_t len, int add) {
+    char key[GROUP_NAME_MAX + 1];
+    size_t key_len = make_key(key, kind, name, len);
+
+    if (!fed_enabled() || key_len == 0) return;
+    pthread_mutex_lock(&fed_lock);
+    int count = set_adjust(&local, key, key_len, add ? 1 : -1);
+    if ((add && count == 1) || (!add && count == 0)) announce(key, key_len, add);
+    pthread_mutex_unlock(&fed_lock);
+}
+
+int fed_publish(struct msgbuf *m) {
+    const char *payload = (const char *)msgbuf_payload(m);
+    size_t len = m->len - FRAME_HDR_LEN;
+    uint8_t type = m->data[FRAME_HDR_LEN - 1];
+    char key[GROUP_NAME_MAX + 1];
+    size_t key_len = 0;
+
+    if (!fed_enabled() || num_links == 0 || len > FED_MAX_INNER) return 0;
+
+    // Routed the way deliver_local() in server.c routes them
+    if (type == FRAME_ROOM) {
+        key_len = make_key(key, FED_ROOM, payload, strnlen(payload, len));
+    } else if (type == FRAME_DIRECT) {
+        size_t from_len = strnlen(payload, len);
+        if (from_len == len) return 0;
+        const char *to = payload + from_len + 1;
+        key_len = make_key(key, FED_USER, to, strnlen(to, len - from_len - 1));
+    } else if (type != FRAME_CHAT) {
+        return 0;
+    }
+    if (type != FRAME_CHAT && key_len == 0) return 0;
+
+    int queued = 0;
+    pthread_mutex_lock(&fed_lock);
+    uint64_t seq = 0;
+    for (int i = 0; i < num_links; i++) {
+        struct fed_link *l = links[i];
+        if (type != FRAME_CHAT && (!l->node || !l->node->gen || !set_count(&l->node->interest, key, key_len))) continue;
+        if (!seq) seq = ++next_seq;
+        queue_push(l, seq, m);
+        queued++;
+    }
+    if (queued) stats.published++;
+    pthread_mutex_unlock(&fed_lock);
+    return queued;
+}
+
+void fed_get_stats(struct fed_stats *s) {
+    pthread_mutex_lock(&fed_lock);
+    *s = stats;
+    s->peers = num_links;
+    for (int i = 0; i < num_links; i++) s->up += links[i]->up;
+    for (struct fed_node *n = nodes; n; n = n->next) {
+        if (!n->gen) continue;
+        s->inbound++;
+        for (unsigned int i = 0; i <= n->interest.mask; i++) {
+            for (struct name_entry *e = n->interest.buckets[i]; e; e = e->next) {
+                if (e->key[0] == FED_ROOM) s->remote_rooms++;
+                else s->remote_users++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fed_lock);
+}
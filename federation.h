@@ -0,0 +1,143 @@
+// federation.h
+// Relay links between server nodes that share one chat
+//
+// Several servers, each behind its own onion address, can carry the same
+// conversation: lobby chat, rooms and direct messages posted on any node
+// reach users on every other. Nodes prove to each other that they hold
+// the same federation secret, a 32-byte file the operator copies to every
+// node, and then pass messages over links that reuse the client protocol:
+// a node dials a peer's listener like a client, runs the same Noise
+// handshake, and sends FRAME_PEER_HELLO where a client would log in.
+//
+// A link carries traffic one way, from the node that dialed it, so every
+// node dials every other and the nodes form a full mesh. A message is
+// relayed once, by the node it was posted on, and never passed on further.
+// Each message carries a global ID, the origin's incarnation (a random
+// 64-bit number drawn at startup) and a per-origin sequence number. A
+// receiving node keeps the last sequence it took from each node and drops
+// anything not newer, so a message resent after a reconnect, or on a link
+// that was replaced, is delivered once.
+//
+// A link keeps the last FED_QUEUE_MAX messages queued for it. On connect
+// the far end answers with the last sequence it has from this origin, and
+// everything after that still in the queue is sent again, so a link that
+// drops for a moment loses nothing; a node that restarted, and has no
+// record of this origin, gets only what was never sent. Messages beyond
+// the queue while a peer is slow or away are dropped and counted rather
+// than held, and shards never wait for a link.
+//
+// Nodes also tell each other which rooms have members and which users are
+// connected on them, FRAME_PEER_INTEREST changes after a full snapshot on
+// every connect, so room and direct messages go only to nodes with someone
+// to read them. Lobby chat goes to every node, which logs it in its own
+// history under its own sequence numbers; the order may differ from node
+// to node for messages posted on different nodes at the same moment.
+//
+// Peers are dialed by "host:port", by a Unix socket path (anything with a
+// '/'), or by "name.onion:port" through Tor's SOCKS port. One thread per
+// link does the dialing, with backoff, and the sending; links accepted
+// from other nodes are served by the event loops like any connection.
+//
+// Every function here may be called from any thread. One lock covers the
+// links, the queues and the interest sets; it is taken after online_lock
+// in server.c and never the other way round.
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgbuf.h"
+#include "noise.h"
+
+#define FED_SECRET_LEN 32
+#define FED_MAX_PEERS 16                   // Nodes one node dials
+#define FED_QUEUE_MAX 4096                 // Messages kept per link for sending and resending
+#define FED_QUEUE_BYTES (16 * 1024 * 1024) // ...and the frame bytes they may hold
+#define FED_BATCH_BYTES (64 * 1024)        // Sealed bytes written per send on a link
+#define FED_RETRY_MIN_MS 1000              // First wait before redialing a peer
+#define FED_RETRY_MAX_MS 30000             // ...doubled up to this
+#define FED_SETUP_TIMEOUT_S 10             // Time a peer gets to finish the handshake
+#define FED_SEND_TIMEOUT_S 10              // A send stuck this long means the link is dead
+#define FED_WAIT_MS 1000                   // Longest a link sleeps before checking its socket
+#define FED_PING_MS 30000                  // Silence after which a link pings
+#define FED_DEAD_MS 90000                  // ...and after which it is redialed
+#define FED_SOCKS_PORT 9050                // Tor's SOCKS port, for .onion peers
+#define FED_PROOF_LEN 32
+#define FED_HELLO_LEN (NOISE_KEY_LEN + 8 + FED_PROOF_LEN)   // Node key, origin, proof
+#define FED_WELCOME_LEN (8 + FED_PROOF_LEN)                 // Last sequence taken from the origin, proof
+#define FED_MSG_HDR 17                                      // Origin, sequence, inner frame type
+#define FED_MAX_INNER (FRAME_MAX_PLAINTEXT - FED_MSG_HDR)   // Largest payload a link relays
+
+// What a node says it has: FRAME_PEER_INTEREST is a kind, 1 to add or 0
+// to remove, then the name
+enum fed_kind {
+    FED_ROOM = 'r',
+    FED_USER = 'u'
+};
+
+// Another node, as known to this one. Records are kept for good.
+struct fed_node;
+
+struct fed_stats {
+    unsigned int peers;                // Links dialed
+    unsigned int up;                   // ...that are connected
+    unsigned int inbound;              // Nodes with a link to this one
+    uint64_t published;                // Local messages queued for at least one link
+    uint64_t sent;                     // Messages written to links
+    uint64_t resent;                   // ...of them again after a reconnect
+    uint64_t dropped;                  // Messages a full link queue lost before sending
+    uint64_t received;                 // Messages taken from other nodes
+    uint64_t duplicates;               // ...dropped as already seen
+    uint64_t connects;                 // Links established, first times included
+    uint64_t remote_rooms;             // Rooms and users announced by other nodes
+    uint64_t remote_users;
+};
+
+// Enable federation with the shared secret. node_key is this node's static
+// public key, which other nodes see in the handshake. Returns -1 if out of
+// memory or without randomness.
+int fed_init(const uint8_t secret[FED_SECRET_LEN], const uint8_t node_key[NOISE_KEY_LEN]);
+int fed_enabled(void);
+
+// Dial addr once fed_start() runs. Returns -1 if the address is malformed
+// or there are FED_MAX_PEERS already.
+int fed_add_peer(const char *addr);
+
+// Start a thread per peer, and stop them all
+int fed_start(void);
+void fed_stop(void);
+
+// Accepting side. Check a FRAME_PEER_HELLO against the secret and the
+// session it arrived on, bound by the key of its initiator-to-responder
+// direction, and write the FRAME_PEER_WELCOME to answer it with. Returns
+// the node with *gen set to this link's generation, or NULL if the proof
+// is wrong.
+struct fed_node *fed_hello(const uint8_t binding[CHACHA20_KEY_LEN], const unsigned char *hello, size_t len,
+                           unsigned char welcome[FED_WELCOME_LEN], uint64_t *gen);
+
+// The link of that generation closed; forget what it announced unless a
+// newer link from the node has taken over
+void fed_link_closed(struct fed_node *n, uint64_t gen);
+
+// Check a FRAME_PEER_MSG from n. Returns 1 if it is new, 0 if it was seen
+// already, -1 if it is malformed; the inner frame is then at payload +
+// FED_MSG_HDR, its type the byte before.
+int fed_accept(struct fed_node *n, const unsigned char *payload, size_t len);
+
+// Apply a FRAME_PEER_INTEREST from the link of generation gen
+void fed_remote_interest(struct fed_node *n, uint64_t gen, const unsigned char *payload, size_t len);
+
+// A room got its first member on a shard (add 1) or lost its last (0), or
+// a user logged in with a first connection or closed their last. Rooms
+// are counted over shards, and other nodes hear of changes in the total.
+void fed_interest(enum fed_kind kind, const char *name, size_t len, int add);
+
+// Queue a local chat, room or direct frame for every node that has
+// someone to read it. Returns the number of links it was queued on.
+int fed_publish(struct msgbuf *m);
+
+void fed_get_stats(struct fed_stats *s);
+
+#endif
@@ -0,0 +1,236 @@
+// files.c
+// Chunked file manifests and the chunk store, see files.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crypto.h"
+#include "frame.h"
+#include "files.h"
+
+#define HASH_HEX_LEN (2 * FILE_HASH_LEN)
+
+static char store_dir[256];
+static uint64_t store_bytes;
+static uint64_t store_max;
+
+void file_hash_chunk(uint8_t hash[FILE_HASH_LEN], const void *data, size_t len) {
+    blake2b(hash, FILE_HASH_LEN, data, len, NULL, 0);
+}
+
+void file_manifest_seal(struct file_manifest *m) {
+    struct blake2b_ctx ctx;
+    unsigned char size[8];
+
+    m->chunks = (uint32_t)((m->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+    frame_put_u64(size, m->size);
+    blake2b_init(&ctx, FILE_ID_LEN, NULL, 0);
+    blake2b_update(&ctx, size, sizeof(size));
+    blake2b_update(&ctx, m->hashes, (size_t)m->chunks * FILE_HASH_LEN);
+    blake2b_final(&ctx, m->id);
+}
+
+size_t file_manifest_len(const struct file_manifest *m) {
+    return strlen(m->name) + 1 + 8 + (size_t)m->chunks * FILE_HASH_LEN;
+}
+
+size_t file_manifest_encode(const struct file_manifest *m, unsigned char *out) {
+    size_t name_len = strlen(m->name);
+    memcpy(out, m->name, name_len + 1);
+    frame_put_u64(out + name_len + 1, m->size);
+    memcpy(out + name_len + 9, m->hashes, (size_t)m->chunks * FILE_HASH_LEN);
+    return name_len + 9 + (size_t)m->chunks * FILE_HASH_LEN;
+}
+
+// Names are shown to users and used as local file names by downloaders:
+// no directories, no hidden files, no control characters
+static int valid_name(const char *name, size_t len) {
+    if (len == 0 || len > FILE_NAME_MAX || name[0] == '.') return 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = name[i];
+        if (ch < 0x20 || ch == 0x7f || ch == '/' || ch == '\\') return 0;
+    }
+    return 1;
+}
+
+int file_manifest_decode(struct file_manifest *m, const unsigned char *p, size_t len) {
+    const unsigned char *sep = memchr(p, 0, len);
+    if (!sep) return -1;
+
+    size_t name_len = sep - p;
+    size_t rest = len - name_len - 1;
+    if (!valid_name((const char *)p, name_len) || rest < 8) return -1;
+
+    memcpy(m->name, p, name_len + 1);
+    m->size = frame_get_u64(sep + 1);
+    if (m->size == 0 || m->size > FILE_MAX_SIZE) return -1;
+    m->chunks = (uint32_t)((m->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+    if (rest - 8 != (size_t)m->chunks * FILE_HASH_LEN) return -1;
+
+    memcpy(m->hashes, sep + 9, rest - 8);
+    file_manifest_seal(m);
+    return 0;
+}
+
+static void format_hex(char *hex, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) sprintf(hex + 2 * i, "%02x", bytes[i]);
+}
+
+void file_id_format(char hex[2 * FILE_ID_LEN + 1], const uint8_t id[FILE_ID_LEN]) {
+    format_hex(hex, id, FILE_ID_LEN);
+}
+
+int file_id_parse(const char *hex, uint8_t id[FILE_ID_LEN]) {
+    if (strlen(hex) != 2 * FILE_ID_LEN) return -1;
+    for (int i = 0; i < FILE_ID_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return -1;
+        id[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+static void chunk_path(char *path, size_t cap, const uint8_t hash[FILE_HASH_LEN]) {
+    char hex[HASH_HEX_LEN + 1];
+    format_hex(hex, hash, FILE_HASH_LEN);
+    snprintf(path, cap, "%s/chunks/%s", store_dir, hex);
+}
+
+static void manifest_path(char *path, size_t cap, const uint8_t id[FILE_ID_LEN]) {
+    char hex[2 * FILE_ID_LEN + 1];
+    file_id_format(hex, id);
+    snprintf(path, cap, "%s/%s", store_dir, hex);
+}
+
+// Write len bytes to a temporary file in the chunk directory and rename it
+// to path, so readers never see it half written
+static int write_file(const char *path, const void *data, size_t len) {
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s/chunks/tmp.XXXXXX", store_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return -1;
+
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int saved = errno;
+            close(fd);
+            unlink(tmp);
+            errno = saved;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int file_store_open(const char *dir, uint64_t max_bytes) {
+    char path[512];
+
+    snprintf(store_dir, sizeof(store_dir), "%s", dir);
+    store_max = max_bytes;
+    if (mkdir(store_dir, 0700) < 0 && errno != EEXIST) return -1;
+    snprintf(path, sizeof(path), "%s/chunks", store_dir);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) return -1;
+
+    DIR *d = opendir(path);
+    if (!d) return -1;
+
+    // Count what is kept and clear out writes cut short by a crash
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char file[1024];
+        struct stat st;
+        snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+        if (strncmp(e->d_name, "tmp.", 4) == 0) {
+            unlink(file);
+        } else if (strlen(e->d_name) == HASH_HEX_LEN && stat(file, &st) == 0) {
+            store_bytes += st.st_size;
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+uint64_t file_store_bytes(void) {
+    return __atomic_load_n(&store_bytes, __ATOMIC_RELAXED);
+}
+
+int file_store_has_chunk(const uint8_t hash[FILE_HASH_LEN]) {
+    char path[512];
+    chunk_path(path, sizeof(path), hash);
+    return access(path, F_OK) == 0;
+}
+
+int file_store_put_chunk(const uint8_t hash[FILE_HASH_LEN], const void *data, size_t len) {
+    char path[512];
+
+    if (__atomic_add_fetch(&store_bytes, len, __ATOMIC_RELAXED) > store_max) {
+        __atomic_sub_fetch(&store_bytes, len, __ATOMIC_RELAXED);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // Another upload may have stored the same chunk meanwhile; the rename
+    // then replaces it with identical bytes, counted once
+    chunk_path(path, sizeof(path), hash);
+    int existed = access(path, F_OK) == 0;
+    if (existed || write_file(path, data, len) < 0) {
+        __atomic_sub_fetch(&store_bytes, len, __ATOMIC_RELAXED);
+        return existed ? 0 : -1;
+    }
+    return 0;
+}
+
+int file_store_open_chunk(const uint8_t hash[FILE_HASH_LEN]) {
+    char path[512];
+    chunk_path(path, sizeof(path), hash);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int file_store_put_manifest(const struct file_manifest *m) {
+    char path[512];
+    unsigned char *buf = malloc(file_manifest_len(m));
+    if (!buf) return -1;
+
+    manifest_path(path, sizeof(path), m->id);
+    int r = write_file(path, buf, file_manifest_encode(m, buf));
+    free(buf);
+    return r;
+}
+
+struct file_manifest *file_store_get_manifest(const uint8_t id[FILE_ID_LEN]) {
+    char path[512];
+    static const size_t cap = FILE_NAME_MAX + 1 + 8 + FILE_MAX_CHUNKS * FILE_HASH_LEN;
+
+    manifest_path(path, sizeof(path), id);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct file_manifest *m = malloc(sizeof(*m));
+    unsigned char *buf = malloc(cap);
+    ssize_t n = m && buf ? read(fd, buf, cap) : -1;
+    close(fd);
+
+    if (n <= 0 || file_manifest_decode(m, buf, n) < 0 || memcmp(m->id, id, FILE_ID_LEN) != 0) {
+        free(m);
+        m = NULL;
+    }
+    free(buf);
+    return m;
+}
@@ -0,0 +1,90 @@
+// files.h
+// Shared files: manifests of content-addressed chunks, and the server's
+// chunk store
+//
+// A file is cut into FILE_CHUNK_SIZE chunks, each named by its BLAKE2b-256
+// hash. Its manifest lists the size, the chunk hashes in order and a file
+// name; the file ID is a hash of the size and the chunk hashes, so a
+// manifest can be checked against the ID it was fetched by and every chunk
+// against its manifest. The same content uploaded twice is one file, and a
+// chunk shared by several files is stored once.
+//
+// An upload is offered with its manifest and the server answers with how
+// many chunks, from the first, it already holds, so a transfer cut off by
+// a dropped circuit resumes from the last confirmed chunk. A download names
+// the chunk to start from for the same reason.
+//
+// The store is a directory: chunks/ holds one file per chunk, named by its
+// hash in hex, and each finished upload leaves its manifest under its ID in
+// hex. Chunks are written to a temporary name and renamed into place, so a
+// chunk file that exists is always whole. The store and manifest functions
+// may be called from any thread.
+
+#ifndef FILES_H
+#define FILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILE_CHUNK_SIZE (32 * 1024)      // Bytes per chunk, the last one may be shorter
+#define FILE_MAX_CHUNKS 1024             // A manifest must fit in one frame
+#define FILE_MAX_SIZE ((uint64_t)FILE_CHUNK_SIZE * FILE_MAX_CHUNKS)
+#define FILE_HASH_LEN 32
+#define FILE_ID_LEN 16
+#define FILE_NAME_MAX 128
+#define FILE_CHUNK_HDR_LEN (FILE_ID_LEN + 4)   // File ID and chunk index ahead of a chunk's data
+#define FILE_REFUSED 0xffffffffu               // Chunk count acknowledging an upload the server will not take
+
+struct file_manifest {
+    uint8_t id[FILE_ID_LEN];
+    char name[FILE_NAME_MAX + 1];
+    uint64_t size;
+    uint32_t chunks;
+    uint8_t hashes[FILE_MAX_CHUNKS][FILE_HASH_LEN];
+};
+
+static inline size_t file_chunk_len(const struct file_manifest *m, uint32_t i) {
+    uint64_t left = m->size - (uint64_t)i * FILE_CHUNK_SIZE;
+    return left < FILE_CHUNK_SIZE ? (size_t)left : FILE_CHUNK_SIZE;
+}
+
+void file_hash_chunk(uint8_t hash[FILE_HASH_LEN], const void *data, size_t len);
+
+// Fill in m->chunks and m->id once the size, name and hashes are set
+void file_manifest_seal(struct file_manifest *m);
+
+// A manifest on the wire and on disk: the name, a NUL byte, the size (8)
+// and the chunk hashes. Returns the encoded length; out needs room for
+// file_manifest_len() bytes.
+size_t file_manifest_len(const struct file_manifest *m);
+size_t file_manifest_encode(const struct file_manifest *m, unsigned char *out);
+
+// Decode and check a manifest, computing its ID. Returns -1 if it is
+// malformed, too large or the name is not a plain file name.
+int file_manifest_decode(struct file_manifest *m, const unsigned char *p, size_t len);
+
+void file_id_format(char hex[2 * FILE_ID_LEN + 1], const uint8_t id[FILE_ID_LEN]);
+int file_id_parse(const char *hex, uint8_t id[FILE_ID_LEN]);
+
+// Open or create the store in dir, counting what it already holds against
+// max_bytes. Returns -1 if the directory cannot be used.
+int file_store_open(const char *dir, uint64_t max_bytes);
+
+// Bytes of chunks stored
+uint64_t file_store_bytes(void);
+
+int file_store_has_chunk(const uint8_t hash[FILE_HASH_LEN]);
+
+// Store a chunk whose data has been checked against hash. Returns -1 with
+// errno ENOSPC if the store is full, or another error from the write.
+int file_store_put_chunk(const uint8_t hash[FILE_HASH_LEN], const void *data, size_t len);
+
+// Open a stored chunk for reading. Returns the descriptor, or -1.
+int file_store_open_chunk(const uint8_t hash[FILE_HASH_LEN]);
+
+int file_store_put_manifest(const struct file_manifest *m);
+
+// The manifest stored under id, allocated, or NULL if there is none
+struct file_manifest *file_store_get_manifest(const uint8_t id[FILE_ID_LEN]);
+
+#endif
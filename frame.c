@@ -0,0 +1,169 @@
+// frame.c
+// Incremental frame decoder and sender, see frame.h
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "pool.h"
+
+void frame_reader_init(struct frame_reader *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+void frame_reader_free(struct frame_reader *r) {
+    pool_free(r->buf, r->cap);
+    memset(r, 0, sizeof(*r));
+}
+
+void frame_reader_release(struct frame_reader *r) {
+    if (r->head == r->tail) frame_reader_free(r);
+}
+
+// Bytes needed before the frame at head can be returned
+static size_t frame_wanted(const struct frame_reader *r) {
+    size_t avail = r->tail - r->head;
+    if (avail < FRAME_HDR_LEN) return FRAME_HDR_LEN;
+
+    uint32_t len = frame_get_u32(r->buf + r->head);
+    if (len > FRAME_MAX_PAYLOAD) return FRAME_HDR_LEN;
+    return FRAME_HDR_LEN + len;
+}
+
+ssize_t frame_reader_fill(struct frame_reader *r, int fd) {
+    if (r->head == r->tail) {
+        r->head = r->tail = 0;
+    }
+
+    if (r->tail == r->cap) {
+        size_t wanted = frame_wanted(r);
+
+        if (r->head > 0) {
+            // Slide the partial frame to the front to make room
+            memmove(r->buf, r->buf + r->head, r->tail - r->head);
+            r->tail -= r->head;
+            r->head = 0;
+        }
+
+        if (r->tail == r->cap || wanted > r->cap) {
+            size_t cap = r->cap ? r->cap : FRAME_INITIAL_BUF;
+            while (cap < wanted || cap == r->tail) cap *= 2;
+
+            unsigned char *buf = pool_grow(r->buf, &r->cap, r->tail, cap);
+            if (!buf) {
+                errno = ENOMEM;
+                return -1;
+            }
+            r->buf = buf;
+        }
+    }
+
+    ssize_t n;
+    do {
+        n = recv(fd, r->buf + r->tail, r->cap - r->tail, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) r->tail += n;
+    return n;
+}
+
+int frame_reader_append(struct frame_reader *r, const void *data, size_t len) {
+    if (r->head == r->tail) {
+        r->head = r->tail = 0;
+    }
+
+    if (r->cap - r->tail < len) {
+        if (r->head > 0) {
+            memmove(r->buf, r->buf + r->head, r->tail - r->head);
+            r->tail -= r->head;
+            r->head = 0;
+        }
+        if (r->cap - r->tail < len) {
+            size_t cap = r->cap ? r->cap : FRAME_INITIAL_BUF;
+            while (cap - r->tail < len) cap *= 2;
+
+            unsigned char *buf = pool_grow(r->buf, &r->cap, r->tail, cap);
+            if (!buf) return -1;
+            r->buf = buf;
+        }
+    }
+
+    memcpy(r->buf + r->tail, data, len);
+    r->tail += len;
+    return 0;
+}
+
+int frame_next(struct frame_reader *r, struct frame *f) {
+    size_t avail = r->tail - r->head;
+    if (avail < FRAME_HDR_LEN) return 0;
+
+    const unsigned char *p = r->buf + r->head;
+    uint32_t len = frame_get_u32(p);
+    if (len > FRAME_MAX_PAYLOAD) return -1;
+    if (avail < FRAME_HDR_LEN + (size_t)len) return 0;
+
+    f->type = p[4];
+    f->len = len;
+    f->payload = p + FRAME_HDR_LEN;
+    r->head += FRAME_HDR_LEN + len;
+    return 1;
+}
+
+void frame_encode_header(unsigned char *hdr, uint8_t type, uint32_t len) {
+    hdr[0] = (unsigned char)(len >> 24);
+    hdr[1] = (unsigned char)(len >> 16);
+    hdr[2] = (unsigned char)(len >> 8);
+    hdr[3] = (unsigned char)len;
+    hdr[4] = type;
+}
+
+int frame_send(int fd, uint8_t type, const void *payload, size_t len) {
+    unsigned char hdr[FRAME_HDR_LEN];
+
+    if (len > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    frame_encode_header(hdr, type, (uint32_t)len);
+
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = FRAME_HDR_LEN },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t total = FRAME_HDR_LEN + len;
+    size_t sent = 0;
+
+    while (sent < total) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (sent == 0) return -1;
+
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, FRAME_SEND_TIMEOUT_MS) <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+
+        sent += n;
+        // Advance the iovecs past what the kernel accepted
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
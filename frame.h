@@ -0,0 +1,189 @@
+// frame.h
+// Length-prefixed wire protocol shared by server.c and client.c
+//
+// Every message on the wire is a frame:
+//
+//   +----------------+--------+----------------------+
+//   | length (4, BE) | type   | payload (length)     |
+//   +----------------+--------+----------------------+
+//
+// The length counts payload bytes only. Frames are decoded in place from a
+// per-connection receive buffer, so any number of frames can arrive in a
+// single read and a frame may be split across as many reads as it takes.
+//
+// Only FRAME_HANDSHAKE frames, and the server's FRAME_AUTH_FAIL to a client
+// that never finished the handshake, travel in the clear. Once the
+// handshake is done every frame is wrapped in a FRAME_SEALED frame (see
+// noise.h).
+//
+// Chat from a client carries only its text. Chat relayed by the server
+// starts with a FRAME_CHAT_HDR_LEN header, the message's sequence number and
+// the time it was logged in Unix milliseconds, both big-endian, so clients
+// can ask for the history since a given message (see history.h).
+//
+// Chat in the lobby reaches everyone and is kept in the history. Rooms and
+// direct messages reach only their members or their recipient and are not
+// logged. Their frames name the target up front, NUL-terminated, so the
+// server can route one without looking further: FRAME_ROOM carries the
+// room name then the text, and FRAME_DIRECT the recipient then the text.
+// Relayed, FRAME_ROOM keeps the room name and prefixes the text with the
+// sender as lobby chat does, and FRAME_DIRECT carries sender, recipient
+// and text.
+//
+// Files travel as numbered chunks of a manifest (see files.h). An upload
+// is FRAME_FILE_OFFER with the target to announce it to, "" for the lobby,
+// "#room" or a user, then the manifest; the server acknowledges it and
+// every chunk with FRAME_FILE_ACK. A download is FRAME_FILE_GET, answered
+// with FRAME_FILE_OFFER carrying the bare manifest and then the chunks.
+//
+// Tor carries a stream in relay cells of FRAME_CELL_DATA bytes each, and a
+// write that ends partway into a cell still costs the whole cell. Either
+// side may fill out a burst of frames to a cell boundary with a sealed
+// FRAME_PADDING frame, or send one now and then as cover traffic; its
+// payload is zeros and the receiver drops it unread.
+//
+// A Tor circuit can die without either end's socket noticing, so both
+// sides check that the other is still there. Either may send FRAME_PING
+// once it has heard nothing for a while, and the other answers with
+// FRAME_PONG carrying the same payload. Any frame, not just a pong, shows
+// the connection is alive.
+//
+// Servers federated into one chat (see federation.h) use the same protocol
+// between them. A node dials a peer, runs the handshake as a client would
+// and answers the login prompt with FRAME_PEER_HELLO, which the peer
+// returns FRAME_PEER_WELCOME to. The dialing node then sends
+// FRAME_PEER_INTEREST and FRAME_PEER_MSG, each wrapping a chat, room or
+// direct frame as the node it was posted on relayed it.
+//
+// A client that offers FRAME_FEATURE_COMPRESS in the handshake, and a
+// server that agrees, may send any frame compress_eligible() allows as
+// FRAME_COMPRESSED instead: the inner type, then the payload compressed
+// against a shared dictionary and what went before in the same direction
+// (see compress.h). Each side decides frame by frame, so short frames and
+// those that would not shrink still go as they are.
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FRAME_HDR_LEN 5
+#define FRAME_MAX_PAYLOAD (64 * 1024)
+#define MAX_MESSAGE_LEN (FRAME_MAX_PAYLOAD - 256)   // Leaves room for the sender prefix on relay
+#define FRAME_SEAL_OVERHEAD 17                      // Inner type byte plus the Poly1305 tag
+#define FRAME_MAX_PLAINTEXT (FRAME_MAX_PAYLOAD - FRAME_SEAL_OVERHEAD)  // Largest payload that can be sealed
+#define FRAME_CHAT_HDR_LEN 16                       // Sequence number and timestamp on relayed chat
+#define FRAME_INITIAL_BUF 4096
+#define FRAME_SEND_TIMEOUT_MS 1000   // How long to wait to finish a partially sent frame
+#define FRAME_CELL_DATA 498          // Stream bytes in one Tor relay cell: 509 less the relay header
+#define FRAME_PADDING_MIN (FRAME_HDR_LEN + FRAME_SEAL_OVERHEAD)  // Sealed size of an empty FRAME_PADDING
+#define FRAME_PING_MAX 8
+#define FRAME_FEATURE_COMPRESS 0x01  // Handshake feature bit: FRAME_COMPRESSED may be used
+
+enum frame_type {
+    FRAME_CHAT = 1,          // Chat message; relayed ones start with sequence and time
+    FRAME_NOTICE = 2,        // Informational text from the server
+    FRAME_AUTH_PROMPT = 3,   // Server asks for a password
+    FRAME_AUTH = 4,          // Client login: user name, a NUL byte, then the password
+    FRAME_AUTH_OK = 5,       // Authentication succeeded
+    FRAME_AUTH_FAIL = 6,     // Authentication failed for good, connection closing
+    FRAME_HANDSHAKE = 7,     // Noise handshake message
+    FRAME_SEALED = 8,        // Encrypted frame carrying one of the above
+    FRAME_HISTORY = 9,       // Replay request: first sequence (8), at most this many messages (4, 0 for all)
+    FRAME_HISTORY_END = 10,  // Replay done: first and one-past-last sequence replayed (8 + 8)
+    FRAME_TICKET = 11,       // Resumption ticket for the next connection (see ticket.h)
+    FRAME_RESUME = 12,       // Login with a ticket: last sequence the client has (8), then the ticket
+    FRAME_JOIN = 13,         // Join a room: its name
+    FRAME_LEAVE = 14,        // Leave a room: its name
+    FRAME_ROOM = 15,         // Chat in a room: room name, a NUL byte, then the text
+    FRAME_DIRECT = 16,       // Direct message: recipient, a NUL byte, then the text
+    FRAME_FILE_OFFER = 17,   // File manifest, to the server preceded by the NUL-terminated target
+    FRAME_FILE_CHUNK = 18,   // File ID (16), chunk index (4), then the chunk
+    FRAME_FILE_ACK = 19,     // File ID (16), chunks the server holds from the first (4)
+    FRAME_FILE_GET = 20,     // Download: file ID (16), first chunk wanted (4)
+    FRAME_PADDING = 21,      // Filler, sealed only, ignored on receipt
+    FRAME_PING = 22,         // Heartbeat, up to FRAME_PING_MAX opaque bytes
+    FRAME_PONG = 23,         // Reply to a ping, echoing its payload
+    FRAME_PEER_HELLO = 24,   // Node login: node key (32), origin (8), proof (32)
+    FRAME_PEER_WELCOME = 25, // Node accepted: last sequence taken from its origin (8), proof (32)
+    FRAME_PEER_INTEREST = 26,// Room or user a node has gained (1) or lost (0): kind, flag, name
+    FRAME_PEER_MSG = 27,     // Relayed message: origin (8), sequence (8), inner type, inner payload
+    FRAME_COMPRESSED = 28    // Compressed frame, sealed only: inner type, then the compressed payload
+};
+
+// A decoded frame. The payload points into the reader's buffer and stays
+// valid until the next frame_reader_fill() or frame_reader_append() on that
+// reader.
+struct frame {
+    uint8_t type;
+    uint32_t len;
+    const unsigned char *payload;
+};
+
+// Incremental decoder state for one connection
+struct frame_reader {
+    unsigned char *buf;
+    size_t cap;
+    size_t head;    // Start of data not yet returned as a frame
+    size_t tail;    // End of received data
+};
+
+void frame_reader_init(struct frame_reader *r);
+void frame_reader_free(struct frame_reader *r);
+
+// Give the buffer back to the pool if it holds nothing, so an idle
+// connection keeps none. Payloads of frames already popped go with it.
+void frame_reader_release(struct frame_reader *r);
+
+// Read once from fd into the buffer. Returns the number of bytes read,
+// 0 on EOF, or -1 with errno set (EAGAIN on a drained non-blocking socket).
+ssize_t frame_reader_fill(struct frame_reader *r, int fd);
+
+// Add bytes received elsewhere, such as by an io_uring receive, as if
+// read by frame_reader_fill(). Returns -1 if out of memory.
+int frame_reader_append(struct frame_reader *r, const void *data, size_t len);
+
+// Pop the next complete frame. Returns 1 if a frame was decoded, 0 if more
+// data is needed, or -1 if the peer sent an oversized frame.
+int frame_next(struct frame_reader *r, struct frame *f);
+
+void frame_encode_header(unsigned char *hdr, uint8_t type, uint32_t len);
+
+// Big-endian fields inside payloads
+static inline uint32_t frame_get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t frame_get_u64(const unsigned char *p) {
+    return ((uint64_t)frame_get_u32(p) << 32) | frame_get_u32(p + 4);
+}
+
+static inline void frame_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void frame_put_u64(unsigned char *p, uint64_t v) {
+    frame_put_u32(p, (uint32_t)(v >> 32));
+    frame_put_u32(p + 4, (uint32_t)v);
+}
+
+// Sealed size of the FRAME_PADDING frame that brings a burst of len sealed
+// bytes up to whole cells, or 0 if it already ends on a cell boundary.
+// Padding is never shorter than FRAME_PADDING_MIN, so a burst just short
+// of a boundary is carried on to the next one.
+static inline size_t frame_padding_len(size_t len) {
+    size_t pad = (FRAME_CELL_DATA - len % FRAME_CELL_DATA) % FRAME_CELL_DATA;
+    return pad == 0 || pad >= FRAME_PADDING_MIN ? pad : pad + FRAME_CELL_DATA;
+}
+
+// Send one whole frame. On a non-blocking socket a frame that cannot be
+// started is dropped (-1, errno EAGAIN); one that was started is finished
+// so the stream never carries a torn frame.
+int frame_send(int fd, uint8_t type, const void *payload, size_t len);
+
+#endif
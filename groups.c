@@ -0,0 +1,150 @@
+// groups.c
+// Named member sets, see groups.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "groups.h"
+
+// FNV-1a
+static uint32_t hash_name(const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+int group_table_init(struct group_table *t) {
+    t->slots = calloc(GROUP_TABLE_MIN, sizeof(*t->slots));
+    if (!t->slots) return -1;
+    t->mask = GROUP_TABLE_MIN - 1;
+    t->count = 0;
+    return 0;
+}
+
+void group_table_free(struct group_table *t) {
+    if (!t->slots) return;
+    for (unsigned int i = 0; i <= t->mask; i++) {
+        if (!t->slots[i]) continue;
+        free(t->slots[i]->members);
+        free(t->slots[i]);
+    }
+    free(t->slots);
+    t->slots = NULL;
+}
+
+// Linear probing; the table is at most half full so a free slot always ends
+// the probe. Returns the slot holding name, or the free slot where it would go.
+static unsigned int find_slot(const struct group_table *t, const char *name, size_t len, uint32_t hash) {
+    unsigned int i = hash & t->mask;
+
+    while (t->slots[i]) {
+        const struct group *g = t->slots[i];
+        if (g->hash == hash && strlen(g->name) == len && memcmp(g->name, name, len) == 0) break;
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+struct group *group_find(const struct group_table *t, const char *name, size_t len) {
+    if (len == 0 || len > GROUP_NAME_MAX) return NULL;
+    return t->slots[find_slot(t, name, len, hash_name(name, len))];
+}
+
+static int grow(struct group_table *t) {
+    unsigned int size = (t->mask + 1) * 2;
+    struct group **slots = calloc(size, sizeof(*slots));
+    if (!slots) return -1;
+
+    for (unsigned int i = 0; i <= t->mask; i++) {
+        struct group *g = t->slots[i];
+        if (!g) continue;
+        unsigned int j = g->hash & (size - 1);
+        while (slots[j]) j = (j + 1) & (size - 1);
+        slots[j] = g;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask = size - 1;
+    return 0;
+}
+
+// Take g out of the table, shifting later entries of its probe run back so
+// no lookup ever stops early at the hole
+static void unlink_group(struct group_table *t, struct group *g) {
+    unsigned int i = g->hash & t->mask;
+    while (t->slots[i] != g) i = (i + 1) & t->mask;
+
+    unsigned int hole = i;
+    for (;;) {
+        i = (i + 1) & t->mask;
+        struct group *next = t->slots[i];
+        if (!next) break;
+
+        // next may fill the hole only if its home slot is not between the
+        // hole and where it sits now
+        unsigned int home = next->hash & t->mask;
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+            t->slots[hole] = next;
+            hole = i;
+        }
+    }
+    t->slots[hole] = NULL;
+    t->count--;
+}
+
+struct group *group_add(struct group_table *t, const char *name, size_t len, void *ref, unsigned int *pos) {
+    if (len == 0 || len > GROUP_NAME_MAX) return NULL;
+
+    uint32_t hash = hash_name(name, len);
+    unsigned int i = find_slot(t, name, len, hash);
+    struct group *g = t->slots[i];
+
+    if (!g) {
+        if ((t->count + 1) * 2 > t->mask + 1) {
+            if (grow(t) < 0) return NULL;
+            i = find_slot(t, name, len, hash);
+        }
+        g = calloc(1, sizeof(*g));
+        if (!g) return NULL;
+        memcpy(g->name, name, len);
+        g->hash = hash;
+        t->slots[i] = g;
+        t->count++;
+    }
+
+    if (g->count == g->cap) {
+        unsigned int cap = g->cap ? g->cap * 2 : GROUP_MEMBERS_MIN;
+        struct group_member *members = realloc(g->members, cap * sizeof(*members));
+        if (!members) {
+            if (g->count == 0) {
+                unlink_group(t, g);
+                free(g);
+            }
+            return NULL;
+        }
+        g->members = members;
+        g->cap = cap;
+    }
+
+    g->members[g->count].ref = ref;
+    g->members[g->count].pos = pos;
+    *pos = g->count++;
+    return g;
+}
+
+int group_remove(struct group_table *t, struct group *g, unsigned int pos) {
+    struct group_member *last = &g->members[--g->count];
+    if (pos != g->count) {
+        g->members[pos] = *last;
+        *g->members[pos].pos = pos;
+    }
+    if (g->count > 0) return 0;
+
+    unlink_group(t, g);
+    free(g->members);
+    free(g);
+    return 1;
+}
@@ -0,0 +1,60 @@
+// groups.h
+// Named member sets in an open-addressing hash table
+//
+// Backs the room index (room name -> connections in it) and the user index
+// (user name -> that user's connections). A group holds its members in a
+// dense array, so sending to a group walks exactly its members and nothing
+// else. Every member keeps its own position in the array up to date through
+// a pointer it hands over when it joins, which makes leaving O(1): the last
+// member is moved into the hole and told its new position.
+//
+// Groups are allocated separately from the table, so a group pointer stays
+// valid as the table grows and other groups come and go; a group is freed
+// as soon as its last member leaves. A table belongs to one thread and is
+// not locked.
+
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GROUP_NAME_MAX 32             // Longest group name
+#define GROUP_TABLE_MIN 64            // Initial slot count, a power of two
+#define GROUP_MEMBERS_MIN 4           // Initial member capacity of a new group
+
+struct group_member {
+    void *ref;
+    unsigned int *pos;                // Where the member keeps its index in members
+};
+
+struct group {
+    char name[GROUP_NAME_MAX + 1];
+    uint32_t hash;
+    unsigned int count;
+    unsigned int cap;
+    struct group_member *members;
+    void *data;                       // The owner's, such as per-user state; never touched by the table
+};
+
+struct group_table {
+    struct group **slots;             // NULL for a free slot
+    unsigned int mask;                // Slot count minus one, a power of two
+    unsigned int count;
+};
+
+int group_table_init(struct group_table *t);
+void group_table_free(struct group_table *t);
+
+struct group *group_find(const struct group_table *t, const char *name, size_t len);
+
+// Add ref to the group called name, creating the group if needed, and store
+// its position in *pos. name must be 1 to GROUP_NAME_MAX bytes. Returns the
+// group, or NULL if out of memory.
+struct group *group_add(struct group_table *t, const char *name, size_t len, void *ref, unsigned int *pos);
+
+// Remove the member at pos. Returns 1 if that emptied the group, which is
+// then freed, or 0. Anything hung on data must be freed first.
+int group_remove(struct group_table *t, struct group *g, unsigned int pos);
+
+#endif
@@ -0,0 +1,451 @@
+// history.c
+// Segmented, memory-mapped chat log, see history.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame.h"
+#include "history.h"
+
+#define SEGMENT_NAME_LEN 24           // 20 digits of first sequence, then ".log"
+
+struct index_entry {
+    uint64_t seq;
+    uint64_t time_ms;
+    size_t offset;
+};
+
+struct history_segment {
+    int refs;                         // The segment list holds one, each cursor another
+    int fd;
+    unsigned char *base;
+    size_t map_len;
+    size_t end;                       // Bytes of complete records, published with release
+    int writable;                     // Still being appended to
+    uint64_t first_seq;
+    uint64_t next_seq;                // One past the last record
+    uint64_t first_time;
+    uint64_t last_time;
+    struct index_entry *index;        // Sparse, ascending
+    unsigned int index_len;
+    unsigned int index_cap;
+    size_t next_index_at;             // Offset from which the next record gets an entry
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static char log_dir[256];
+static struct history_segment **segs; // Oldest first; the last one may be writable
+static unsigned int num_segs;
+static unsigned int segs_cap;
+static uint64_t next_seq = 1;
+static uint64_t total_bytes;
+static int append_failing;            // Warned about a failed segment, quiet until one works
+
+static uint64_t wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void segment_path(char *path, size_t cap, uint64_t first_seq) {
+    snprintf(path, cap, "%s/%020llu.log", log_dir, (unsigned long long)first_seq);
+}
+
+static struct history_segment *segment_ref(struct history_segment *s) {
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+static void segment_unref(struct history_segment *s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    munmap(s->base, s->map_len);
+    close(s->fd);
+    free(s->index);
+    free(s);
+}
+
+// Length of the record at off if it is a complete chat frame numbered seq,
+// otherwise 0. Used to find where a segment really ends after a restart.
+static size_t record_len(const struct history_segment *s, size_t off, uint64_t seq) {
+    if (off + FRAME_HDR_LEN + FRAME_CHAT_HDR_LEN > s->map_len) return 0;
+
+    const unsigned char *p = s->base + off;
+    uint32_t len = frame_get_u32(p);
+    if (len < FRAME_CHAT_HDR_LEN || len > FRAME_MAX_PLAINTEXT || p[4] != FRAME_CHAT) return 0;
+    if (off + FRAME_HDR_LEN + len > s->map_len) return 0;
+    if (frame_get_u64(p + FRAME_HDR_LEN) != seq) return 0;
+    return FRAME_HDR_LEN + len;
+}
+
+// Note a record just written or recovered at off
+static int index_record(struct history_segment *s, uint64_t seq, uint64_t time_ms, size_t off) {
+    if (s->index_len == 0) s->first_time = time_ms;
+    s->last_time = time_ms;
+    if (s->index_len > 0 && off < s->next_index_at) return 0;
+
+    if (s->index_len == s->index_cap) {
+        unsigned int cap = s->index_cap ? s->index_cap * 2 : 64;
+        struct index_entry *index = realloc(s->index, cap * sizeof(*index));
+        if (!index) return -1;
+        s->index = index;
+        s->index_cap = cap;
+    }
+    s->index[s->index_len++] = (struct index_entry){ .seq = seq, .time_ms = time_ms, .offset = off };
+    s->next_index_at = off + HISTORY_INDEX_STRIDE;
+    return 0;
+}
+
+static struct history_segment *segment_new(int fd, size_t map_len, int prot, uint64_t first_seq) {
+    struct history_segment *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+
+    s->base = mmap(NULL, map_len, prot, MAP_SHARED, fd, 0);
+    if (s->base == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    s->refs = 1;
+    s->fd = fd;
+    s->map_len = map_len;
+    s->first_seq = s->next_seq = first_seq;
+    return s;
+}
+
+// Start an empty, preallocated segment for messages from first_seq on
+static struct history_segment *segment_create(uint64_t first_seq) {
+    char path[512];
+
+    segment_path(path, sizeof(path), first_seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+
+    struct history_segment *s = NULL;
+    if (ftruncate(fd, HISTORY_SEGMENT_SIZE) == 0) {
+        s = segment_new(fd, HISTORY_SEGMENT_SIZE, PROT_READ | PROT_WRITE, first_seq);
+    }
+    if (!s) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    s->writable = 1;
+    return s;
+}
+
+// Map an existing segment and walk its records to rebuild the index.
+// Whatever follows the last complete record, such as the unused tail of a
+// preallocated segment or a record torn by a crash, is cut off.
+static struct history_segment *segment_load(uint64_t first_seq) {
+    char path[512];
+    struct stat st;
+
+    segment_path(path, sizeof(path), first_seq);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    struct history_segment *s = segment_new(fd, st.st_size, PROT_READ, first_seq);
+    if (!s) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len;
+    while ((len = record_len(s, s->end, s->next_seq)) > 0) {
+        uint64_t time_ms = frame_get_u64(s->base + s->end + FRAME_HDR_LEN + 8);
+        if (index_record(s, s->next_seq, time_ms, s->end) < 0) break;
+        s->end += len;
+        s->next_seq++;
+    }
+
+    if (s->end == 0) {
+        segment_unref(s);
+        unlink(path);
+        return NULL;
+    }
+    if ((size_t)st.st_size > s->end && ftruncate(fd, s->end) < 0) {
+        perror("history: ftruncate");
+    }
+    return s;
+}
+
+// Stop appending to a segment and give back its unused preallocation
+static void segment_seal(struct history_segment *s) {
+    if (!s->writable) return;
+    s->writable = 0;
+    msync(s->base, s->end, MS_ASYNC);
+    if (ftruncate(s->fd, s->end) < 0) perror("history: ftruncate");
+}
+
+static int segs_push(struct history_segment *s) {
+    if (num_segs == segs_cap) {
+        unsigned int cap = segs_cap ? segs_cap * 2 : 16;
+        struct history_segment **list = realloc(segs, cap * sizeof(*list));
+        if (!list) return -1;
+        segs = list;
+        segs_cap = cap;
+    }
+    segs[num_segs++] = s;
+    return 0;
+}
+
+// Index of the segment holding seq, or of the first one after it if seq
+// is not kept. num_segs if there is none. Called with log_lock held.
+static unsigned int find_segment(uint64_t seq) {
+    unsigned int lo = 0, hi = num_segs;
+
+    // First segment starting after seq
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (segs[mid]->first_seq <= seq) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0 && seq < segs[lo - 1]->next_seq) return lo - 1;
+    return lo;
+}
+
+// Offset of the first record >= seq in s: binary search over the sparse
+// index, then a scan of at most one stride
+static size_t locate(const struct history_segment *s, uint64_t seq) {
+    unsigned int lo = 0, hi = s->index_len;
+    size_t end = __atomic_load_n(&s->end, __ATOMIC_ACQUIRE);
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (s->index[mid].seq <= seq) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    size_t off = s->index[lo - 1].offset;
+    while (off < end && frame_get_u64(s->base + off + FRAME_HDR_LEN) < seq) {
+        off += FRAME_HDR_LEN + frame_get_u32(s->base + off);
+    }
+    return off;
+}
+
+// Delete whole segments, oldest first, while the log is over its size or
+// age limit. The newest segment is always kept. Called with log_lock held.
+static void enforce_retention(uint64_t now) {
+    char path[512];
+
+    while (num_segs > 1) {
+        struct history_segment *s = segs[0];
+        int too_big = total_bytes > HISTORY_MAX_BYTES;
+        int too_old = s->last_time + HISTORY_MAX_AGE_S * 1000ULL < now;
+        if (!too_big && !too_old) break;
+
+        memmove(segs, segs + 1, (num_segs - 1) * sizeof(*segs));
+        num_segs--;
+        total_bytes -= s->end;
+
+        // Cursors still replaying it keep the mapping alive
+        segment_path(path, sizeof(path), s->first_seq);
+        unlink(path);
+        segment_unref(s);
+    }
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int history_open(const char *dir) {
+    uint64_t *found = NULL;
+    unsigned int count = 0, cap = 0;
+
+    snprintf(log_dir, sizeof(log_dir), "%s", dir);
+    if (mkdir(log_dir, 0700) < 0 && errno != EEXIST) return -1;
+
+    DIR *d = opendir(log_dir);
+    if (!d) return -1;
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char *end;
+        if (strlen(e->d_name) != SEGMENT_NAME_LEN) continue;
+        unsigned long long seq = strtoull(e->d_name, &end, 10);
+        if (strcmp(end, ".log") != 0 || seq == 0) continue;
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *list = realloc(found, cap * sizeof(*list));
+            if (!list) break;
+            found = list;
+        }
+        found[count++] = seq;
+    }
+    closedir(d);
+    qsort(found, count, sizeof(*found), cmp_seq);
+
+    pthread_mutex_lock(&log_lock);
+    for (unsigned int i = 0; i < count; i++) {
+        // Segments never overlap; one that does is left over from a crash
+        // in the middle of a rotation
+        if (found[i] < next_seq) continue;
+
+        struct history_segment *s = segment_load(found[i]);
+        if (!s) continue;
+        if (segs_push(s) < 0) {
+            segment_unref(s);
+            break;
+        }
+        total_bytes += s->end;
+        next_seq = s->next_seq;
+    }
+    enforce_retention(wall_ms());
+    pthread_mutex_unlock(&log_lock);
+
+    free(found);
+    return 0;
+}
+
+void history_close(void) {
+    pthread_mutex_lock(&log_lock);
+    for (unsigned int i = 0; i < num_segs; i++) {
+        segment_seal(segs[i]);
+        segment_unref(segs[i]);
+    }
+    free(segs);
+    segs = NULL;
+    num_segs = segs_cap = 0;
+    total_bytes = 0;
+    pthread_mutex_unlock(&log_lock);
+}
+
+// The segment the next record of len bytes goes in, rotating if the
+// current one is full or too old. Called with log_lock held.
+static struct history_segment *writable_segment(uint64_t seq, size_t len, uint64_t now) {
+    struct history_segment *s = num_segs ? segs[num_segs - 1] : NULL;
+
+    if (s && s->writable && s->end + len <= s->map_len &&
+        (s->end == 0 || now - s->first_time < HISTORY_SEGMENT_MAX_AGE_S * 1000ULL)) {
+        return s;
+    }
+    if (s) segment_seal(s);
+
+    s = segment_create(seq);
+    if (!s || segs_push(s) < 0) {
+        if (s) segment_unref(s);
+        if (!append_failing) perror("history: cannot start a new segment");
+        append_failing = 1;
+        return NULL;
+    }
+    append_failing = 0;
+    return s;
+}
+
+uint64_t history_append(unsigned char *frame, size_t len) {
+    uint64_t now = wall_ms();
+
+    pthread_mutex_lock(&log_lock);
+    uint64_t seq = next_seq++;
+    frame_put_u64(frame + FRAME_HDR_LEN, seq);
+    frame_put_u64(frame + FRAME_HDR_LEN + 8, now);
+
+    struct history_segment *s = writable_segment(seq, len, now);
+    if (s) {
+        size_t off = s->end;
+
+        // Length last, so a record torn by a crash fails validation on
+        // the next start instead of replaying half a message
+        memcpy(s->base + off + 4, frame + 4, len - 4);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        memcpy(s->base + off, frame, 4);
+
+        index_record(s, seq, now, off);
+        s->next_seq = seq + 1;
+        total_bytes += len;
+        __atomic_store_n(&s->end, off + len, __ATOMIC_RELEASE);
+        enforce_retention(now);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return seq;
+}
+
+uint64_t history_seek(struct history_cursor *cur, uint64_t since, uint32_t max) {
+    memset(cur, 0, sizeof(*cur));
+
+    pthread_mutex_lock(&log_lock);
+    uint64_t end = next_seq;
+    uint64_t start = num_segs && since < segs[0]->first_seq ? segs[0]->first_seq : since;
+    if (start > end) start = end;
+    if (max && end - start > max) start = end - max;
+
+    unsigned int i = start < end ? find_segment(start) : num_segs;
+    if (i < num_segs) {
+        struct history_segment *s = segs[i];
+        if (start < s->first_seq) start = s->first_seq;
+        cur->seg = segment_ref(s);
+        cur->off = locate(s, start);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    cur->first_seq = cur->next_seq = start;
+    cur->end_seq = end;
+    return end - start;
+}
+
+// Move a cursor that reached the end of its segment into the next one
+static void next_segment(struct history_cursor *cur) {
+    struct history_segment *next = NULL;
+
+    pthread_mutex_lock(&log_lock);
+    unsigned int i = find_segment(cur->next_seq);
+    if (i < num_segs && segs[i] != cur->seg) {
+        next = segment_ref(segs[i]);
+        if (cur->next_seq < next->first_seq) cur->next_seq = next->first_seq;
+        cur->off = locate(next, cur->next_seq);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    segment_unref(cur->seg);
+    cur->seg = next;
+}
+
+const unsigned char *history_peek(struct history_cursor *cur, size_t *len) {
+    while (cur->seg && cur->next_seq < cur->end_seq) {
+        struct history_segment *s = cur->seg;
+        if (cur->off < __atomic_load_n(&s->end, __ATOMIC_ACQUIRE)) {
+            const unsigned char *p = s->base + cur->off;
+            *len = FRAME_HDR_LEN + frame_get_u32(p);
+            return p;
+        }
+        next_segment(cur);
+    }
+    history_cursor_release(cur);
+    return NULL;
+}
+
+void history_advance(struct history_cursor *cur, size_t len) {
+    cur->next_seq = frame_get_u64(cur->seg->base + cur->off + FRAME_HDR_LEN) + 1;
+    cur->off += len;
+}
+
+void history_cursor_release(struct history_cursor *cur) {
+    if (cur->seg) segment_unref(cur->seg);
+    cur->seg = NULL;
+}
+
+void history_get_stats(struct history_stats *st) {
+    pthread_mutex_lock(&log_lock);
+    st->segments = num_segs;
+    st->bytes = total_bytes;
+    st->first_seq = num_segs ? segs[0]->first_seq : next_seq;
+    st->next_seq = next_seq;
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,79 @@
+// history.h
+// Persistent chat history: an append-only log of chat frames kept in
+// memory-mapped segment files
+//
+// Every relayed chat message is stored exactly as it goes to clients, a
+// FRAME_CHAT frame whose payload starts with its sequence number and time.
+// Replaying history therefore needs no decoding or re-encoding: a reader
+// walks records straight out of the mapping and hands each frame to the
+// connection as it is.
+//
+// The log is a directory of segments, each named after the first sequence
+// number it holds. The newest segment is preallocated and appended to
+// through its mapping; once it is full or old enough a new one is started.
+// Each segment keeps a sparse index, one (sequence, time, offset) entry per
+// HISTORY_INDEX_STRIDE bytes, so finding "since sequence N" is a binary
+// search plus a short scan. Whole segments are deleted, oldest first, to
+// keep the log within HISTORY_MAX_BYTES and HISTORY_MAX_AGE_S.
+//
+// Appends from every thread are serialised by one lock. Readers hold a
+// reference on the segment they are in and only read up to the end
+// published after each append, so a replay never blocks a writer.
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_SEGMENT_SIZE (16 * 1024 * 1024)   // Preallocated size of a new segment
+#define HISTORY_SEGMENT_MAX_AGE_S (24 * 3600)      // Start a new segment at least this often
+#define HISTORY_MAX_BYTES (256 * 1024 * 1024)      // Total log size kept
+#define HISTORY_MAX_AGE_S (30 * 24 * 3600)         // Segments whose last message is older are deleted
+#define HISTORY_INDEX_STRIDE 4096                  // Log bytes between sparse index entries
+
+struct history_segment;
+
+// A replay in progress over [first_seq, end_seq)
+struct history_cursor {
+    struct history_segment *seg;  // Referenced segment, NULL once done
+    size_t off;                   // Offset of the next record in seg
+    uint64_t next_seq;            // Sequence number of the next record
+    uint64_t first_seq;
+    uint64_t end_seq;
+};
+
+struct history_stats {
+    unsigned int segments;
+    uint64_t bytes;
+    uint64_t first_seq;           // Oldest message still kept
+    uint64_t next_seq;            // Sequence the next message will get
+};
+
+// Open or create the log in dir and recover every segment in it.
+// Returns -1 if the directory cannot be used.
+int history_open(const char *dir);
+void history_close(void);
+
+// Stamp a FRAME_CHAT frame of len bytes with the next sequence number and
+// the current time, writing both into its payload header, and append it.
+// Returns the sequence number. The message keeps its number even if it
+// could not be written to disk.
+uint64_t history_append(unsigned char *frame, size_t len);
+
+// Position cur at the first kept message with sequence >= since, but no
+// more than max messages (0 for no limit) before the newest. Returns the
+// number of messages the cursor will yield.
+uint64_t history_seek(struct history_cursor *cur, uint64_t since, uint32_t max);
+
+// The next record as a complete frame, or NULL once the replay is done.
+// The pointer stays valid until history_advance() or release.
+const unsigned char *history_peek(struct history_cursor *cur, size_t *len);
+void history_advance(struct history_cursor *cur, size_t len);
+
+// Drop the cursor's segment reference; safe on a finished or zeroed cursor
+void history_cursor_release(struct history_cursor *cur);
+
+void history_get_stats(struct history_stats *s);
+
+#endif
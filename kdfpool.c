@@ -0,0 +1,170 @@
+// kdfpool.c
+// Password verification workers, see kdfpool.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "crypto.h"
+#include "kdfpool.h"
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct kdf_job *queue_head, *queue_tail;
+static int queue_len;
+static int queue_max;
+static int pool_stopping;
+static pthread_t threads[KDF_MAX_WORKERS];
+static int num_workers;
+static struct kdf_stats stats;        // Guarded by pool_lock
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int kdf_done_init(struct kdf_done *d) {
+    memset(d, 0, sizeof(*d));
+    pthread_mutex_init(&d->lock, NULL);
+    d->event_fd = eventfd(0, EFD_NONBLOCK);
+    return d->event_fd < 0 ? -1 : 0;
+}
+
+struct kdf_job *kdf_done_take(struct kdf_done *d) {
+    uint64_t count;
+    if (read(d->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    pthread_mutex_lock(&d->lock);
+    struct kdf_job *list = d->head;
+    d->head = d->tail = NULL;
+    pthread_mutex_unlock(&d->lock);
+    return list;
+}
+
+static void deliver(struct kdf_job *job) {
+    struct kdf_done *d = job->done;
+
+    job->next = NULL;
+    pthread_mutex_lock(&d->lock);
+    int was_empty = d->head == NULL;
+    if (d->tail) d->tail->next = job;
+    else d->head = job;
+    d->tail = job;
+    pthread_mutex_unlock(&d->lock);
+
+    // The loop drains the whole list per wakeup, so only the first
+    // completion needs to signal it
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(d->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (!queue_head && !pool_stopping) pthread_cond_wait(&pool_cond, &pool_lock);
+        if (pool_stopping) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        struct kdf_job *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        uint64_t start = now_ns();
+        job->wait_ns = start - job->queued_ns;
+        int r = argon2id_verify(&job->params, job->password, job->password_len);
+        job->result = job->known_user ? r : 0;
+        job->kdf_ns = now_ns() - start;
+        crypto_wipe(job->password, sizeof(job->password));
+
+        pthread_mutex_lock(&pool_lock);
+        queue_len--;
+        stats.completed++;
+        stats.total_wait_ns += job->wait_ns;
+        stats.total_kdf_ns += job->kdf_ns;
+        pthread_mutex_unlock(&pool_lock);
+
+        deliver(job);
+    }
+}
+
+int kdf_pool_start(int workers, int max_queued) {
+    if (workers < 1) workers = 1;
+    if (workers > KDF_MAX_WORKERS) workers = KDF_MAX_WORKERS;
+    queue_max = max_queued;
+
+    for (num_workers = 0; num_workers < workers; num_workers++) {
+        if (pthread_create(&threads[num_workers], NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            kdf_pool_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void kdf_pool_stop(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < num_workers; i++) pthread_join(threads[i], NULL);
+    num_workers = 0;
+
+    // Nobody is left to answer queued logins
+    while (queue_head) {
+        struct kdf_job *job = queue_head;
+        queue_head = job->next;
+        kdf_job_free(job);
+    }
+    queue_tail = NULL;
+    queue_len = 0;
+}
+
+int kdf_pool_submit(struct kdf_job *job) {
+    job->next = NULL;
+    job->queued_ns = now_ns();
+
+    pthread_mutex_lock(&pool_lock);
+    if (queue_len >= queue_max || pool_stopping) {
+        stats.rejected++;
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    if (queue_tail) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    queue_len++;
+    if ((uint64_t)queue_len > stats.peak_queued) stats.peak_queued = queue_len;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+void kdf_pool_stats(struct kdf_stats *s) {
+    pthread_mutex_lock(&pool_lock);
+    *s = stats;
+    s->queued = queue_len;
+    s->workers = num_workers;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void kdf_job_free(struct kdf_job *job) {
+    crypto_wipe(job, sizeof(*job));
+    free(job);
+}
@@ -0,0 +1,73 @@
+// kdfpool.h
+// Worker threads for password verification
+//
+// Argon2id is deliberately slow and memory-hard, so running it on an event
+// loop would stall every other connection on that thread. Event loops hand
+// each login to this pool instead and carry on. A worker runs the KDF and
+// pushes the finished job onto the completion list of the loop that asked,
+// then signals that loop's eventfd. Only the first completion since the
+// loop last drained its list costs a write.
+//
+// The job queue is bounded. At most `workers` hashes run at once, which
+// also bounds the memory the KDF can take.
+
+#ifndef KDFPOOL_H
+#define KDFPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "argon2.h"
+
+#define KDF_MAX_PASSWORD 1024         // Longest password accepted
+#define KDF_MAX_WORKERS 64
+
+// Finished jobs waiting for one event loop
+struct kdf_done {
+    pthread_mutex_t lock;
+    struct kdf_job *head;
+    struct kdf_job *tail;
+    int event_fd;                     // Readable while the list is non-empty
+};
+
+struct kdf_job {
+    struct kdf_job *next;
+    struct kdf_done *done;            // Where to deliver the result
+    void *owner;                      // Caller's connection, NULL once it is gone
+    struct argon2_params params;
+    int known_user;                   // 0 if params are a decoy for an unknown user
+    char password[KDF_MAX_PASSWORD];
+    size_t password_len;
+    int result;                       // 1 match, 0 mismatch, -1 error
+    uint64_t queued_ns;
+    uint64_t wait_ns;                 // Time spent queued
+    uint64_t kdf_ns;                  // Time spent hashing
+};
+
+struct kdf_stats {
+    uint64_t completed;
+    uint64_t rejected;                // Refused because the queue was full
+    uint64_t queued;                  // Waiting or running right now
+    uint64_t peak_queued;
+    uint64_t total_wait_ns;
+    uint64_t total_kdf_ns;
+    int workers;
+};
+
+int kdf_done_init(struct kdf_done *d);
+
+// Take every finished job, oldest first, and reset the eventfd
+struct kdf_job *kdf_done_take(struct kdf_done *d);
+
+int kdf_pool_start(int workers, int max_queued);
+void kdf_pool_stop(void);
+
+// Queue a job. Returns -1 if the queue is full.
+int kdf_pool_submit(struct kdf_job *job);
+
+void kdf_pool_stats(struct kdf_stats *s);
+
+// Wipe and free a job once its result has been used
+void kdf_job_free(struct kdf_job *job);
+
+#endif
@@ -0,0 +1,343 @@
+// log.c
+// Asynchronous event log, see log.h
+
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_FIELD_MAX 48          // Longest ip or user name kept per record
+#define LOG_BATCH_BUF (64 * 1024) // Output gathered before each write
+#define LOG_LINE_MAX 4096         // Room one formatted record may need
+
+#define COLOR_RED    "\x1b[31m"
+#define COLOR_YELLOW "\x1b[33m"
+#define COLOR_RESET  "\x1b[0m"
+
+struct log_record {
+    unsigned int seq;             // Ring position this slot is ready for, see log_event
+    uint8_t level;
+    int16_t thread;
+    uint16_t port;
+    uint16_t len;
+    uint64_t ms;                  // Real time in milliseconds
+    const char *event;
+    char ip[LOG_FIELD_MAX];
+    char user[LOG_FIELD_MAX];
+    char text[LOG_TEXT_MAX];
+};
+
+// Bounded MPSC queue after Vyukov: each slot carries the position it is
+// ready for, so producers only contend on the tail CAS and the consumer
+// never touches the tail at all
+static struct {
+    _Alignas(64) unsigned int tail;  // Next position to claim, shared by producers
+    _Alignas(64) unsigned int head;  // Next position to read, writer only
+    _Alignas(64) uint64_t dropped;
+    uint64_t written;
+    struct log_record *slots;
+} ring;
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+static int min_level = LOG_INFO;
+static int log_fd = -1;
+static const char *log_path;
+static uint64_t log_size;
+static int stopping;
+static int running;
+static pthread_t writer;
+static __thread int thread_id = -1;
+
+// Writer state: output buffers and the time stamp cache
+static char file_buf[LOG_BATCH_BUF];
+static size_t file_len;
+static char console_buf[LOG_BATCH_BUF];
+static size_t console_len;
+static time_t stamp_sec = -1;
+static char stamp_iso[32];    // UTC, for the file
+static char stamp_clock[16];  // Local wall clock, for the console
+
+int log_level_parse(const char *name) {
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+        if (strcmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void log_set_thread(int id) {
+    thread_id = id;
+}
+
+uint64_t log_dropped() {
+    return __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t log_written() {
+    return __atomic_load_n(&ring.written, __ATOMIC_RELAXED);
+}
+
+static void copy_field(char *dst, const char *src) {
+    if (!src) {
+        dst[0] = '\0';
+        return;
+    }
+    size_t n = strnlen(src, LOG_FIELD_MAX - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+void log_event(enum log_level level, const char *event, const char *ip, int port,
+               const char *user, const char *fmt, ...) {
+    if ((int)level < min_level || !ring.slots) return;
+
+    // Claim a position whose slot the writer has released
+    unsigned int mask = LOG_RING_SIZE - 1;
+    unsigned int pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+    struct log_record *r;
+    for (;;) {
+        r = &ring.slots[pos & mask];
+        int diff = (int)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            // Still holds a record from one lap ago: full
+            __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    r->ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    r->level = level;
+    r->thread = thread_id;
+    r->event = event;
+    r->port = port;
+    copy_field(r->ip, ip);
+    copy_field(r->user, user);
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->text, sizeof(r->text), fmt, ap);
+    va_end(ap);
+    r->len = n < 0 ? 0 : (size_t)n >= sizeof(r->text) ? sizeof(r->text) - 1 : (size_t)n;
+
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void open_file() {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    log_size = log_fd >= 0 && fstat(log_fd, &st) == 0 ? st.st_size : 0;
+}
+
+// path.N-1 -> path.N, ..., path -> path.1, then start a fresh file
+static void rotate() {
+    char from[4096], to[4096];
+    close(log_fd);
+    for (int i = LOG_KEEP_FILES - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    rename(log_path, to);
+    open_file();
+}
+
+static void flush_output() {
+    if (file_len > 0 && log_fd >= 0) {
+        write_all(log_fd, file_buf, file_len);
+        log_size += file_len;
+        if (log_size >= LOG_MAX_BYTES) rotate();
+    }
+    file_len = 0;
+
+    if (console_len > 0) {
+        fwrite(console_buf, 1, console_len, stdout);
+        fflush(stdout);
+    }
+    console_len = 0;
+}
+
+static void update_stamp(uint64_t ms) {
+    time_t sec = ms / 1000;
+    if (sec == stamp_sec) return;
+
+    struct tm t;
+    gmtime_r(&sec, &t);
+    strftime(stamp_iso, sizeof(stamp_iso), "%Y-%m-%dT%H:%M:%S", &t);
+    localtime_r(&sec, &t);
+    strftime(stamp_clock, sizeof(stamp_clock), "%H:%M:%S", &t);
+    stamp_sec = sec;
+}
+
+// Append s as the inside of a JSON string
+static size_t json_escape(char *out, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\') {
+            out[o++] = '\\';
+            out[o++] = ch;
+        } else if (ch < 0x20 || ch == 0x7f) {
+            memcpy(out + o, "\\u00", 4);
+            out[o + 4] = hex[ch >> 4];
+            out[o + 5] = hex[ch & 15];
+            o += 6;
+        } else {
+            out[o++] = ch;
+        }
+    }
+    return o;
+}
+
+static void format_record(const struct log_record *r) {
+    if (file_len + LOG_LINE_MAX > sizeof(file_buf) || console_len + LOG_LINE_MAX > sizeof(console_buf)) {
+        flush_output();
+    }
+    update_stamp(r->ms);
+
+    char *out = file_buf + file_len;
+    size_t o = sprintf(out, "{\"time\":\"%s.%03uZ\",\"level\":\"%s\",\"event\":\"%s\"",
+                       stamp_iso, (unsigned int)(r->ms % 1000), level_names[r->level], r->event);
+    if (r->thread >= 0) o += sprintf(out + o, ",\"thread\":%d", r->thread);
+    if (r->ip[0]) o += sprintf(out + o, ",\"addr\":\"%s:%u\"", r->ip, r->port);
+    if (r->user[0]) {
+        o += sprintf(out + o, ",\"user\":\"");
+        o += json_escape(out + o, r->user, strlen(r->user));
+        out[o++] = '"';
+    }
+    o += sprintf(out + o, ",\"msg\":\"");
+    o += json_escape(out + o, r->text, r->len);
+    memcpy(out + o, "\"}\n", 3);
+    file_len += o + 3;
+
+    const char *color = r->level >= LOG_WARN ? COLOR_RED : "";
+    console_len += snprintf(console_buf + console_len, sizeof(console_buf) - console_len,
+                            COLOR_YELLOW "[%s] " COLOR_RESET "%s%.*s%s\n", stamp_clock, color,
+                            (int)r->len, r->text, color[0] ? COLOR_RESET : "");
+}
+
+// Write out every published record; returns how many there were
+static unsigned int drain() {
+    unsigned int n = 0;
+    for (;;) {
+        struct log_record *r = &ring.slots[ring.head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ring.head + 1) break;
+
+        format_record(r);
+        __atomic_store_n(&r->seq, ring.head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ring.head++;
+        n++;
+    }
+    if (n > 0) __atomic_fetch_add(&ring.written, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+static void report_dropped(uint64_t *reported) {
+    uint64_t dropped = log_dropped();
+    if (dropped == *reported) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    struct log_record r = {
+        .level = LOG_WARN,
+        .thread = -1,
+        .ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+        .event = "log",
+    };
+    int n = snprintf(r.text, sizeof(r.text), "%llu log record%s dropped, the log could not keep up",
+                     (unsigned long long)(dropped - *reported), dropped - *reported == 1 ? "" : "s");
+    r.len = n;
+    format_record(&r);
+    *reported = dropped;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    uint64_t reported = 0;
+    struct timespec pause = { 0, LOG_FLUSH_MS * 1000000L };
+
+    for (;;) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        unsigned int n = drain();
+        report_dropped(&reported);
+        flush_output();
+        if (n == 0) {
+            if (stop) break;
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_open(const char *path, enum log_level level) {
+    log_path = path;
+    min_level = level;
+    open_file();
+    if (log_fd < 0) {
+        fprintf(stderr, "log: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    ring.slots = calloc(LOG_RING_SIZE, sizeof(struct log_record));
+    if (!ring.slots) {
+        perror("calloc");
+        close(log_fd);
+        return -1;
+    }
+    for (unsigned int i = 0; i < LOG_RING_SIZE; i++) ring.slots[i].seq = i;
+
+    // Signals such as SIGHUP are taken through a signalfd on the main
+    // thread; the writer must never be the thread they are delivered to
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int r = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) {
+        perror("pthread_create");
+        free(ring.slots);
+        ring.slots = NULL;
+        close(log_fd);
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+void log_close() {
+    if (!running) return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    running = 0;
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,60 @@
+// log.h
+// Asynchronous event log: a lock-free ring drained by a writer thread
+//
+// Logging a line used to mean time(), localtime() and a printf to the
+// terminal from inside the event loop, so a slow terminal or a full pipe
+// stalled every client on that thread. Now an event-loop thread only
+// formats its message into a slot of a bounded multi-producer ring (one
+// CAS to claim it, one release store to publish it) and moves on. A single
+// writer thread drains the ring in batches, appends them as JSON lines to
+// a log file that it rotates by size, and echoes them to stdout.
+//
+// Nothing ever waits for the writer: when the ring is full a record is
+// dropped and counted, and the writer reports the loss in the log itself.
+// Record times come from the coarse real-time clock; the writer formats a
+// time stamp at most once per second.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#define LOG_RING_SIZE 8192               // Records in flight, a power of two
+#define LOG_TEXT_MAX 320                 // Longest message kept per record
+#define LOG_MAX_BYTES (64 * 1024 * 1024) // Log file size at which it is rotated
+#define LOG_KEEP_FILES 5                 // Rotated files kept as <path>.1 (newest) to <path>.N
+#define LOG_FLUSH_MS 20                  // Writer sleep when the ring is empty
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+// Start the writer thread, appending to path (created with mode 0600).
+// Records below min_level are discarded before they are formatted.
+// Returns 0, or -1 if the file cannot be opened.
+int log_open(const char *path, enum log_level min_level);
+
+// Write out everything still queued and stop the writer. Every thread that
+// logs must have stopped first.
+void log_close();
+
+// Parse "debug", "info", "warn" or "error"; -1 for anything else
+int log_level_parse(const char *name);
+
+// Label this thread's records with an event-loop thread number
+void log_set_thread(int id);
+
+// Log one event. event is a short fixed name such as "login" and must be a
+// string literal; ip, port and user describe the client it concerns and may
+// be NULL, 0 and NULL. The message is truncated to LOG_TEXT_MAX.
+void log_event(enum log_level level, const char *event, const char *ip, int port,
+               const char *user, const char *fmt, ...) __attribute__((format(printf, 6, 7)));
+
+// Records lost because the ring was full, and records written
+uint64_t log_dropped();
+uint64_t log_written();
+
+#endif
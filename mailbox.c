@@ -0,0 +1,486 @@
+// mailbox.c
+// Offline mailboxes with spill files, see mailbox.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "creds.h"
+#include "frame.h"
+#include "log.h"
+#include "mailbox.h"
+
+#define MAILBOX_SUFFIX ".mbox"
+#define TABLE_MIN 64                  // Initial bucket count, a power of two
+
+struct mailbox {
+    struct mailbox *hash_next;
+    struct mailbox *lru_prev;         // Mailboxes with a buffer, least recently written first
+    struct mailbox *lru_next;
+    char user[CREDS_MAX_USER + 1];
+    unsigned char *buf;               // Newest messages, as records
+    size_t buf_cap;
+    size_t buf_len;
+    uint64_t buf_count;
+    uint64_t disk_bytes;              // Older messages, in the spill file
+    uint64_t disk_count;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char box_dir[256];
+static struct mailbox **table;
+static unsigned int table_mask;
+static struct mailbox *lru_head;
+static struct mailbox *lru_tail;
+static struct mailbox_stats stats;
+
+// FNV-1a
+static uint32_t hash_user(const char *user) {
+    uint32_t h = 2166136261u;
+    for (; *user; user++) h = (h ^ (unsigned char)*user) * 16777619u;
+    return h;
+}
+
+static void box_path(char *path, size_t cap, const char *user, const char *suffix) {
+    snprintf(path, cap, "%s/%s%s", box_dir, user, suffix);
+}
+
+static struct mailbox *find(const char *user) {
+    struct mailbox *mb = table[hash_user(user) & table_mask];
+    while (mb && strcmp(mb->user, user) != 0) mb = mb->hash_next;
+    return mb;
+}
+
+static int grow_table(void) {
+    unsigned int size = (table_mask + 1) * 2;
+    struct mailbox **slots = calloc(size, sizeof(*slots));
+    if (!slots) return -1;
+
+    for (unsigned int i = 0; i <= table_mask; i++) {
+        while (table[i]) {
+            struct mailbox *mb = table[i];
+            table[i] = mb->hash_next;
+            unsigned int k = hash_user(mb->user) & (size - 1);
+            mb->hash_next = slots[k];
+            slots[k] = mb;
+        }
+    }
+    free(table);
+    table = slots;
+    table_mask = size - 1;
+    return 0;
+}
+
+static struct mailbox *find_or_add(const char *user) {
+    struct mailbox *mb = find(user);
+    if (mb) return mb;
+
+    // Grown at one mailbox per bucket; failing to grow only lengthens chains
+    if (stats.mailboxes > table_mask) grow_table();
+    mb = calloc(1, sizeof(*mb));
+    if (!mb) return NULL;
+    snprintf(mb->user, sizeof(mb->user), "%s", user);
+    unsigned int k = hash_user(user) & table_mask;
+    mb->hash_next = table[k];
+    table[k] = mb;
+    stats.mailboxes++;
+    return mb;
+}
+
+static void lru_unlink(struct mailbox *mb) {
+    if (mb->lru_prev) mb->lru_prev->lru_next = mb->lru_next;
+    else if (lru_head == mb) lru_head = mb->lru_next;
+    if (mb->lru_next) mb->lru_next->lru_prev = mb->lru_prev;
+    else if (lru_tail == mb) lru_tail = mb->lru_prev;
+    mb->lru_prev = mb->lru_next = NULL;
+}
+
+static void lru_append(struct mailbox *mb) {
+    mb->lru_prev = lru_tail;
+    mb->lru_next = NULL;
+    if (lru_tail) lru_tail->lru_next = mb;
+    else lru_head = mb;
+    lru_tail = mb;
+}
+
+static void remove_box(struct mailbox *mb) {
+    struct mailbox **p = &table[hash_user(mb->user) & table_mask];
+    while (*p != mb) p = &(*p)->hash_next;
+    *p = mb->hash_next;
+    lru_unlink(mb);
+    stats.mailboxes--;
+    free(mb);
+}
+
+static void drop_buffer(struct mailbox *mb) {
+    stats.mem_bytes -= mb->buf_cap;
+    free(mb->buf);
+    mb->buf = NULL;
+    mb->buf_cap = mb->buf_len = 0;
+    mb->buf_count = 0;
+    lru_unlink(mb);
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Append the buffer to the spill file and free it. A failed write is cut
+// back off, so the file only ever holds whole records.
+static int spill(struct mailbox *mb) {
+    char path[512];
+
+    box_path(path, sizeof(path), mb->user, MAILBOX_SUFFIX);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    if (write_all(fd, mb->buf, mb->buf_len) < 0) {
+        int saved = errno;
+        if (ftruncate(fd, mb->disk_bytes) < 0) {
+            // Nothing more to be done; the torn record is cut off on the next open
+        }
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+
+    mb->disk_bytes += mb->buf_len;
+    mb->disk_count += mb->buf_count;
+    stats.disk_bytes += mb->buf_len;
+    stats.spills++;
+    mb->buf_count = 0;
+    drop_buffer(mb);
+    return 0;
+}
+
+// Bytes of whole records at the start of p, and how many there are
+static size_t scan_records(const unsigned char *p, size_t len, uint64_t *count) {
+    size_t off = 0;
+
+    *count = 0;
+    while (len - off >= MAILBOX_REC_HDR + FRAME_HDR_LEN) {
+        size_t rec = MAILBOX_REC_HDR + FRAME_HDR_LEN + frame_get_u32(p + off + MAILBOX_REC_HDR);
+        if (rec > len - off) break;
+        off += rec;
+        (*count)++;
+    }
+    return off;
+}
+
+// Pick up a spill file left by an earlier run, cutting off a torn record.
+// One that cannot be read is left alone.
+static void load_box(const char *user) {
+    char path[512];
+    struct stat st;
+    uint64_t count = 0;
+    size_t len = 0;
+
+    box_path(path, sizeof(path), user, MAILBOX_SUFFIX);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            log_event(LOG_WARN, "mailbox", NULL, 0, NULL, "Cannot read messages for %s: %s", user, strerror(errno));
+            close(fd);
+            return;
+        }
+        len = scan_records(map, st.st_size, &count);
+        munmap(map, st.st_size);
+        if (len < (size_t)st.st_size && ftruncate(fd, len) < 0) len = 0;
+    }
+    close(fd);
+
+    struct mailbox *mb = count > 0 ? find_or_add(user) : NULL;
+    if (!mb) {
+        unlink(path);
+        return;
+    }
+    mb->disk_bytes = len;
+    mb->disk_count = count;
+    stats.disk_bytes += len;
+    stats.messages += count;
+}
+
+int mailbox_open(const char *dir) {
+    snprintf(box_dir, sizeof(box_dir), "%s", dir);
+    if (mkdir(box_dir, 0700) < 0 && errno != EEXIST) return -1;
+
+    table = calloc(TABLE_MIN, sizeof(*table));
+    if (!table) return -1;
+    table_mask = TABLE_MIN - 1;
+
+    DIR *d = opendir(box_dir);
+    if (!d) return -1;
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        // Left by a put-back that did not finish
+        if (strncmp(e->d_name, "tmp.", 4) == 0) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", box_dir, e->d_name);
+            unlink(path);
+            continue;
+        }
+
+        size_t len = strlen(e->d_name), suffix = strlen(MAILBOX_SUFFIX);
+        if (len <= suffix || strcmp(e->d_name + len - suffix, MAILBOX_SUFFIX) != 0) continue;
+
+        char user[CREDS_MAX_USER + 1];
+        if (!creds_valid_user(e->d_name, len - suffix)) continue;
+        memcpy(user, e->d_name, len - suffix);
+        user[len - suffix] = 0;
+        load_box(user);
+    }
+    closedir(d);
+    return 0;
+}
+
+void mailbox_close(void) {
+    pthread_mutex_lock(&lock);
+    for (unsigned int i = 0; table && i <= table_mask; i++) {
+        while (table[i]) {
+            struct mailbox *mb = table[i];
+            if (mb->buf_len > 0 && spill(mb) < 0) {
+                log_event(LOG_WARN, "mailbox", NULL, 0, NULL, "Cannot save messages for %s: %s", mb->user,
+                          strerror(errno));
+            }
+            table[i] = mb->hash_next;
+            free(mb->buf);
+            free(mb);
+        }
+    }
+    free(table);
+    table = NULL;
+    lru_head = lru_tail = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+int mailbox_put(const char *user, const unsigned char *frame, size_t len) {
+    size_t rec = MAILBOX_REC_HDR + len;
+    int err = 0;
+
+    pthread_mutex_lock(&lock);
+    struct mailbox *mb = find_or_add(user);
+    if (!mb) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    if (mb->disk_bytes + mb->buf_len + rec > MAILBOX_USER_MAX ||
+        stats.disk_bytes + stats.mem_bytes + rec > MAILBOX_TOTAL_MAX) {
+        stats.refused++;
+        err = ENOSPC;
+        goto out;
+    }
+    if (mb->buf_len > 0 && mb->buf_len + rec > MAILBOX_MEM_BYTES && spill(mb) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    if (mb->buf_len + rec > mb->buf_cap) {
+        size_t cap = mb->buf_cap ? mb->buf_cap * 2 : MAILBOX_INITIAL_BUF;
+        while (cap < mb->buf_len + rec) cap *= 2;
+        unsigned char *buf = realloc(mb->buf, cap);
+        if (!buf) {
+            err = ENOMEM;
+            goto out;
+        }
+        stats.mem_bytes += cap - mb->buf_cap;
+        mb->buf = buf;
+        mb->buf_cap = cap;
+    }
+
+    frame_put_u64(mb->buf + mb->buf_len, (uint64_t)time(NULL));
+    memcpy(mb->buf + mb->buf_len + MAILBOX_REC_HDR, frame, len);
+    mb->buf_len += rec;
+    mb->buf_count++;
+    stats.messages++;
+    stats.stored++;
+    lru_unlink(mb);
+    lru_append(mb);
+
+    // Over the memory cap: spill whoever has gone longest without mail
+    while (stats.mem_bytes > MAILBOX_TOTAL_MEM && lru_head != mb) {
+        struct mailbox *old = lru_head;
+        if (spill(old) == 0) continue;
+        log_event(LOG_WARN, "mailbox", NULL, 0, NULL, "Cannot spill messages for %s: %s", old->user, strerror(errno));
+        stats.lost += old->buf_count;
+        stats.messages -= old->buf_count;
+        drop_buffer(old);
+        if (old->disk_count == 0) remove_box(old);
+    }
+
+out:
+    if (mb && mb->buf_count + mb->disk_count == 0) remove_box(mb);
+    pthread_mutex_unlock(&lock);
+    if (err) errno = err;
+    return err ? -1 : 0;
+}
+
+uint64_t mailbox_take(const char *user, struct mailbox_drain *d) {
+    char path[512];
+
+    memset(d, 0, sizeof(*d));
+    pthread_mutex_lock(&lock);
+    struct mailbox *mb = find(user);
+    if (!mb) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    if (mb->disk_bytes > 0) {
+        box_path(path, sizeof(path), user, MAILBOX_SUFFIX);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        void *map = fd < 0 ? MAP_FAILED : mmap(NULL, mb->disk_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) close(fd);
+        if (map == MAP_FAILED) {
+            // Left where it is for the next login
+            log_event(LOG_WARN, "mailbox", NULL, 0, NULL, "Cannot read messages for %s: %s", user, strerror(errno));
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+        unlink(path);
+        d->map = map;
+        d->map_len = mb->disk_bytes;
+    }
+    d->mem = mb->buf;
+    d->mem_len = mb->buf_len;
+    mb->buf = NULL;
+
+    uint64_t count = mb->disk_count + mb->buf_count;
+    stats.messages -= count;
+    stats.delivered += count;
+    stats.disk_bytes -= mb->disk_bytes;
+    stats.mem_bytes -= mb->buf_cap;
+    remove_box(mb);
+    pthread_mutex_unlock(&lock);
+
+    const unsigned char *first = d->map ? d->map : d->mem;
+    d->oldest = first ? frame_get_u64(first) : 0;
+    return count;
+}
+
+// The record at the drain's position, or NULL if none is left whole
+static const unsigned char *next_record(const struct mailbox_drain *d, size_t *left) {
+    if (d->off < d->map_len) {
+        *left = d->map_len - d->off;
+        return d->map + d->off;
+    }
+    if (d->off - d->map_len < d->mem_len) {
+        *left = d->mem_len - (d->off - d->map_len);
+        return d->mem + (d->off - d->map_len);
+    }
+    return NULL;
+}
+
+const unsigned char *mailbox_peek(struct mailbox_drain *d, size_t *len) {
+    size_t left;
+    const unsigned char *rec = next_record(d, &left);
+
+    if (!rec || left < MAILBOX_REC_HDR + FRAME_HDR_LEN) return NULL;
+    *len = FRAME_HDR_LEN + frame_get_u32(rec + MAILBOX_REC_HDR);
+    if (*len > left - MAILBOX_REC_HDR) return NULL;
+    return rec + MAILBOX_REC_HDR;
+}
+
+void mailbox_advance(struct mailbox_drain *d, size_t len) {
+    d->off += MAILBOX_REC_HDR + len;
+}
+
+void mailbox_drain_release(struct mailbox_drain *d) {
+    if (d->map) munmap(d->map, d->map_len);
+    free(d->mem);
+    memset(d, 0, sizeof(*d));
+}
+
+// Write the undelivered rest of d, then whatever was spilled for the user
+// meanwhile, to a new spill file that replaces the old one
+static int write_returned(const char *user, const struct mailbox_drain *d, struct mailbox *mb, size_t *written) {
+    char path[512], tmp[512];
+    size_t map_off = d->off < d->map_len ? d->off : d->map_len;
+    size_t mem_off = d->off - map_off;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", box_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return -1;
+
+    int r = write_all(fd, d->map + map_off, d->map_len - map_off);
+    if (r == 0 && mem_off < d->mem_len) r = write_all(fd, d->mem + mem_off, d->mem_len - mem_off);
+
+    box_path(path, sizeof(path), user, MAILBOX_SUFFIX);
+    if (r == 0 && mb && mb->disk_bytes > 0) {
+        int in = open(path, O_RDONLY | O_CLOEXEC);
+        void *map = in < 0 ? MAP_FAILED : mmap(NULL, mb->disk_bytes, PROT_READ, MAP_PRIVATE, in, 0);
+        if (in >= 0) close(in);
+        r = map == MAP_FAILED ? -1 : write_all(fd, map, mb->disk_bytes);
+        if (map != MAP_FAILED) munmap(map, mb->disk_bytes);
+    }
+    if (close(fd) < 0 || r < 0 || rename(tmp, path) < 0) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    *written = d->map_len - map_off + (mem_off < d->mem_len ? d->mem_len - mem_off : 0);
+    return 0;
+}
+
+void mailbox_return(const char *user, struct mailbox_drain *d) {
+    size_t left, written;
+    uint64_t count = 0;
+
+    const unsigned char *rec = next_record(d, &left);
+    if (rec) {
+        // Whole records only; each part is counted on its own
+        size_t map_off = d->off < d->map_len ? d->off : d->map_len;
+        uint64_t n;
+        scan_records(d->map + map_off, d->map_len - map_off, &n);
+        count = n;
+        size_t mem_off = d->off - map_off;
+        if (mem_off < d->mem_len) {
+            scan_records(d->mem + mem_off, d->mem_len - mem_off, &n);
+            count += n;
+        }
+    }
+
+    if (count > 0) {
+        pthread_mutex_lock(&lock);
+        struct mailbox *mb = find(user);
+        if (write_returned(user, d, mb, &written) < 0) {
+            log_event(LOG_WARN, "mailbox", NULL, 0, NULL, "Cannot put back messages for %s: %s", user, strerror(errno));
+            stats.lost += count;
+        } else if ((mb = find_or_add(user)) != NULL) {
+            mb->disk_bytes += written;
+            mb->disk_count += count;
+            stats.disk_bytes += written;
+            stats.messages += count;
+            stats.delivered -= count;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    mailbox_drain_release(d);
+}
+
+void mailbox_get_stats(struct mailbox_stats *s) {
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    pthread_mutex_unlock(&lock);
+}
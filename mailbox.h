@@ -0,0 +1,88 @@
+// mailbox.h
+// Store-and-forward mailboxes for direct messages to users who are offline
+//
+// A direct message to a user with no connection is kept in their mailbox
+// and streamed to them in one batch, ahead of live chat, when they next
+// log in. Messages are stored as the FRAME_DIRECT frames they go out as,
+// each behind its arrival time, so draining a mailbox seals them straight
+// from where they lie, as a history replay does.
+//
+// A mailbox collects messages in a memory buffer. Once the next one would
+// take it past MAILBOX_MEM_BYTES, the buffer is appended to the user's
+// spill file, <user>.mbox in the mailbox directory, and emptied; the file
+// thus always holds the older messages and the buffer the newer ones. The
+// buffers of all users together are kept within MAILBOX_TOTAL_MEM by
+// spilling those written to least recently first, so accounts nobody logs
+// into any more end up costing disk rather than memory. A user with
+// MAILBOX_USER_MAX bytes waiting, or all of them with MAILBOX_TOTAL_MAX,
+// get no more until some are collected. Spill files survive restarts, and
+// every buffer is spilled at shutdown.
+//
+// All mailboxes share one lock, which is held across the occasional spill.
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAILBOX_MEM_BYTES (32 * 1024)               // Buffered per user before spilling to disk
+#define MAILBOX_TOTAL_MEM (16 * 1024 * 1024)        // Buffered for all users together
+#define MAILBOX_USER_MAX (4 * 1024 * 1024)          // Waiting for one user, on disk and in memory
+#define MAILBOX_TOTAL_MAX (1024ULL * 1024 * 1024)   // Waiting for all users together
+#define MAILBOX_INITIAL_BUF 1024
+#define MAILBOX_REC_HDR 8                           // Arrival time ahead of each stored frame
+
+// A mailbox taken for delivery: the spilled messages, then the buffered ones
+struct mailbox_drain {
+    unsigned char *map;           // Spill file, mapped, or NULL
+    size_t map_len;
+    unsigned char *mem;           // Buffer, or NULL
+    size_t mem_len;
+    size_t off;                   // Next record, counting from the start of map and on into mem
+    uint64_t oldest;              // Unix time the first message arrived
+};
+
+struct mailbox_stats {
+    unsigned int mailboxes;       // Users with messages waiting
+    uint64_t messages;            // Messages waiting
+    uint64_t mem_bytes;           // Held in buffers
+    uint64_t disk_bytes;          // Held in spill files
+    uint64_t stored;              // Messages taken in, in total
+    uint64_t delivered;           // ...handed over at login
+    uint64_t refused;             // ...turned away by a cap
+    uint64_t lost;                // ...dropped because a spill failed
+    uint64_t spills;              // Buffers written out
+};
+
+// Open or create the mailbox directory and pick up the spill files in it.
+// Returns -1 if the directory cannot be used.
+int mailbox_open(const char *dir);
+
+// Spill every buffer and forget all mailboxes
+void mailbox_close(void);
+
+// Store a frame of len bytes for user, who must be a valid user name.
+// Returns -1 with errno ENOSPC if a cap turns it away, or another errno if
+// it could not be spilled.
+int mailbox_put(const char *user, const unsigned char *frame, size_t len);
+
+// Empty user's mailbox into d. Returns the number of messages in it, 0 if
+// there were none (d is then empty).
+uint64_t mailbox_take(const char *user, struct mailbox_drain *d);
+
+// The next message as a complete frame, or NULL once all are out. The
+// pointer stays valid until mailbox_advance() or release.
+const unsigned char *mailbox_peek(struct mailbox_drain *d, size_t *len);
+void mailbox_advance(struct mailbox_drain *d, size_t len);
+
+// Put back whatever d has not yet handed out, ahead of anything stored for
+// user since it was taken, then release it
+void mailbox_return(const char *user, struct mailbox_drain *d);
+
+// Free what is left of d; safe on a finished or zeroed drain
+void mailbox_drain_release(struct mailbox_drain *d);
+
+void mailbox_get_stats(struct mailbox_stats *s);
+
+#endif
@@ -0,0 +1,83 @@
+// metrics.c
+// Counters and log-linear histograms, see metrics.h
+
+#include "metrics.h"
+
+static unsigned int bucket_of(uint64_t v) {
+    if (v < HIST_SUB) return (unsigned int)v;
+
+    unsigned int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (unsigned int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Largest value that falls in bucket i
+static uint64_t bucket_high(unsigned int i) {
+    if (i < HIST_SUB) return i;
+
+    unsigned int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB) << shift) + (1ull << shift) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t v) {
+    metric_add(&h->counts[bucket_of(v)], 1);
+    metric_add(&h->sum, v);
+    if (v > h->max) metric_set(&h->max, v);
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src) {
+    // The count is taken from the buckets themselves so that it always
+    // agrees with them, however the writer moves on meanwhile
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = metric_get(&src->counts[i]);
+        dst->counts[i] += n;
+        dst->count += n;
+    }
+    dst->sum += metric_get(&src->sum);
+    uint64_t max = metric_get(&src->max);
+    if (max > dst->max) dst->max = max;
+}
+
+uint64_t hist_quantile(const struct histogram *h, double p) {
+    if (h->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * h->count + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_high(i);
+            return i == HIST_BUCKETS - 1 || v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void hist_write_prometheus(FILE *out, const char *name, const char *labels,
+                           const struct histogram *h, double scale) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t below = 0;
+    unsigned int i = 0;
+
+    // Bucket boundaries just below every power of two: each one closes
+    // whole fine-grained buckets, so the cumulative counts are exact. le
+    // is inclusive, so it is the largest value counted, 2^e - 1, and the
+    // last fine-grained bucket, which has no upper bound, only goes in +Inf.
+    for (unsigned int e = HIST_SUB_BITS; e < HIST_MAX_BITS; e++) {
+        unsigned int end = (e - HIST_SUB_BITS + 1) * HIST_SUB;
+        while (i < end) below += h->counts[i++];
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                (double)bucket_high(end - 1) * scale, (unsigned long long)below);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)h->count);
+
+    if (labels[0]) {
+        fprintf(out, "%s_sum{%s} %.9g\n", name, labels, h->sum * scale);
+        fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+    } else {
+        fprintf(out, "%s_sum %.9g\n", name, h->sum * scale);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long)h->count);
+    }
+}
@@ -0,0 +1,62 @@
+// metrics.h
+// Lock-free counters and latency histograms for live server metrics
+//
+// Every event-loop thread keeps its own set and is its only writer, so an
+// update is a load and a relaxed store: no locked instruction and no cache
+// line shared with another thread. Readers such as the admin socket load
+// each value atomically and add the threads up. A snapshot may be a few
+// events out of step between two counters, but no value is ever torn.
+//
+// Histograms are log-linear, as in HdrHistogram: values below HIST_SUB get
+// a bucket each, and every power of two above that is split into HIST_SUB
+// equal buckets. Any value is known to within 1/HIST_SUB (6%), and every
+// histogram has the same fixed size whatever the range it sees.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)              // Buckets per power of two
+#define HIST_MAX_BITS 40                           // Values from 2^40 up share the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+// Single-writer updates; only the owning thread may call these
+static inline void metric_add(uint64_t *c, uint64_t n) {
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(uint64_t *g, uint64_t v) {
+    __atomic_store_n(g, v, __ATOMIC_RELAXED);
+}
+
+// Any thread
+static inline uint64_t metric_get(const uint64_t *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+void hist_record(struct histogram *h, uint64_t v);
+
+// Add src, which may be live on another thread, into the snapshot dst
+void hist_merge(struct histogram *dst, const struct histogram *src);
+
+// Upper bound of the bucket holding the p-th quantile (0 < p <= 1) of a
+// snapshot, or 0 if it is empty
+uint64_t hist_quantile(const struct histogram *h, double p);
+
+// Write a snapshot in the Prometheus text format, with one cumulative
+// bucket per power of two, up to 2^e - 1 inclusive, and values multiplied by scale (1e-9 turns
+// nanoseconds into seconds). labels is "" or a list such as thread="0".
+void hist_write_prometheus(FILE *out, const char *name, const char *labels,
+                           const struct histogram *h, double scale);
+
+#endif
@@ -0,0 +1,270 @@
+// msgbuf.c
+// Pooled refcounted frame buffers and writev output queues, see msgbuf.h
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "msgbuf.h"
+#include "pool.h"
+
+#define MSGBUF_OVERHEAD (sizeof(struct msgbuf) + FRAME_HDR_LEN)
+
+struct msgbuf *msgbuf_alloc(uint8_t type, size_t payload_len) {
+    size_t cap;
+
+    if (payload_len > FRAME_MAX_PAYLOAD) return NULL;
+
+    struct msgbuf *m = pool_alloc(MSGBUF_OVERHEAD + payload_len, &cap);
+    if (!m) return NULL;
+
+    m->refs = 1;
+    m->len = FRAME_HDR_LEN + payload_len;
+    m->cap = cap - MSGBUF_OVERHEAD;
+    frame_encode_header(m->data, type, (uint32_t)payload_len);
+    return m;
+}
+
+struct msgbuf *msgbuf_new(uint8_t type, const void *payload, size_t len) {
+    struct msgbuf *m = msgbuf_alloc(type, len);
+    if (m) memcpy(msgbuf_payload(m), payload, len);
+    return m;
+}
+
+void msgbuf_unref(struct msgbuf *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    pool_free(m, MSGBUF_OVERHEAD + m->cap);
+}
+
+void outq_init(struct outq *q) {
+    memset(q, 0, sizeof(*q));
+}
+
+void outq_free(struct outq *q) {
+    for (unsigned int i = 0; i < q->count; i++) {
+        msgbuf_unref(q->items[(q->head + i) % q->cap]);
+    }
+    pool_free(q->items, q->cap * sizeof(*q->items));
+    pool_free(q->wire, q->wire_cap);
+    memset(q, 0, sizeof(*q));
+}
+
+int outq_push(struct outq *q, struct msgbuf *m) {
+    if (q->count == q->cap) {
+        size_t bytes;
+        unsigned int cap = q->cap ? q->cap * 2 : OUTQ_INITIAL_SLOTS;
+        struct msgbuf **items = pool_alloc(cap * sizeof(*items), &bytes);
+        if (!items) return -1;
+
+        // Unwrap the ring into the new array
+        for (unsigned int i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->cap];
+        }
+        pool_free(q->items, q->cap * sizeof(*q->items));
+        q->items = items;
+        q->cap = bytes / sizeof(*items);
+        q->head = 0;
+    }
+
+    q->items[(q->head + q->count) % q->cap] = msgbuf_ref(m);
+    q->count++;
+    q->bytes += m->len;
+    return 0;
+}
+
+static int wire_reserve(struct outq *q, size_t need) {
+    if (q->wire_len + need <= q->wire_cap) return 0;
+
+    size_t cap = q->wire_cap ? q->wire_cap * 2 : OUTQ_WIRE_INITIAL;
+    while (cap < q->wire_len + need) cap *= 2;
+    unsigned char *wire = pool_grow(q->wire, &q->wire_cap, q->wire_len, cap);
+    if (!wire) return -1;
+    q->wire = wire;
+    return 0;
+}
+
+// Pop the head frame once it has been written or copied out
+static void outq_pop(struct outq *q) {
+    struct msgbuf *m = q->items[q->head];
+    q->offset = 0;
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    if (q->source_after > 0) q->source_after--;
+    msgbuf_unref(m);
+
+    // Only queues with something waiting hold a ring
+    if (q->count == 0) {
+        pool_free(q->items, q->cap * sizeof(*q->items));
+        q->items = NULL;
+        q->cap = 0;
+        q->head = 0;
+    }
+}
+
+int outq_set_sealer(struct outq *q, outq_sealer seal, void *arg) {
+    // Move what is already queued into the wire buffer unsealed
+    while (q->count > 0) {
+        struct msgbuf *m = q->items[q->head];
+        size_t rest = m->len - q->offset;
+        if (wire_reserve(q, rest) < 0) return -1;
+        memcpy(q->wire + q->wire_len, m->data + q->offset, rest);
+        q->wire_len += rest;
+        outq_pop(q);
+    }
+
+    q->seal = seal;
+    q->seal_arg = arg;
+    return 0;
+}
+
+void outq_set_source(struct outq *q, outq_source source, void *arg) {
+    q->source = source;
+    q->source_arg = arg;
+    q->source_after = q->count;
+}
+
+void outq_set_filler(struct outq *q, outq_source filler, void *arg) {
+    q->filler = filler;
+    q->filler_arg = arg;
+}
+
+void outq_set_padding(struct outq *q, int pad) {
+    q->pad = pad;
+    q->burst = 0;
+}
+
+// Refill the wire buffer from a source or filler, dropping it once it is done
+static int outq_pull(struct outq *q, outq_source *fn, void *arg) {
+    if (wire_reserve(q, OUTQ_SOURCE_CAP) < 0) return -1;
+
+    size_t n = (*fn)(arg, q->wire, q->wire_cap);
+    if (n == 0) *fn = NULL;
+    q->wire_len = n;
+    q->bytes += n;
+    return 0;
+}
+
+// Seal queued frames into the wire buffer, up to one batch or until the
+// source's turn
+static int outq_seal_batch(struct outq *q) {
+    while (q->count > 0 && !(q->source && q->source_after == 0)) {
+        struct msgbuf *m = q->items[q->head];
+        size_t need = m->len + FRAME_SEAL_OVERHEAD;
+
+        if (q->wire_len > 0 && q->wire_len + need > OUTQ_WIRE_BATCH) break;
+        if (wire_reserve(q, need) < 0) return -1;
+
+        size_t n = q->seal(q->seal_arg, q->wire + q->wire_len, m->data, m->len);
+        q->wire_len += n;
+        q->bytes += n - m->len;
+        outq_pop(q);
+    }
+    return 0;
+}
+
+// Close the burst with padding once nothing more is waiting behind it
+static int outq_pad_burst(struct outq *q) {
+    unsigned char frame[FRAME_HDR_LEN + FRAME_CELL_DATA];
+
+    q->burst += q->wire_len;
+    if (q->count > 0 || q->source || q->filler) return 0;
+
+    size_t n = frame_padding_len(q->burst);
+    q->burst = 0;
+    if (n == 0) return 0;
+    if (wire_reserve(q, n) < 0) return -1;
+
+    size_t payload = n - FRAME_PADDING_MIN;
+    frame_encode_header(frame, FRAME_PADDING, (uint32_t)payload);
+    memset(frame + FRAME_HDR_LEN, 0, payload);
+    q->wire_len += q->seal(q->seal_arg, q->wire + q->wire_len, frame, FRAME_HDR_LEN + payload);
+    q->bytes += n;
+    q->padded += n;
+    return 0;
+}
+
+ssize_t outq_wire_next(struct outq *q, const unsigned char **data) {
+    if (q->wire_off == q->wire_len) {
+        q->wire_off = q->wire_len = 0;
+        if (q->source && q->source_after == 0 && outq_pull(q, &q->source, q->source_arg) < 0) return -1;
+        if (q->wire_len == 0 && q->count > 0 && outq_seal_batch(q) < 0) return -1;
+        if (q->wire_len == 0 && q->filler && !q->source && outq_pull(q, &q->filler, q->filler_arg) < 0) return -1;
+        if (q->pad && q->burst + q->wire_len > 0 && outq_pad_burst(q) < 0) return -1;
+    }
+
+    // Idle connections should not each pin a buffer
+    if (q->wire_len == 0 && q->wire) {
+        pool_free(q->wire, q->wire_cap);
+        q->wire = NULL;
+        q->wire_cap = 0;
+    }
+
+    *data = q->wire + q->wire_off;
+    return q->wire_len - q->wire_off;
+}
+
+void outq_wire_sent(struct outq *q, size_t n) {
+    q->wire_off += n;
+    q->bytes -= n;
+    q->sent += n;
+}
+
+static int outq_flush_wire(struct outq *q, int fd) {
+    while (1) {
+        const unsigned char *data;
+        ssize_t len = outq_wire_next(q, &data);
+        if (len <= 0) return len;
+
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        outq_wire_sent(q, n);
+    }
+}
+
+int outq_flush(struct outq *q, int fd) {
+    struct iovec iov[OUTQ_MAX_IOV];
+
+    if (q->seal) return outq_flush_wire(q, fd);
+
+    while (q->count > 0) {
+        int n_iov = 0;
+        for (unsigned int i = 0; i < q->count && n_iov < OUTQ_MAX_IOV; i++) {
+            struct msgbuf *m = q->items[(q->head + i) % q->cap];
+            size_t skip = i == 0 ? q->offset : 0;
+            iov[n_iov].iov_base = m->data + skip;
+            iov[n_iov].iov_len = m->len - skip;
+            n_iov++;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n_iov };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        // Release every frame the kernel took in full
+        q->bytes -= n;
+        q->sent += n;
+        size_t left = n;
+        while (left > 0) {
+            struct msgbuf *m = q->items[q->head];
+            size_t rest = m->len - q->offset;
+            if (left < rest) {
+                q->offset += left;
+                break;
+            }
+            left -= rest;
+            outq_pop(q);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// msgbuf.h
+// Refcounted, pooled frame buffers and per-connection output queues
+//
+// A message is encoded into a frame once and the same buffer is queued by
+// reference on every recipient, so a broadcast to N clients costs one
+// encode plus N pointer pushes. Queues are flushed with writev, batching
+// every frame queued since the last write into a single syscall.
+//
+// Buffers may be shared between shard threads, so reference counts are
+// atomic. Frames, queue rings and sealing buffers all come from the
+// calling thread's pool (see pool.h), so queueing a message never reaches
+// malloc once the pools are warm, and an empty queue holds no memory.
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "frame.h"
+
+#define OUTQ_INITIAL_SLOTS 64       // One 512-byte pool buffer
+#define OUTQ_MAX_IOV 64             // Frames written per writev call
+#define OUTQ_WIRE_BATCH (16 * 1024) // Sealed bytes prepared per write on encrypted queues
+#define OUTQ_WIRE_INITIAL 4096      // First sealing buffer, grown as batches need
+#define OUTQ_SOURCE_CAP (OUTQ_WIRE_BATCH + FRAME_HDR_LEN + FRAME_MAX_PAYLOAD)  // Room offered to a source, at least one whole frame
+
+struct msgbuf {
+    int refs;
+    uint32_t len;                   // Encoded frame length, header included
+    uint32_t cap;                   // Payload capacity
+    unsigned char data[];
+};
+
+// Encrypts one whole frame of len bytes into out, which has room for
+// len + FRAME_SEAL_OVERHEAD bytes. Returns the number of bytes written.
+typedef size_t (*outq_sealer)(void *arg, unsigned char *out, const unsigned char *frame, size_t len);
+
+// Produces sealed bytes to send ahead of every queued frame, writing at
+// most cap bytes into out. Returns the number written, or 0 once it is done.
+typedef size_t (*outq_source)(void *arg, unsigned char *out, size_t cap);
+
+// FIFO of queued frames for one connection
+struct outq {
+    struct msgbuf **items;
+    unsigned int cap;
+    unsigned int head;
+    unsigned int count;
+    size_t offset;                  // Bytes of the head frame already written
+    size_t bytes;                   // Bytes queued and not yet written
+    uint64_t sent;                  // Bytes written to the socket in total
+    outq_sealer seal;               // NULL for a plaintext connection
+    void *seal_arg;
+    outq_source source;             // Pulled ahead of later frames while set, such as a history replay
+    void *source_arg;
+    unsigned int source_after;      // Frames queued before the source was set, sent ahead of it
+    outq_source filler;             // Pulled only while nothing else is waiting, such as a file download
+    void *filler_arg;
+    int pad;                        // Round every burst up to whole Tor cells
+    size_t burst;                   // Sealed bytes since the queue last ran dry
+    uint64_t padded;                // Padding bytes sealed in total
+    unsigned char *wire;            // Sealed bytes waiting to be written
+    size_t wire_cap;
+    size_t wire_len;
+    size_t wire_off;
+};
+
+// Allocate a frame with room for payload_len bytes and a reference count
+// of one. The caller fills msgbuf_payload() before queueing it.
+struct msgbuf *msgbuf_alloc(uint8_t type, size_t payload_len);
+struct msgbuf *msgbuf_new(uint8_t type, const void *payload, size_t len);
+
+static inline unsigned char *msgbuf_payload(struct msgbuf *m) {
+    return m->data + FRAME_HDR_LEN;
+}
+
+static inline struct msgbuf *msgbuf_ref(struct msgbuf *m) {
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+void msgbuf_unref(struct msgbuf *m);
+
+void outq_init(struct outq *q);
+void outq_free(struct outq *q);
+
+// Bytes of pool buffers the queue holds, for memory accounting
+static inline size_t outq_memory(const struct outq *q) {
+    return q->cap * sizeof(*q->items) + q->wire_cap;
+}
+
+// Queue a frame, taking a new reference. Returns -1 if out of memory.
+int outq_push(struct outq *q, struct msgbuf *m);
+
+// Seal every frame queued from now on. Frames already queued still go out
+// as they are, ahead of the sealed ones. Returns -1 if out of memory.
+int outq_set_sealer(struct outq *q, outq_sealer seal, void *arg);
+
+// Send whatever source produces once the frames already queued are out,
+// until it reports it is done. Frames queued meanwhile wait behind it.
+// Only a sealed queue takes a source, since the source seals its own output.
+void outq_set_source(struct outq *q, outq_source source, void *arg);
+
+// Send whatever filler produces whenever no frame and no source is waiting,
+// one pull at a time, until it reports it is done. Bulk data fed this way
+// never holds up anything else queued. Only a sealed queue takes a filler.
+void outq_set_filler(struct outq *q, outq_source filler, void *arg);
+
+// Whenever the queue runs dry, seal a FRAME_PADDING frame after the last
+// burst so it ends on a cell boundary (see frame.h). Only a sealed queue
+// is padded.
+void outq_set_padding(struct outq *q, int pad);
+
+// For sending a sealed queue asynchronously: point *data at the next run
+// of sealed bytes, sealing more frames if needed, and return its length
+// (0 when the queue is empty, -1 if out of memory). The bytes must stay
+// untouched until outq_wire_sent() reports how many went out, so no other
+// call may be made on the queue meanwhile except outq_push().
+ssize_t outq_wire_next(struct outq *q, const unsigned char **data);
+void outq_wire_sent(struct outq *q, size_t n);
+
+// Write as much of the queue as the socket accepts. Returns 0 when the
+// socket would block or the queue is empty, -1 on a fatal socket error.
+int outq_flush(struct outq *q, int fd);
+
+#endif
@@ -0,0 +1,210 @@
+// noise.c
+// Noise NX handshake and sealed frames, see noise.h
+
+#include <string.h>
+
+#include "noise.h"
+
+#define NOISE_PROTOCOL_NAME "Noise_NX_25519_ChaChaPoly_BLAKE2b"
+
+static void noise_nonce(uint8_t out[CHACHA20_NONCE_LEN], uint64_t n) {
+    // 32 zero bits followed by the little-endian counter
+    memset(out, 0, 4);
+    for (int i = 0; i < 8; i++) out[4 + i] = (uint8_t)(n >> (8 * i));
+}
+
+static void mix_hash(struct noise_handshake *hs, const uint8_t *data, size_t len) {
+    struct blake2b_ctx ctx;
+    blake2b_init(&ctx, BLAKE2B_OUT_LEN, NULL, 0);
+    blake2b_update(&ctx, hs->h, sizeof(hs->h));
+    blake2b_update(&ctx, data, len);
+    blake2b_final(&ctx, hs->h);
+}
+
+// HKDF with HMAC-BLAKE2b, two outputs
+static void hkdf2(const uint8_t ck[BLAKE2B_OUT_LEN], const uint8_t *ikm, size_t ikm_len,
+                  uint8_t out1[BLAKE2B_OUT_LEN], uint8_t out2[BLAKE2B_OUT_LEN]) {
+    uint8_t temp[BLAKE2B_OUT_LEN];
+    uint8_t in[BLAKE2B_OUT_LEN + 1];
+
+    hmac_blake2b(temp, ck, BLAKE2B_OUT_LEN, ikm, ikm_len);
+    in[0] = 0x01;
+    hmac_blake2b(out1, temp, sizeof(temp), in, 1);
+    memcpy(in, out1, BLAKE2B_OUT_LEN);
+    in[BLAKE2B_OUT_LEN] = 0x02;
+    hmac_blake2b(out2, temp, sizeof(temp), in, sizeof(in));
+
+    crypto_wipe(temp, sizeof(temp));
+    crypto_wipe(in, sizeof(in));
+}
+
+// Mix a DH result into the chaining key. Returns -1 for an all-zero
+// result, which means the peer sent a low-order point.
+static int mix_dh(struct noise_handshake *hs, const uint8_t priv[NOISE_KEY_LEN], const uint8_t pub[NOISE_KEY_LEN]) {
+    static const uint8_t zero[X25519_LEN];
+    uint8_t dh[X25519_LEN];
+    uint8_t temp_k[BLAKE2B_OUT_LEN];
+
+    x25519(dh, priv, pub);
+    if (crypto_memeq(dh, zero, sizeof(dh))) return -1;
+
+    hkdf2(hs->ck, dh, sizeof(dh), hs->ck, temp_k);
+    memcpy(hs->k, temp_k, CHACHA20_KEY_LEN);
+    hs->has_key = 1;
+    hs->n = 0;
+
+    crypto_wipe(dh, sizeof(dh));
+    crypto_wipe(temp_k, sizeof(temp_k));
+    return 0;
+}
+
+static void encrypt_and_hash(struct noise_handshake *hs, uint8_t *out, const uint8_t *in, size_t len) {
+    uint8_t nonce[CHACHA20_NONCE_LEN];
+
+    noise_nonce(nonce, hs->n++);
+    aead_seal(out, in, len, hs->h, sizeof(hs->h), hs->k, nonce);
+    mix_hash(hs, out, len + POLY1305_TAG_LEN);
+}
+
+static int decrypt_and_hash(struct noise_handshake *hs, uint8_t *out, const uint8_t *in, size_t len) {
+    uint8_t nonce[CHACHA20_NONCE_LEN];
+
+    noise_nonce(nonce, hs->n++);
+    if (aead_open(out, in, len, hs->h, sizeof(hs->h), hs->k, nonce) < 0) return -1;
+    mix_hash(hs, in, len + POLY1305_TAG_LEN);
+    return 0;
+}
+
+static void handshake_init(struct noise_handshake *hs) {
+    memset(hs, 0, sizeof(*hs));
+    // The name fits in one hash output, so it is used zero-padded
+    memcpy(hs->h, NOISE_PROTOCOL_NAME, strlen(NOISE_PROTOCOL_NAME));
+    memcpy(hs->ck, hs->h, sizeof(hs->ck));
+    mix_hash(hs, NULL, 0);    // Empty prologue
+}
+
+static void split(struct noise_handshake *hs, struct noise_cipher *c1, struct noise_cipher *c2) {
+    uint8_t k1[BLAKE2B_OUT_LEN], k2[BLAKE2B_OUT_LEN];
+
+    hkdf2(hs->ck, NULL, 0, k1, k2);
+    memcpy(c1->key, k1, CHACHA20_KEY_LEN);
+    memcpy(c2->key, k2, CHACHA20_KEY_LEN);
+    c1->nonce = 0;
+    c2->nonce = 0;
+
+    crypto_wipe(k1, sizeof(k1));
+    crypto_wipe(k2, sizeof(k2));
+    crypto_wipe(hs, sizeof(*hs));
+}
+
+int noise_keypair(uint8_t priv[NOISE_KEY_LEN], uint8_t pub[NOISE_KEY_LEN]) {
+    if (random_bytes(priv, NOISE_KEY_LEN) < 0) return -1;
+    x25519_public(pub, priv);
+    return 0;
+}
+
+int noise_initiator_start(struct noise_handshake *hs, uint8_t msg1[NOISE_MSG1_MAX], uint8_t features) {
+    size_t payload_len = features ? 1 : 0;
+
+    handshake_init(hs);
+    if (noise_keypair(hs->e_priv, hs->e_pub) < 0) return -1;
+    hs->features = features;
+
+    // -> e, with the features offered if any
+    memcpy(msg1, hs->e_pub, NOISE_KEY_LEN);
+    msg1[NOISE_KEY_LEN] = features;
+    mix_hash(hs, hs->e_pub, NOISE_KEY_LEN);
+    mix_hash(hs, msg1 + NOISE_KEY_LEN, payload_len);
+    return (int)(NOISE_MSG1_LEN + payload_len);
+}
+
+int noise_initiator_finish(struct noise_handshake *hs, const uint8_t *msg2, size_t len,
+                           uint8_t rs[NOISE_KEY_LEN], struct noise_cipher *tx, struct noise_cipher *rx,
+                           uint8_t *features) {
+    const uint8_t *re = msg2;
+    const uint8_t *enc_s = msg2 + NOISE_KEY_LEN;
+    const uint8_t *enc_payload = enc_s + NOISE_KEY_LEN + POLY1305_TAG_LEN;
+    size_t payload_len = hs->features ? 1 : 0;
+    uint8_t agreed = 0;
+
+    if (len != NOISE_MSG2_LEN + payload_len) return -1;
+
+    // <- e, ee, s, es
+    mix_hash(hs, re, NOISE_KEY_LEN);
+    if (mix_dh(hs, hs->e_priv, re) < 0) return -1;
+    if (decrypt_and_hash(hs, rs, enc_s, NOISE_KEY_LEN) < 0) return -1;
+    if (mix_dh(hs, hs->e_priv, rs) < 0) return -1;
+    if (decrypt_and_hash(hs, &agreed, enc_payload, payload_len) < 0) return -1;
+
+    // The server may only narrow what was offered
+    if (agreed & ~hs->features) return -1;
+    *features = agreed;
+
+    split(hs, tx, rx);
+    return 0;
+}
+
+int noise_responder_reply(const uint8_t s_priv[NOISE_KEY_LEN], const uint8_t s_pub[NOISE_KEY_LEN],
+                          const uint8_t *msg1, size_t len, uint8_t msg2[NOISE_MSG2_MAX],
+                          struct noise_cipher *tx, struct noise_cipher *rx, uint8_t *features) {
+    struct noise_handshake hs;
+    const uint8_t *re = msg1;
+
+    if (len != NOISE_MSG1_LEN && len != NOISE_MSG1_MAX) return -1;
+
+    // -> e, and the features offered if any
+    size_t payload_len = len - NOISE_MSG1_LEN;
+    uint8_t agreed = payload_len ? msg1[NOISE_KEY_LEN] & *features : 0;
+    handshake_init(&hs);
+    mix_hash(&hs, re, NOISE_KEY_LEN);
+    mix_hash(&hs, msg1 + NOISE_KEY_LEN, payload_len);
+
+    // <- e, ee, s, es
+    if (noise_keypair(hs.e_priv, hs.e_pub) < 0) goto fail;
+    memcpy(msg2, hs.e_pub, NOISE_KEY_LEN);
+    mix_hash(&hs, hs.e_pub, NOISE_KEY_LEN);
+    if (mix_dh(&hs, hs.e_priv, re) < 0) goto fail;
+    encrypt_and_hash(&hs, msg2 + NOISE_KEY_LEN, s_pub, NOISE_KEY_LEN);
+    if (mix_dh(&hs, s_priv, re) < 0) goto fail;
+    encrypt_and_hash(&hs, msg2 + NOISE_KEY_LEN + NOISE_KEY_LEN + POLY1305_TAG_LEN, &agreed, payload_len);
+
+    // The initiator sends with the first key
+    split(&hs, rx, tx);
+    *features = agreed;
+    return (int)(NOISE_MSG2_LEN + payload_len);
+
+fail:
+    crypto_wipe(&hs, sizeof(hs));
+    return -1;
+}
+
+size_t noise_seal_frame(struct noise_cipher *cs, unsigned char *out, uint8_t type, const void *payload, size_t len) {
+    uint8_t nonce[CHACHA20_NONCE_LEN];
+    unsigned char *body = out + FRAME_HDR_LEN;
+
+    frame_encode_header(out, FRAME_SEALED, (uint32_t)(len + FRAME_SEAL_OVERHEAD));
+    body[0] = type;
+    memmove(body + 1, payload, len);
+
+    noise_nonce(nonce, cs->nonce++);
+    aead_seal(body, body, len + 1, NULL, 0, cs->key, nonce);
+    return FRAME_HDR_LEN + len + FRAME_SEAL_OVERHEAD;
+}
+
+int noise_open_frame(struct noise_cipher *cs, struct frame *f) {
+    uint8_t nonce[CHACHA20_NONCE_LEN];
+    // Frames are decoded in place from a writable receive buffer
+    unsigned char *body = (unsigned char *)f->payload;
+
+    if (f->type != FRAME_SEALED || f->len < FRAME_SEAL_OVERHEAD) return -1;
+
+    size_t len = f->len - POLY1305_TAG_LEN;
+    noise_nonce(nonce, cs->nonce);
+    if (aead_open(body, body, len, NULL, 0, cs->key, nonce) < 0) return -1;
+    cs->nonce++;
+
+    f->type = body[0];
+    f->payload = body + 1;
+    f->len = len - 1;
+    return 0;
+}
@@ -0,0 +1,89 @@
+// noise.h
+// Noise_NX_25519_ChaChaPoly_BLAKE2b session handshake and sealed frames
+//
+// The client (initiator) sends an ephemeral key; the server (responder)
+// answers with its own ephemeral key and its static key encrypted under
+// the ephemeral-ephemeral secret, which proves it holds that static key:
+//
+//   -> e
+//   <- e, ee, s, es
+//
+// The client checks the static key against a pinned or remembered value,
+// so a proxy in the middle cannot impersonate the server. Both sides then
+// split the chaining key into one ChaCha20-Poly1305 key per direction.
+//
+// The handshake also settles optional protocol features. A client that
+// wants any sends a features byte as the payload of its first message, in
+// the clear but bound into the transcript, and the server answers with
+// the subset it agrees to, encrypted, as the payload of the second. A
+// client that offers nothing sends the bare key, and gets the bare reply,
+// as before features existed.
+//
+// After the handshake every frame is carried inside a FRAME_SEALED frame
+// whose payload is AEAD(inner type | inner payload) followed by the tag,
+// using a per-direction 64-bit message counter as the nonce.
+
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypto.h"
+#include "frame.h"
+
+#define NOISE_KEY_LEN X25519_LEN
+#define NOISE_MSG1_LEN NOISE_KEY_LEN                                        // e
+#define NOISE_MSG2_LEN (NOISE_KEY_LEN + NOISE_KEY_LEN + POLY1305_TAG_LEN + POLY1305_TAG_LEN)  // e, enc(s), enc(payload)
+#define NOISE_MSG1_MAX (NOISE_MSG1_LEN + 1)                                 // ...with a features byte
+#define NOISE_MSG2_MAX (NOISE_MSG2_LEN + 1)
+
+// One direction of an established session
+struct noise_cipher {
+    uint8_t key[CHACHA20_KEY_LEN];
+    uint64_t nonce;
+};
+
+// Handshake state, only needed until the session keys are split
+struct noise_handshake {
+    uint8_t ck[BLAKE2B_OUT_LEN];
+    uint8_t h[BLAKE2B_OUT_LEN];
+    uint8_t k[CHACHA20_KEY_LEN];
+    int has_key;
+    uint64_t n;
+    uint8_t e_priv[NOISE_KEY_LEN];
+    uint8_t e_pub[NOISE_KEY_LEN];
+    uint8_t features;          // Offered by the initiator
+};
+
+int noise_keypair(uint8_t priv[NOISE_KEY_LEN], uint8_t pub[NOISE_KEY_LEN]);
+
+// Initiator, first message, offering features (0 for none). Returns its
+// length, or -1 if no randomness was available.
+int noise_initiator_start(struct noise_handshake *hs, uint8_t msg1[NOISE_MSG1_MAX], uint8_t features);
+
+// Initiator, reads the reply and derives the session. The server's static
+// key is stored in rs for the caller to verify, and the features it agreed
+// to in *features. Returns -1 if the reply is malformed or fails
+// authentication.
+int noise_initiator_finish(struct noise_handshake *hs, const uint8_t *msg2, size_t len,
+                           uint8_t rs[NOISE_KEY_LEN], struct noise_cipher *tx, struct noise_cipher *rx,
+                           uint8_t *features);
+
+// Responder, reads the first message and writes the reply in one step.
+// *features holds those the responder supports on entry and those agreed
+// on return. Returns the length of the reply, or -1 if the message is
+// malformed.
+int noise_responder_reply(const uint8_t s_priv[NOISE_KEY_LEN], const uint8_t s_pub[NOISE_KEY_LEN],
+                          const uint8_t *msg1, size_t len, uint8_t msg2[NOISE_MSG2_MAX],
+                          struct noise_cipher *tx, struct noise_cipher *rx, uint8_t *features);
+
+// Encrypt one frame into out, which needs room for FRAME_HDR_LEN + len +
+// FRAME_SEAL_OVERHEAD bytes. Returns the length of the sealed frame.
+size_t noise_seal_frame(struct noise_cipher *cs, unsigned char *out, uint8_t type, const void *payload, size_t len);
+
+// Decrypt a FRAME_SEALED frame in place and turn f into the inner frame.
+// Returns -1 if the frame is truncated or was tampered with.
+int noise_open_frame(struct noise_cipher *cs, struct frame *f);
+
+#endif
@@ -0,0 +1,175 @@
+// pool.c
+// Per-thread buffer pools and slabs, see pool.h
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "pool.h"
+
+#define SLAB_ALIGN 16
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+static __thread struct pool_block *free_lists[POOL_CLASSES];
+static __thread size_t free_bytes[POOL_CLASSES];
+static __thread struct pool_stats *stats;
+static __thread struct pool_stats unregistered;
+
+void pool_thread_init(struct pool_stats *s) {
+    stats = s;
+}
+
+static struct pool_stats *thread_stats(void) {
+    return stats ? stats : &unregistered;
+}
+
+// Class index for size, or POOL_CLASSES if it is too large for one
+static int size_class(size_t size) {
+    if (size > POOL_MAX_SIZE) return POOL_CLASSES;
+    if (size <= (size_t)1 << POOL_MIN_SHIFT) return 0;
+    return (int)(sizeof(unsigned long long) * 8 - __builtin_clzll(size - 1)) - POOL_MIN_SHIFT;
+}
+
+void *pool_alloc(size_t size, size_t *cap) {
+    struct pool_stats *st = thread_stats();
+    int k = size_class(size);
+    size_t bytes = k < POOL_CLASSES ? (size_t)1 << (POOL_MIN_SHIFT + k) : size;
+    void *p;
+
+    if (k < POOL_CLASSES && free_lists[k]) {
+        struct pool_block *b = free_lists[k];
+        free_lists[k] = b->next;
+        free_bytes[k] -= bytes;
+        metric_set(&st->cached, st->cached - bytes);
+        p = b;
+    } else {
+        p = malloc(bytes);
+        if (!p) return NULL;
+        metric_add(&st->mallocs, 1);
+    }
+
+    metric_add(&st->allocs, 1);
+    metric_add(&st->allocated, bytes);
+    *cap = bytes;
+    return p;
+}
+
+void pool_free(void *p, size_t cap) {
+    if (!p) return;
+
+    struct pool_stats *st = thread_stats();
+    int k = size_class(cap);
+    metric_add(&st->freed, cap);
+
+    if (k < POOL_CLASSES && free_bytes[k] + cap <= POOL_CACHE_BYTES) {
+        struct pool_block *b = p;
+        b->next = free_lists[k];
+        free_lists[k] = b;
+        free_bytes[k] += cap;
+        metric_set(&st->cached, st->cached + cap);
+        return;
+    }
+    free(p);
+}
+
+void *pool_grow(void *p, size_t *cap, size_t used, size_t size) {
+    size_t new_cap;
+    void *q = pool_alloc(size, &new_cap);
+    if (!q) return NULL;
+
+    if (used > 0) memcpy(q, p, used);
+    pool_free(p, *cap);
+    *cap = new_cap;
+    return q;
+}
+
+// A page starts with this header, padded to SLAB_ALIGN. Each object is
+// preceded by a pointer to its page, so freeing needs no lookup.
+struct slab_page {
+    struct slab_page *prev;
+    struct slab_page *next;
+    void *free;                             // Freed objects, linked through their first word
+    unsigned int used;                      // Objects handed out
+    unsigned int carved;                    // Objects ever handed out; the rest were never touched
+};
+
+#define PAGE_HEADER ((sizeof(struct slab_page) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+void slab_init(struct slab *s, size_t size) {
+    memset(s, 0, sizeof(*s));
+    s->stride = SLAB_ALIGN + ((size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1));
+    s->per_page = (POOL_SLAB_PAGE - PAGE_HEADER) / s->stride;
+}
+
+static void page_link(struct slab_page **head, struct slab_page *pg) {
+    pg->prev = NULL;
+    pg->next = *head;
+    if (*head) (*head)->prev = pg;
+    *head = pg;
+}
+
+static void page_unlink(struct slab_page **head, struct slab_page *pg) {
+    if (pg->prev) pg->prev->next = pg->next;
+    else *head = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
+    pg->prev = pg->next = NULL;
+}
+
+void *slab_alloc(struct slab *s) {
+    struct slab_page *pg = s->partial;
+
+    if (!pg) {
+        if (s->empty) {
+            pg = s->empty;
+            page_unlink(&s->empty, pg);
+            s->empty_count--;
+        } else {
+            if (s->per_page == 0) return NULL;
+            pg = mmap(NULL, POOL_SLAB_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pg == MAP_FAILED) return NULL;
+            pg->free = NULL;
+            pg->used = pg->carved = 0;
+            metric_set(&s->pages, s->pages + 1);
+        }
+        page_link(&s->partial, pg);
+    }
+
+    unsigned char *slot;
+    if (pg->free) {
+        void **obj = pg->free;
+        pg->free = *obj;
+        slot = (unsigned char *)obj - SLAB_ALIGN;
+    } else {
+        slot = (unsigned char *)pg + PAGE_HEADER + (size_t)pg->carved++ * s->stride;
+        *(struct slab_page **)slot = pg;
+    }
+    if (++pg->used == s->per_page) page_unlink(&s->partial, pg);
+    metric_set(&s->objects, s->objects + 1);
+
+    memset(slot + SLAB_ALIGN, 0, s->stride - SLAB_ALIGN);
+    return slot + SLAB_ALIGN;
+}
+
+void slab_free(struct slab *s, void *p) {
+    if (!p) return;
+
+    struct slab_page *pg = *(struct slab_page **)((unsigned char *)p - SLAB_ALIGN);
+    *(void **)p = pg->free;
+    pg->free = p;
+    if (pg->used-- == s->per_page) page_link(&s->partial, pg);
+    metric_set(&s->objects, s->objects - 1);
+    if (pg->used > 0) return;
+
+    page_unlink(&s->partial, pg);
+    if (s->empty_count < POOL_SLAB_KEEP) {
+        page_link(&s->empty, pg);
+        s->empty_count++;
+        return;
+    }
+    munmap(pg, POOL_SLAB_PAGE);
+    metric_set(&s->pages, s->pages - 1);
+}
@@ -0,0 +1,87 @@
+// pool.h
+// Size-classed buffer pools and fixed-size slabs for the hot path
+//
+// Every buffer a message passes through, the receive buffer, the frame
+// itself, the output queue's ring and its sealing buffer, comes from a
+// pool of power-of-two size classes kept per thread. A buffer freed goes
+// on its class's free list for the next one of that size, so a thread in
+// steady state never calls malloc: taking and giving back a buffer is a
+// pointer pop and push with no lock. Buffers may be freed on a different
+// thread than the one that took them, as shared frames are; they then join
+// that thread's lists. Each list keeps at most POOL_CACHE_BYTES and hands
+// the rest back to malloc, so a burst cannot leave a thread pinning its
+// peak forever, and rounding up to a class wastes less than half a buffer.
+// Sizes above the largest class go to malloc directly.
+//
+// Callers keep the capacity pool_alloc() reports and pass it back to
+// pool_free(); no header is stored in the buffer, so a 4096-byte request
+// really takes 4096 bytes.
+//
+// A slab hands out objects of one size, such as connection state, carved
+// from POOL_SLAB_PAGE pages mapped straight from the kernel. Objects of a
+// page sit together, freeing one is O(1), and a page whose objects are all
+// freed goes back to the kernel, apart from one kept for the next
+// arrivals. A slab belongs to one thread and is not locked.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_MIN_SHIFT 9                    // Smallest class, 512 bytes
+#define POOL_CLASSES 9                      // 512 bytes to 128 KiB
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_CACHE_BYTES (2 * 1024 * 1024)  // Free bytes kept per class and thread
+#define POOL_SLAB_PAGE (64 * 1024)          // Slab page size
+#define POOL_SLAB_KEEP 1                    // Empty slab pages kept mapped
+
+// One thread's pool counters, updated with metric_add() and metric_set()
+// once registered. Bytes in use on all threads together are allocated
+// minus freed; a thread alone may free more than it took.
+struct pool_stats {
+    uint64_t allocs;                        // Buffers handed out
+    uint64_t mallocs;                       // ...of which the pool had none free
+    uint64_t allocated;                     // Bytes handed out
+    uint64_t freed;                         // Bytes given back
+    uint64_t cached;                        // Gauge: bytes on this thread's free lists
+};
+
+// Count the calling thread's pool use in s from now on
+void pool_thread_init(struct pool_stats *s);
+
+// A buffer of at least size bytes, its real capacity stored in *cap, or
+// NULL if out of memory
+void *pool_alloc(size_t size, size_t *cap);
+
+// Give back a buffer with the capacity pool_alloc() reported. NULL is ignored.
+void pool_free(void *p, size_t cap);
+
+// Grow a buffer to at least size bytes, keeping its first used bytes. On
+// failure the old buffer is left as it was and NULL is returned.
+void *pool_grow(void *p, size_t *cap, size_t used, size_t size);
+
+struct slab_page;
+
+struct slab {
+    size_t stride;                          // Bytes per object, header included
+    unsigned int per_page;
+    struct slab_page *partial;              // Pages with free objects
+    struct slab_page *empty;                // Kept for reuse
+    unsigned int empty_count;
+    uint64_t pages;                         // Pages mapped
+    uint64_t objects;                       // Objects handed out
+};
+
+void slab_init(struct slab *s, size_t size);
+
+// A zeroed object, or NULL if out of memory
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *p);
+
+// Memory an object takes from its slab
+static inline size_t slab_object_size(const struct slab *s) {
+    return s->stride;
+}
+
+#endif
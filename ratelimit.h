@@ -0,0 +1,47 @@
+// ratelimit.h
+// Token buckets kept as one timestamp each, shareable between threads
+//
+// This is the generic cell rate algorithm: rather than a token count and
+// the time of the last refill, a bucket holds the time at which it would
+// be full again had nothing more been taken ("theoretical arrival time").
+// Taking n tokens moves that time n intervals on from now or from where it
+// was, whichever is later; while it stays within the burst of now the
+// bucket still had the tokens. The whole state is a single word, so a
+// bucket shared by several threads, such as one user's connections on
+// different shards, is updated with one compare-and-swap and no lock.
+//
+// Takes never fail: a bucket may go into debt by one take, and its owner
+// is expected to stop drawing on it until bucket_take() says it is clear.
+// That lets work be charged after it is done, by its real size.
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+struct rate_limit {
+    uint64_t interval_ns;           // Time to earn one token, 0 for no limit
+    uint64_t burst_ns;              // Time to earn a full bucket
+};
+
+// rate tokens per second, at most burst at once; a rate of 0 disables it
+static inline void rate_limit_init(struct rate_limit *l, uint64_t rate, uint64_t burst) {
+    l->interval_ns = rate ? 1000000000ull / rate : 0;
+    if (rate && l->interval_ns == 0) l->interval_ns = 1;
+    l->burst_ns = l->interval_ns * burst;
+}
+
+// Take n tokens from the bucket *tat at monotonic time now_ns. Returns the
+// time from which it can be drawn on again: now_ns or earlier if it still
+// has tokens, later if it is in debt.
+static inline uint64_t bucket_take(uint64_t *tat, const struct rate_limit *l, uint64_t now_ns, uint64_t n) {
+    if (l->interval_ns == 0) return now_ns;
+
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+    do {
+        next = (old > now_ns ? old : now_ns) + n * l->interval_ns;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return next > l->burst_ns ? next - l->burst_ns : 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+// ring.h
+// Lock-free single-producer single-consumer ring of pointers
+//
+// Used as the cross-shard message bus: every shard owns one inbound ring
+// per peer shard, so each ring has exactly one writer and one reader and
+// needs no locks, only acquire/release ordering on the two indices.
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+
+struct spsc_ring {
+    _Alignas(64) unsigned int head;     // Next slot to read, owned by the consumer
+    _Alignas(64) unsigned int tail;     // Next slot to write, owned by the producer
+    _Alignas(64) unsigned int mask;
+    void *slots[];
+};
+
+// Capacity must be a power of two
+static inline struct spsc_ring *spsc_ring_new(unsigned int capacity) {
+    struct spsc_ring *r = aligned_alloc(64, (sizeof(*r) + capacity * sizeof(void *) + 63) & ~(size_t)63);
+    if (!r) return NULL;
+    r->head = 0;
+    r->tail = 0;
+    r->mask = capacity - 1;
+    return r;
+}
+
+// Producer side. Returns 0 if the ring is full.
+static inline int spsc_ring_push(struct spsc_ring *r, void *p) {
+    unsigned int tail = r->tail;
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - head > r->mask) return 0;
+
+    r->slots[tail & r->mask] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Consumer side. Returns NULL if the ring is empty.
+static inline void *spsc_ring_pop(struct spsc_ring *r) {
+    unsigned int head = r->head;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return NULL;
+
+    void *p = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+#endif
@@ -1,23 +1,101 @@
 // server.c
-// build: gcc -Wall -O2 -o server server.c
-// run: ./server
+// build: gcc -Wall -O2 -pthread -o server server.c frame.c msgbuf.c pool.c crypto.c chacha_simd.c noise.c argon2.c creds.c kdfpool.c history.c ticket.c metrics.c log.c uring.c groups.c files.c timer.c mailbox.c federation.c socks5.c compress.c
+// run: ./server [-t threads] [-w kdf-workers] [-p port] [-F peer]...
+// add a user: ./server -u <name>
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <time.h>
+#include <termios.h>
+
+#include "compress.h"
+#include "creds.h"
+#include "crypto.h"
+#include "federation.h"
+#include "files.h"
+#include "frame.h"
+#include "groups.h"
+#include "history.h"
+#include "kdfpool.h"
+#include "log.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "msgbuf.h"
+#include "noise.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "ring.h"
+#include "ticket.h"
+#include "timer.h"
+#include "uring.h"
 
 #define LISTEN_ADDR "127.0.0.1"
+#define UNIX_SOCKET_UMASK 0117   // -s socket is rw for owner and group, so Tor's user can be let in by group
 #define PORT 1234
 #define BUF_SIZE 4096
-#define PASSWORD "secret123"  // Change this to your desired password
+#define CREDENTIALS_FILE "credentials"  // user:argon2id-hash lines, reloaded on SIGHUP
 #define MAX_AUTH_ATTEMPTS 3
+#define MAX_CLIENTS 16384     // Size of the fd-indexed connection table
+#define MAX_EVENTS 256
+#define LISTEN_BACKLOG 1024
+#define MAX_PENDING_AUTH 2048          // Half-authenticated connections allowed at once, per thread
+#define HANDSHAKE_TIMEOUT_MS 10000     // Time allowed for the key exchange after connecting
+#define AUTH_PASSWORD_TIMEOUT_MS 30000 // Time allowed for each password attempt
+#define AUTH_VERIFY_TIMEOUT_MS 30000   // Time a login may wait for a KDF worker
+#define PING_AFTER_MS 30000            // Ping a chat client that has sent nothing for this long
+#define IDLE_TIMEOUT_MS 90000          // Disconnect one that has sent nothing, a pong included, for this long
+#define KDF_QUEUE_MAX 8192             // Logins queued for the KDF workers, all threads together
+#define OUTQ_HIGH_WATER (256 * 1024)   // Queued bytes above which chat to a client is dropped
+#define OUTQ_MAX_DROPPED 64            // Consecutive drops before a slow client is disconnected
+#define MAX_SHARDS 64                  // Upper bound for -t
+#define BUS_RING_SIZE 4096             // Messages in flight between any two threads
+#define SERVER_KEY_FILE "server.key"   // Static X25519 key, created on first start
+#define HISTORY_DIR "history"          // Chat log segments, replayed to clients on request
+#define RESUME_REPLAY_MAX 1000         // Missed messages replayed to a resuming client
+#define ADMIN_SOCKET "admin.sock"      // Unix socket serving live metrics to local tools
+#define ADMIN_TIMEOUT_S 2              // Time an admin client gets to send its request
+#define STATUS_TOP_CLIENTS 5           // Busiest connections listed by /status
+#define URING_ENTRIES 4096             // io_uring submission queue size, per thread
+#define URING_CQ_ENTRIES 16384         // io_uring completion queue size, per thread
+#define URING_BUFS 1024                // Receive buffers shared by a thread's connections, a power of two
+#define URING_BUF_SIZE 4096            // Bytes per receive buffer
+#define LOG_FILE "server.log"          // Event log, JSON lines, rotated at LOG_MAX_BYTES (see log.h)
+#define MAX_ROOMS_JOINED 16            // Rooms one connection may be in at once
+#define FILES_DIR "files"              // Shared files, as chunks and manifests (see files.h)
+#define MAILBOX_DIR "mailbox"          // Direct messages spilled for offline users (see mailbox.h)
+#define FEDERATION_KEY_FILE "federation.key"  // Secret shared by federated nodes, made with -K
+#define FILES_MAX_BYTES (1024ULL * 1024 * 1024)  // Chunk bytes the store may hold
+#define FILE_SEND_LOWAT (128 * 1024)   // Unsent bytes the kernel holds for a client taking a download
+#define BATCH_MAX_MS 1000              // Longest coalescing window -W accepts
+#define COVER_MIN_MS 10                // Shortest padding interval -C accepts
+#define DRR_QUANTUM (16 * 1024)        // Input bytes handled per round for each client with input waiting
+#define PEER_DRR_QUANTUM (16 * DRR_QUANTUM)  // ...and for a federation link, which carries a whole node's chat
+#define RX_BACKLOG_MAX (256 * 1024)    // io_uring: unhandled input at which a client's receive is paused
+#define CONN_MSG_RATE 20               // Chat messages per second from one connection (-q)
+#define USER_MSG_RATE 50               // ...and from all of one user's connections together (-Q)
+#define CONN_BYTE_RATE (1024 * 1024)   // Input bytes per second from one connection
+#define USER_BYTE_RATE (2 * 1024 * 1024)
+#define RATE_BURST_S 3                 // Rate limits allow bursts of this many seconds' worth
 
 // Color codes for server output
 #define COLOR_RED     "\x1b[31m"
@@ -28,10 +106,259 @@
 #define COLOR_CYAN    "\x1b[36m"
 #define COLOR_RESET   "\x1b[0m"
 
-void print_timestamp() {
+// Connection lifecycle. Every phase before CONN_CHAT has its own deadline
+// so a client that stalls mid-handshake is dropped instead of holding a slot;
+// in the chat, a client that falls silent is pinged and then dropped, so
+// dead circuits and half-open sockets do not pile up.
+enum conn_state {
+    CONN_HANDSHAKE,           // Waiting for the client's Noise handshake message
+    CONN_AUTH_PASSWORD,       // Prompt sent, waiting for a password attempt
+    CONN_AUTH_VERIFY,         // Password handed to a KDF worker, waiting for the result
+    CONN_CHAT,                // Authenticated chat session
+    CONN_PEER                 // Link from another federated node, relaying its messages
+};
+
+enum login_method { LOGIN_PASSWORD, LOGIN_TICKET };
+
+// Live counters for one shard. Only the shard's own thread writes them
+// (see metrics.h); the admin socket and /status read them from others.
+struct shard_metrics {
+    uint64_t connections;                 // Accepted
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t messages_in;                 // Chat messages received from clients
+    uint64_t frames_out;                  // Frames queued to clients
+    uint64_t frames_dropped;              // Chat frames dropped for clients over OUTQ_HIGH_WATER
+    uint64_t bus_dropped;                 // Messages lost to a full peer inbox
+    uint64_t logins[2];                   // Successful, by login_method
+    uint64_t logins_failed[2];
+    uint64_t pending;                     // Gauge: connections not yet in the chat
+    uint64_t outq_bytes;                  // Gauge: bytes queued to this shard's clients
+    uint64_t rooms;                       // Gauge: rooms with members on this shard
+    uint64_t chunks_in;                   // File chunks stored from uploads
+    uint64_t chunks_out;                  // File chunks streamed to downloads
+    uint64_t held;                        // Times a client's output waited out the batching window
+    uint64_t padding_out;                 // Padding bytes sealed to fill cells or as cover traffic
+    uint64_t throttled;                   // Times a client's input was paused by a rate limit
+    uint64_t idle_closed;                 // Chat clients dropped for not answering pings
+    uint64_t conn_memory;                 // Gauge: bytes of client state and the buffers it holds
+    uint64_t slab_bytes;                  // Gauge: slab pages mapped for client state
+    uint64_t compressed_out;              // Frames sent compressed
+    uint64_t compress_raw;                // ...their payload bytes before compression
+    uint64_t compress_wire;               // ...and after, inner type included
+    uint64_t decompressed_in;             // Compressed frames received
+    struct pool_stats pool;               // This thread's buffer pools
+    struct histogram loop_ns;             // Busy time of each event-loop iteration
+    struct histogram fanout_ns;           // Queueing one message for every local recipient
+    struct histogram compress_ns;         // Compressing one eligible frame for one client
+    struct histogram outq_depth;          // Bytes still queued on a client after each flush
+};
+
+// Counters for one connection, in a per-shard table indexed by descriptor
+// so other threads can read them without going near the client itself.
+// seq is odd while the owning thread rewrites the identity fields.
+struct conn_stats {
+    unsigned int seq;
+    int in_use;
+    int state;
+    int port;
+    char ip[INET_ADDRSTRLEN];
+    char user[CREDS_MAX_USER + 1];
+    uint64_t since;                       // Unix time connected
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t messages_in;
+    uint64_t frames_out;
+    uint64_t frames_dropped;
+    uint64_t queued;                      // Bytes waiting in the output queue
+    uint64_t memory;                      // Bytes of state and buffers it holds
+};
+
+struct shard;
+
+// Rate limit buckets shared by all of one user's connections, on whichever
+// shards, hung on the user's entry in the online directory
+struct user_limits {
+    uint64_t msgs;
+    uint64_t bytes;
+};
+
+// A room a connection is in, and its place among the room's members
+struct client_room {
+    struct group *room;        // NULL for a free entry
+    unsigned int pos;
+};
+
+// Per-connection state, indexed by socket descriptor
+struct client {
+    int fd;
+    struct shard *shard;       // Event-loop thread that owns this connection
+    enum conn_state state;
+    int slot;                  // Index in active_clients once authenticated
+    int auth_attempts;
+    struct kdf_job *auth_job;  // Password check in flight
+    char user[CREDS_MAX_USER + 1];
+    struct timer timer;        // Phase deadline, then heartbeat (see client_timer())
+    uint64_t last_rx;          // Monotonic ms of the last frame from it, in the chat
+    struct client *pend_prev;  // Pending list, oldest phase first
+    struct client *pend_next;
+    struct frame_reader rx;
+    struct outq out;
+    struct noise_cipher seal;  // Session keys once the handshake is done
+    struct noise_cipher open;
+    uint8_t features;          // Agreed in the handshake
+    struct compress_stream *zout;  // Compression contexts, made on first use
+    struct compress_stream *zin;
+    struct history_cursor replay;  // History being streamed to the client
+    int replaying;
+    struct mailbox_drain mail;     // Messages stored while it was offline, streamed ahead of the replay
+    int dropped;               // Consecutive chat frames dropped by backpressure
+    struct conn_stats *stats;  // This connection's entry in the shard's table
+    struct client_room rooms[MAX_ROOMS_JOINED];
+    struct group *local_user;  // This connection in the shard's user index, once in the chat
+    unsigned int local_pos;
+    struct group *online_user; // ...and in the server-wide directory
+    unsigned int online_pos;
+    struct user_limits *limits;      // The user's buckets, while in the directory
+    struct fed_node *peer_node;      // Node at the other end of a federation link
+    uint64_t peer_gen;               // ...and the link's generation (see fed_hello())
+    uint64_t msg_bucket;             // This connection's own (see ratelimit.h)
+    uint64_t byte_bucket;
+    uint64_t throttled_until;        // Monotonic ns before which its input is left unread
+    int rate_noticed;                // Told once that it is sending too fast
+    int sched;                       // Waiting to have its input handled, or throttled
+    long deficit;                    // Input bytes it may still have handled this round
+    struct client *sched_prev;
+    struct client *sched_next;
+    struct file_manifest *upload;    // File being received, until its last chunk is in
+    uint32_t upload_next;            // First chunk of it the store still lacks
+    char upload_to[GROUP_NAME_MAX + 2];  // Where to announce it: "", "#room" or a user
+    struct file_manifest *download;  // File being streamed to the client
+    uint32_t download_next;
+    int download_lowat;              // TCP_NOTSENT_LOWAT from before the download
+    int recv_armed;            // io_uring: the multishot receive is active
+    int recv_paused;           // io_uring: receive cancelled until the backlog is handled
+    int recv_eof;              // io_uring: the peer closed; disconnect once its input is handled
+    int sending;               // io_uring: a send from out.wire is in flight
+    int removed;               // io_uring: closed, freed once neither of the above
+    unsigned char *orphan_wire;  // io_uring: buffer of a send in flight when it closed
+    size_t orphan_cap;
+    int closing;               // Close at the end of this loop iteration
+    int dirty;                 // On the flush list, or held on the batching list
+    uint64_t flush_at;         // Monotonic ms the held output is due, 0 if not held this time
+    uint64_t padded;           // out.padded already counted in the metrics
+    uint64_t cover_mark;       // frames_out at the last cover tick
+    struct client *dirty_prev;
+    struct client *dirty_next;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+};
+
+// One event-loop thread. Each shard has its own SO_REUSEPORT listener, so
+// the kernel spreads new connections across shards and a connection stays
+// on the thread that accepted it. Nothing in a shard is touched by other
+// threads except its inbox rings and the published client count.
+struct shard {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int epfd;
+    int uring;                            // Driven by ring instead of epfd
+    struct uring ring;
+    struct uring_bufs bufs;               // Receive buffers for ring
+    int wake_fd;                          // eventfd signalled when the inbox has messages
+    struct kdf_done kdf_done;             // Password checks finished for this thread
+    struct client *clients[MAX_CLIENTS];
+    struct client *active_clients[MAX_CLIENTS];
+    int client_count;
+    int published_count;                  // client_count as seen by other threads
+    struct client *pending_head, *pending_tail;
+    int pending_count;
+    struct timer_wheel timers;            // Every client's timer, in monotonic ms
+    struct slab client_slab;              // Every client's state
+    struct client *dirty_head;            // Clients with output queued since the last flush
+    struct client *held_head, *held_tail; // Clients whose output waits out the batching window, oldest first
+    uint64_t next_cover;                  // Monotonic ms of the next cover tick
+    struct client *ready_head, *ready_tail;  // Clients with input waiting, served round robin
+    struct client *throttled_head;        // Clients over a rate limit, in no order
+    uint64_t next_release;                // Earliest throttled_until among them
+    struct spsc_ring *inbox[MAX_SHARDS];  // inbox[i] is written only by shard i
+    struct group_table rooms;             // Room name -> this shard's connections in it
+    struct group_table users;             // User name -> this shard's connections as that user
+    uint64_t wake_mask;                   // Peers sent to during this iteration
+    struct shard_metrics m;
+    struct conn_stats *conn_stats;        // MAX_CLIENTS entries, indexed by fd
+};
+
+static struct shard *shards[MAX_SHARDS];
+static int num_shards = 1;
+static int stopping;                      // Set once by shard 0 on /quit, SIGINT or SIGTERM
+
+static const int phase_timeout_ms[] = {
+    [CONN_HANDSHAKE] = HANDSHAKE_TIMEOUT_MS,
+    [CONN_AUTH_PASSWORD] = AUTH_PASSWORD_TIMEOUT_MS,
+    [CONN_AUTH_VERIFY] = AUTH_VERIFY_TIMEOUT_MS,
+};
+
+// Swapped whole on SIGHUP; lookups hold the read lock only long enough to
+// copy one entry out
+static struct cred_table *creds;
+static pthread_rwlock_t creds_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Every chat connection on every shard, by user name, so a direct message
+// is passed only to the shards its recipient is connected to. Changed on
+// login and logout, read once per direct message.
+static struct group_table online;
+static pthread_mutex_t online_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Checked in place of an unknown user's hash, so a login for a name that
+// does not exist takes as long as one that does
+static struct argon2_params decoy_params;
+static int signal_fd = -1;
+
+static uint8_t server_priv[NOISE_KEY_LEN];
+static uint8_t server_pub[NOISE_KEY_LEN];
+
+static const char *unix_path;         // Listen on this Unix socket instead of TCP (-s)
+static int listen_port = PORT;      // TCP port to listen on (-p)
+static int fed_peers;                 // Nodes to federate with (-F)
+static int use_uring;                 // Drive the event loops with io_uring (-e uring)
+static int stdin_polled;              // stdin is watched for server commands
+static int log_level = LOG_INFO;
+static int log_bodies;                // Log chat text instead of only its size (-b)
+static int batch_ms;                  // Hold chat output this long to coalesce it (-W)
+static int pad_cells;                 // Pad every burst of output to whole Tor cells (-P)
+static int cover_ms;                  // Cover traffic interval for quiet clients (-C)
+static uint8_t features = FRAME_FEATURE_COMPRESS;   // Handshake features agreed to when offered (-Z drops compression)
+static int conn_msg_rate = CONN_MSG_RATE;   // Per-connection message rate, 0 for no connection limits (-q)
+static int user_msg_rate = USER_MSG_RATE;   // Per-user message rate, 0 for no user limits (-Q)
+static struct rate_limit conn_msgs, user_msgs, conn_bytes, user_bytes;
+
+static int admin_fd = -1;
+static pthread_t admin_thread;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log an event about client c, tagged with its address and user
+#define log_client(level, event, c, ...) \
+    log_event(level, event, (c)->ip, (c)->port, (c)->user[0] ? (c)->user : NULL, __VA_ARGS__)
+
+// Console time stamp for command output; events go through the log
+static void print_timestamp() {
     time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    printf(COLOR_YELLOW "[%02d:%02d:%02d] " COLOR_RESET, t->tm_hour, t->tm_min, t->tm_sec);
+    struct tm t;
+    localtime_r(&now, &t);
+    printf(COLOR_YELLOW "[%02d:%02d:%02d] " COLOR_RESET, t.tm_hour, t.tm_min, t.tm_sec);
 }
 
 void print_server_banner() {
@@ -44,207 +371,3186 @@ void print_server_banner() {
     printf("\n");
 }
 
-int authenticate_client(int sockfd, const char *client_ip, int client_port) {
-    char buffer[BUF_SIZE];
-    int attempts = 0;
-    
-    print_timestamp();
-    printf("Authenticating client %s:%d\n", client_ip, client_port);
-    
-    while (attempts < MAX_AUTH_ATTEMPTS) {
-        // Send password prompt
-        const char *prompt = "Enter password: ";
-        if (send(sockfd, prompt, strlen(prompt), 0) < 0) {
-            print_timestamp();
-            printf(COLOR_RED "Send failed for client %s:%d\n" COLOR_RESET, client_ip, client_port);
-            return 0;
+static const char *format_bytes(char *buf, size_t cap, uint64_t n) {
+    if (n < 1024) snprintf(buf, cap, "%llu B", (unsigned long long)n);
+    else if (n < 1024 * 1024) snprintf(buf, cap, "%.1f KiB", n / 1024.0);
+    else if (n < 1024ull * 1024 * 1024) snprintf(buf, cap, "%.1f MiB", n / (1024.0 * 1024.0));
+    else snprintf(buf, cap, "%.2f GiB", n / (1024.0 * 1024.0 * 1024.0));
+    return buf;
+}
+
+// Allow as many descriptors as the hard limit permits so thousands of
+// clients can be connected at once
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// A reader that sees seq odd, or changed across its copy, retries
+static void conn_stats_begin(struct conn_stats *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void conn_stats_end(struct conn_stats *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Take a consistent copy of a connection's stats from any thread.
+// Returns 0 if the slot is not in use.
+static int conn_stats_read(const struct conn_stats *s, struct conn_stats *copy) {
+    if (!__atomic_load_n(&s->in_use, __ATOMIC_RELAXED)) return 0;
+
+    while (1) {
+        unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        memcpy(copy, s, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) return copy->in_use;
+    }
+}
+
+// Bring the memory gauges up to date with the buffers a client holds. An
+// idle one holds none, only its slab object.
+static void account_memory(struct client *c) {
+    struct shard *sh = c->shard;
+    struct conn_stats *s = c->stats;
+    uint64_t mem = slab_object_size(&sh->client_slab) + c->rx.cap + outq_memory(&c->out) +
+                   ((c->zout != NULL) + (c->zin != NULL)) * sizeof(struct compress_stream);
+
+    metric_set(&sh->m.conn_memory, sh->m.conn_memory + mem - s->memory);
+    metric_set(&s->memory, mem);
+}
+
+// Bring the counters up to date with what the output queue wrote and
+// still holds
+static void account_output(struct client *c) {
+    struct shard_metrics *m = &c->shard->m;
+    struct conn_stats *s = c->stats;
+
+    metric_add(&m->bytes_out, c->out.sent - s->bytes_out);
+    metric_set(&s->bytes_out, c->out.sent);
+    metric_set(&m->outq_bytes, m->outq_bytes + c->out.bytes - s->queued);
+    metric_set(&s->queued, c->out.bytes);
+    metric_add(&m->padding_out, c->out.padded - c->padded);
+    c->padded = c->out.padded;
+    account_memory(c);
+}
+
+enum { DIRTY = 1, HELD = 2 };
+
+// A held client counts as dirty: more output for it joins the batch
+static void mark_dirty(struct client *c) {
+    struct shard *sh = c->shard;
+    if (c->dirty) return;
+    c->dirty = DIRTY;
+    c->dirty_prev = NULL;
+    c->dirty_next = sh->dirty_head;
+    if (sh->dirty_head) sh->dirty_head->dirty_prev = c;
+    sh->dirty_head = c;
+}
+
+static void unmark_dirty(struct client *c) {
+    struct shard *sh = c->shard;
+    if (!c->dirty) return;
+    if (c->dirty_prev) c->dirty_prev->dirty_next = c->dirty_next;
+    else if (c->dirty == HELD) sh->held_head = c->dirty_next;
+    else sh->dirty_head = c->dirty_next;
+    if (c->dirty_next) c->dirty_next->dirty_prev = c->dirty_prev;
+    else if (c->dirty == HELD) sh->held_tail = c->dirty_prev;
+    c->dirty = 0;
+}
+
+// Park a client on the batching list until `due`. Every hold lasts the same
+// window, so appending keeps the list in deadline order.
+static void hold_output(struct client *c, uint64_t due) {
+    struct shard *sh = c->shard;
+    c->dirty = HELD;
+    c->flush_at = due;
+    c->dirty_next = NULL;
+    c->dirty_prev = sh->held_tail;
+    if (sh->held_tail) sh->held_tail->dirty_next = c;
+    else sh->held_head = c;
+    sh->held_tail = c;
+    metric_add(&sh->m.held, 1);
+}
+
+// Schedule a client to be closed once the current loop iteration is done,
+// for paths that must not free it while iterating over clients
+static void close_later(struct client *c) {
+    c->closing = 1;
+    if (c->dirty == HELD) unmark_dirty(c);
+    mark_dirty(c);
+}
+
+// --- Input scheduling ----------------------------------------------------
+//
+// Readable clients are not read on the spot but queued, and each loop
+// iteration runs one round of deficit round robin over the queue: every
+// client in it gets DRR_QUANTUM more bytes of input handled, then goes to
+// the back if it has more. A client pasting megabytes thus costs everyone
+// else at most one quantum per round, with output flushed between rounds.
+// A client over a rate limit leaves the queue until its buckets clear, and
+// its unread input waits in the kernel, pushing back on the sender.
+
+enum { INPUT_IDLE, INPUT_READY, INPUT_THROTTLED };
+
+static void sched_unlink(struct client *c) {
+    struct shard *sh = c->shard;
+    if (c->sched == INPUT_IDLE) return;
+    if (c->sched_prev) c->sched_prev->sched_next = c->sched_next;
+    else if (c->sched == INPUT_READY) sh->ready_head = c->sched_next;
+    else sh->throttled_head = c->sched_next;
+    if (c->sched_next) c->sched_next->sched_prev = c->sched_prev;
+    else if (c->sched == INPUT_READY) sh->ready_tail = c->sched_prev;
+    c->sched = INPUT_IDLE;
+}
+
+static void sched_ready(struct client *c) {
+    struct shard *sh = c->shard;
+    c->sched = INPUT_READY;
+    c->sched_next = NULL;
+    c->sched_prev = sh->ready_tail;
+    if (sh->ready_tail) sh->ready_tail->sched_next = c;
+    else sh->ready_head = c;
+    sh->ready_tail = c;
+}
+
+static void sched_throttle(struct client *c) {
+    struct shard *sh = c->shard;
+    c->sched = INPUT_THROTTLED;
+    c->sched_prev = NULL;
+    c->sched_next = sh->throttled_head;
+    if (sh->throttled_head) sh->throttled_head->sched_prev = c;
+    sh->throttled_head = c;
+    if (!sh->next_release || c->throttled_until < sh->next_release) sh->next_release = c->throttled_until;
+    metric_add(&sh->m.throttled, 1);
+}
+
+// Input arrived: queue the client for its turn, unless it is already
+// queued or waiting out a rate limit
+static void schedule_input(struct client *c) {
+    if (c->sched == INPUT_IDLE) sched_ready(c);
+}
+
+// Put every throttled client whose buckets have cleared back in line
+static void release_throttled(struct shard *sh, uint64_t now) {
+    if (!sh->throttled_head || now < sh->next_release) return;
+
+    sh->next_release = 0;
+    struct client *c = sh->throttled_head;
+    while (c) {
+        struct client *next = c->sched_next;
+        if (c->throttled_until <= now) {
+            sched_unlink(c);
+            sched_ready(c);
+        } else if (!sh->next_release || c->throttled_until < sh->next_release) {
+            sh->next_release = c->throttled_until;
         }
-        
-        // Receive password attempt
-        int n = recv(sockfd, buffer, BUF_SIZE - 1, 0);
-        if (n <= 0) {
-            print_timestamp();
-            printf(COLOR_RED "Client %s:%d disconnected during authentication\n" COLOR_RESET, client_ip, client_port);
-            return 0;
+        c = next;
+    }
+}
+
+// --- io_uring requests ---------------------------------------------------
+//
+// A request's user_data says what completed: the client pointer with the
+// operation in its low bits for receives and sends, or the descriptor for
+// accepts and polls. A client closed with a request still in flight stays
+// allocated, marked removed, until that request's last completion.
+
+enum uring_op { OP_ACCEPT, OP_POLL, OP_RECV, OP_SEND, OP_CANCEL };
+
+#define URING_OP_BITS 3
+
+static uint64_t uring_data(enum uring_op op, uintptr_t ref) {
+    return op < OP_RECV ? (uint64_t)ref << URING_OP_BITS | op : (uint64_t)ref | op;
+}
+
+static struct io_uring_sqe *shard_sqe(struct shard *sh) {
+    struct io_uring_sqe *sqe = uring_sqe(&sh->ring);
+    if (!sqe) perror("io_uring_enter");
+    return sqe;
+}
+
+static void uring_arm_accept(struct shard *sh) {
+    struct io_uring_sqe *sqe = shard_sqe(sh);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sh->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = uring_data(OP_ACCEPT, sh->listen_fd);
+}
+
+static void uring_arm_poll(struct shard *sh, int fd) {
+    struct io_uring_sqe *sqe = shard_sqe(sh);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_data(OP_POLL, fd);
+}
+
+// Receive whenever data arrives, into whichever buffer is free then
+static int uring_arm_recv(struct client *c) {
+    struct io_uring_sqe *sqe = shard_sqe(c->shard);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = c->shard->bufs.group;
+    sqe->user_data = uring_data(OP_RECV, (uintptr_t)c);
+    c->recv_armed = 1;
+    return 0;
+}
+
+// Stop receiving for c until its backlog is handled, so a client held back
+// by a rate limit cannot fill server memory instead of its socket buffer.
+// The receive ends with -ECANCELED; the cancel's own completion is ignored.
+static void uring_pause_recv(struct client *c) {
+    c->recv_paused = 1;
+    if (!c->recv_armed) return;
+    struct io_uring_sqe *sqe = shard_sqe(c->shard);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(OP_RECV, (uintptr_t)c);
+    sqe->user_data = uring_data(OP_CANCEL, 0);
+}
+
+// Start sending the client's queue unless a send is already in flight;
+// its completion starts the next one. Returns -1 on a fatal error.
+static int uring_send(struct client *c) {
+    // The few plaintext frames before the key exchange go out directly
+    if (c->sending) return 0;
+    if (!c->out.seal) return outq_flush(&c->out, c->fd);
+
+    const unsigned char *data;
+    ssize_t len = outq_wire_next(&c->out, &data);
+    if (len <= 0) return len;
+
+    struct io_uring_sqe *sqe = shard_sqe(c->shard);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_data(OP_SEND, (uintptr_t)c);
+    c->sending = 1;
+    return 0;
+}
+
+// Free a removed client once the kernel is done with it
+static void release_removed(struct client *c) {
+    struct shard *sh = c->shard;
+
+    if (c->recv_armed || c->sending) return;
+    pool_free(c->orphan_wire, c->orphan_cap);
+    slab_free(&sh->client_slab, c);
+    metric_set(&sh->m.slab_bytes, sh->client_slab.pages * POOL_SLAB_PAGE);
+}
+
+// Queue a frame on a client by reference. Chat traffic above the high-water
+// mark is dropped for that client, and one that keeps falling behind is
+// disconnected as a slow consumer so it cannot grow server memory.
+static void queue_frame(struct client *c, struct msgbuf *m, int droppable) {
+    if (c->closing) return;
+
+    if (droppable && c->out.bytes + m->len > OUTQ_HIGH_WATER) {
+        metric_add(&c->stats->frames_dropped, 1);
+        metric_add(&c->shard->m.frames_dropped, 1);
+        if (++c->dropped == OUTQ_MAX_DROPPED) {
+            log_client(LOG_WARN, "slow", c, "Client %s:%d is not keeping up, disconnecting", c->ip, c->port);
+            close_later(c);
         }
-        buffer[n] = 0;
-        
-        // Remove newline if present
-        buffer[strcspn(buffer, "\n")] = 0;
-        buffer[strcspn(buffer, "\r")] = 0;
-        
-        print_timestamp();
-        printf("Authentication attempt %d from %s:%d: %s\n", 
-               attempts + 1, client_ip, client_port, 
-               strcmp(buffer, PASSWORD) == 0 ? "SUCCESS" : "FAILED");
-        
-        // Check password
-        if (strcmp(buffer, PASSWORD) == 0) {
-            const char *success_msg = "Authentication successful! Welcome to the secure chat.\n";
-            send(sockfd, success_msg, strlen(success_msg), 0);
-            print_timestamp();
-            printf(COLOR_GREEN "Client %s:%d authenticated successfully\n" COLOR_RESET, client_ip, client_port);
-            return 1;
-        } else {
-            attempts++;
-            if (attempts >= MAX_AUTH_ATTEMPTS) {
-                const char *max_attempts_msg = "Maximum authentication attempts exceeded. Connection closed.\n";
-                send(sockfd, max_attempts_msg, strlen(max_attempts_msg), 0);
-                print_timestamp();
-                printf(COLOR_RED "Client %s:%d failed authentication (max attempts)\n" COLOR_RESET, client_ip, client_port);
-                return 0;
-            } else {
-                const char *fail_msg = "Authentication failed. Please try again.\n";
-                send(sockfd, fail_msg, strlen(fail_msg), 0);
-            }
+        return;
+    }
+
+    if (outq_push(&c->out, m) < 0) {
+        close_later(c);
+        return;
+    }
+    c->dropped = 0;
+    metric_add(&c->stats->frames_out, 1);
+    metric_add(&c->shard->m.frames_out, 1);
+    mark_dirty(c);
+}
+
+static void send_frame(struct client *c, uint8_t type, const void *data, size_t len) {
+    struct msgbuf *m = msgbuf_new(type, data, len);
+    if (!m) return;
+    queue_frame(c, m, 0);
+    msgbuf_unref(m);
+}
+
+static void send_text(struct client *c, uint8_t type, const char *msg) {
+    send_frame(c, type, msg, strlen(msg));
+}
+
+// Pending list: half-authenticated connections, in the order they entered
+// their current phase. Their deadlines are on the timer wheel.
+static void pending_unlink(struct client *c) {
+    struct shard *sh = c->shard;
+    if (c->pend_prev) c->pend_prev->pend_next = c->pend_next;
+    else sh->pending_head = c->pend_next;
+    if (c->pend_next) c->pend_next->pend_prev = c->pend_prev;
+    else sh->pending_tail = c->pend_prev;
+    c->pend_prev = c->pend_next = NULL;
+    sh->pending_count--;
+}
+
+static void pending_arm(struct client *c, enum conn_state state) {
+    struct shard *sh = c->shard;
+
+    if (c->pend_prev || sh->pending_head == c) {
+        pending_unlink(c);
+    }
+
+    c->state = state;
+    timer_arm(&sh->timers, &c->timer, now_ms() + phase_timeout_ms[state]);
+    __atomic_store_n(&c->stats->state, state, __ATOMIC_RELAXED);
+
+    c->pend_prev = sh->pending_tail;
+    c->pend_next = NULL;
+    if (sh->pending_tail) sh->pending_tail->pend_next = c;
+    else sh->pending_head = c;
+    sh->pending_tail = c;
+    sh->pending_count++;
+}
+
+// Take c out of the i-th room in its list
+static void leave_room(struct client *c, int i) {
+    struct shard *sh = c->shard;
+    char name[GROUP_NAME_MAX + 1];
+
+    snprintf(name, sizeof(name), "%s", c->rooms[i].room->name);
+    if (group_remove(&sh->rooms, c->rooms[i].room, c->rooms[i].pos)) fed_interest(FED_ROOM, name, strlen(name), 0);
+    c->rooms[i].room = NULL;
+    metric_set(&sh->m.rooms, sh->rooms.count);
+}
+
+// Make a client that entered the chat reachable by its user name
+static void index_user(struct client *c) {
+    size_t len = strlen(c->user);
+    c->local_user = group_add(&c->shard->users, c->user, len, c, &c->local_pos);
+    pthread_mutex_lock(&online_lock);
+    c->online_user = group_add(&online, c->user, len, c, &c->online_pos);
+    if (c->online_user && !c->online_user->data) c->online_user->data = calloc(1, sizeof(struct user_limits));
+    c->limits = c->online_user ? c->online_user->data : NULL;
+    if (c->online_user && c->online_user->count == 1) fed_interest(FED_USER, c->user, len, 1);
+    pthread_mutex_unlock(&online_lock);
+    if (!c->local_user || !c->online_user) {
+        log_client(LOG_ERROR, "server", c, "Out of memory, direct messages to %s will be lost", c->user);
+    }
+}
+
+// Drop every trace of a chat client from the room and user indexes
+static void unindex_client(struct client *c) {
+    for (int i = 0; i < MAX_ROOMS_JOINED; i++) {
+        if (c->rooms[i].room) leave_room(c, i);
+    }
+    if (c->local_user) group_remove(&c->shard->users, c->local_user, c->local_pos);
+    if (c->online_user) {
+        pthread_mutex_lock(&online_lock);
+        if (c->online_user->count == 1) {
+            free(c->online_user->data);
+            fed_interest(FED_USER, c->user, strlen(c->user), 0);
         }
+        group_remove(&online, c->online_user, c->online_pos);
+        pthread_mutex_unlock(&online_lock);
     }
-    return 0;
+    c->local_user = c->online_user = NULL;
+    c->limits = NULL;
 }
 
-int main() {
-    int sockfd, new_sock;
-    struct sockaddr_in serv_addr, cli_addr;
-    socklen_t cli_len = sizeof(cli_addr);
-    char buffer[BUF_SIZE];
+static void remove_client(struct client *c) {
+    struct shard *sh = c->shard;
 
-    print_server_banner();
-    
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) { 
-        perror("socket"); 
-        exit(1); 
+    if (c->state == CONN_CHAT) {
+        // Keep the active list dense by moving the last entry into the hole
+        struct client *last = sh->active_clients[--sh->client_count];
+        sh->active_clients[c->slot] = last;
+        last->slot = c->slot;
+        __atomic_store_n(&sh->published_count, sh->client_count, __ATOMIC_RELAXED);
+        unindex_client(c);
+    } else if (c->state == CONN_PEER) {
+        fed_link_closed(c->peer_node, c->peer_gen);
+    } else {
+        pending_unlink(c);
     }
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
+    // A KDF worker may still hold the login; its result will be discarded
+    if (c->auth_job) c->auth_job->owner = NULL;
+
+    unmark_dirty(c);
+    sched_unlink(c);
+    timer_cancel(&sh->timers, &c->timer);
+    sh->clients[c->fd] = NULL;
+    if (!sh->uring) epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+
+    // Last chance for queued notices such as the reason for closing,
+    // unless a send in flight owns the head of the queue
+    if (!c->sending) outq_flush(&c->out, c->fd);
+    account_output(c);
+    metric_set(&sh->m.outq_bytes, sh->m.outq_bytes - c->stats->queued);
+    metric_set(&sh->m.conn_memory, sh->m.conn_memory - c->stats->memory);
+    conn_stats_begin(c->stats);
+    c->stats->in_use = 0;
+    conn_stats_end(c->stats);
+
+    if (sh->uring) {
+        // Requests in flight hold the socket open; this ends them
+        shutdown(c->fd, SHUT_RDWR);
+        if (c->sending) {
+            c->orphan_wire = c->out.wire;
+            c->orphan_cap = c->out.wire_cap;
+            c->out.wire = NULL;
+            c->out.wire_cap = 0;
+        }
     }
+    close(c->fd);
+    frame_reader_free(&c->rx);
+    outq_free(&c->out);
+    history_cursor_release(&c->replay);
+    mailbox_return(c->user, &c->mail);
+    free(c->upload);
+    free(c->download);
+    compress_stream_free(c->zout);
+    compress_stream_free(c->zin);
+    crypto_wipe(&c->seal, sizeof(c->seal));
+    crypto_wipe(&c->open, sizeof(c->open));
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(LISTEN_ADDR);
-    serv_addr.sin_port = htons(PORT);
+    log_client(LOG_INFO, "close", c, "Connection with %s:%d closed (%d clients connected)", c->ip, c->port, sh->client_count);
+    c->removed = 1;
+    release_removed(c);
+}
 
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("bind"); 
-        close(sockfd);
-        exit(1);
+// Queue an encoded frame on every authenticated client of this shard except
+// `except` (may be NULL). Nothing is written here; flush_clients() batches it.
+static void broadcast_local(struct shard *sh, struct msgbuf *m, struct client *except) {
+    for (int i = 0; i < sh->client_count; i++) {
+        struct client *c = sh->active_clients[i];
+        if (c == except) continue;
+        queue_frame(c, m, 1);
     }
+}
 
-    if (listen(sockfd, 5) < 0) {
-        perror("listen");
-        close(sockfd);
-        exit(1);
+// Queue a frame on every member of a group except `except`
+static void group_send(struct group *g, struct msgbuf *m, struct client *except) {
+    if (!g) return;
+    for (unsigned int i = 0; i < g->count; i++) {
+        struct client *c = g->members[i].ref;
+        if (c == except) continue;
+        queue_frame(c, m, 1);
     }
+}
 
-    print_timestamp();
-    printf("Server listening on %s:%d\n", LISTEN_ADDR, PORT);
-    print_timestamp();
-    printf("Waiting for incoming connections...\n");
+// Queue a frame on whichever of this shard's clients it is for: everyone
+// for lobby chat, the room's members or the recipient's connections
+// otherwise. Room and direct frames start with the NUL-terminated room or
+// user they are routed by, sender first in a direct one.
+static void deliver_local(struct shard *sh, struct msgbuf *m, struct client *except) {
+    const char *name = (const char *)msgbuf_payload(m);
+    size_t len = m->len - FRAME_HDR_LEN;
 
-    while (1) {
-        new_sock = accept(sockfd, (struct sockaddr*)&cli_addr, &cli_len);
-        if (new_sock < 0) { 
-            perror("accept"); 
+    switch (m->data[FRAME_HDR_LEN - 1]) {
+    case FRAME_ROOM:
+        group_send(group_find(&sh->rooms, name, strnlen(name, len)), m, except);
+        break;
+    case FRAME_DIRECT: {
+        size_t from_len = strnlen(name, len);
+        if (from_len == len) break;
+        name += from_len + 1;
+        group_send(group_find(&sh->users, name, strnlen(name, len - from_len - 1)), m, except);
+        break;
+    }
+    default:
+        broadcast_local(sh, m, except);
+        break;
+    }
+}
+
+// Fan a frame out: to this shard's clients directly, and to each shard in
+// `peers` by passing a reference through its inbox ring. Every shard picks
+// out its own recipients. Peers are woken once per loop iteration, not once
+// per message.
+static void fan_out(struct shard *sh, struct msgbuf *m, struct client *except, uint64_t peers) {
+    uint64_t start = now_ns();
+    deliver_local(sh, m, except);
+
+    peers &= ~(1ULL << sh->id);
+    while (peers) {
+        int i = __builtin_ctzll(peers);
+        peers &= peers - 1;
+        if (!spsc_ring_push(shards[i]->inbox[sh->id], msgbuf_ref(m))) {
+            msgbuf_unref(m);
+            metric_add(&sh->m.bus_dropped, 1);
             continue;
         }
-        
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &cli_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        int client_port = ntohs(cli_addr.sin_port);
-        
-        print_timestamp();
-        printf(COLOR_GREEN "New client connected from %s:%d\n" COLOR_RESET, client_ip, client_port);
-        
-        // Authenticate client
-        if (authenticate_client(new_sock, client_ip, client_port)) {
-            const char *welcome_msg = "Welcome to the secure chat server! Type your messages.\n";
-            send(new_sock, welcome_msg, strlen(welcome_msg), 0);
-            
-            // Main chat loop
-            fd_set readfds;
-            int maxfd = (new_sock > STDIN_FILENO) ? new_sock : STDIN_FILENO;
-            int authenticated_session = 1;
-            
-            print_timestamp();
-            printf("Chat session started with %s:%d\n", client_ip, client_port);
-            
-            while (authenticated_session) {
-                FD_ZERO(&readfds);
-                FD_SET(new_sock, &readfds);
-                FD_SET(STDIN_FILENO, &readfds);
-
-                if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
-                    perror("select");
-                    break;
-                }
+        sh->wake_mask |= 1ULL << i;
+    }
+    hist_record(&sh->m.fanout_ns, now_ns() - start);
+}
 
-                // Incoming message from client
-                if (FD_ISSET(new_sock, &readfds)) {
-                    int n = recv(new_sock, buffer, BUF_SIZE - 1, 0);
-                    if (n <= 0) {
-                        print_timestamp();
-                        printf(COLOR_RED "Client %s:%d disconnected\n" COLOR_RESET, client_ip, client_port);
-                        break;
-                    }
-                    buffer[n] = 0;
-                    
-                    // Remove newline if present
-                    buffer[strcspn(buffer, "\n")] = 0;
-                    buffer[strcspn(buffer, "\r")] = 0;
-                    
-                    // Display client message
-                    print_timestamp();
-                    printf(COLOR_BLUE "Client %s:%d: %s\n" COLOR_RESET, client_ip, client_port, buffer);
-                }
+static uint64_t all_shards() {
+    return num_shards == 64 ? ~0ULL : (1ULL << num_shards) - 1;
+}
+
+// Relay a chat message: number it, append it to the history log and fan it
+// out, all from the one encoded frame
+static void broadcast_chat(struct shard *sh, const char *prefix, size_t prefix_len,
+                           const void *text, size_t len, struct client *except) {
+    size_t max = FRAME_MAX_PLAINTEXT - FRAME_CHAT_HDR_LEN - prefix_len;
+    if (len > max) len = max;
+
+    struct msgbuf *m = msgbuf_alloc(FRAME_CHAT, FRAME_CHAT_HDR_LEN + prefix_len + len);
+    if (!m) return;
+    unsigned char *p = msgbuf_payload(m) + FRAME_CHAT_HDR_LEN;
+    memcpy(p, prefix, prefix_len);
+    memcpy(p + prefix_len, text, len);
+
+    history_append(m->data, m->len);
+    fed_publish(m);
+    fan_out(sh, m, except, all_shards());
+    msgbuf_unref(m);
+}
+
+static void wake_shard(struct shard *sh) {
+    uint64_t one = 1;
+    if (write(sh->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+}
+
+// Deliver everything other shards queued for this one
+static void drain_inbox(struct shard *sh) {
+    uint64_t count;
+    if (read(sh->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        struct spsc_ring *r = sh->inbox[i];
+        struct msgbuf *m;
+        if (!r) continue;
+        while ((m = spsc_ring_pop(r)) != NULL) {
+            uint64_t start = now_ns();
+            deliver_local(sh, m, NULL);
+            hist_record(&sh->m.fanout_ns, now_ns() - start);
+            msgbuf_unref(m);
+        }
+    }
+}
+
+// Whether fresh output for c should wait out the batching window: only
+// chat, only from an idle start, and never a replay or a download, which
+// are bulk already and would only be slowed down
+static int should_hold(const struct client *c) {
+    return batch_ms > 0 && c->flush_at == 0 && !c->closing && c->state == CONN_CHAT && !c->sending &&
+           c->out.wire_off == c->out.wire_len && !c->out.source && !c->out.filler;
+}
+
+// Write out everything queued during this loop iteration, one writev per
+// client, reap clients scheduled for closing and wake peer shards that
+// were sent messages. With -W a client's first frames are held for the
+// batching window instead, and whatever else arrives for it meanwhile goes
+// out in the same write.
+static void flush_clients(struct shard *sh) {
+    uint64_t now = batch_ms > 0 ? now_ms() : 0;
+
+    while (sh->held_head && sh->held_head->flush_at <= now) {
+        struct client *c = sh->held_head;
+        unmark_dirty(c);
+        mark_dirty(c);
+    }
+
+    while (sh->dirty_head) {
+        struct client *c = sh->dirty_head;
+        unmark_dirty(c);
+
+        if (should_hold(c)) {
+            hold_output(c, now + batch_ms);
+            continue;
+        }
+        c->flush_at = 0;
+
+        if (c->closing || (sh->uring ? uring_send(c) : outq_flush(&c->out, c->fd)) < 0) {
+            remove_client(c);
+            continue;
+        }
+        account_output(c);
+        hist_record(&sh->m.outq_depth, c->out.bytes);
+    }
+
+    while (sh->wake_mask) {
+        int i = __builtin_ctzll(sh->wake_mask);
+        sh->wake_mask &= sh->wake_mask - 1;
+        wake_shard(shards[i]);
+    }
+}
+
+// A client's timer fired. Before the chat that is its phase deadline. In
+// the chat, and on a federation link, it is rearmed lazily: frames only
+// note when they arrived, and the timer, finding the client heard from
+// since, moves itself on. One silent for PING_AFTER_MS is pinged, and one
+// still silent at IDLE_TIMEOUT_MS is dropped.
+static void client_timer(struct client *c, uint64_t now) {
+    struct shard *sh = c->shard;
+
+    if (c->state < CONN_CHAT) {
+        log_client(LOG_WARN, "timeout", c, "Client %s:%d %s timed out", c->ip, c->port,
+                   c->state == CONN_HANDSHAKE ? "key exchange" : "authentication");
+        send_text(c, FRAME_AUTH_FAIL, "Authentication timed out. Connection closed.");
+        remove_client(c);
+        return;
+    }
+
+    uint64_t quiet = now - c->last_rx;
+    if (quiet >= IDLE_TIMEOUT_MS) {
+        log_client(LOG_INFO, "timeout", c, "Client %s:%d silent for %llu s, disconnecting", c->ip, c->port,
+                   (unsigned long long)(quiet / 1000));
+        metric_add(&sh->m.idle_closed, 1);
+        remove_client(c);
+    } else if (quiet >= PING_AFTER_MS) {
+        send_frame(c, FRAME_PING, NULL, 0);
+        timer_arm(&sh->timers, &c->timer, c->last_rx + IDLE_TIMEOUT_MS);
+    } else {
+        timer_arm(&sh->timers, &c->timer, c->last_rx + PING_AFTER_MS);
+    }
+}
+
+// Run every client timer that is due. Returns the wait until the next, or
+// -1 if none.
+static int expire_timers(struct shard *sh) {
+    uint64_t now = now_ms();
+    struct timer *t;
+
+    while ((t = timer_expire(&sh->timers, now)) != NULL) {
+        client_timer((struct client *)((char *)t - offsetof(struct client, timer)), now);
+    }
+    return timer_wheel_timeout(&sh->timers, now);
+}
+
+// Constant-rate cover: every chat client that was queued nothing since the
+// last tick gets one cell of padding, so its circuit carries at least a
+// cell every cover_ms whether anyone talks or not. Returns the epoll
+// timeout until the next tick.
+static int send_cover(struct shard *sh) {
+    uint64_t now = now_ms();
 
-                // Server input
-                if (FD_ISSET(STDIN_FILENO, &readfds)) {
-                    if (!fgets(buffer, BUF_SIZE - 1, stdin)) break;
-                    buffer[strcspn(buffer, "\n")] = 0;
-                    
-                    if (strlen(buffer) > 0) {
-                        // Check for server commands
-                        if (strcmp(buffer, "/quit") == 0 || strcmp(buffer, "/exit") == 0) {
-                            print_timestamp();
-                            printf("Server shutting down...\n");
-                            const char *shutdown_msg = "Server is shutting down. Goodbye!\n";
-                            send(new_sock, shutdown_msg, strlen(shutdown_msg), 0);
-                            close(new_sock);
-                            close(sockfd);
-                            exit(0);
-                        }
-                        
-                        if (strcmp(buffer, "/status") == 0) {
-                            print_timestamp();
-                            printf("Server status: Active, 1 client connected\n");
-                            continue;
-                        }
-                        
-                        // Display server message locally
-                        print_timestamp();
-                        printf(COLOR_CYAN "You: %s\n" COLOR_RESET, buffer);
-                        
-                        // Send message to client
-                        if (send(new_sock, buffer, strlen(buffer), 0) < 0) {
-                            perror("send");
-                            break;
-                        }
-                    }
+    if (now >= sh->next_cover) {
+        struct msgbuf *m = msgbuf_alloc(FRAME_PADDING, FRAME_CELL_DATA - FRAME_PADDING_MIN);
+        if (m) {
+            memset(msgbuf_payload(m), 0, FRAME_CELL_DATA - FRAME_PADDING_MIN);
+            for (int i = 0; i < sh->client_count; i++) {
+                struct client *c = sh->active_clients[i];
+                if (c->stats->frames_out == c->cover_mark) {
+                    queue_frame(c, m, 1);
+                    metric_add(&sh->m.padding_out, FRAME_CELL_DATA);
                 }
+                c->cover_mark = c->stats->frames_out;
             }
-        } else {
-            print_timestamp();
-            printf(COLOR_RED "Client %s:%d failed authentication\n" COLOR_RESET, client_ip, client_port);
+            msgbuf_unref(m);
         }
-        
-        close(new_sock);
-        print_timestamp();
-        printf("Connection with %s:%d closed\n", client_ip, client_port);
+        sh->next_cover = now + cover_ms;
     }
+    return (int)(sh->next_cover - now);
+}
 
-    close(sockfd);
-    print_timestamp();
-    printf("Server shutdown\n");
+// The earlier of two epoll timeouts, where -1 is none
+static int sooner(int a, int b) {
+    return a < 0 ? b : b < 0 || a < b ? a : b;
+}
+
+static void new_connection(struct shard *sh, int fd, const char *ip, int port) {
+    if (fd >= MAX_CLIENTS) {
+        log_event(LOG_WARN, "reject", ip, port, NULL, "Too many clients, rejecting %s:%d", ip, port);
+        close(fd);
+        return;
+    }
+
+    // At the cap, evict the connection longest in its phase so stalled
+    // clients can never lock out new arrivals
+    if (sh->pending_count >= MAX_PENDING_AUTH) {
+        struct client *old = sh->pending_head;
+        log_client(LOG_WARN, "reject", old, "Too many pending authentications, dropping %s:%d", old->ip, old->port);
+        send_text(old, FRAME_AUTH_FAIL, "Server busy. Connection closed.");
+        remove_client(old);
+    }
+
+    struct client *c = slab_alloc(&sh->client_slab);
+    if (!c) {
+        close(fd);
+        return;
+    }
+    metric_set(&sh->m.slab_bytes, sh->client_slab.pages * POOL_SLAB_PAGE);
+
+    c->fd = fd;
+    c->shard = sh;
+    c->port = port;
+    c->slot = -1;
+    timer_init(&c->timer);
+    frame_reader_init(&c->rx);
+    outq_init(&c->out);
+    snprintf(c->ip, sizeof(c->ip), "%s", ip);
+
+    // EPOLLOUT is edge-triggered too, so it only fires once a full socket
+    // buffer drains and never needs to be toggled
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+    if (sh->uring ? uring_arm_recv(c) < 0 : epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (!sh->uring) perror("epoll_ctl");
+        close(fd);
+        slab_free(&sh->client_slab, c);
+        return;
+    }
+
+    struct conn_stats *st = &sh->conn_stats[fd];
+    conn_stats_begin(st);
+    st->in_use = 1;
+    st->port = port;
+    memcpy(st->ip, c->ip, sizeof(st->ip));
+    st->user[0] = 0;
+    st->since = (uint64_t)time(NULL);
+    metric_set(&st->bytes_in, 0);
+    metric_set(&st->bytes_out, 0);
+    metric_set(&st->messages_in, 0);
+    metric_set(&st->frames_out, 0);
+    metric_set(&st->frames_dropped, 0);
+    metric_set(&st->queued, 0);
+    metric_set(&st->memory, 0);
+    conn_stats_end(st);
+    c->stats = st;
+    metric_add(&sh->m.connections, 1);
+    account_memory(c);
+
+    sh->clients[fd] = c;
+    pending_arm(c, CONN_HANDSHAKE);
+
+    log_event(LOG_DEBUG, "connect", ip, port, NULL, "Waiting for key exchange with %s:%d", ip, port);
+}
+
+// Compress a payload of the given frame type for the client into out,
+// which has room for len bytes. Returns the compressed length, or 0 to
+// send it raw.
+static size_t compress_for_client(struct client *c, uint8_t type, unsigned char *out, const unsigned char *payload,
+                                  size_t len) {
+    struct shard_metrics *m = &c->shard->m;
+
+    if (!c->zout && (c->zout = compress_stream_new()) == NULL) return 0;
+
+    uint64_t start = now_ns();
+    size_t n = compress_payload(c->zout, type, out, payload, len);
+    hist_record(&m->compress_ns, now_ns() - start);
+    if (n > 0) {
+        metric_add(&m->compressed_out, 1);
+        metric_add(&m->compress_raw, len);
+        metric_add(&m->compress_wire, n + 1);
+    }
+    return n;
+}
+
+// outq sealer: encrypt one queued frame under this client's session key,
+// compressed first if the client takes that and it shrinks
+static size_t seal_for_client(void *arg, unsigned char *out, const unsigned char *frame, size_t len) {
+    struct client *c = arg;
+    uint8_t type = frame[FRAME_HDR_LEN - 1];
+    const unsigned char *payload = frame + FRAME_HDR_LEN;
+    size_t payload_len = len - FRAME_HDR_LEN;
+
+    if ((c->features & FRAME_FEATURE_COMPRESS) && compress_eligible(type, payload_len)) {
+        // Built where noise_seal_frame() would move it to anyway
+        unsigned char *inner = out + FRAME_HDR_LEN + 1;
+        size_t n = compress_for_client(c, type, inner + 1, payload, payload_len);
+        if (n > 0) {
+            inner[0] = type;
+            return noise_seal_frame(&c->seal, out, FRAME_COMPRESSED, inner, n + 1);
+        }
+    }
+    return noise_seal_frame(&c->seal, out, type, payload, payload_len);
+}
+
+// outq source: seal logged chat frames straight out of the history mapping,
+// a batch at a time, then close the replay with FRAME_HISTORY_END
+static size_t replay_fill(void *arg, unsigned char *out, size_t cap) {
+    struct client *c = arg;
+    const unsigned char *rec;
+    size_t len, used = 0;
+
+    if (!c->replaying) return 0;
+
+    while (used < OUTQ_WIRE_BATCH && (rec = history_peek(&c->replay, &len)) != NULL) {
+        if (used + len + FRAME_SEAL_OVERHEAD > cap) return used;
+        used += seal_for_client(c, out + used, rec, len);
+        history_advance(&c->replay, len);
+    }
+    if (used >= OUTQ_WIRE_BATCH) return used;
+
+    unsigned char range[16];
+    frame_put_u64(range, c->replay.first_seq);
+    frame_put_u64(range + 8, c->replay.end_seq);
+    used += noise_seal_frame(&c->seal, out + used, FRAME_HISTORY_END, range, sizeof(range));
+    c->replaying = 0;
+    return used;
+}
+
+// outq source: seal stored direct messages straight out of the mailbox,
+// a batch at a time
+static size_t mail_fill(struct client *c, unsigned char *out, size_t cap) {
+    const unsigned char *frame;
+    size_t len, used = 0;
+
+    while (used < OUTQ_WIRE_BATCH && (frame = mailbox_peek(&c->mail, &len)) != NULL) {
+        if (used + len + FRAME_SEAL_OVERHEAD > cap) break;
+        used += seal_for_client(c, out + used, frame, len);
+        mailbox_advance(&c->mail, len);
+    }
+    if (used == 0) mailbox_drain_release(&c->mail);
+    return used;
+}
+
+// The client's outq source: its mailbox first, then any history replay
+static size_t client_fill(void *arg, unsigned char *out, size_t cap) {
+    struct client *c = arg;
+    size_t used = mail_fill(c, out, cap);
+    return used > 0 ? used : replay_fill(c, out, cap);
+}
+
+// Stream messages from `since` on, at most the last `max`, ahead of live
+// chat. A new replay replaces one still running.
+static void start_replay(struct client *c, uint64_t since, uint32_t max) {
+    history_cursor_release(&c->replay);
+    uint64_t count = history_seek(&c->replay, since, max);
+    c->replaying = 1;
+    outq_set_source(&c->out, client_fill, c);
+    mark_dirty(c);
+
+    log_client(LOG_DEBUG, "replay", c, "Replaying %llu message%s from #%llu to %s", (unsigned long long)count,
+               count == 1 ? "" : "s", (unsigned long long)c->replay.first_seq, c->user);
+}
+
+// Answer the client's Noise handshake message and switch the connection to
+// sealed frames. Returns 0 if the connection was closed.
+static int complete_handshake(struct client *c, const struct frame *f) {
+    uint8_t reply[NOISE_MSG2_MAX];
+
+    c->features = features;
+    int len = noise_responder_reply(server_priv, server_pub, f->payload, f->len, reply, &c->seal, &c->open,
+                                    &c->features);
+    if (len < 0) {
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent a bad handshake", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+
+    // The reply goes out in the clear, everything after it is sealed
+    send_frame(c, FRAME_HANDSHAKE, reply, len);
+    if (outq_set_sealer(&c->out, seal_for_client, c) < 0) {
+        remove_client(c);
+        return 0;
+    }
+    outq_set_padding(&c->out, pad_cells);
+
+    pending_arm(c, CONN_AUTH_PASSWORD);
+    log_client(LOG_DEBUG, "handshake", c, "Session with %s:%d encrypted, authenticating", c->ip, c->port);
+    send_text(c, FRAME_AUTH_PROMPT, "Enter user name and password: ");
+    return 1;
+}
+
+// A login was refused: prompt again, or give up after too many attempts.
+// Returns 0 if the connection was closed.
+static int login_failed(struct client *c) {
+    c->auth_attempts++;
+    if (c->auth_attempts >= MAX_AUTH_ATTEMPTS) {
+        send_text(c, FRAME_AUTH_FAIL, "Maximum authentication attempts exceeded. Connection closed.");
+        log_client(LOG_WARN, "auth", c, "Client %s:%d failed authentication (max attempts)", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+
+    send_text(c, FRAME_NOTICE, "Authentication failed. Please try again.");
+    send_text(c, FRAME_AUTH_PROMPT, "Enter user name and password: ");
+    pending_arm(c, CONN_AUTH_PASSWORD);
+    return 1;
+}
+
+// Handle one login attempt, "user\0password". The password check runs on
+// the KDF pool; finish_login() picks up the result. Returns 0 if the
+// connection was closed.
+static int authenticate_client(struct client *c, const struct frame *f) {
+    struct shard *sh = c->shard;
+
+    if (c->state == CONN_AUTH_VERIFY) {
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent a login while the last was being checked", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+
+    const char *sep = memchr(f->payload, 0, f->len);
+    size_t user_len = sep ? (size_t)(sep - (const char *)f->payload) : 0;
+    size_t password_len = sep ? f->len - user_len - 1 : 0;
+    if (!sep || !creds_valid_user((const char *)f->payload, user_len) || password_len > KDF_MAX_PASSWORD) {
+        log_client(LOG_INFO, "auth", c, "Authentication attempt %d from %s:%d: FAILED (malformed login)",
+                   c->auth_attempts + 1, c->ip, c->port);
+        metric_add(&sh->m.logins_failed[LOGIN_PASSWORD], 1);
+        return login_failed(c);
+    }
+
+    struct kdf_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        remove_client(c);
+        return 0;
+    }
+    job->done = &sh->kdf_done;
+    job->owner = c;
+    memcpy(job->password, sep + 1, password_len);
+    job->password_len = password_len;
+    memcpy(c->user, f->payload, user_len);
+    c->user[user_len] = 0;
+
+    pthread_rwlock_rdlock(&creds_lock);
+    const struct cred *cred = creds_lookup(creds, c->user, user_len);
+    job->known_user = cred != NULL;
+    job->params = cred ? cred->params : decoy_params;
+    pthread_rwlock_unlock(&creds_lock);
+
+    if (kdf_pool_submit(job) < 0) {
+        kdf_job_free(job);
+        log_client(LOG_WARN, "reject", c, "Too many logins waiting, dropping %s:%d", c->ip, c->port);
+        send_text(c, FRAME_AUTH_FAIL, "Server busy. Connection closed.");
+        remove_client(c);
+        return 0;
+    }
+
+    c->auth_job = job;
+    pending_arm(c, CONN_AUTH_VERIFY);
+    return 1;
+}
+
+// Stream whatever was stored for the user while nobody was logged in as
+// them, ahead of everything but what is already queued
+static void deliver_mailbox(struct client *c) {
+    char msg[160], when[32];
+    struct tm tm;
+
+    uint64_t count = mailbox_take(c->user, &c->mail);
+    if (count == 0) return;
+
+    time_t oldest = (time_t)c->mail.oldest;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M UTC", gmtime_r(&oldest, &tm));
+    snprintf(msg, sizeof(msg), "%llu message%s arrived while you were away, the first at %s.",
+             (unsigned long long)count, count == 1 ? "" : "s", when);
+    send_text(c, FRAME_NOTICE, msg);
+    outq_set_source(&c->out, client_fill, c);
+    mark_dirty(c);
+
+    log_client(LOG_INFO, "mailbox", c, "Delivering %llu stored message%s to %s", (unsigned long long)count,
+               count == 1 ? "" : "s", c->user);
+}
+
+// Move a client that proved who it is into the chat, and give it a ticket
+// to come back with
+static void enter_chat(struct client *c, const char *greeting) {
+    struct shard *sh = c->shard;
+    unsigned char ticket[TICKET_MAX_LEN];
+    size_t ticket_len = 0;
+
+    pending_unlink(c);
+    c->state = CONN_CHAT;
+    c->last_rx = now_ms();
+    timer_arm(&sh->timers, &c->timer, c->last_rx + PING_AFTER_MS);
+    conn_stats_begin(c->stats);
+    c->stats->state = CONN_CHAT;
+    memcpy(c->stats->user, c->user, sizeof(c->user));
+    conn_stats_end(c->stats);
+    c->slot = sh->client_count;
+    sh->active_clients[sh->client_count++] = c;
+    __atomic_store_n(&sh->published_count, sh->client_count, __ATOMIC_RELAXED);
+    index_user(c);
+
+    pthread_rwlock_rdlock(&creds_lock);
+    const struct cred *cred = creds_lookup(creds, c->user, strlen(c->user));
+    if (cred) ticket_len = ticket_issue(ticket, c->user, &cred->params);
+    pthread_rwlock_unlock(&creds_lock);
+
+    send_text(c, FRAME_AUTH_OK, greeting);
+    if (ticket_len > 0) send_frame(c, FRAME_TICKET, ticket, ticket_len);
+    deliver_mailbox(c);
+    log_client(LOG_INFO, "login", c, "Client %s:%d authenticated successfully as %s", c->ip, c->port, c->user);
+    log_client(LOG_INFO, "join", c, "Chat session started with %s (%d clients connected)", c->user, sh->client_count);
+}
+
+// Handle a login with a resumption ticket: "last sequence seen, ticket".
+// The check is a MAC and a table lookup, so it is answered at once, and
+// whatever the client missed is replayed straight after. Returns 0 if the
+// connection was closed.
+static int resume_client(struct client *c, const struct frame *f) {
+    char user[CREDS_MAX_USER + 1] = "?";
+
+    if (c->state == CONN_AUTH_VERIFY) {
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent a login while the last was being checked", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+
+    int ok = 0;
+    if (f->len >= 8 && ticket_user(f->payload + 8, f->len - 8, user) == 0) {
+        pthread_rwlock_rdlock(&creds_lock);
+        const struct cred *cred = creds_lookup(creds, user, strlen(user));
+        ok = cred && ticket_verify(f->payload + 8, f->len - 8, &cred->params);
+        pthread_rwlock_unlock(&creds_lock);
+    }
+
+    log_event(LOG_INFO, "resume", c->ip, c->port, user, "Session resumption from %s:%d as %s: %s",
+              c->ip, c->port, user, ok ? "SUCCESS" : "FAILED");
+    metric_add(ok ? &c->shard->m.logins[LOGIN_TICKET] : &c->shard->m.logins_failed[LOGIN_TICKET], 1);
+    if (!ok) return login_failed(c);
+
+    memcpy(c->user, user, sizeof(user));
+    enter_chat(c, "Session resumed.");
+    start_replay(c, frame_get_u64(f->payload) + 1, RESUME_REPLAY_MAX);
+    return 1;
+}
+
+// Act on a finished password check
+static void finish_login(struct kdf_job *job) {
+    struct client *c = job->owner;
+
+    if (!c) {
+        kdf_job_free(job);
+        return;
+    }
+
+    int ok = job->result == 1;
+    c->auth_job = NULL;
+
+    log_client(LOG_INFO, "auth", c, "Authentication attempt %d from %s:%d as %s: %s (%.1f ms)",
+               c->auth_attempts + 1, c->ip, c->port, c->user, ok ? "SUCCESS" : "FAILED",
+               (job->wait_ns + job->kdf_ns) / 1e6);
+    if (job->result < 0) {
+        log_client(LOG_ERROR, "auth", c, "Could not check the password hash for %s", c->user);
+    }
+    kdf_job_free(job);
+    metric_add(ok ? &c->shard->m.logins[LOGIN_PASSWORD] : &c->shard->m.logins_failed[LOGIN_PASSWORD], 1);
+
+    if (!ok) {
+        login_failed(c);
+        return;
+    }
+
+    enter_chat(c, "Authentication successful! Welcome to the secure chat.");
+    send_text(c, FRAME_NOTICE, "Welcome to the secure chat server! Type your messages.");
+}
+
+static void drain_logins(struct shard *sh) {
+    struct kdf_job *job = kdf_done_take(&sh->kdf_done);
+    while (job) {
+        struct kdf_job *next = job->next;
+        finish_login(job);
+        job = next;
+    }
+}
+
+// Take on a socket just accepted from the peer at addr (unused for Unix
+// sockets, and NULL to look it up)
+static void accept_one(struct shard *sh, int fd, const struct sockaddr_in *addr) {
+    static int unix_serial;
+    struct sockaddr_in peer;
+
+    // Unix peers have no address; Tor is the only one anyway, so each
+    // connection is told apart by a serial number in place of a port
+    char client_ip[INET_ADDRSTRLEN] = "unix";
+    int client_port;
+    if (unix_path) {
+        client_port = __atomic_add_fetch(&unix_serial, 1, __ATOMIC_RELAXED);
+    } else {
+        if (!addr) {
+            socklen_t len = sizeof(peer);
+            memset(&peer, 0, sizeof(peer));
+            getpeername(fd, (struct sockaddr *)&peer, &len);
+            addr = &peer;
+        }
+        inet_ntop(AF_INET, &addr->sin_addr, client_ip, INET_ADDRSTRLEN);
+        client_port = ntohs(addr->sin_port);
+        // Output is already gathered into one write per loop iteration,
+        // so Nagle would only hold it back waiting for an ACK
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    log_event(LOG_INFO, "connect", client_ip, client_port, NULL, "New client connected from %s:%d",
+              client_ip, client_port);
+
+    new_connection(sh, fd, client_ip, client_port);
+}
+
+static void accept_clients(struct shard *sh) {
+    struct sockaddr_in cli_addr;
+    socklen_t cli_len;
+
+    // Edge-triggered: drain every pending connection
+    while (1) {
+        cli_len = sizeof(cli_addr);
+        int new_sock = accept4(sh->listen_fd, (struct sockaddr*)&cli_addr, &cli_len, SOCK_NONBLOCK);
+        if (new_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return;
+        }
+        accept_one(sh, new_sock, &cli_addr);
+    }
+}
+
+// The entry for room name in c's list, or -1
+static int find_room(const struct client *c, const char *name, size_t len) {
+    for (int i = 0; i < MAX_ROOMS_JOINED; i++) {
+        const struct group *g = c->rooms[i].room;
+        if (g && strlen(g->name) == len && memcmp(g->name, name, len) == 0) return i;
+    }
+    return -1;
+}
+
+// Room names follow the rules for user names
+static void join_room(struct client *c, const struct frame *f) {
+    struct shard *sh = c->shard;
+    const char *name = (const char *)f->payload;
+    char msg[128];
+
+    if (!creds_valid_user(name, f->len)) {
+        send_text(c, FRAME_NOTICE, "Room names are 1 to 32 letters, digits, '.', '-' or '_'.");
+        return;
+    }
+    if (find_room(c, name, f->len) >= 0) return;
+
+    int i = 0;
+    while (i < MAX_ROOMS_JOINED && c->rooms[i].room) i++;
+    if (i == MAX_ROOMS_JOINED) {
+        snprintf(msg, sizeof(msg), "You are already in %d rooms; leave one first.", MAX_ROOMS_JOINED);
+        send_text(c, FRAME_NOTICE, msg);
+        return;
+    }
+
+    c->rooms[i].room = group_add(&sh->rooms, name, f->len, c, &c->rooms[i].pos);
+    if (!c->rooms[i].room) {
+        send_text(c, FRAME_NOTICE, "Could not join the room, try again later.");
+        return;
+    }
+    metric_set(&sh->m.rooms, sh->rooms.count);
+    if (c->rooms[i].room->count == 1) fed_interest(FED_ROOM, name, f->len, 1);
+
+    snprintf(msg, sizeof(msg), "Joined #%.*s", (int)f->len, name);
+    send_text(c, FRAME_NOTICE, msg);
+    log_client(LOG_INFO, "room", c, "%s joined #%.*s", c->user, (int)f->len, name);
+}
+
+static void part_room(struct client *c, const struct frame *f) {
+    const char *name = (const char *)f->payload;
+    char msg[128];
+
+    int i = find_room(c, name, f->len);
+    if (i < 0) return;
+    leave_room(c, i);
+
+    snprintf(msg, sizeof(msg), "Left #%.*s", (int)f->len, name);
+    send_text(c, FRAME_NOTICE, msg);
+    log_client(LOG_INFO, "room", c, "%s left #%.*s", c->user, (int)f->len, name);
+}
+
+// Relay text to the room's members on every shard as "room\0user: text"
+static void post_room(struct client *c, const char *name, size_t name_len, const char *text, size_t len) {
+    if (find_room(c, name, name_len) < 0) {
+        send_text(c, FRAME_NOTICE, "You are not in that room; /join it first.");
+        return;
+    }
+
+    if (log_bodies) {
+        log_client(LOG_INFO, "message", c, "%s to #%.*s: %.*s", c->user, (int)name_len, name, (int)len, text);
+    } else {
+        log_client(LOG_INFO, "message", c, "%s to #%.*s: %zu-byte message", c->user, (int)name_len, name, len);
+    }
+
+    size_t user_len = strlen(c->user);
+    size_t max = FRAME_MAX_PLAINTEXT - name_len - user_len - 3;
+    if (len > max) len = max;
+
+    struct msgbuf *m = msgbuf_alloc(FRAME_ROOM, name_len + user_len + 3 + len);
+    if (!m) return;
+    unsigned char *p = msgbuf_payload(m);
+    memcpy(p, name, name_len);
+    p[name_len] = 0;
+    p += name_len + 1;
+    memcpy(p, c->user, user_len);
+    memcpy(p + user_len, ": ", 2);
+    memcpy(p + user_len + 2, text, len);
+
+    fed_publish(m);
+    fan_out(c->shard, m, c, all_shards());
+    msgbuf_unref(m);
+}
+
+// Relay text as "sender\0user\0text" to the shards and federated nodes
+// where that user is connected, or keep it in their mailbox if they have
+// an account but no connection, or tell the sender nobody will read it
+static void send_direct(struct client *c, const char *to, size_t to_len, const char *text, size_t len) {
+    char msg[128], user[CREDS_MAX_USER + 1];
+
+    if (!creds_valid_user(to, to_len)) {
+        send_text(c, FRAME_NOTICE, "Direct messages need a user name.");
+        return;
+    }
+    memcpy(user, to, to_len);
+    user[to_len] = 0;
+
+    pthread_rwlock_rdlock(&creds_lock);
+    int known = creds_lookup(creds, to, to_len) != NULL;
+    pthread_rwlock_unlock(&creds_lock);
+
+    size_t from_len = strlen(c->user);
+    size_t max = FRAME_MAX_PLAINTEXT - from_len - to_len - 2;
+    if (len > max) len = max;
+
+    struct msgbuf *m = msgbuf_alloc(FRAME_DIRECT, from_len + to_len + 2 + len);
+    if (!m) return;
+    unsigned char *p = msgbuf_payload(m);
+    memcpy(p, c->user, from_len + 1);
+    memcpy(p + from_len + 1, to, to_len);
+    p[from_len + 1 + to_len] = 0;
+    memcpy(p + from_len + to_len + 2, text, len);
+
+    // Connections hold their shard for life and leave the directory
+    // before they are freed, so the lock covers everything read here.
+    // Storing under it too means a login either shows up here or finds
+    // the message in its mailbox (see enter_chat()).
+    uint64_t peers = 0;
+    int stored = -1;
+    pthread_mutex_lock(&online_lock);
+    struct group *g = group_find(&online, to, to_len);
+    for (unsigned int i = 0; g && i < g->count; i++) {
+        const struct client *peer = g->members[i].ref;
+        peers |= 1ULL << peer->shard->id;
+    }
+    int remote = fed_publish(m);
+    if (!peers && !remote && known) stored = mailbox_put(user, m->data, m->len);
+    pthread_mutex_unlock(&online_lock);
+
+    if (!peers && !remote) {
+        if (!known) {
+            snprintf(msg, sizeof(msg), "%s is not online.", user);
+        } else if (stored == 0) {
+            snprintf(msg, sizeof(msg), "%s is offline; the message will be delivered when they log in.", user);
+        } else {
+            snprintf(msg, sizeof(msg), "%s is offline and their mailbox is full.", user);
+        }
+        send_text(c, FRAME_NOTICE, msg);
+        if (stored != 0) {
+            msgbuf_unref(m);
+            return;
+        }
+    }
+
+    if (log_bodies) {
+        log_client(LOG_INFO, "message", c, "%s to %.*s: %.*s", c->user, (int)to_len, to, (int)len, text);
+    } else {
+        log_client(LOG_INFO, "message", c, "%s to %.*s: %zu-byte message", c->user, (int)to_len, to, len);
+    }
+    if (peers) fan_out(c->shard, m, c, peers);
+    msgbuf_unref(m);
+}
+
+// Tell the upload's target about a file that is now complete, as a chat
+// message from the uploader carrying the command that fetches it
+static void announce_file(struct client *c, const struct file_manifest *m, const char *to) {
+    char text[FILE_NAME_MAX + 128], id[2 * FILE_ID_LEN + 1], size[32];
+    char prefix[CREDS_MAX_USER + 3];
+
+    file_id_format(id, m->id);
+    int len = snprintf(text, sizeof(text), "shared %s (%s): /get %s", m->name,
+                       format_bytes(size, sizeof(size), m->size), id);
+
+    if (to[0] == '#') {
+        post_room(c, to + 1, strlen(to + 1), text, len);
+    } else if (to[0]) {
+        send_direct(c, to, strlen(to), text, len);
+    } else {
+        int prefix_len = snprintf(prefix, sizeof(prefix), "%s: ", c->user);
+        broadcast_chat(c->shard, prefix, prefix_len, text, len, c);
+    }
+}
+
+static void send_file_ack(struct client *c, const uint8_t id[FILE_ID_LEN], uint32_t chunks) {
+    unsigned char ack[FILE_CHUNK_HDR_LEN];
+    memcpy(ack, id, FILE_ID_LEN);
+    frame_put_u32(ack + FILE_ID_LEN, chunks);
+    send_frame(c, FRAME_FILE_ACK, ack, sizeof(ack));
+}
+
+static void refuse_upload(struct client *c, const char *why) {
+    send_text(c, FRAME_NOTICE, why);
+    send_file_ack(c, c->upload->id, FILE_REFUSED);
+    free(c->upload);
+    c->upload = NULL;
+}
+
+// Acknowledge the chunks stored so far; once they are all in, keep the
+// manifest and announce the file
+static void upload_progress(struct client *c) {
+    struct file_manifest *m = c->upload;
+
+    while (c->upload_next < m->chunks && file_store_has_chunk(m->hashes[c->upload_next])) c->upload_next++;
+    if (c->upload_next < m->chunks) {
+        send_file_ack(c, m->id, c->upload_next);
+        return;
+    }
+
+    if (file_store_put_manifest(m) < 0) {
+        log_client(LOG_ERROR, "file", c, "Cannot save the manifest of %s: %s", m->name, strerror(errno));
+        refuse_upload(c, "The server could not store the file.");
+        return;
+    }
+    send_file_ack(c, m->id, m->chunks);
+    log_client(LOG_INFO, "file", c, "%s shared %s, %llu bytes", c->user, m->name, (unsigned long long)m->size);
+    announce_file(c, m, c->upload_to);
+    free(m);
+    c->upload = NULL;
+}
+
+// "target\0manifest": start an upload, or resume one cut off earlier. The
+// reply says how many chunks the store already has, so a resumed upload
+// sends only the rest and one whose chunks are all known completes at once.
+static void offer_file(struct client *c, const struct frame *f) {
+    const char *to = (const char *)f->payload;
+    const char *sep = memchr(to, 0, f->len);
+    size_t to_len = sep ? (size_t)(sep - to) : 0;
+
+    struct file_manifest *m = malloc(sizeof(*m));
+    if (!m) return;
+    if (!sep || to_len > GROUP_NAME_MAX + 1 ||
+        file_manifest_decode(m, (const unsigned char *)sep + 1, f->len - to_len - 1) < 0) {
+        send_text(c, FRAME_NOTICE, "That file cannot be shared.");
+        free(m);
+        return;
+    }
+
+    free(c->upload);
+    c->upload = m;
+    c->upload_next = 0;
+    memcpy(c->upload_to, to, to_len + 1);
+
+    if (to_len > 0 && to[0] == '#' && find_room(c, to + 1, to_len - 1) < 0) {
+        refuse_upload(c, "You are not in that room; /join it first.");
+    } else if (to_len > 0 && to[0] != '#' && !creds_valid_user(to, to_len)) {
+        refuse_upload(c, "Files can be sent to the lobby, a room or a user.");
+    } else if (file_store_bytes() + m->size > FILES_MAX_BYTES) {
+        refuse_upload(c, "The server has no room for more files.");
+    } else {
+        upload_progress(c);
+    }
+}
+
+// File ID, index, data: check the chunk against the upload's manifest and
+// store it
+static void receive_chunk(struct client *c, const struct frame *f) {
+    struct file_manifest *m = c->upload;
+    uint8_t hash[FILE_HASH_LEN];
+
+    // Chunks of an upload that was refused or replaced are still in flight
+    if (!m || f->len < FILE_CHUNK_HDR_LEN || memcmp(f->payload, m->id, FILE_ID_LEN) != 0) return;
+
+    uint32_t i = frame_get_u32(f->payload + FILE_ID_LEN);
+    const unsigned char *data = f->payload + FILE_CHUNK_HDR_LEN;
+    size_t len = f->len - FILE_CHUNK_HDR_LEN;
+    if (i >= m->chunks || len != file_chunk_len(m, i)) {
+        refuse_upload(c, "A file chunk had the wrong size; the upload was stopped.");
+        return;
+    }
+    file_hash_chunk(hash, data, len);
+    if (!crypto_memeq(hash, m->hashes[i], FILE_HASH_LEN)) {
+        log_client(LOG_WARN, "file", c, "Chunk %u of %s from %s failed its hash check", i, m->name, c->user);
+        refuse_upload(c, "A file chunk did not match its hash; the upload was stopped.");
+        return;
+    }
+    if (file_store_put_chunk(hash, data, len) < 0) {
+        if (errno != ENOSPC) log_client(LOG_ERROR, "file", c, "Cannot store a chunk: %s", strerror(errno));
+        refuse_upload(c, errno == ENOSPC ? "The server has no room for more files." : "The server could not store the file.");
+        return;
+    }
+    metric_add(&c->shard->m.chunks_in, 1);
+
+    if (i == c->upload_next) c->upload_next++;
+    upload_progress(c);
+}
+
+// Drop the client's download and give the socket back its send buffering
+static void end_download(struct client *c) {
+    free(c->download);
+    c->download = NULL;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &c->download_lowat, sizeof(c->download_lowat));
+}
+
+// outq filler: the next chunk of the client's download. Every byte sent is
+// sealed under the connection's key, so the chunk cannot go out with
+// sendfile(); instead it is read from the page cache straight into the
+// wire buffer and encrypted there in place, the one copy it needs.
+static size_t file_fill(void *arg, unsigned char *out, size_t cap) {
+    struct client *c = arg;
+    struct file_manifest *m = c->download;
+
+    if (!m) return 0;
+    if (c->download_next >= m->chunks) {
+        end_download(c);
+        return 0;
+    }
+
+    uint32_t i = c->download_next++;
+    size_t len = file_chunk_len(m, i);
+    if (FRAME_HDR_LEN + FRAME_SEAL_OVERHEAD + FILE_CHUNK_HDR_LEN + len > cap) {
+        log_client(LOG_ERROR, "file", c, "Chunk %u of %s does not fit in a frame", i, m->name);
+        end_download(c);
+        return 0;
+    }
+    unsigned char *payload = out + FRAME_HDR_LEN + 1;
+    int fd = file_store_open_chunk(m->hashes[i]);
+    ssize_t n = fd >= 0 ? pread(fd, payload + FILE_CHUNK_HDR_LEN, len, 0) : -1;
+    if (fd >= 0) close(fd);
+    if (n != (ssize_t)len) {
+        log_client(LOG_ERROR, "file", c, "Chunk %u of %s is missing from the store", i, m->name);
+        send_text(c, FRAME_NOTICE, "The server lost part of that file.");
+        end_download(c);
+        return 0;
+    }
+
+    memcpy(payload, m->id, FILE_ID_LEN);
+    frame_put_u32(payload + FILE_ID_LEN, i);
+    metric_add(&c->shard->m.chunks_out, 1);
+    return noise_seal_frame(&c->seal, out, FRAME_FILE_CHUNK, payload, FILE_CHUNK_HDR_LEN + len);
+}
+
+// File ID, first chunk: send the manifest, then stream the chunks from
+// there behind anything else queued, replacing a download in progress
+static void get_file(struct client *c, const struct frame *f) {
+    if (f->len != FILE_CHUNK_HDR_LEN) return;
+
+    struct file_manifest *m = file_store_get_manifest(f->payload);
+    unsigned char *buf = m ? malloc(file_manifest_len(m)) : NULL;
+    if (!buf) {
+        send_text(c, FRAME_NOTICE, "There is no such file.");
+        free(m);
+        return;
+    }
+    send_frame(c, FRAME_FILE_OFFER, buf, file_manifest_encode(m, buf));
+    free(buf);
+
+    // Chat queued behind a download waits only for what the kernel holds,
+    // so hold little until it ends. Unix sockets have no such option and
+    // need none.
+    if (!c->download) {
+        socklen_t optlen = sizeof(c->download_lowat);
+        c->download_lowat = 0;
+        getsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &c->download_lowat, &optlen);
+    }
+    free(c->download);
+    c->download = m;
+    c->download_next = frame_get_u32(f->payload + FILE_ID_LEN);
+
+    int lowat = FILE_SEND_LOWAT;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    outq_set_filler(&c->out, file_fill, c);
+    mark_dirty(c);
+
+    log_client(LOG_DEBUG, "file", c, "Sending %s to %s from chunk %u", m->name, c->user, c->download_next);
+}
+
+// Another node answered the login prompt with its proof of the federation
+// secret. The connection becomes its link: no user, no rooms, and only
+// relayed messages from here on. Returns 0 if it was refused.
+static int accept_peer(struct client *c, const struct frame *f) {
+    struct shard *sh = c->shard;
+    unsigned char welcome[FED_WELCOME_LEN];
+
+    c->peer_node = fed_hello(c->open.key, f->payload, f->len, welcome, &c->peer_gen);
+    if (!c->peer_node) {
+        log_client(LOG_WARN, "federation", c, "Node %s:%d failed to prove the federation secret%s", c->ip, c->port,
+                   fed_enabled() ? "" : " (federation is off here)");
+        send_text(c, FRAME_AUTH_FAIL, "Not a node of this federation. Connection closed.");
+        remove_client(c);
+        return 0;
+    }
+
+    pending_unlink(c);
+    c->state = CONN_PEER;
+    c->last_rx = now_ms();
+    timer_arm(&sh->timers, &c->timer, c->last_rx + PING_AFTER_MS);
+    conn_stats_begin(c->stats);
+    c->stats->state = CONN_PEER;
+    conn_stats_end(c->stats);
+
+    send_frame(c, FRAME_PEER_WELCOME, welcome, sizeof(welcome));
+    log_client(LOG_INFO, "federation", c, "Node %s:%d linked in, taking its messages from #%llu on", c->ip, c->port,
+               (unsigned long long)frame_get_u64(welcome) + 1);
+    return 1;
+}
+
+// Deliver a message another node relayed as if it had been posted here,
+// except that it is not passed on to further nodes. Lobby chat is logged
+// under this node's own numbering; a direct message for a user who has
+// since logged off waits in their mailbox here.
+static void relay_remote(struct client *c, uint8_t type, const unsigned char *payload, size_t len) {
+    struct shard *sh = c->shard;
+    uint64_t peers = all_shards();
+
+    if (type == FRAME_CHAT && len < FRAME_CHAT_HDR_LEN) return;
+    if (type != FRAME_CHAT && type != FRAME_ROOM && type != FRAME_DIRECT) return;
+
+    struct msgbuf *m = msgbuf_new(type, payload, len);
+    if (!m) return;
+
+    if (type == FRAME_CHAT) {
+        history_append(m->data, m->len);
+    } else if (type == FRAME_DIRECT) {
+        const char *from = (const char *)payload;
+        size_t from_len = strnlen(from, len);
+        const char *to = from + from_len + 1;
+        size_t to_len = from_len < len ? strnlen(to, len - from_len - 1) : 0;
+        char user[CREDS_MAX_USER + 1];
+
+        if (!creds_valid_user(to, to_len)) {
+            msgbuf_unref(m);
+            return;
+        }
+        memcpy(user, to, to_len);
+        user[to_len] = 0;
+
+        pthread_rwlock_rdlock(&creds_lock);
+        int known = creds_lookup(creds, to, to_len) != NULL;
+        pthread_rwlock_unlock(&creds_lock);
+
+        peers = 0;
+        pthread_mutex_lock(&online_lock);
+        struct group *g = group_find(&online, to, to_len);
+        for (unsigned int i = 0; g && i < g->count; i++) {
+            const struct client *peer = g->members[i].ref;
+            peers |= 1ULL << peer->shard->id;
+        }
+        if (!peers && known) mailbox_put(user, m->data, m->len);
+        pthread_mutex_unlock(&online_lock);
+    }
+
+    if (peers) fan_out(sh, m, NULL, peers);
+    msgbuf_unref(m);
+}
+
+// A frame on a federation link; types it does not know are ignored, as
+// in the chat
+static int peer_frame(struct client *c, struct frame *f) {
+    if (f->type == FRAME_PING) {
+        if (f->len <= FRAME_PING_MAX) send_frame(c, FRAME_PONG, f->payload, f->len);
+        return 1;
+    }
+    if (f->type == FRAME_PEER_INTEREST) {
+        fed_remote_interest(c->peer_node, c->peer_gen, f->payload, f->len);
+        return 1;
+    }
+    if (f->type != FRAME_PEER_MSG) return 1;
+
+    int r = fed_accept(c->peer_node, f->payload, f->len);
+    if (r < 0) {
+        log_client(LOG_WARN, "protocol", c, "Node %s:%d relayed a truncated message", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+    if (r > 0) relay_remote(c, f->payload[FED_MSG_HDR - 1], f->payload + FED_MSG_HDR, f->len - FED_MSG_HDR);
+    return 1;
+}
+
+// Turn a FRAME_COMPRESSED into the frame it carries, whose payload is then
+// only good until the next one. Returns 0 if the connection was closed.
+static int decompress_frame(struct client *c, struct frame *f) {
+    const unsigned char *payload = NULL;
+    size_t len = 0;
+
+    if ((c->features & FRAME_FEATURE_COMPRESS) && f->len > 1 &&
+        (c->zin || (c->zin = compress_stream_new()) != NULL)) {
+        payload = decompress_payload(c->zin, f->payload[0], f->payload + 1, f->len - 1, &len);
+    }
+    if (!payload || !compress_eligible(f->payload[0], len)) {
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent a frame that failed decompression", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+
+    f->type = f->payload[0];
+    f->payload = payload;
+    f->len = (uint32_t)len;
+    metric_add(&c->shard->m.decompressed_in, 1);
+    return 1;
+}
+
+// Handle one frame from a client. Returns 0 if the connection was closed.
+static int handle_frame(struct client *c, struct frame *f) {
+    char prefix[CREDS_MAX_USER + 3];
+
+    if (c->state == CONN_HANDSHAKE) {
+        if (f->type != FRAME_HANDSHAKE) {
+            log_client(LOG_WARN, "protocol", c, "Client %s:%d sent frame type %d before the key exchange",
+                       c->ip, c->port, f->type);
+            remove_client(c);
+            return 0;
+        }
+        return complete_handshake(c, f);
+    }
+
+    if (noise_open_frame(&c->open, f) < 0) {
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent a frame that failed decryption", c->ip, c->port);
+        remove_client(c);
+        return 0;
+    }
+    if (f->type == FRAME_PADDING) return 1;
+    if (f->type == FRAME_COMPRESSED && !decompress_frame(c, f)) return 0;
+    if (c->state == CONN_PEER) return peer_frame(c, f);
+
+    if (c->state != CONN_CHAT) {
+        if (f->type == FRAME_AUTH) return authenticate_client(c, f);
+        if (f->type == FRAME_RESUME) return resume_client(c, f);
+        if (f->type == FRAME_PEER_HELLO) return accept_peer(c, f);
+
+        log_client(LOG_WARN, "protocol", c, "Client %s:%d sent frame type %d before authenticating",
+                   c->ip, c->port, f->type);
+        remove_client(c);
+        return 0;
+    }
+
+    if (f->type == FRAME_PING) {
+        if (f->len <= FRAME_PING_MAX) send_frame(c, FRAME_PONG, f->payload, f->len);
+        return 1;
+    }
+    if (f->type == FRAME_HISTORY) {
+        if (f->len == 12) start_replay(c, frame_get_u64(f->payload), frame_get_u32(f->payload + 8));
+        return 1;
+    }
+    if (f->type == FRAME_JOIN) {
+        join_room(c, f);
+        return 1;
+    }
+    if (f->type == FRAME_LEAVE) {
+        part_room(c, f);
+        return 1;
+    }
+    if (f->type == FRAME_FILE_OFFER) {
+        offer_file(c, f);
+        return 1;
+    }
+    if (f->type == FRAME_FILE_CHUNK) {
+        receive_chunk(c, f);
+        return 1;
+    }
+    if (f->type == FRAME_FILE_GET) {
+        get_file(c, f);
+        return 1;
+    }
+    if (f->type != FRAME_CHAT && f->type != FRAME_ROOM && f->type != FRAME_DIRECT) return 1;
+    metric_add(&c->stats->messages_in, 1);
+    metric_add(&c->shard->m.messages_in, 1);
+
+    if (f->type == FRAME_ROOM || f->type == FRAME_DIRECT) {
+        // Both name their target up front, NUL-terminated
+        const char *name = (const char *)f->payload;
+        const char *sep = memchr(name, 0, f->len);
+        size_t name_len = sep ? (size_t)(sep - name) : 0;
+        const char *text = sep ? sep + 1 : name;
+        size_t len = sep ? f->len - name_len - 1 : 0;
+
+        if (f->type == FRAME_ROOM) post_room(c, name, name_len, text, len);
+        else send_direct(c, name, name_len, text, len);
+        return 1;
+    }
+
+    if (log_bodies) {
+        log_client(LOG_INFO, "message", c, "%s (%s:%d): %.*s", c->user, c->ip, c->port,
+                   (int)f->len, (const char *)f->payload);
+    } else {
+        log_client(LOG_INFO, "message", c, "%s (%s:%d): %u-byte message", c->user, c->ip, c->port, f->len);
+    }
+
+    // Encode the relay once, straight from the receive buffer
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s: ", c->user);
+    broadcast_chat(c->shard, prefix, prefix_len, f->payload, f->len, c);
+    return 1;
+}
+
+// The far end closed the connection: log it by the phase it was in, then
+// let the client go
+static void client_disconnected(struct client *c) {
+    if (c->state == CONN_CHAT) {
+        log_client(LOG_INFO, "disconnect", c, "Client %s:%d disconnected", c->ip, c->port);
+    } else if (c->state == CONN_PEER) {
+        log_client(LOG_WARN, "federation", c, "Node %s:%d closed its link", c->ip, c->port);
+    } else {
+        log_client(LOG_INFO, "disconnect", c, "Client %s:%d disconnected during %s", c->ip, c->port,
+                   c->state == CONN_HANDSHAKE ? "key exchange" : "authentication");
+    }
+    remove_client(c);
+}
+
+static void count_input(struct client *c, size_t n) {
+    metric_add(&c->stats->bytes_in, n);
+    metric_add(&c->shard->m.bytes_in, n);
+}
+
+static uint64_t later(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+// Charge a handled frame to the client's buckets and the user's: its size
+// against the byte rates and, for chat, one message against the message
+// rates. Only chat sessions are limited; before that each phase has its
+// deadline. Returns 1 if a bucket went into debt, with throttled_until set
+// to when they all clear.
+static int charge_input(struct client *c, uint8_t type, size_t len, uint64_t now) {
+    if (c->state != CONN_CHAT) return 0;
+
+    uint64_t until = bucket_take(&c->byte_bucket, &conn_bytes, now, len);
+    if (c->limits) until = later(until, bucket_take(&c->limits->bytes, &user_bytes, now, len));
+
+    if (type == FRAME_CHAT || type == FRAME_ROOM || type == FRAME_DIRECT) {
+        uint64_t msgs = bucket_take(&c->msg_bucket, &conn_msgs, now, 1);
+        if (c->limits) msgs = later(msgs, bucket_take(&c->limits->msgs, &user_msgs, now, 1));
+        if (msgs > now && !c->rate_noticed) {
+            c->rate_noticed = 1;
+            send_text(c, FRAME_NOTICE, "You are sending too fast; your messages will be delayed.");
+            log_client(LOG_INFO, "throttle", c, "%s (%s:%d) is over the message rate", c->user, c->ip, c->port);
+        }
+        until = later(until, msgs);
+    }
+    if (until <= now) return 0;
+    c->throttled_until = until;
+    return 1;
+}
+
+enum { SERVE_MORE, SERVE_THROTTLED, SERVE_DRAINED, SERVE_GONE };
+
+// Give c its turn: handle up to its deficit in input bytes, reading more
+// from the socket as frames run out. Frames are handled whole, so a turn
+// may overrun by up to one frame; the next turn is shorter by as much.
+static int serve_client(struct client *c, uint64_t now) {
+    struct frame f;
+    int r;
+
+    c->deficit += c->state == CONN_PEER ? PEER_DRR_QUANTUM : DRR_QUANTUM;
+    while (c->deficit > 0) {
+        if (c->throttled_until > now) return SERVE_THROTTLED;
+
+        if ((r = frame_next(&c->rx, &f)) > 0) {
+            size_t len = FRAME_HDR_LEN + f.len;
+            c->deficit -= len;
+            c->last_rx = now / 1000000;
+            if (!handle_frame(c, &f)) return SERVE_GONE;
+            charge_input(c, f.type, len, now);
+            continue;
+        }
+        if (r < 0) {
+            log_client(LOG_WARN, "protocol", c, "Client %s:%d sent an oversized frame", c->ip, c->port);
+            remove_client(c);
+            return SERVE_GONE;
+        }
+
+        if (c->shard->uring) {
+            // Everything received has been handled; let more in
+            if (c->recv_eof) {
+                client_disconnected(c);
+                return SERVE_GONE;
+            }
+            if (c->recv_paused) {
+                c->recv_paused = 0;
+                if (!c->recv_armed && uring_arm_recv(c) < 0) {
+                    remove_client(c);
+                    return SERVE_GONE;
+                }
+            }
+            return SERVE_DRAINED;
+        }
+
+        // Edge-triggered: only a drained socket reports more input
+        ssize_t n = frame_reader_fill(&c->rx, c->fd);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return SERVE_DRAINED;
+        if (n <= 0) {
+            client_disconnected(c);
+            return SERVE_GONE;
+        }
+        count_input(c, n);
+    }
+    return SERVE_MORE;
+}
+
+// One round over the clients with input waiting, in arrival order. Clients
+// queued during the round, and those with input left, wait for the next.
+static void serve_ready(struct shard *sh) {
+    uint64_t now = now_ns();
+    struct client *last = sh->ready_tail;
+
+    release_throttled(sh, now);
+    if (!last) last = sh->ready_tail;
+
+    while (sh->ready_head) {
+        struct client *c = sh->ready_head;
+        int end = c == last;
+
+        sched_unlink(c);
+        switch (serve_client(c, now)) {
+        case SERVE_MORE:
+            sched_ready(c);
+            break;
+        case SERVE_THROTTLED:
+            c->deficit = 0;
+            sched_throttle(c);
+            break;
+        case SERVE_DRAINED:
+            c->deficit = 0;
+            frame_reader_release(&c->rx);
+            account_memory(c);
+            break;
+        }
+        if (end) break;
+    }
+}
+
+static const char *const state_names[] = {
+    [CONN_HANDSHAKE] = "key exchange",
+    [CONN_AUTH_PASSWORD] = "login",
+    [CONN_AUTH_VERIFY] = "password check",
+    [CONN_CHAT] = "chat",
+    [CONN_PEER] = "federation",
+};
+
+// Per-thread counters and gauges, exported as torchat_<name>{thread="N"}
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} shard_series[] = {
+    { "connections_total", "counter", "Connections accepted.", offsetof(struct shard_metrics, connections) },
+    { "received_bytes_total", "counter", "Bytes read from clients.", offsetof(struct shard_metrics, bytes_in) },
+    { "sent_bytes_total", "counter", "Bytes written to clients.", offsetof(struct shard_metrics, bytes_out) },
+    { "messages_received_total", "counter", "Chat, room and direct messages received from clients.", offsetof(struct shard_metrics, messages_in) },
+    { "frames_queued_total", "counter", "Frames queued to clients.", offsetof(struct shard_metrics, frames_out) },
+    { "frames_dropped_total", "counter", "Chat frames dropped for clients that fell behind.", offsetof(struct shard_metrics, frames_dropped) },
+    { "bus_dropped_total", "counter", "Messages lost to a full cross-thread inbox.", offsetof(struct shard_metrics, bus_dropped) },
+    { "pending_connections", "gauge", "Connections in the key exchange or logging in.", offsetof(struct shard_metrics, pending) },
+    { "queued_bytes", "gauge", "Bytes waiting in client output queues.", offsetof(struct shard_metrics, outq_bytes) },
+    { "rooms", "gauge", "Rooms with members on this thread.", offsetof(struct shard_metrics, rooms) },
+    { "file_chunks_received_total", "counter", "File chunks stored from uploads.", offsetof(struct shard_metrics, chunks_in) },
+    { "file_chunks_sent_total", "counter", "File chunks streamed to downloads.", offsetof(struct shard_metrics, chunks_out) },
+    { "output_held_total", "counter", "Times a client's output was held to coalesce it (-W).", offsetof(struct shard_metrics, held) },
+    { "padding_bytes_total", "counter", "Padding sealed to fill Tor cells or as cover traffic.", offsetof(struct shard_metrics, padding_out) },
+    { "rate_limited_total", "counter", "Times a client's input was paused by a rate limit.", offsetof(struct shard_metrics, throttled) },
+    { "idle_disconnects_total", "counter", "Chat clients dropped for not answering pings.", offsetof(struct shard_metrics, idle_closed) },
+    { "connection_memory_bytes", "gauge", "Bytes of client state and the buffers it holds.", offsetof(struct shard_metrics, conn_memory) },
+    { "connection_slab_bytes", "gauge", "Slab pages mapped for client state.", offsetof(struct shard_metrics, slab_bytes) },
+    { "compressed_frames_sent_total", "counter", "Frames sent to clients compressed.", offsetof(struct shard_metrics, compressed_out) },
+    { "compression_input_bytes_total", "counter", "Payload bytes of those frames before compression.", offsetof(struct shard_metrics, compress_raw) },
+    { "compression_output_bytes_total", "counter", "Payload bytes of those frames after compression, inner type included.", offsetof(struct shard_metrics, compress_wire) },
+    { "compressed_frames_received_total", "counter", "Compressed frames received from clients.", offsetof(struct shard_metrics, decompressed_in) },
+    { "buffer_allocations_total", "counter", "Buffers taken from the thread's pools.", offsetof(struct shard_metrics, pool.allocs) },
+    { "buffer_mallocs_total", "counter", "Buffer allocations the pools could not serve from their free lists.", offsetof(struct shard_metrics, pool.mallocs) },
+    { "buffer_allocated_bytes_total", "counter", "Bytes of buffers taken from the thread's pools.", offsetof(struct shard_metrics, pool.allocated) },
+    { "buffer_freed_bytes_total", "counter", "Bytes of buffers given back on this thread.", offsetof(struct shard_metrics, pool.freed) },
+    { "buffer_cached_bytes", "gauge", "Free buffer bytes kept in the thread's pools.", offsetof(struct shard_metrics, pool.cached) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+    double scale;
+} shard_histograms[] = {
+    { "loop_iteration_seconds", "Busy time of one event-loop iteration.", offsetof(struct shard_metrics, loop_ns), 1e-9 },
+    { "fanout_seconds", "Time to queue one message for every recipient on a thread.", offsetof(struct shard_metrics, fanout_ns), 1e-9 },
+    { "compress_seconds", "Time to compress one eligible frame for one client, sent compressed or not.", offsetof(struct shard_metrics, compress_ns), 1e-9 },
+    { "queue_depth_bytes", "Bytes left queued on a client after each flush.", offsetof(struct shard_metrics, outq_depth), 1 },
+};
+
+// Per-connection series, exported as torchat_client_<name>
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} conn_series[] = {
+    { "received_bytes_total", "counter", "Bytes read from this connection.", offsetof(struct conn_stats, bytes_in) },
+    { "sent_bytes_total", "counter", "Bytes written to this connection.", offsetof(struct conn_stats, bytes_out) },
+    { "messages_received_total", "counter", "Chat messages received from this connection.", offsetof(struct conn_stats, messages_in) },
+    { "frames_queued_total", "counter", "Frames queued to this connection.", offsetof(struct conn_stats, frames_out) },
+    { "frames_dropped_total", "counter", "Chat frames dropped because this connection fell behind.", offsetof(struct conn_stats, frames_dropped) },
+    { "queued_bytes", "gauge", "Bytes waiting in this connection's output queue.", offsetof(struct conn_stats, queued) },
+    { "memory_bytes", "gauge", "Bytes of state and buffers this connection holds.", offsetof(struct conn_stats, memory) },
+};
+
+static uint64_t shard_counter(int i, size_t offset) {
+    return metric_get((const uint64_t *)((const char *)&shards[i]->m + offset));
+}
+
+// Sum of one shard_metrics counter over every thread
+static uint64_t total_counter(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < num_shards; i++) total += shard_counter(i, offset);
+    return total;
+}
+
+// Snapshot of one thread's histogram, or of all of them for thread -1
+static void snapshot_histogram(struct histogram *h, int thread, size_t offset) {
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < num_shards; i++) {
+        if (thread < 0 || thread == i) {
+            hist_merge(h, (const struct histogram *)((const char *)&shards[i]->m + offset));
+        }
+    }
+}
+
+static int inbox_depth(int i) {
+    unsigned int depth = 0;
+    for (int j = 0; j < num_shards; j++) {
+        struct spsc_ring *r = shards[i]->inbox[j];
+        if (r) depth += __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+    return (int)depth;
+}
+
+struct conn_snapshot {
+    int thread;
+    struct conn_stats s;
+};
+
+// Copy the stats of every open connection. Returns how many; the array is
+// the caller's to free.
+static size_t snapshot_conns(struct conn_snapshot **out) {
+    struct conn_snapshot *v = NULL;
+    size_t n = 0, cap = 0;
+
+    for (int i = 0; i < num_shards; i++) {
+        for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+            struct conn_stats copy;
+            if (!conn_stats_read(&shards[i]->conn_stats[fd], &copy)) continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct conn_snapshot *grown = realloc(v, cap * sizeof(*v));
+                if (!grown) break;
+                v = grown;
+            }
+            v[n].thread = i;
+            v[n].s = copy;
+            n++;
+        }
+    }
+    *out = v;
+    return n;
+}
+
+static int by_traffic(const void *a, const void *b) {
+    const struct conn_stats *x = &((const struct conn_snapshot *)a)->s;
+    const struct conn_stats *y = &((const struct conn_snapshot *)b)->s;
+    uint64_t tx = x->bytes_in + x->bytes_out, ty = y->bytes_in + y->bytes_out;
+    return tx < ty ? 1 : tx > ty ? -1 : 0;
+}
+
+static const char *format_ns(char *buf, size_t cap, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, cap, "%llu ns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, cap, "%.1f us", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, cap, "%.1f ms", ns / 1e6);
+    else snprintf(buf, cap, "%.2f s", ns / 1e9);
+    return buf;
+}
+
+static void print_status() {
+    char a[32], b[32], c[32];
+    struct histogram h;
+    int total = 0;
+
+    for (int i = 0; i < num_shards; i++) {
+        total += __atomic_load_n(&shards[i]->published_count, __ATOMIC_RELAXED);
+    }
+
+    print_timestamp();
+    printf("Server status: Active, %d client%s connected, %llu logging in\n", total, total == 1 ? "" : "s",
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, pending)));
+    printf("    traffic: %s in, %s out; %llu messages in, %llu frames out, %llu dropped for slow clients\n",
+           format_bytes(a, sizeof(a), total_counter(offsetof(struct shard_metrics, bytes_in))),
+           format_bytes(b, sizeof(b), total_counter(offsetof(struct shard_metrics, bytes_out))),
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, messages_in)),
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, frames_out)),
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, frames_dropped)));
+    printf("    logins: %llu by password, %llu by ticket, %llu failed; %s queued to clients\n",
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, logins[LOGIN_PASSWORD])),
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, logins[LOGIN_TICKET])),
+           (unsigned long long)(total_counter(offsetof(struct shard_metrics, logins_failed[LOGIN_PASSWORD])) +
+                                total_counter(offsetof(struct shard_metrics, logins_failed[LOGIN_TICKET]))),
+           format_bytes(a, sizeof(a), total_counter(offsetof(struct shard_metrics, outq_bytes))));
+
+    uint64_t open = total + total_counter(offsetof(struct shard_metrics, pending));
+    uint64_t conn_mem = total_counter(offsetof(struct shard_metrics, conn_memory));
+    uint64_t allocs = total_counter(offsetof(struct shard_metrics, pool.allocs));
+    uint64_t mallocs = total_counter(offsetof(struct shard_metrics, pool.mallocs));
+    printf("    memory: %s held by connections, %s each on average, in %s of slab pages\n",
+           format_bytes(a, sizeof(a), conn_mem), format_bytes(b, sizeof(b), open ? conn_mem / open : 0),
+           format_bytes(c, sizeof(c), total_counter(offsetof(struct shard_metrics, slab_bytes))));
+    printf("    buffers: %s in use, %s cached; %llu taken, %.2f%% of them from malloc\n",
+           format_bytes(a, sizeof(a), total_counter(offsetof(struct shard_metrics, pool.allocated)) -
+                                      total_counter(offsetof(struct shard_metrics, pool.freed))),
+           format_bytes(b, sizeof(b), total_counter(offsetof(struct shard_metrics, pool.cached))),
+           (unsigned long long)allocs, allocs ? 100.0 * mallocs / allocs : 0.0);
+
+    snapshot_histogram(&h, -1, offsetof(struct shard_metrics, loop_ns));
+    printf("    event loop: %s p50, %s p99, %s max per busy iteration\n",
+           format_ns(a, sizeof(a), hist_quantile(&h, 0.5)), format_ns(b, sizeof(b), hist_quantile(&h, 0.99)),
+           format_ns(c, sizeof(c), h.max));
+    snapshot_histogram(&h, -1, offsetof(struct shard_metrics, fanout_ns));
+    printf("    fan-out: %s p50, %s p99, %s max per message\n",
+           format_ns(a, sizeof(a), hist_quantile(&h, 0.5)), format_ns(b, sizeof(b), hist_quantile(&h, 0.99)),
+           format_ns(c, sizeof(c), h.max));
+    uint64_t zraw = total_counter(offsetof(struct shard_metrics, compress_raw));
+    uint64_t zwire = total_counter(offsetof(struct shard_metrics, compress_wire));
+    snapshot_histogram(&h, -1, offsetof(struct shard_metrics, compress_ns));
+    printf("    compression: %llu frames out, %s to %s (%.0f%%), %s p50 per frame; %llu frames in\n",
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, compressed_out)),
+           format_bytes(a, sizeof(a), zraw), format_bytes(b, sizeof(b), zwire), zraw ? 100.0 * zwire / zraw : 0.0,
+           format_ns(c, sizeof(c), hist_quantile(&h, 0.5)),
+           (unsigned long long)total_counter(offsetof(struct shard_metrics, decompressed_in)));
+
+    if (num_shards > 1) {
+        for (int i = 0; i < num_shards; i++) {
+            printf("    thread %d: %d clients, %s in, %s out, %d in inbox\n", i,
+                   __atomic_load_n(&shards[i]->published_count, __ATOMIC_RELAXED),
+                   format_bytes(a, sizeof(a), shard_counter(i, offsetof(struct shard_metrics, bytes_in))),
+                   format_bytes(b, sizeof(b), shard_counter(i, offsetof(struct shard_metrics, bytes_out))),
+                   inbox_depth(i));
+        }
+        printf("    cross-thread messages dropped: %llu\n",
+               (unsigned long long)total_counter(offsetof(struct shard_metrics, bus_dropped)));
+    }
+
+    struct kdf_stats ks;
+    kdf_pool_stats(&ks);
+    pthread_rwlock_rdlock(&creds_lock);
+    unsigned int users = creds ? creds->count : 0;
+    pthread_rwlock_unlock(&creds_lock);
+    printf("    users: %u, password checks: %llu done, %llu in progress (peak %llu), %llu refused\n",
+           users, (unsigned long long)ks.completed, (unsigned long long)ks.queued,
+           (unsigned long long)ks.peak_queued, (unsigned long long)ks.rejected);
+    if (ks.completed > 0) {
+        printf("    password check time: %.1f ms hashing + %.1f ms queued on average, %d workers\n",
+               ks.total_kdf_ns / 1e6 / ks.completed, ks.total_wait_ns / 1e6 / ks.completed, ks.workers);
+    }
+
+    struct history_stats hs;
+    history_get_stats(&hs);
+    printf("    history: messages #%llu-#%llu kept, %.1f MiB in %u segment%s\n",
+           (unsigned long long)hs.first_seq, (unsigned long long)hs.next_seq - 1,
+           hs.bytes / (1024.0 * 1024.0), hs.segments, hs.segments == 1 ? "" : "s");
+    struct mailbox_stats ms;
+    mailbox_get_stats(&ms);
+    printf("    mailboxes: %llu message%s for %u offline user%s, %s in memory, %s on disk; %llu delivered, %llu refused\n",
+           (unsigned long long)ms.messages, ms.messages == 1 ? "" : "s", ms.mailboxes, ms.mailboxes == 1 ? "" : "s",
+           format_bytes(a, sizeof(a), ms.mem_bytes), format_bytes(b, sizeof(b), ms.disk_bytes),
+           (unsigned long long)ms.delivered, (unsigned long long)ms.refused);
+    if (fed_enabled()) {
+        struct fed_stats fs;
+        fed_get_stats(&fs);
+        printf("    federation: %u of %u peer%s linked, %u node%s linked in; %llu messages sent (%llu resent, %llu dropped), "
+               "%llu received, %llu duplicates\n",
+               fs.up, fs.peers, fs.peers == 1 ? "" : "s", fs.inbound, fs.inbound == 1 ? "" : "s",
+               (unsigned long long)fs.sent, (unsigned long long)fs.resent, (unsigned long long)fs.dropped,
+               (unsigned long long)fs.received, (unsigned long long)fs.duplicates);
+    }
+    printf("    log: %llu events written to %s, %llu dropped\n", (unsigned long long)log_written(), LOG_FILE,
+           (unsigned long long)log_dropped());
+
+    struct conn_snapshot *conns;
+    size_t n = snapshot_conns(&conns);
+    qsort(conns, n, sizeof(*conns), by_traffic);
+    if (n > 0) printf("    busiest connections:\n");
+    for (size_t i = 0; i < n && i < STATUS_TOP_CLIENTS; i++) {
+        const struct conn_stats *st = &conns[i].s;
+        printf("      %-16s %s:%d  %s, %s in, %s out, %llu messages, %s queued\n",
+               st->user[0] ? st->user : "-", st->ip, st->port, state_names[st->state],
+               format_bytes(a, sizeof(a), st->bytes_in), format_bytes(b, sizeof(b), st->bytes_out),
+               (unsigned long long)st->messages_in, format_bytes(c, sizeof(c), st->queued));
+    }
+    free(conns);
+}
+
+// The /metrics page: per-thread counters, gauges and histograms plus the
+// process-wide figures, in the Prometheus text format
+static void write_metrics(FILE *out) {
+    static const char *const methods[] = { [LOGIN_PASSWORD] = "password", [LOGIN_TICKET] = "ticket" };
+    struct histogram h;
+    char labels[32];
+
+    for (size_t k = 0; k < sizeof(shard_series) / sizeof(shard_series[0]); k++) {
+        fprintf(out, "# HELP torchat_%s %s\n# TYPE torchat_%s %s\n",
+                shard_series[k].name, shard_series[k].help, shard_series[k].name, shard_series[k].type);
+        for (int i = 0; i < num_shards; i++) {
+            fprintf(out, "torchat_%s{thread=\"%d\"} %llu\n", shard_series[k].name, i,
+                    (unsigned long long)shard_counter(i, shard_series[k].offset));
+        }
+    }
+
+    fprintf(out, "# HELP torchat_logins_total Login attempts by method and result.\n# TYPE torchat_logins_total counter\n");
+    for (int i = 0; i < num_shards; i++) {
+        for (int m = LOGIN_PASSWORD; m <= LOGIN_TICKET; m++) {
+            fprintf(out, "torchat_logins_total{thread=\"%d\",method=\"%s\",result=\"success\"} %llu\n", i, methods[m],
+                    (unsigned long long)metric_get(&shards[i]->m.logins[m]));
+            fprintf(out, "torchat_logins_total{thread=\"%d\",method=\"%s\",result=\"failure\"} %llu\n", i, methods[m],
+                    (unsigned long long)metric_get(&shards[i]->m.logins_failed[m]));
+        }
+    }
+
+    fprintf(out, "# HELP torchat_clients Clients in the chat.\n# TYPE torchat_clients gauge\n");
+    for (int i = 0; i < num_shards; i++) {
+        fprintf(out, "torchat_clients{thread=\"%d\"} %d\n", i, __atomic_load_n(&shards[i]->published_count, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP torchat_inbox_messages Messages from other threads not yet delivered.\n# TYPE torchat_inbox_messages gauge\n");
+    for (int i = 0; i < num_shards; i++) {
+        fprintf(out, "torchat_inbox_messages{thread=\"%d\"} %d\n", i, inbox_depth(i));
+    }
+
+    for (size_t k = 0; k < sizeof(shard_histograms) / sizeof(shard_histograms[0]); k++) {
+        char name[64];
+        snprintf(name, sizeof(name), "torchat_%s", shard_histograms[k].name);
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, shard_histograms[k].help, name);
+        for (int i = 0; i < num_shards; i++) {
+            snapshot_histogram(&h, i, shard_histograms[k].offset);
+            snprintf(labels, sizeof(labels), "thread=\"%d\"", i);
+            hist_write_prometheus(out, name, labels, &h, shard_histograms[k].scale);
+        }
+    }
+
+    struct kdf_stats ks;
+    kdf_pool_stats(&ks);
+    pthread_rwlock_rdlock(&creds_lock);
+    unsigned int users = creds ? creds->count : 0;
+    pthread_rwlock_unlock(&creds_lock);
+    struct history_stats hs;
+    history_get_stats(&hs);
+    struct mailbox_stats ms;
+    mailbox_get_stats(&ms);
+
+    fprintf(out, "# HELP torchat_users Accounts in the credentials file.\n# TYPE torchat_users gauge\ntorchat_users %u\n", users);
+    fprintf(out, "# HELP torchat_password_checks_total Password checks finished.\n# TYPE torchat_password_checks_total counter\n"
+                 "torchat_password_checks_total %llu\n", (unsigned long long)ks.completed);
+    fprintf(out, "# HELP torchat_password_checks_refused_total Logins refused because the check queue was full.\n"
+                 "# TYPE torchat_password_checks_refused_total counter\ntorchat_password_checks_refused_total %llu\n",
+            (unsigned long long)ks.rejected);
+    fprintf(out, "# HELP torchat_password_check_queue Password checks queued or running.\n"
+                 "# TYPE torchat_password_check_queue gauge\ntorchat_password_check_queue %llu\n", (unsigned long long)ks.queued);
+    fprintf(out, "# HELP torchat_history_messages Messages kept in the history log.\n# TYPE torchat_history_messages gauge\n"
+                 "torchat_history_messages %llu\n", (unsigned long long)(hs.next_seq - hs.first_seq));
+    fprintf(out, "# HELP torchat_history_bytes Size of the history log.\n# TYPE torchat_history_bytes gauge\n"
+                 "torchat_history_bytes %llu\n", (unsigned long long)hs.bytes);
+    fprintf(out, "# HELP torchat_mailbox_messages Direct messages waiting for offline users.\n"
+                 "# TYPE torchat_mailbox_messages gauge\ntorchat_mailbox_messages %llu\n", (unsigned long long)ms.messages);
+    fprintf(out, "# HELP torchat_mailbox_bytes Bytes of waiting messages, by where they are held.\n"
+                 "# TYPE torchat_mailbox_bytes gauge\ntorchat_mailbox_bytes{store=\"memory\"} %llu\n"
+                 "torchat_mailbox_bytes{store=\"disk\"} %llu\n",
+            (unsigned long long)ms.mem_bytes, (unsigned long long)ms.disk_bytes);
+    fprintf(out, "# HELP torchat_mailbox_messages_total Messages to offline users, by outcome.\n"
+                 "# TYPE torchat_mailbox_messages_total counter\ntorchat_mailbox_messages_total{result=\"stored\"} %llu\n"
+                 "torchat_mailbox_messages_total{result=\"delivered\"} %llu\n"
+                 "torchat_mailbox_messages_total{result=\"refused\"} %llu\n"
+                 "torchat_mailbox_messages_total{result=\"lost\"} %llu\n",
+            (unsigned long long)ms.stored, (unsigned long long)ms.delivered,
+            (unsigned long long)ms.refused, (unsigned long long)ms.lost);
+    fprintf(out, "# HELP torchat_mailbox_spills_total Mailbox buffers written out to disk.\n"
+                 "# TYPE torchat_mailbox_spills_total counter\ntorchat_mailbox_spills_total %llu\n", (unsigned long long)ms.spills);
+    if (fed_enabled()) {
+        struct fed_stats fs;
+        fed_get_stats(&fs);
+        fprintf(out, "# HELP torchat_federation_links Federation links, by direction and whether they are up.\n"
+                     "# TYPE torchat_federation_links gauge\ntorchat_federation_links{direction=\"out\",state=\"up\"} %u\n"
+                     "torchat_federation_links{direction=\"out\",state=\"down\"} %u\n"
+                     "torchat_federation_links{direction=\"in\",state=\"up\"} %u\n",
+                fs.up, fs.peers - fs.up, fs.inbound);
+        fprintf(out, "# HELP torchat_federation_messages_total Messages relayed between nodes, by outcome.\n"
+                     "# TYPE torchat_federation_messages_total counter\n"
+                     "torchat_federation_messages_total{result=\"published\"} %llu\n"
+                     "torchat_federation_messages_total{result=\"sent\"} %llu\n"
+                     "torchat_federation_messages_total{result=\"resent\"} %llu\n"
+                     "torchat_federation_messages_total{result=\"dropped\"} %llu\n"
+                     "torchat_federation_messages_total{result=\"received\"} %llu\n"
+                     "torchat_federation_messages_total{result=\"duplicate\"} %llu\n",
+                (unsigned long long)fs.published, (unsigned long long)fs.sent, (unsigned long long)fs.resent,
+                (unsigned long long)fs.dropped, (unsigned long long)fs.received, (unsigned long long)fs.duplicates);
+        fprintf(out, "# HELP torchat_federation_connects_total Federation links established.\n"
+                     "# TYPE torchat_federation_connects_total counter\ntorchat_federation_connects_total %llu\n",
+                (unsigned long long)fs.connects);
+        fprintf(out, "# HELP torchat_federation_remote Rooms and users other nodes have announced.\n"
+                     "# TYPE torchat_federation_remote gauge\ntorchat_federation_remote{kind=\"room\"} %llu\n"
+                     "torchat_federation_remote{kind=\"user\"} %llu\n",
+                (unsigned long long)fs.remote_rooms, (unsigned long long)fs.remote_users);
+    }
+    fprintf(out, "# HELP torchat_log_events_total Events written to the log.\n# TYPE torchat_log_events_total counter\n"
+                 "torchat_log_events_total %llu\n", (unsigned long long)log_written());
+    fprintf(out, "# HELP torchat_log_dropped_total Events dropped because the log writer fell behind.\n"
+                 "# TYPE torchat_log_dropped_total counter\ntorchat_log_dropped_total %llu\n", (unsigned long long)log_dropped());
+}
+
+// The /clients page: counters for every open connection, labelled with
+// its address and user, so the ones driving load stand out
+static void write_client_metrics(FILE *out) {
+    struct conn_snapshot *conns;
+    size_t n = snapshot_conns(&conns);
+
+    for (size_t k = 0; k < sizeof(conn_series) / sizeof(conn_series[0]); k++) {
+        fprintf(out, "# HELP torchat_client_%s %s\n# TYPE torchat_client_%s %s\n",
+                conn_series[k].name, conn_series[k].help, conn_series[k].name, conn_series[k].type);
+        for (size_t i = 0; i < n; i++) {
+            const struct conn_stats *st = &conns[i].s;
+            fprintf(out, "torchat_client_%s{thread=\"%d\",addr=\"%s:%d\",user=\"%s\"} %llu\n",
+                    conn_series[k].name, conns[i].thread, st->ip, st->port, st->user,
+                    (unsigned long long)*(const uint64_t *)((const char *)st + conn_series[k].offset));
+        }
+    }
+    free(conns);
+}
+
+// Answer one request on the admin socket. It speaks just enough HTTP for
+// Prometheus, through a Unix-socket-capable scraper, or curl --unix-socket;
+// a bare page name on a line, as sent with socat or nc -U, gets the body
+// alone.
+static void admin_serve(int fd) {
+    char req[1024];
+    size_t len = 0;
+
+    struct timeval tv = { .tv_sec = ADMIN_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < sizeof(req) - 1 && !memchr(req, '\n', len)) {
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0) break;
+        len += n;
+    }
+    req[len] = 0;
+    req[strcspn(req, "\r\n")] = 0;
+
+    int http = strncmp(req, "GET ", 4) == 0;
+    char *page = http ? req + 4 : req;
+    page[strcspn(page, " ?")] = 0;
+    if (*page == '/') page++;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) return;
+
+    int found = 1;
+    if (strcmp(page, "") == 0 || strcmp(page, "metrics") == 0) {
+        write_metrics(out);
+    } else if (strcmp(page, "clients") == 0) {
+        write_client_metrics(out);
+    } else {
+        found = 0;
+        fprintf(out, "Unknown page; try /metrics or /clients\n");
+    }
+    fclose(out);
+
+    if (http) {
+        dprintf(fd, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                found ? "200 OK" : "404 Not Found", body_len);
+    }
+    for (size_t off = 0; off < body_len; ) {
+        ssize_t n = send(fd, body + off, body_len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    free(body);
+}
+
+// Admin requests are rare and may walk every connection, so they get a
+// thread of their own instead of stalling an event loop
+static void *admin_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;  // Shut down by main
+        }
+        admin_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Listen on a Unix socket at path whose file gets mode 0777 & ~mask.
+// Binding changes the process umask for a moment, so call this while no
+// other thread may be creating files.
+static int open_unix_socket(const char *path, mode_t mask, int flags, int backlog) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, COLOR_RED "Error: socket path %s is too long\n" COLOR_RESET, path);
+        return -1;
+    }
+    memcpy(sa.sun_path, path, strlen(path) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // A socket file left by an earlier run would make bind fail; anything
+    // else at that path is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    mode_t old_mask = umask(mask);
+    int r = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    umask(old_mask);
+    if (r < 0 || listen(fd, backlog) < 0) {
+        fprintf(stderr, COLOR_RED "Error: cannot listen on %s: %s\n" COLOR_RESET, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Listen on ADMIN_SOCKET, readable by the server's user only
+static int open_admin_socket() {
+    return open_unix_socket(ADMIN_SOCKET, 077, 0, 16);
+}
+
+// Swap in a freshly read credentials file. On error the old table stays.
+static void reload_credentials() {
+    struct cred_table *t = creds_load(CREDENTIALS_FILE);
+
+    if (!t) {
+        log_event(LOG_ERROR, "creds", NULL, 0, NULL, "Could not reload %s: %s", CREDENTIALS_FILE, strerror(errno));
+        return;
+    }
+
+    pthread_rwlock_wrlock(&creds_lock);
+    struct cred_table *old = creds;
+    creds = t;
+    pthread_rwlock_unlock(&creds_lock);
+    creds_free(old);
+
+    log_event(LOG_INFO, "creds", NULL, 0, NULL, "Reloaded %s: %u user%s", CREDENTIALS_FILE, t->count,
+              t->count == 1 ? "" : "s");
+}
+
+// Stop every shard; main then saves what is still held in memory
+static void stop_server(void) {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (int j = 1; j < num_shards; j++) wake_shard(shards[j]);
+}
+
+static void handle_signal() {
+    struct signalfd_siginfo si;
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGHUP) {
+            reload_credentials();
+        } else {
+            log_event(LOG_INFO, "server", NULL, 0, NULL, "Caught %s", strsignal(si.ssi_signo));
+            stop_server();
+        }
+    }
+}
+
+// Server input, read on shard 0. Returns 0 when the server should shut down.
+static int handle_server_input(struct shard *sh) {
+    char buffer[BUF_SIZE];
+
+    if (!fgets(buffer, BUF_SIZE - 1, stdin)) return 0;
+    buffer[strcspn(buffer, "\n")] = 0;
+
+    if (strlen(buffer) == 0) return 1;
+
+    // Check for server commands
+    if (strcmp(buffer, "/quit") == 0 || strcmp(buffer, "/exit") == 0) {
+        return 0;
+    }
+
+    if (strcmp(buffer, "/status") == 0) {
+        print_status();
+        return 1;
+    }
+
+    if (log_bodies) {
+        log_event(LOG_INFO, "message", NULL, 0, NULL, "You: %s", buffer);
+    } else {
+        log_event(LOG_INFO, "message", NULL, 0, NULL, "You: %zu-byte message", strlen(buffer));
+    }
+
+    // Send message to every client
+    broadcast_chat(sh, "Server: ", 8, buffer, strlen(buffer), NULL);
+    return 1;
+}
+
+// Load the server's static key, generating one on first start. Clients pin
+// the public half, so the file must survive restarts.
+static int load_server_key() {
+    int fd = open(SERVER_KEY_FILE, O_RDONLY);
+
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(SERVER_KEY_FILE, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            perror("open " SERVER_KEY_FILE);
+            return -1;
+        }
+        if (random_bytes(server_priv, sizeof(server_priv)) < 0 ||
+            write(fd, server_priv, sizeof(server_priv)) != sizeof(server_priv)) {
+            perror("write " SERVER_KEY_FILE);
+            close(fd);
+            unlink(SERVER_KEY_FILE);
+            return -1;
+        }
+        close(fd);
+        log_event(LOG_INFO, "server", NULL, 0, NULL, "Generated new server key in %s", SERVER_KEY_FILE);
+    } else if (fd < 0) {
+        perror("open " SERVER_KEY_FILE);
+        return -1;
+    } else {
+        ssize_t n = read(fd, server_priv, sizeof(server_priv));
+        close(fd);
+        if (n != sizeof(server_priv)) {
+            fprintf(stderr, COLOR_RED "Error: %s is not a valid key file\n" COLOR_RESET, SERVER_KEY_FILE);
+            return -1;
+        }
+    }
+
+    x25519_public(server_pub, server_priv);
+    return 0;
+}
+
+// Write a fresh federation secret for -K. Every node of a federation
+// needs a copy; an existing one is never overwritten.
+static int create_federation_key() {
+    uint8_t secret[FED_SECRET_LEN];
+    int fd = open(FEDERATION_KEY_FILE, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) {
+        perror("open " FEDERATION_KEY_FILE);
+        return 1;
+    }
+    if (random_bytes(secret, sizeof(secret)) < 0 || write(fd, secret, sizeof(secret)) != sizeof(secret)) {
+        perror("write " FEDERATION_KEY_FILE);
+        close(fd);
+        unlink(FEDERATION_KEY_FILE);
+        return 1;
+    }
+    close(fd);
+    crypto_wipe(secret, sizeof(secret));
+    printf("Federation key written to %s; copy it to every node that should share this chat.\n", FEDERATION_KEY_FILE);
+    return 0;
+}
+
+// Federation is on whenever the secret is present, so a node that only
+// accepts links needs it as much as one that dials them
+static int load_federation_key() {
+    uint8_t secret[FED_SECRET_LEN];
+    int fd = open(FEDERATION_KEY_FILE, O_RDONLY);
+
+    if (fd < 0 && errno == ENOENT && fed_peers == 0) return 0;
+    if (fd < 0) {
+        perror("open " FEDERATION_KEY_FILE);
+        fprintf(stderr, "Create one with -K and copy it to every node.\n");
+        return -1;
+    }
+    ssize_t n = read(fd, secret, sizeof(secret));
+    close(fd);
+    if (n != sizeof(secret)) {
+        fprintf(stderr, COLOR_RED "Error: %s is not a valid key file\n" COLOR_RESET, FEDERATION_KEY_FILE);
+        return -1;
+    }
+
+    int r = fed_init(secret, server_pub);
+    crypto_wipe(secret, sizeof(secret));
+    if (r < 0) {
+        fprintf(stderr, COLOR_RED "Error: cannot start federation\n" COLOR_RESET);
+        return -1;
+    }
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Federation on, dialing %d node%s", fed_peers, fed_peers == 1 ? "" : "s");
+    return 0;
+}
+
+static int open_listener() {
+    struct sockaddr_in serv_addr;
+
+    if (unix_path) return open_unix_socket(unix_path, UNIX_SOCKET_UMASK, SOCK_NONBLOCK, LISTEN_BACKLOG);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+    }
+    // Every shard binds the same address; the kernel balances accepts
+    if (num_shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = inet_addr(LISTEN_ADDR);
+    serv_addr.sin_port = htons(listen_port);
+
+    if (bind(fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static struct shard *create_shard(int id) {
+    struct shard *sh = calloc(1, sizeof(*sh));
+    if (!sh) return NULL;
+
+    sh->id = id;
+    sh->conn_stats = calloc(MAX_CLIENTS, sizeof(*sh->conn_stats));
+    if (!sh->conn_stats) return NULL;
+    // A Unix socket cannot be bound once per thread like a TCP port, so
+    // every shard waits on the same one; EPOLLEXCLUSIVE wakes just one
+    sh->listen_fd = unix_path && id > 0 ? shards[0]->listen_fd : open_listener();
+    sh->epfd = epoll_create1(0);
+    sh->wake_fd = eventfd(0, EFD_NONBLOCK);
+    int kdf_ok = kdf_done_init(&sh->kdf_done) == 0;
+    if (sh->listen_fd < 0 || sh->epfd < 0 || sh->wake_fd < 0 || !kdf_ok) {
+        if (sh->epfd < 0) perror("epoll_create1");
+        if (sh->wake_fd < 0 || !kdf_ok) perror("eventfd");
+        return NULL;
+    }
+    if (group_table_init(&sh->rooms) < 0 || group_table_init(&sh->users) < 0) return NULL;
+    timer_wheel_init(&sh->timers, now_ms());
+    slab_init(&sh->client_slab, sizeof(struct client));
+
+    // Needs 6.1 or later for single-issuer rings with deferred task work;
+    // on anything older the shards keep to epoll (see main)
+    if (use_uring) {
+        unsigned int flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+        if (uring_init(&sh->ring, URING_ENTRIES, URING_CQ_ENTRIES, flags) < 0) {
+            log_event(LOG_WARN, "server", NULL, 0, NULL, "io_uring is not available (%s), using epoll", strerror(errno));
+            use_uring = 0;
+        } else if (uring_bufs_init(&sh->ring, &sh->bufs, 0, URING_BUFS, URING_BUF_SIZE) < 0) {
+            log_event(LOG_WARN, "server", NULL, 0, NULL, "io_uring buffer rings are not available (%s), using epoll",
+                      strerror(errno));
+            uring_exit(&sh->ring);
+            use_uring = 0;
+        } else {
+            sh->uring = 1;
+        }
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        if (i == id) continue;
+        sh->inbox[i] = spsc_ring_new(BUS_RING_SIZE);
+        if (!sh->inbox[i]) return NULL;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (unix_path ? EPOLLEXCLUSIVE : 0), .data.fd = sh->listen_fd };
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = sh->wake_fd;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return NULL;
+    }
+
+    ev.data.fd = sh->kdf_done.event_fd;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->kdf_done.event_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return NULL;
+    }
+    return sh;
+}
+
+// Wake-ups on descriptors other than clients and the listener
+static void handle_input(struct shard *sh, int fd) {
+    if (fd == sh->wake_fd) {
+        drain_inbox(sh);
+    } else if (fd == sh->kdf_done.event_fd) {
+        drain_logins(sh);
+    } else if (fd == signal_fd && sh->id == 0) {
+        handle_signal();
+    } else if (fd == STDIN_FILENO && sh->id == 0) {
+        if (!handle_server_input(sh)) stop_server();
+    }
+}
+
+static void handle_events(struct shard *sh, struct epoll_event *events, int nev) {
+    for (int i = 0; i < nev; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == sh->listen_fd) {
+            accept_clients(sh);
+        } else if (sh->clients[fd]) {
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                schedule_input(sh->clients[fd]);
+            }
+            if ((events[i].events & EPOLLOUT) && sh->clients[fd]) {
+                mark_dirty(sh->clients[fd]);
+            }
+        } else {
+            handle_input(sh, fd);
+        }
+    }
+}
+
+static void uring_received(struct shard *sh, struct client *c, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) c->recv_armed = 0;
+
+    int alive = !c->removed;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (alive && cqe->res > 0 && frame_reader_append(&c->rx, uring_buf(&sh->bufs, bid), cqe->res) < 0) {
+            remove_client(c);
+            alive = 0;
+        }
+        uring_bufs_put(&sh->bufs, bid);
+    }
+    if (!alive) {
+        release_removed(c);
+        return;
+    }
+
+    // Input is handled in the client's turn (see serve_ready()); until
+    // then it waits in rx, and past RX_BACKLOG_MAX in the socket
+    if (cqe->res > 0) {
+        count_input(c, cqe->res);
+        schedule_input(c);
+        if (c->rx.tail - c->rx.head > RX_BACKLOG_MAX) {
+            if (!c->recv_paused) uring_pause_recv(c);
+        }
+        else if (!c->recv_armed && !c->recv_paused && uring_arm_recv(c) < 0) remove_client(c);
+    } else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        // Every buffer was busy, the ones handed back meanwhile will do;
+        // or paused, and resumed by its turn unless still paused
+        if (!c->recv_armed && !c->recv_paused && uring_arm_recv(c) < 0) remove_client(c);
+    } else if (cqe->res == 0) {
+        c->recv_eof = 1;
+        schedule_input(c);
+    } else {
+        client_disconnected(c);
+    }
+}
+
+static void uring_sent(struct client *c, const struct io_uring_cqe *cqe) {
+    c->sending = 0;
+    if (c->removed) {
+        release_removed(c);
+        return;
+    }
+    if (cqe->res < 0) {
+        remove_client(c);
+        return;
+    }
+    outq_wire_sent(&c->out, cqe->res);
+    account_output(c);
+    if (c->out.bytes > 0 || c->out.filler) mark_dirty(c);
+}
+
+static void handle_completions(struct shard *sh) {
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_cqe(&sh->ring)) != NULL) {
+        enum uring_op op = cqe->user_data & ((1 << URING_OP_BITS) - 1);
+        int more = cqe->flags & IORING_CQE_F_MORE;
+
+        switch (op) {
+        case OP_ACCEPT:
+            if (cqe->res >= 0) {
+                accept_one(sh, cqe->res, NULL);
+            } else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+            }
+            if (!more) uring_arm_accept(sh);
+            break;
+        case OP_POLL: {
+            int fd = cqe->user_data >> URING_OP_BITS;
+            handle_input(sh, fd);
+            if (!more) uring_arm_poll(sh, fd);
+            break;
+        }
+        case OP_RECV:
+            uring_received(sh, (struct client *)(uintptr_t)(cqe->user_data - op), cqe);
+            break;
+        case OP_SEND:
+            uring_sent((struct client *)(uintptr_t)(cqe->user_data - op), cqe);
+            break;
+        case OP_CANCEL:
+            break;
+        }
+        uring_cqe_seen(&sh->ring);
+    }
+    uring_bufs_commit(&sh->bufs);
+}
+
+// Must run on the shard's own thread, the only one that submits to it
+static int start_uring(struct shard *sh) {
+    if (uring_enable(&sh->ring) < 0) {
+        perror("io_uring enable");
+        return -1;
+    }
+    uring_arm_accept(sh);
+    uring_arm_poll(sh, sh->wake_fd);
+    uring_arm_poll(sh, sh->kdf_done.event_fd);
+    if (sh->id == 0 && signal_fd >= 0) uring_arm_poll(sh, signal_fd);
+    if (sh->id == 0 && stdin_polled) uring_arm_poll(sh, STDIN_FILENO);
+    return 0;
+}
+
+// Event loop for one shard. Shard 0 runs on the main thread and also owns
+// the operator console.
+static void run_shard(struct shard *sh) {
+    struct epoll_event events[MAX_EVENTS];
+
+    log_set_thread(sh->id);
+    pool_thread_init(&sh->m.pool);
+    if (sh->uring && start_uring(sh) < 0) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int timeout = expire_timers(sh);
+        uint64_t busy;
+
+        if (cover_ms > 0) timeout = sooner(timeout, send_cover(sh));
+        if (sh->held_head) {
+            uint64_t now = now_ms();
+            timeout = sooner(timeout, sh->held_head->flush_at > now ? (int)(sh->held_head->flush_at - now) : 0);
+        }
+        if (sh->throttled_head) {
+            uint64_t now = now_ns();
+            timeout = sooner(timeout, sh->next_release > now ? (int)((sh->next_release - now + 999999) / 1000000) : 0);
+        }
+        if (sh->dirty_head || sh->ready_head) timeout = 0;
+
+        if (sh->uring) {
+            // One syscall both submits everything queued last iteration
+            // and waits for what completes next
+            if (uring_submit(&sh->ring, 1, timeout) < 0) {
+                perror("io_uring_enter");
+                break;
+            }
+            busy = now_ns();
+            handle_completions(sh);
+        } else {
+            int nev = epoll_wait(sh->epfd, events, MAX_EVENTS, timeout);
+            if (nev < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                break;
+            }
+            busy = now_ns();
+            handle_events(sh, events, nev);
+        }
+
+        serve_ready(sh);
+        flush_clients(sh);
+        hist_record(&sh->m.loop_ns, now_ns() - busy);
+        metric_set(&sh->m.pending, sh->pending_count);
+    }
+
+    // Say goodbye to this shard's clients
+    const char *shutdown_msg = "Server is shutting down. Goodbye!";
+    struct msgbuf *m = msgbuf_new(FRAME_NOTICE, shutdown_msg, strlen(shutdown_msg));
+    if (m) {
+        broadcast_local(sh, m, NULL);
+        msgbuf_unref(m);
+    }
+    while (sh->client_count > 0) {
+        remove_client(sh->active_clients[0]);
+    }
+    while (sh->pending_head) {
+        remove_client(sh->pending_head);
+    }
+}
+
+static void *shard_thread(void *arg) {
+    run_shard(arg);
+    return NULL;
+}
+
+// Read a password from stdin without echoing it on a terminal
+static int read_password(const char *prompt, char *buf, size_t cap) {
+    struct termios old, quiet;
+    int tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &old) == 0;
+
+    printf("%s", prompt);
+    fflush(stdout);
+    if (tty) {
+        quiet = old;
+        quiet.c_lflag &= ~ECHO;
+        tcsetattr(STDIN_FILENO, TCSANOW, &quiet);
+    }
+    char *r = fgets(buf, cap, stdin);
+    if (tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &old);
+        printf("\n");
+    }
+    if (!r) return -1;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+// -u: add a user or change their password, then exit
+static int set_user(const char *user) {
+    char password[KDF_MAX_PASSWORD + 2];
+    char again[KDF_MAX_PASSWORD + 2];
+
+    if (!creds_valid_user(user, strlen(user))) {
+        fprintf(stderr, COLOR_RED "Error: user names are 1-%d letters, digits, '.', '-' or '_'\n" COLOR_RESET, CREDS_MAX_USER);
+        return 1;
+    }
+    if (read_password("Password: ", password, sizeof(password)) < 0) return 1;
+    if (isatty(STDIN_FILENO) && (read_password("Repeat password: ", again, sizeof(again)) < 0 || strcmp(password, again) != 0)) {
+        fprintf(stderr, COLOR_RED "Error: passwords do not match\n" COLOR_RESET);
+        return 1;
+    }
+
+    int r = creds_set(CREDENTIALS_FILE, user, password);
+    crypto_wipe(password, sizeof(password));
+    crypto_wipe(again, sizeof(again));
+    if (r < 0) {
+        perror(CREDENTIALS_FILE);
+        return 1;
+    }
+    printf(COLOR_GREEN "Saved user %s in %s\n" COLOR_RESET, user, CREDENTIALS_FILE);
+    printf("A running server picks it up on SIGHUP: kill -HUP <pid>\n");
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-t threads] [-w kdf-workers] [-e engine] [-s socket] [-p port] [-l level] [-b] [-W ms] [-P]\n"
+           "       %*s [-C ms] [-Z] [-q msgs/s] [-Q msgs/s] [-F peer]...\n", prog, (int)strlen(prog), "");
+    printf("       %s -u user\n", prog);
+    printf("       %s -K\n", prog);
+    printf("  -t threads   Event-loop threads, each with its own listener (default 1, max %d)\n", MAX_SHARDS);
+    printf("  -w workers   Password-hashing threads (default: one per CPU, max %d)\n", KDF_MAX_WORKERS);
+    printf("  -e engine    epoll (default) or uring; uring needs Linux 6.1 and falls back to epoll\n");
+    printf("  -s socket    Listen on this Unix socket instead of %s:%d, for HiddenServicePort ... unix:<socket>\n",
+           LISTEN_ADDR, PORT);
+    printf("  -p port      Listen on this TCP port instead (default %d)\n", PORT);
+    printf("  -l level     Least important events logged: debug, info (default), warn or error\n");
+    printf("  -b           Log the text of chat messages, not just their size\n");
+    printf("  -W ms        Hold chat output this long so frames close together share Tor cells (default 0)\n");
+    printf("  -P           Pad each burst of output to whole Tor cells of %d bytes\n", FRAME_CELL_DATA);
+    printf("  -C ms        Send a cell of padding this often to clients with nothing else coming\n");
+    printf("  -Z           Refuse compression to clients that offer it\n");
+    printf("  -q msgs/s    Chat messages one connection may send per second, bursts of %ds (default %d, 0 for no\n"
+           "               per-connection limits); input is also held to %d KiB/s\n",
+           RATE_BURST_S, CONN_MSG_RATE, CONN_BYTE_RATE / 1024);
+    printf("  -Q msgs/s    The same for all of one user's connections together (default %d, %d KiB/s)\n",
+           USER_MSG_RATE, USER_BYTE_RATE / 1024);
+    printf("  -F peer      Federate with the node at host:port, a Unix socket path or name.onion:port, relaying\n"
+           "               chat both ways; every node needs the same %s (repeat for up to %d peers)\n",
+           FEDERATION_KEY_FILE, FED_MAX_PEERS);
+    printf("  -u user      Add a user to %s, or change their password, reading it from stdin\n", CREDENTIALS_FILE);
+    printf("  -K           Create %s, to be copied to every node of a federation\n", FEDERATION_KEY_FILE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int kdf_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *add_user = NULL;
+    int new_fed_key = 0;
+
+    while ((opt = getopt(argc, argv, "t:w:e:s:p:l:bW:PC:Zq:Q:F:u:Kh")) != -1) {
+        switch (opt) {
+        case 't':
+            num_shards = atoi(optarg);
+            if (num_shards < 1 || num_shards > MAX_SHARDS) {
+                fprintf(stderr, COLOR_RED "Error: thread count must be between 1 and %d\n" COLOR_RESET, MAX_SHARDS);
+                return 1;
+            }
+            break;
+        case 'w':
+            kdf_workers = atoi(optarg);
+            if (kdf_workers < 1 || kdf_workers > KDF_MAX_WORKERS) {
+                fprintf(stderr, COLOR_RED "Error: worker count must be between 1 and %d\n" COLOR_RESET, KDF_MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") != 0 && strcmp(optarg, "epoll") != 0) {
+                fprintf(stderr, COLOR_RED "Error: engine must be epoll or uring\n" COLOR_RESET);
+                return 1;
+            }
+            use_uring = strcmp(optarg, "uring") == 0;
+            break;
+        case 's':
+            unix_path = optarg;
+            break;
+        case 'p':
+            listen_port = atoi(optarg);
+            if (listen_port < 1 || listen_port > 65535) {
+                fprintf(stderr, COLOR_RED "Error: port must be between 1 and 65535\n" COLOR_RESET);
+                return 1;
+            }
+            break;
+        case 'l':
+            log_level = log_level_parse(optarg);
+            if (log_level < 0) {
+                fprintf(stderr, COLOR_RED "Error: log level must be debug, info, warn or error\n" COLOR_RESET);
+                return 1;
+            }
+            break;
+        case 'b':
+            log_bodies = 1;
+            break;
+        case 'W':
+            batch_ms = atoi(optarg);
+            if (batch_ms < 0 || batch_ms > BATCH_MAX_MS) {
+                fprintf(stderr, COLOR_RED "Error: batching window must be between 0 and %d ms\n" COLOR_RESET, BATCH_MAX_MS);
+                return 1;
+            }
+            break;
+        case 'P':
+            pad_cells = 1;
+            break;
+        case 'C':
+            cover_ms = atoi(optarg);
+            if (cover_ms < COVER_MIN_MS) {
+                fprintf(stderr, COLOR_RED "Error: padding interval must be at least %d ms\n" COLOR_RESET, COVER_MIN_MS);
+                return 1;
+            }
+            break;
+        case 'Z':
+            features &= ~FRAME_FEATURE_COMPRESS;
+            break;
+        case 'q':
+        case 'Q':
+            *(opt == 'q' ? &conn_msg_rate : &user_msg_rate) = atoi(optarg);
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, COLOR_RED "Error: message rate must not be negative\n" COLOR_RESET);
+                return 1;
+            }
+            break;
+        case 'F':
+            if (fed_add_peer(optarg) < 0) {
+                fprintf(stderr, COLOR_RED "Error: peer must be host:port or a socket path, at most %d of them\n" COLOR_RESET,
+                        FED_MAX_PEERS);
+                return 1;
+            }
+            fed_peers++;
+            break;
+        case 'u':
+            add_user = optarg;
+            break;
+        case 'K':
+            new_fed_key = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (add_user) return set_user(add_user);
+    if (new_fed_key) return create_federation_key();
+
+    rate_limit_init(&conn_msgs, conn_msg_rate, conn_msg_rate * RATE_BURST_S);
+    rate_limit_init(&conn_bytes, conn_msg_rate ? CONN_BYTE_RATE : 0, CONN_BYTE_RATE * RATE_BURST_S);
+    rate_limit_init(&user_msgs, user_msg_rate, user_msg_rate * RATE_BURST_S);
+    rate_limit_init(&user_bytes, user_msg_rate ? USER_BYTE_RATE : 0, USER_BYTE_RATE * RATE_BURST_S);
+
+    print_server_banner();
+
+    // A peer closing mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    if (log_open(LOG_FILE, log_level) < 0) exit(1);
+
+    if (load_server_key() < 0) exit(1);
+    ticket_init(server_priv);
+    char key_hex[2 * NOISE_KEY_LEN + 1];
+    for (int i = 0; i < NOISE_KEY_LEN; i++) sprintf(key_hex + 2 * i, "%02x", server_pub[i]);
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Server key: %s", key_hex);
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Clients can pin it with: ./client -k <server key> <onion-address> %d", listen_port);
+    if (load_federation_key() < 0) exit(1);
+
+    creds = creds_load(CREDENTIALS_FILE);
+    if (!creds) {
+        fprintf(stderr, COLOR_RED "Error: cannot read %s: %s\n" COLOR_RESET, CREDENTIALS_FILE, strerror(errno));
+        fprintf(stderr, "Add a user first: %s -u <name>\n", argv[0]);
+        exit(1);
+    }
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Loaded %u user%s from %s", creds->count,
+              creds->count == 1 ? "" : "s", CREDENTIALS_FILE);
+
+    if (history_open(HISTORY_DIR) < 0) {
+        fprintf(stderr, COLOR_RED "Error: cannot use %s/: %s\n" COLOR_RESET, HISTORY_DIR, strerror(errno));
+        exit(1);
+    }
+    struct history_stats hs;
+    history_get_stats(&hs);
+    print_timestamp();
+    printf("History: %llu message%s in %s/\n", (unsigned long long)(hs.next_seq - hs.first_seq),
+           hs.next_seq - hs.first_seq == 1 ? "" : "s", HISTORY_DIR);
+
+    if (file_store_open(FILES_DIR, FILES_MAX_BYTES) < 0) {
+        fprintf(stderr, COLOR_RED "Error: cannot use %s/: %s\n" COLOR_RESET, FILES_DIR, strerror(errno));
+        exit(1);
+    }
+    if (mailbox_open(MAILBOX_DIR) < 0) {
+        fprintf(stderr, COLOR_RED "Error: cannot use %s/: %s\n" COLOR_RESET, MAILBOX_DIR, strerror(errno));
+        exit(1);
+    }
+    struct mailbox_stats ms;
+    mailbox_get_stats(&ms);
+    if (ms.messages > 0) {
+        print_timestamp();
+        printf("Mailboxes: %llu message%s for %u offline user%s in %s/\n", (unsigned long long)ms.messages,
+               ms.messages == 1 ? "" : "s", ms.mailboxes, ms.mailboxes == 1 ? "" : "s", MAILBOX_DIR);
+    }
+
+    // The decoy hash is random, so no password ever matches it
+    decoy_params = (struct argon2_params){
+        .t_cost = ARGON2_DEFAULT_T, .m_cost = ARGON2_DEFAULT_M, .lanes = ARGON2_DEFAULT_P,
+        .salt_len = ARGON2_SALT_LEN, .hash_len = ARGON2_HASH_LEN,
+    };
+    random_bytes(decoy_params.salt, decoy_params.salt_len);
+    random_bytes(decoy_params.hash, decoy_params.hash_len);
+
+    // SIGHUP, SIGINT and SIGTERM are taken through a signalfd on the main
+    // loop; block them before any thread starts so none of them receives
+    // one directly. Stopping on a signal goes through the same shutdown as
+    // /quit, which spills the mailboxes and closes the history.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    }
+
+    if (kdf_pool_start(kdf_workers, KDF_QUEUE_MAX) < 0) exit(1);
+    if (group_table_init(&online) < 0) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        shards[i] = create_shard(i);
+        if (!shards[i]) exit(1);
+    }
+    // A ring that failed on one shard puts them all on epoll, so that the
+    // server runs one event engine. Nothing is queued on the rings yet.
+    if (!use_uring) {
+        for (int i = 0; i < num_shards; i++) {
+            if (!shards[i]->uring) continue;
+            uring_exit(&shards[i]->ring);
+            uring_bufs_free(&shards[i]->bufs);
+            shards[i]->uring = 0;
+        }
+    }
+
+    // stdin stays level-triggered since it is read a line at a time
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = STDIN_FILENO };
+    if (epoll_ctl(shards[0]->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0) {
+        stdin_polled = 1;
+    } else {
+        log_event(LOG_WARN, "server", NULL, 0, NULL, "stdin is not pollable, server commands disabled");
+    }
+
+    ev.data.fd = signal_fd;
+    if (signal_fd >= 0 && epoll_ctl(shards[0]->epfd, EPOLL_CTL_ADD, signal_fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+
+    // Before any other thread starts, since binding it briefly changes the umask
+    admin_fd = open_admin_socket();
+    if (admin_fd >= 0 && pthread_create(&admin_thread, NULL, admin_main, NULL) != 0) {
+        perror("pthread_create");
+        close(admin_fd);
+        admin_fd = -1;
+    }
+
+    char where[128];
+    if (unix_path) snprintf(where, sizeof(where), "%s", unix_path);
+    else snprintf(where, sizeof(where), "%s:%d", LISTEN_ADDR, listen_port);
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Server listening on %s with %d %s thread%s, %d password worker%s",
+              where, num_shards, use_uring ? "io_uring" : "epoll", num_shards == 1 ? "" : "s",
+              kdf_workers, kdf_workers == 1 ? "" : "s");
+    if (admin_fd >= 0) {
+        log_event(LOG_INFO, "server", NULL, 0, NULL, "Metrics on %s: curl --unix-socket %s http://localhost/metrics",
+                  ADMIN_SOCKET, ADMIN_SOCKET);
+    }
+    if (batch_ms > 0 || pad_cells || cover_ms > 0) {
+        log_event(LOG_INFO, "server", NULL, 0, NULL, "Output batched for %d ms, %s, cover traffic %s",
+                  batch_ms, pad_cells ? "padded to whole cells" : "not padded", cover_ms > 0 ? "on" : "off");
+    }
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Input limited to %d messages/s per connection, %d per user (0: unlimited)",
+              conn_msg_rate, user_msg_rate);
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Events logged to %s", LOG_FILE);
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Waiting for incoming connections...");
+
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&shards[i]->thread, NULL, shard_thread, shards[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    if (fed_start() < 0) exit(1);
+
+    run_shard(shards[0]);
+
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Server shutting down...");
+
+    // Another shard may have stopped on an error; make sure all follow
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 1; i < num_shards; i++) {
+        wake_shard(shards[i]);
+        pthread_join(shards[i]->thread, NULL);
+    }
+    fed_stop();
+
+    if (admin_fd >= 0) {
+        shutdown(admin_fd, SHUT_RDWR);
+        pthread_join(admin_thread, NULL);
+        close(admin_fd);
+        unlink(ADMIN_SOCKET);
+    }
+
+    // Every client is gone, so any results still arriving are discarded
+    kdf_pool_stop();
+    for (int i = 0; i < num_shards; i++) {
+        drain_logins(shards[i]);
+        close(shards[i]->epfd);
+        close(shards[i]->wake_fd);
+        close(shards[i]->kdf_done.event_fd);
+        if (!unix_path || i == 0) close(shards[i]->listen_fd);
+        if (shards[i]->uring) uring_exit(&shards[i]->ring);
+    }
+    if (unix_path) unlink(unix_path);
+    creds_free(creds);
+    mailbox_close();
+    history_close();
+    log_event(LOG_INFO, "server", NULL, 0, NULL, "Server shutdown");
+    log_close();
     return 0;
 }
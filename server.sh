@@ -15,4 +15,4 @@ if [ ! -x "./server" ]; then
 fi
 
 # Start the server
-./server
+./server "$@"
@@ -24,7 +24,7 @@ fi
 
 # Compile server
 echo "Compiling server..."
-gcc -Wall -O2 -o server server.c
+gcc -Wall -O2 -pthread -o server server.c frame.c msgbuf.c pool.c crypto.c chacha_simd.c noise.c argon2.c creds.c kdfpool.c history.c ticket.c metrics.c log.c uring.c groups.c files.c timer.c mailbox.c federation.c socks5.c compress.c
 if [ $? -eq 0 ]; then
     echo "Server compiled successfully"
 else
@@ -34,7 +34,7 @@ fi
 
 # Compile client
 echo "Compiling client..."
-gcc -Wall -O2 -o client client.c
+gcc -Wall -O2 -pthread -o client client.c socks5.c frame.c pool.c crypto.c chacha_simd.c noise.c files.c compress.c
 if [ $? -eq 0 ]; then
     echo "Client compiled successfully"
 else
@@ -42,9 +42,32 @@ else
     exit 1
 fi
 
+# Compile crypto benchmark
+echo "Compiling crypto benchmark..."
+gcc -Wall -O2 -o bench_crypto bench_crypto.c crypto.c chacha_simd.c noise.c frame.c pool.c argon2.c
+if [ $? -eq 0 ]; then
+    echo "Benchmark compiled successfully"
+else
+    echo "Error: Failed to compile benchmark"
+    exit 1
+fi
+
+# Compile load benchmark
+echo "Compiling load benchmark..."
+gcc -Wall -O2 -pthread -o bench_load bench_load.c socks5.c frame.c pool.c crypto.c chacha_simd.c noise.c compress.c
+if [ $? -eq 0 ]; then
+    echo "Load benchmark compiled successfully"
+else
+    echo "Error: Failed to compile load benchmark"
+    exit 1
+fi
+
 echo ""
 echo "Setup completed successfully!"
 echo "You can now:"
-echo "1. Run the server: ./server.sh"
-echo "2. Configure Tor hidden service"
-echo "3. Run the client: ./client <onion-address> <port>"
+echo "1. Add a user: ./server -u <name>"
+echo "2. Run the server: ./server.sh"
+echo "3. Configure Tor hidden service"
+echo "4. Run the client: ./client [-k server-key] <onion-address> <port>"
+echo "5. Measure crypto cost: ./bench_crypto"
+echo "6. Measure load and latency: ./bench_load (see README.md)"
@@ -0,0 +1,182 @@
+// socks5.c
+// SOCKS5 client side, see socks5.h
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "socks5.h"
+
+// Read exactly len bytes, however the proxy splits them. Returns -1 on an
+// error or if the connection closes first.
+static int read_exact(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static const char *socks5_error(unsigned char code) {
+    switch (code) {
+        case 0x01: return "General failure";
+        case 0x02: return "Connection not allowed";
+        case 0x03: return "Network unreachable";
+        case 0x04: return "Host unreachable";
+        case 0x05: return "Connection refused";
+        case 0x06: return "TTL expired";
+        case 0x07: return "Command not supported";
+        case 0x08: return "Address type not supported";
+    }
+    return "Unknown error";
+}
+
+int socks5_connect_domain(int proxy_fd, const char *domain, int port, const char *auth,
+                          const void *early, size_t early_len, int pipelined) {
+    unsigned char buf[1024 + SOCKS5_MAX_EARLY];
+    size_t greet_len, auth_len = 0, req_len, off = 0;
+
+    size_t dlen = strlen(domain);
+    if (dlen > 255) {
+        fprintf(stderr, "SOCKS5: Domain name too long\n");
+        return -1;
+    }
+    if (early_len > SOCKS5_MAX_EARLY) {
+        fprintf(stderr, "SOCKS5: Early data too long\n");
+        return -1;
+    }
+
+    // 1) greeting: no auth, or username/password
+    buf[off++] = 0x05;
+    buf[off++] = 0x01;
+    buf[off++] = auth ? 0x02 : 0x00;
+    greet_len = off;
+
+    // 2) username/password sub-negotiation (RFC 1929)
+    if (auth) {
+        const char *colon = strchr(auth, ':');
+        size_t ulen = colon ? (size_t)(colon - auth) : strlen(auth);
+        const char *pass = colon ? colon + 1 : "";
+        size_t plen = strlen(pass);
+        if (ulen == 0 || ulen > 255 || plen > 255) {
+            fprintf(stderr, "SOCKS5: User name and password must be 1-255 bytes\n");
+            return -1;
+        }
+        buf[off++] = 0x01;
+        buf[off++] = (unsigned char)ulen;
+        memcpy(buf + off, auth, ulen); off += ulen;
+        buf[off++] = (unsigned char)plen;
+        memcpy(buf + off, pass, plen); off += plen;
+        auth_len = off - greet_len;
+    }
+
+    // 3) CONNECT request with domain name
+    size_t req_off = off;
+    buf[off++] = 0x05; // version
+    buf[off++] = 0x01; // CONNECT
+    buf[off++] = 0x00; // RSV
+    buf[off++] = 0x03; // ATYP = DOMAINNAME
+    buf[off++] = (unsigned char)dlen;
+    memcpy(buf + off, domain, dlen); off += dlen;
+    buf[off++] = (unsigned char)((port >> 8) & 0xff);
+    buf[off++] = (unsigned char)(port & 0xff);
+    req_len = off - req_off;
+
+    // 4) optimistic data for the server
+    memcpy(buf + off, early, early_len);
+    off += early_len;
+
+    if (pipelined && send_all(proxy_fd, buf, off) < 0) {
+        fprintf(stderr, "SOCKS5: Failed to send connection request\n");
+        return -1;
+    }
+
+    if (!pipelined && send_all(proxy_fd, buf, greet_len) < 0) {
+        fprintf(stderr, "SOCKS5: Failed to send greeting\n");
+        return -1;
+    }
+    if (read_exact(proxy_fd, buf, 2) < 0) {
+        fprintf(stderr, "SOCKS5: Failed to receive greeting response\n");
+        return -1;
+    }
+    if (buf[0] != 0x05 || buf[1] != (auth ? 0x02 : 0x00)) {
+        fprintf(stderr, "SOCKS5: %s not supported by proxy\n",
+                auth ? "Username/password authentication" : "Unauthenticated access");
+        return -1;
+    }
+
+    if (auth) {
+        if (!pipelined && send_all(proxy_fd, buf + greet_len, auth_len) < 0) {
+            fprintf(stderr, "SOCKS5: Failed to send credentials\n");
+            return -1;
+        }
+        if (read_exact(proxy_fd, buf, 2) < 0 || buf[1] != 0x00) {
+            fprintf(stderr, "SOCKS5: Proxy rejected the credentials\n");
+            return -1;
+        }
+    }
+
+    if (!pipelined && send_all(proxy_fd, buf + req_off, req_len) < 0) {
+        fprintf(stderr, "SOCKS5: Failed to send connection request\n");
+        return -1;
+    }
+
+    // 5) read reply
+    if (read_exact(proxy_fd, buf, 4) < 0) {
+        fprintf(stderr, "SOCKS5: Failed to receive connection response\n");
+        return -1;
+    }
+    
+    if (buf[0] != 0x05) {
+        fprintf(stderr, "SOCKS5: Invalid version in response\n");
+        return -1;
+    }
+    
+    if (buf[1] != 0x00) {
+        fprintf(stderr, "SOCKS5: Connection failed - %s\n", socks5_error(buf[1]));
+        return -1;
+    }
+
+    // Read the rest of the response based on address type
+    unsigned char atyp = buf[3];
+    int ok;
+    if (atyp == 0x01) { // IPv4
+        ok = read_exact(proxy_fd, buf, 4 + 2) == 0;
+    } else if (atyp == 0x03) { // domain
+        ok = read_exact(proxy_fd, buf, 1) == 0 && read_exact(proxy_fd, buf + 1, buf[0] + 2) == 0;
+    } else if (atyp == 0x04) { // IPv6
+        ok = read_exact(proxy_fd, buf, 16 + 2) == 0;
+    } else {
+        fprintf(stderr, "SOCKS5: Unsupported address type\n");
+        return -1;
+    }
+    if (!ok) {
+        fprintf(stderr, "SOCKS5: Truncated connection response\n");
+        return -1;
+    }
+
+    if (!pipelined && send_all(proxy_fd, early, early_len) < 0) {
+        perror("SOCKS5: send");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+// socks5.h
+// SOCKS5 client side: open a tunnel through Tor's SOCKS port
+//
+// Shared by the chat client and the load benchmark, so the benchmark
+// exercises exactly the connection setup real clients go through.
+
+#ifndef SOCKS5_H
+#define SOCKS5_H
+
+#include <stddef.h>
+
+#define SOCKS5_MAX_EARLY 512          // Largest early data sent with the request
+
+// Open a SOCKS5 tunnel to domain:port over the connected proxy_fd and send
+// `early` through it.
+//
+// In pipelined mode the greeting, the optional username/password, the
+// CONNECT request and the early data all go out in one write, and the
+// replies are read afterwards. Tor accepts this, so connecting costs one
+// round trip to the proxy instead of three, and the early data (the first
+// handshake message) is on its way to the server before the circuit is
+// even built. Otherwise each step waits for the proxy's answer.
+//
+// Tor puts connections with different SOCKS credentials on different
+// circuits, so `auth` ("user:password", or NULL) isolates this session.
+//
+// Returns 0 once the tunnel is up, -1 after printing why it is not.
+int socks5_connect_domain(int proxy_fd, const char *domain, int port, const char *auth,
+                          const void *early, size_t early_len, int pipelined);
+
+#endif
@@ -0,0 +1,58 @@
+// ticket.c
+// Stateless resumption tickets, see ticket.h
+
+#include <string.h>
+#include <time.h>
+
+#include "crypto.h"
+#include "frame.h"
+#include "ticket.h"
+
+static uint8_t ticket_key[32];
+
+void ticket_init(const uint8_t server_priv[32]) {
+    static const char label[] = "torchat resumption ticket";
+    blake2b(ticket_key, sizeof(ticket_key), label, sizeof(label) - 1, server_priv, 32);
+}
+
+static void ticket_mac(uint8_t mac[TICKET_MAC_LEN], const unsigned char *t, size_t len,
+                       const struct argon2_params *cred) {
+    struct blake2b_ctx ctx;
+
+    blake2b_init(&ctx, TICKET_MAC_LEN, ticket_key, sizeof(ticket_key));
+    blake2b_update(&ctx, t, len);
+    blake2b_update(&ctx, cred->hash, cred->hash_len);
+    blake2b_final(&ctx, mac);
+}
+
+size_t ticket_issue(unsigned char *out, const char *user, const struct argon2_params *cred) {
+    size_t user_len = strlen(user);
+
+    frame_put_u64(out, (uint64_t)time(NULL) + TICKET_LIFETIME_S);
+    out[8] = (unsigned char)user_len;
+    memcpy(out + 9, user, user_len);
+    ticket_mac(out + 9 + user_len, out, 9 + user_len, cred);
+    return 9 + user_len + TICKET_MAC_LEN;
+}
+
+int ticket_user(const unsigned char *t, size_t len, char user[CREDS_MAX_USER + 1]) {
+    if (len < 9 + TICKET_MAC_LEN) return -1;
+
+    size_t user_len = t[8];
+    if (len != 9 + user_len + TICKET_MAC_LEN || !creds_valid_user((const char *)t + 9, user_len)) return -1;
+    memcpy(user, t + 9, user_len);
+    user[user_len] = 0;
+    return 0;
+}
+
+int ticket_verify(const unsigned char *t, size_t len, const struct argon2_params *cred) {
+    uint8_t mac[TICKET_MAC_LEN];
+    char user[CREDS_MAX_USER + 1];
+
+    if (ticket_user(t, len, user) < 0) return 0;
+
+    size_t body = len - TICKET_MAC_LEN;
+    ticket_mac(mac, t, body, cred);
+    if (!crypto_memeq(mac, t + body, TICKET_MAC_LEN)) return 0;
+    return frame_get_u64(t) > (uint64_t)time(NULL);
+}
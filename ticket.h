@@ -0,0 +1,48 @@
+// ticket.h
+// Session resumption tickets
+//
+// After a login the server hands the client a ticket. The client presents
+// it on its next connection instead of a password. The server keeps no
+// record of the tickets it issued; checking one is a MAC computation and
+// an in-memory account lookup:
+//
+//   +------------+-------------+------+----------+
+//   | expiry (8) | user len(1) | user | MAC (32) |
+//   +------------+-------------+------+----------+
+//
+// The expiry is in Unix seconds. The MAC is keyed BLAKE2b under a key
+// derived from the server's static key, over the fields before it and
+// the account's current password hash. Changing a password or removing
+// the account therefore invalidates its tickets, while a restart does not
+// as long as server.key is kept. Tickets only travel inside the encrypted
+// session, since anyone holding one can log in until it expires.
+
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "argon2.h"
+#include "creds.h"
+
+#define TICKET_MAC_LEN 32
+#define TICKET_MAX_LEN (8 + 1 + CREDS_MAX_USER + TICKET_MAC_LEN)
+#define TICKET_LIFETIME_S (12 * 3600)          // How long a ticket lets a client back in
+
+// Derive the ticket key from the server's static private key
+void ticket_init(const uint8_t server_priv[32]);
+
+// Write a fresh ticket for user, whose account currently has `cred`.
+// Returns its length.
+size_t ticket_issue(unsigned char *out, const char *user, const struct argon2_params *cred);
+
+// Copy out the user name a ticket claims, without trusting it yet.
+// Returns -1 if the ticket is malformed.
+int ticket_user(const unsigned char *t, size_t len, char user[CREDS_MAX_USER + 1]);
+
+// 1 if the ticket was issued by this server for the account as it is now
+// and has not expired, 0 otherwise
+int ticket_verify(const unsigned char *t, size_t len, const struct argon2_params *cred);
+
+#endif
@@ -0,0 +1,152 @@
+// timer.c
+// Hierarchical timer wheel, see timer.h
+
+#include <limits.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+#define WHEEL_SPAN (1ULL << LEVEL_SHIFT(TIMER_LEVELS))
+
+static void list_init(struct timer *head) {
+    head->next = head->prev = head;
+}
+
+static void list_append(struct timer *head, struct timer *t) {
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(struct timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+    w->now = now;
+    for (int i = 0; i < TIMER_LEVELS; i++) w->occupied[i] = 0;
+    for (int i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) list_init(&w->slots[i]);
+    list_init(&w->due);
+}
+
+// File t under the level whose span covers how far ahead it is due. A slot
+// of level L runs when the ticks below it wrap, so a timer at least
+// TIMER_SLOTS^L ticks ahead never lands in the slot running next.
+static void place(struct timer_wheel *w, struct timer *t) {
+    uint64_t when = t->expires, delta;
+    int level = 0;
+
+    if (when < w->now) {
+        // Its tick has already run
+        t->slot = -1;
+        list_append(&w->due, t);
+        return;
+    }
+    delta = when - w->now;
+
+    if (delta >= WHEEL_SPAN) {
+        // Beyond the top level: park it as far out as it reaches
+        when = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << LEVEL_SHIFT(level + 1)) level++;
+
+    unsigned int idx = (when >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+    t->slot = level * TIMER_SLOTS + idx;
+    list_append(&w->slots[t->slot], t);
+    w->occupied[level] |= 1ULL << idx;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires) {
+    if (timer_armed(t)) timer_cancel(w, t);
+    t->expires = expires;
+    place(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if (!timer_armed(t)) return;
+
+    struct timer *head = t->slot >= 0 ? &w->slots[t->slot] : NULL;
+    list_unlink(t);
+    if (head && head->next == head) {
+        w->occupied[t->slot / TIMER_SLOTS] &= ~(1ULL << (t->slot % TIMER_SLOTS));
+    }
+}
+
+// Spread the timers of one upper-level slot over the levels below
+static void cascade(struct timer_wheel *w, int level, unsigned int idx) {
+    struct timer *head = &w->slots[level * TIMER_SLOTS + idx];
+
+    w->occupied[level] &= ~(1ULL << idx);
+    while (head->next != head) {
+        struct timer *t = head->next;
+        list_unlink(t);
+        place(w, t);
+    }
+}
+
+// The first tick from w->now on at which anything happens: a level-0 slot
+// with timers runs, or an occupied upper slot is spread out. Every tick
+// before it is a no-op and can be skipped.
+static uint64_t next_event(const struct timer_wheel *w) {
+    uint64_t best = UINT64_MAX;
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t occ = w->occupied[level];
+        if (!occ) continue;
+
+        // First slot number k at this level whose start is not before now
+        int shift = LEVEL_SHIFT(level);
+        uint64_t base = (w->now + (1ULL << shift) - 1) >> shift;
+        unsigned int b = base & (TIMER_SLOTS - 1);
+        uint64_t rot = b ? (occ >> b) | (occ << (TIMER_SLOTS - b)) : occ;
+        uint64_t tick = (base + __builtin_ctzll(rot)) << shift;
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+struct timer *timer_expire(struct timer_wheel *w, uint64_t now) {
+    while (w->due.next == &w->due && w->now <= now) {
+        uint64_t next = next_event(w);
+        if (next > w->now) {
+            w->now = next <= now ? next : now + 1;
+            continue;
+        }
+
+        uint64_t tick = w->now;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) break;
+            cascade(w, level, (tick >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1));
+        }
+
+        // Everything left in this tick's slot is due
+        unsigned int idx = tick & (TIMER_SLOTS - 1);
+        struct timer *head = &w->slots[idx];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            list_unlink(t);
+            t->slot = -1;
+            list_append(&w->due, t);
+        }
+        w->occupied[0] &= ~(1ULL << idx);
+        w->now++;
+    }
+
+    if (w->due.next == &w->due) return NULL;
+    struct timer *t = w->due.next;
+    list_unlink(t);
+    return t;
+}
+
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now) {
+    if (w->due.next != &w->due) return 0;
+
+    uint64_t next = next_event(w);
+    if (next == UINT64_MAX) return -1;
+    if (next <= now) return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
@@ -0,0 +1,72 @@
+// timer.h
+// Hierarchical timer wheel with millisecond ticks
+//
+// Drives every per-connection deadline in a shard: the key exchange and
+// login phases, heartbeats and idle timeouts. Arming, re-arming and
+// cancelling are O(1) whatever the number of timers, which matters with a
+// timer for each of 100k connections that is pushed back on every message.
+//
+// TIMER_LEVELS wheels of TIMER_SLOTS slots each: level 0 holds timers due
+// within the next 64 ticks, one slot per tick, level 1 those within 64^2
+// ticks, 64 ticks per slot, and so on. As time reaches a slot of an upper
+// level its timers are spread over the levels below, so every timer fires
+// on its exact tick however far ahead it was set. Timers further out than
+// the top level covers wait in its last slot and are spread out again.
+//
+// Timers are embedded in their owner's structure and linked into the slot
+// lists; the wheel allocates nothing. Due timers are handed back one at a
+// time by timer_expire(), so whatever the caller does with one, including
+// re-arming or cancelling others, cannot upset the walk. A wheel belongs to
+// one thread and is not locked.
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4                // Spans 2^24 ticks, 4.6 hours of milliseconds
+
+struct timer {
+    struct timer *next;               // NULL while not armed
+    struct timer *prev;
+    uint64_t expires;                 // Tick at which it is due
+    int slot;                         // Slot list it is on, or -1 for the due list
+};
+
+struct timer_wheel {
+    uint64_t now;                     // Next tick to run
+    uint64_t occupied[TIMER_LEVELS];  // Slots with timers, one bit each
+    struct timer slots[TIMER_LEVELS * TIMER_SLOTS];  // List heads
+    struct timer due;                 // Timers whose tick has run, not yet handed out
+};
+
+// now is the current tick, from the same clock later calls use
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+static inline void timer_init(struct timer *t) {
+    t->next = t->prev = NULL;
+}
+
+static inline int timer_armed(const struct timer *t) {
+    return t->next != NULL;
+}
+
+// Arm t to fire at tick expires, moving it if it is already armed. A tick
+// already past fires on the next timer_expire().
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires);
+
+// Disarm t if it is armed
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+// Run the wheel up to tick now and hand out the next timer due by then,
+// disarmed, or NULL once there are none
+struct timer *timer_expire(struct timer_wheel *w, uint64_t now);
+
+// Milliseconds from now until the wheel next has work, for an epoll or
+// io_uring wait: 0 if timers are due, -1 if none are armed
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now);
+
+#endif
@@ -0,0 +1,164 @@
+// uring.c
+// Minimal io_uring wrapper, see uring.h
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg, unsigned int n) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+int uring_init(struct uring *u, unsigned int entries, unsigned int cq_entries, unsigned int flags) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    p.flags = flags | IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED;
+    p.cq_entries = cq_entries;
+
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0) return -1;
+
+    // Needed for the SQ and CQ rings to share one mapping, and for the
+    // timeout argument to io_uring_enter
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring_mem = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_mem == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring_mem, u->ring_size);
+        close(u->fd);
+        return -1;
+    }
+
+    unsigned char *ring = u->ring_mem;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+
+    // SQE i always sits in slot i
+    unsigned int *array = (unsigned int *)(ring + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) array[i] = i;
+    return 0;
+}
+
+int uring_enable(struct uring *u) {
+    return sys_register(u->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0);
+}
+
+void uring_exit(struct uring *u) {
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring_mem, u->ring_size);
+    close(u->fd);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_submit(u, 0, 0) < 0) return NULL;
+        if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *u, int wait, int timeout_ms) {
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    unsigned int pending = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (!wait && pending == 0) return 0;
+
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if (sys_enter(u->fd, pending, wait ? 1 : 0, flags, argp, argsz) < 0 && errno != ETIME && errno != EINTR) {
+        // The completion queue is backed up; reaping it will make room
+        if (errno == EBUSY || errno == EAGAIN) return 0;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_bufs_init(struct uring *u, struct uring_bufs *b, unsigned short group,
+                    unsigned int count, unsigned int size) {
+    memset(b, 0, sizeof(*b));
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED) return -1;
+    b->base = malloc((size_t)count * size);
+    if (!b->base) {
+        munmap(b->ring, ring_size);
+        return -1;
+    }
+    b->count = count;
+    b->size = size;
+    b->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(b->base);
+        munmap(b->ring, ring_size);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++) uring_bufs_put(b, i);
+    uring_bufs_commit(b);
+    return 0;
+}
+
+void uring_bufs_free(struct uring_bufs *b) {
+    munmap(b->ring, b->count * sizeof(struct io_uring_buf));
+    free(b->base);
+    memset(b, 0, sizeof(*b));
+}
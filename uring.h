@@ -0,0 +1,97 @@
+// uring.h
+// Minimal io_uring wrapper: ring setup, submission, completion and
+// provided buffer rings, straight on the kernel interface
+//
+// One ring belongs to one event-loop thread. Requests are queued as SQEs
+// and handed to the kernel together with the wait for completions in a
+// single io_uring_enter, so a loop iteration costs one syscall however
+// many sends, receives and accepts it starts. Receives take their buffer
+// from a provided buffer ring only once data has arrived, so idle
+// connections hold no receive memory.
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;          // Advanced by the kernel as it consumes SQEs
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sqe_tail;          // SQEs prepared, published on the next enter
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+// Buffers the kernel picks from for IOSQE_BUFFER_SELECT receives
+struct uring_bufs {
+    struct io_uring_buf_ring *ring;
+    unsigned char *base;
+    unsigned int count;             // A power of two
+    unsigned int size;              // Bytes per buffer
+    unsigned short group;
+    unsigned short tail;
+};
+
+// Create a ring. flags are IORING_SETUP_* flags; the ring is created
+// disabled and must be enabled, with uring_enable(), by the thread that
+// will submit to it. Returns 0, or -1 with errno set (EINVAL or ENOSYS
+// when the kernel lacks a feature asked for).
+int uring_init(struct uring *u, unsigned int entries, unsigned int cq_entries, unsigned int flags);
+int uring_enable(struct uring *u);
+void uring_exit(struct uring *u);
+
+// Next free SQE, zeroed, or NULL if the queue is full even after handing
+// what is queued to the kernel
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+// Submit every prepared SQE and, if wait is set, wait until a completion
+// is ready or timeout_ms passes (-1 waits indefinitely). Returns 0, or -1
+// with errno set; ETIME and EINTR are not errors.
+int uring_submit(struct uring *u, int wait, int timeout_ms);
+
+// Oldest completion not yet seen, or NULL
+static inline struct io_uring_cqe *uring_cqe(struct uring *u) {
+    unsigned int head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Register count buffers of size bytes as buffer group `group`
+int uring_bufs_init(struct uring *u, struct uring_bufs *b, unsigned short group,
+                    unsigned int count, unsigned int size);
+// Release the buffers; the ring they were registered with goes first
+void uring_bufs_free(struct uring_bufs *b);
+
+static inline unsigned char *uring_buf(struct uring_bufs *b, unsigned int bid) {
+    return b->base + (size_t)bid * b->size;
+}
+
+// Give buffer bid back to the kernel; it becomes usable once committed
+static inline void uring_bufs_put(struct uring_bufs *b, unsigned short bid) {
+    struct io_uring_buf *e = &b->ring->bufs[b->tail & (b->count - 1)];
+    e->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+    e->len = b->size;
+    e->bid = bid;
+    b->tail++;
+}
+
+static inline void uring_bufs_commit(struct uring_bufs *b) {
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif